@@ -36,6 +36,23 @@ timestamp()
     return t;
 }
 
+/* Ticks of timestamp() per second. */
+static inline uint64_t
+timerfreq()
+{
+    uint64_t f;
+    asm volatile("mrs %[freq], cntfrq_el0" : [freq] "=r"(f));
+    return f;
+}
+
+/* Microseconds in t ticks of timestamp(). */
+static inline uint64_t
+ticks2us(uint64_t t)
+{
+    uint64_t f = timerfreq();
+    return t / f * 1000000 + t % f * 1000000 / f;
+}
+
 static inline void
 put32(uint64_t p, uint32_t x)
 {
@@ -62,6 +79,13 @@ cli()
     asm volatile("msr daif, %[x]" : : [x] "r"(0xF << 6));
 }
 
+/* Sleep until an interrupt is pending, even if it is masked. */
+static inline void
+wfi()
+{
+    asm volatile("wfi");
+}
+
 /* Brute-force data and instruction synchronization barrier. */
 static inline void
 disb()
@@ -73,7 +97,24 @@ disb()
 static inline void
 dccivac(void* p, int n)
 {
-    while (n--) asm volatile("dc civac, %[x]" : : [x] "r"(p + n));
+    // One operation per 64-byte line of the Cortex-A53 covers every byte.
+    uint64_t a = (uint64_t)p & ~63UL, end = (uint64_t)p + n;
+    for (; a < end; a += 64) asm volatile("dc civac, %[x]" : : [x] "r"(a));
+}
+
+/*
+ * Make instructions just written at [p, p + n) visible to instruction
+ * fetch on all CPUs: clean the data cache lines to the point of
+ * unification, then drop the instruction cache lines.
+ */
+static inline void
+icache_sync(void* p, int n)
+{
+    uint64_t a = (uint64_t)p & ~63UL, end = (uint64_t)p + n;
+    for (uint64_t v = a; v < end; v += 64) asm volatile("dc cvau, %[x]" : : [x] "r"(v));
+    asm volatile("dsb ish");
+    for (uint64_t v = a; v < end; v += 64) asm volatile("ic ivau, %[x]" : : [x] "r"(v));
+    asm volatile("dsb ish; isb");
 }
 
 /* Read Exception Syndrome Register (EL1). */
@@ -94,6 +135,54 @@ relr()
     return r;
 }
 
+/* Read Fault Address Register (EL1). */
+static inline uint64_t
+rfar()
+{
+    uint64_t r;
+    asm volatile("mrs %[x], far_el1" : [x] "=r"(r));
+    return r;
+}
+
+/* Read Architectural Feature Access Control Register (EL1). */
+static inline uint64_t
+rcpacr()
+{
+    uint64_t r;
+    asm volatile("mrs %[x], cpacr_el1" : [x] "=r"(r));
+    return r;
+}
+
+/* Load Architectural Feature Access Control Register (EL1). */
+static inline void
+lcpacr(uint64_t r)
+{
+    asm volatile("msr cpacr_el1, %[x]; isb" : : [x] "r"(r));
+}
+
+/* Drop the TLB entries of user page va, for any ASID, on all CPUs. */
+static inline void
+tlbi_va(uint64_t va)
+{
+    asm volatile("dsb ishst; tlbi vaae1is, %[x]; dsb ish; isb"
+                 :
+                 : [x] "r"(va >> 12));
+}
+
+/* Drop all TLB entries of this CPU. */
+static inline void
+tlbi_local()
+{
+    asm volatile("dsb nshst; tlbi vmalle1; dsb nsh; isb");
+}
+
+/* Drop all TLB entries on all CPUs. */
+static inline void
+tlbi_all()
+{
+    asm volatile("dsb ishst; tlbi vmalle1is; dsb ish; isb");
+}
+
 /* Load Exception Syndrome Register (EL1). */
 static inline void
 lesr(uint64_t r)
@@ -101,6 +190,29 @@ lesr(uint64_t r)
     asm volatile("msr esr_el1, %[x]" : : [x] "r"(r));
 }
 
+/* Load EL0 Read-Only Software Thread ID Register, see vdso.S. */
+static inline void
+ltpidrro(uint64_t r)
+{
+    asm volatile("msr tpidrro_el0, %[x]" : : [x] "r"(r));
+}
+
+/* Read Counter-timer Kernel Control Register (EL1). */
+static inline uint64_t
+rcntkctl()
+{
+    uint64_t r;
+    asm volatile("mrs %[x], cntkctl_el1" : [x] "=r"(r));
+    return r;
+}
+
+/* Load Counter-timer Kernel Control Register (EL1). */
+static inline void
+lcntkctl(uint64_t r)
+{
+    asm volatile("msr cntkctl_el1, %[x]; isb" : : [x] "r"(r));
+}
+
 /* Load vector base (virtual) address register (EL1). */
 static inline void
 lvbar(void* p)
@@ -110,14 +222,16 @@ lvbar(void* p)
     disb();
 }
 
-/* Load Translation Table Base Register 0 (EL1). */
+/*
+ * Load Translation Table Base Register 0 (EL1). The ASID in the top
+ * bits of p tags the TLB entries of its non-global pages, so there
+ * is no need to flush.
+ */
 static inline void
 lttbr0(uint64_t p)
 {
     asm volatile("msr ttbr0_el1, %[x]" : : [x] "r"(p));
     disb();
-    asm volatile("tlbi vmalle1");
-    disb();
 }
 
 /* Load Translation Table Base Register 1 (EL1). */
@@ -0,0 +1,15 @@
+#ifndef INC_BENCH_H_
+#define INC_BENCH_H_
+
+#define BENCH 5 /* Major device number of the benchmark device */
+
+/*
+ * Reading the benchmark device from offset 0 times the kernel's core
+ * primitives and returns one line per result,
+ *     name iterations ticks ns-per-iteration
+ * after a "# freq" line with timestamp() Hz. Reads further on return
+ * the rest of the same report. Other lines starting with # are notes.
+ */
+void bench_init();
+
+#endif  // INC_BENCH_H_
@@ -0,0 +1,27 @@
+#ifndef INC_BOOT_H_
+#define INC_BOOT_H_
+
+#include <stdint.h>
+
+#include "arm.h"
+
+#define NBOOTSTEP 48 /* Init steps recorded, at most */
+
+/*
+ * Boot-time profile: every init step, on whichever CPU ran it, with
+ * when it started (in ticks since power-on) and how long it took.
+ * Read it from the statistics device as bootstat.
+ */
+void boot_step(const char* name, uint64_t start);
+
+/* Run call as the init step name. */
+#define BOOT_STEP(name, call)            \
+    do {                                 \
+        uint64_t _t = timestamp();       \
+        call;                            \
+        boot_step(name, _t);             \
+    } while (0)
+
+void boot_done();
+
+#endif  // INC_BOOT_H_
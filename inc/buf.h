@@ -10,6 +10,10 @@
 
 #define B_VALID 0x2 /* Buffer has been read from disk. */
 #define B_DIRTY 0x4 /* Buffer needs to be written to disk. */
+#define B_RA    0x8 /* Read ahead and not yet asked for. */
+#define B_IO    0x10 /* Queued for or in flight to the card. */
+#define B_ASYNC 0x20 /* Release when the I/O completes, nobody waits. */
+#define B_CKPT  0x40 /* Committed in the log, not yet written home. */
 
 struct buf {
     int flags;
@@ -18,15 +22,32 @@ struct buf {
     uint8_t data[BSIZE];    // storing data
     uint32_t refcnt;        // the number of waiting devices
     struct sleeplock lock;  // when locked, waiting for driver to release
-    struct buf* prev;       // less recent buffer
-    struct buf* next;       // more recent buffer
+    struct buf* hnext;      // next buffer in the same hash bucket
+    struct buf* cnext;      // next buffer in the clock ring
+    int used;               // referenced since the clock hand last passed
+    struct buf* qnext;      // next request in the driver queue
+    uint8_t* ext;           // if set, the driver moves data here instead
 };
 
+/* Where the driver transfers b's block to or from. */
+static inline uint8_t*
+bdata(struct buf* b)
+{
+    return b->ext ? b->ext : b->data;
+}
+
 void binit();
 struct buf* bread(uint32_t, uint32_t);
 void bwrite(struct buf*);
 void brelse(struct buf*);
+void brelse_io(struct buf*);
 void bpin(struct buf*);
 void bunpin(struct buf*);
+struct buf* bgetblk(uint32_t, uint32_t);
+void bread_multi(struct buf**, int);
+void bwrite_multi(struct buf**, int);
+void breadahead(uint32_t, uint32_t*, int);
+int bcached(uint32_t, uint32_t);
+void bcache_dump();
 
 #endif  // INC_BUF_H_
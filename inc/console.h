@@ -2,11 +2,13 @@
 #define INC_CONSOLE_H_
 
 #include <stdarg.h>
+#include <stddef.h>
 
 void console_init();
 void console_intr(int (*getc)());
 void cgetchar(int c);
 void cprintf(const char* fmt, ...);
+int snprintf(char* buf, size_t n, const char* fmt, ...);
 void panic(const char* fmt, ...);
 
 #define assert(x)                                                              \
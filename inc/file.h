@@ -5,18 +5,46 @@
 
 #include "fs.h"
 #include "sleeplock.h"
+#include "spinlock.h"
 #include "types.h"
 
-#define NFILE 100  // Open files per system
+#define UIO_MAXIOV 1024 /* iovecs per readv() or writev() */
+
+struct iovec {
+    void* iov_base; /* Starting address. */
+    size_t iov_len; /* Number of bytes to transfer. */
+};
 
 struct file {
-    enum { FD_NONE, FD_PIPE, FD_INODE } type;
+    enum { FD_NONE, FD_PIPE, FD_INODE, FD_RING } type;
     int ref;
     char readable;
     char writable;
+    char direct;  // Opened O_DIRECT, reads bypass the buffer cache
     struct pipe* pipe;
     struct inode* ip;
     size_t off;
+    uint64_t ring;    // FD_RING: user address of the struct ioring
+    uint32_t nring;   // ... and its entries, see ioring.c
+
+    // Sequential read-ahead state, protected by ip->lock.
+    size_t ra_next;   // Offset at which a sequential read would start
+    size_t ra_end;    // Read ahead up to here
+    uint32_t ra_win;  // Current window in blocks, 0 if not sequential
+};
+
+/*
+ * A table of open files, shared by the processes that clone() made
+ * with CLONE_FILES. See fd_alloc().
+ */
+struct files {
+    int ref;               // Processes using it
+    struct spinlock lock;  // Protects everything below here
+    int nofile;            // Size of ofile, a multiple of NOFILE
+    struct file** ofile;   // Open files, ofile0 until it grows
+    uint64_t* fdmap;       // A bit per open fd, fdmap0 until then
+    struct file* ofile0[NOFILE];
+    uint64_t fdmap0[NOFILE / 64];
 };
 
 /*
@@ -26,6 +54,14 @@ struct inode {
     uint32_t dev;           // Device number
     uint32_t inum;          // Inode number
     int ref;                // Reference count
+    struct inode* hnext;    // Hash chain in the inode cache
+    struct inode* lprev;    // LRU list of unreferenced inodes
+    struct inode* lnext;
+    struct pcnode* pages;   // Page cache, see pcache.c
+    uint32_t npages;        // Pages in it
+    uint32_t ndirty;        // ... not written back yet
+    uint64_t dirtied;       // When it joined the dirty list, 0 if not on it
+    struct inode* dnext;    // Dirty list, see pcache.c
     struct sleeplock lock;  // Protects everything below here
     int valid;              // Inode has been read from disk?
 
@@ -34,7 +70,11 @@ struct inode {
     uint16_t minor;
     uint16_t nlink;
     uint32_t size;
-    uint32_t addrs[NDIRECT + 1];
+    uint32_t addrs[NDIRECT + 3];
+
+    uint32_t leaf;     // Last indirect block bmap() mapped data through
+    uint32_t leaf_bn;  // First file block that leaf maps
+    uint32_t goal;     // Where to try to allocate the next block
 };
 
 /*
@@ -42,8 +82,8 @@ struct inode {
  * device functions
  */
 struct devsw {
-    ssize_t (*read)(struct inode*, char*, ssize_t);
-    ssize_t (*write)(struct inode*, char*, ssize_t);
+    ssize_t (*read)(struct inode*, char*, size_t, ssize_t);
+    ssize_t (*write)(struct inode*, char*, size_t, ssize_t);
 };
 
 extern struct devsw devsw[];
@@ -57,10 +97,28 @@ void file_close(struct file*);
 int file_stat(struct file*, struct stat*);
 ssize_t file_read(struct file*, char*, ssize_t);
 ssize_t file_write(struct file*, char*, ssize_t);
+ssize_t file_readv(struct file*, struct iovec*, int);
+ssize_t file_writev(struct file*, struct iovec*, int);
+ssize_t file_pread(struct file*, char*, size_t, size_t);
+ssize_t file_pwrite(struct file*, char*, size_t, size_t);
+int file_sync(struct file*);
+ssize_t dev_bounce(struct spinlock*, char*, size_t, int, ssize_t (*)(char*, size_t, void*), void*);
+
+struct files* files_alloc();
+struct files* files_copy(struct files*);
+void files_put(struct files*);
+struct file* fd_get(struct proc*, uint64_t);
+int fd_alloc(struct proc*, struct file*, int);
+struct file* fd_remove(struct proc*, uint64_t);
+
+// kern/sysfile.c
+
+int file_open(char*, uint64_t);
 
 // kern/fs.c
 
 void readsb(int, struct superblock*);
+void bdiscard(uint32_t, uint32_t, uint32_t);
 
 void iinit(int);
 struct inode* ialloc(uint32_t, uint16_t);
@@ -73,12 +131,17 @@ void iunlockput(struct inode*);
 void stati(struct inode*, struct stat*);
 ssize_t readi(struct inode*, char*, size_t, size_t);
 ssize_t writei(struct inode*, char*, size_t, size_t);
+void readahead(struct inode*, size_t, size_t);
+uint32_t bmap(struct inode*, uint32_t, int);
+ssize_t readi_direct(struct inode*, char*, size_t, size_t);
 
 int namecmp(const char*, const char*);
 struct inode* dirlookup(struct inode*, char*, size_t*);
 int dirlink(struct inode*, char*, uint32_t);
+void dcache_remove(struct inode*, char*);
 
 struct inode* namei(char*);
+struct inode* nameiat(struct inode*, char*);
 struct inode* nameiparent(char*, char*);
 
 #endif  // INC_FILE_H_
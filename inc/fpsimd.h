@@ -0,0 +1,30 @@
+#ifndef INC_FPSIMD_H_
+#define INC_FPSIMD_H_
+
+#include <stdint.h>
+
+/*
+ * FP/SIMD registers of a user process, as saved by fp_save(): the 32
+ * 128-bit V registers, then FPSR and FPCR.
+ */
+struct fpsimd {
+    uint64_t v[64];
+    uint64_t fpsr;
+    uint64_t fpcr;
+} __attribute__((aligned(16)));
+
+struct proc;
+
+// kern/fpsimd.S
+
+void fp_save(struct fpsimd*);
+void fp_restore(struct fpsimd*);
+
+// kern/fpsimd.c
+
+void fpsimd_trap(struct proc*);
+void fpsimd_switch_out(struct proc*);
+void fpsimd_fork(struct proc*, struct proc*);
+void fpsimd_exec(struct proc*);
+
+#endif  // INC_FPSIMD_H_
@@ -11,15 +11,19 @@
 
 // Kernel only
 #define NDEV        10                 // Maximum major device number
-#define NINODE      50                 // Maximum number of active i-nodes
+#define NINODE      50                 // Minimum size of the inode cache
 #define MAXOPBLOCKS 10                 // Max # of blocks any FS op writes
-#define NBUF        (MAXOPBLOCKS * 3)  // Size of disk block cache
+#define NBUF        (MAXOPBLOCKS * 3)  // Minimum size of disk block cache
+#define RA_MIN      4                  // Initial read-ahead window in blocks
+#define RA_MAX      64                 // Maximum read-ahead window in blocks
+#define NDCACHE     256                // Entries in the directory name cache
 
 // mkfs only
-#define FSSIZE 1000  // Size of file system in blocks
+#define FSSIZE 16384  // Size of file system in blocks
+#define NLOG   1024   // Size of on-disk log in blocks, header included
 
 // Belows are used by both
-#define LOGSIZE (MAXOPBLOCKS * 3)  // Max data blocks in on-disk log
+#define LOGSIZE (MAXOPBLOCKS * 12) // Max data blocks in one log transaction
 #define ROOTDEV 1                  // Device number of file system root disk
 #define ROOTINO 1                  // Root i-number
 
@@ -42,9 +46,11 @@ struct superblock {
     uint32_t bmapstart;   // Block number of first free map block
 };
 
-#define NDIRECT   12
-#define NINDIRECT (BSIZE / sizeof(uint32_t))
-#define MAXFILE   (NDIRECT + NINDIRECT)
+#define NDIRECT    10
+#define NINDIRECT  (BSIZE / sizeof(uint32_t))
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define NTINDIRECT (NDINDIRECT * NINDIRECT)
+#define MAXFILE    (NDIRECT + NINDIRECT + NDINDIRECT + NTINDIRECT)
 
 /* On-disk inode structure. */
 struct dinode {
@@ -53,7 +59,8 @@ struct dinode {
     uint16_t minor;               // Minor device number (T_DEV only)
     uint16_t nlink;               // Number of links to inode in file system
     uint32_t size;                // Size of file (bytes)
-    uint32_t addrs[NDIRECT + 1];  // Data block addresses
+    uint32_t addrs[NDIRECT + 3];  // Data block addresses: direct, single,
+                                  // double and triple indirect
 };
 
 /* Inodes per block. */
@@ -76,6 +83,52 @@ struct dirent {
     char name[DIRSIZ];
 };
 
+/*
+ * Directory entry as getdents64() returns it, in the layout of Linux:
+ * records of d_reclen bytes, 8-byte aligned, names NUL-terminated.
+ */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;      // Offset in the directory of the next entry
+    uint16_t d_reclen;
+    uint8_t d_type;     // DT_UNKNOWN (0): stat() the entry for its type
+    char d_name[];
+};
+
+/*
+ * A hashed directory keeps its entries in DIRH_NBUCKET chains of
+ * blocks, the chain of a name being picked by dirhash().  File block 0
+ * is the index, holding the first block of each chain, and every chain
+ * block starts with a header pointing to the next one.  All of these
+ * are dirhslots, shaped like dirents with inum 0, so whoever reads the
+ * directory as an array of dirents still sees just its entries.
+ *
+ * A directory is hashed if it starts with DIRH_MAGIC instead of ".".
+ * Its size is always a whole number of blocks.
+ */
+#define DIRH_MAGIC   0x4854                             // "TH"
+#define DIRH_NSLOT   (BSIZE / sizeof(struct dirent))    // Slots per block
+#define DIRH_NPTR    (DIRSIZ / sizeof(uint16_t))        // Pointers per slot
+#define DIRH_NBUCKET ((DIRH_NSLOT - 1) * DIRH_NPTR)     // Chains
+
+struct dirhslot {
+    uint16_t zero;            // Always 0, this is not an entry
+    uint16_t v[DIRH_NPTR];    // Index header: DIRH_MAGIC, DIRH_NBUCKET.
+                              // Index: first file block of each chain.
+                              // Chain header: next file block.
+                              // 0 ends a chain.
+};
+
+/* FNV-1a hash of a name of at most DIRSIZ bytes. */
+static inline uint32_t
+dirhash(const char* name)
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < DIRSIZ && name[i]; i++)
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    return h;
+}
+
 struct stat;
 
 #define T_DIR  1  // Directory
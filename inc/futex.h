@@ -0,0 +1,23 @@
+#ifndef INC_FUTEX_H_
+#define INC_FUTEX_H_
+
+#include <stdint.h>
+
+#include "proc.h"
+
+/* Operations of futex(2), as Linux numbers them. */
+#define FUTEX_WAIT           0
+#define FUTEX_WAKE           1
+#define FUTEX_REQUEUE        3
+#define FUTEX_CMP_REQUEUE    4
+#define FUTEX_PRIVATE_FLAG   128
+#define FUTEX_CLOCK_REALTIME 256
+
+#define NFUTEX 64 /* Buckets of waiters */
+
+void futex_init();
+int futex_wait(struct proc*, uint64_t, int, int);
+int futex_wake(struct proc*, uint64_t, int, int);
+int futex_requeue(struct proc*, uint64_t, int, int, uint64_t, int, int, int);
+
+#endif  // INC_FUTEX_H_
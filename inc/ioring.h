@@ -0,0 +1,59 @@
+#ifndef INC_IORING_H_
+#define INC_IORING_H_
+
+#include <stdint.h>
+
+/*
+ * A submission and completion ring in user memory, registered once
+ * with io_uring_setup(entries, ring), which returns an fd for it, and
+ * then driven by io_uring_enter(fd, to_submit, 0, 0), which consumes
+ * up to to_submit entries of the submission queue and returns how
+ * many it did. All of them are complete by then.
+ *
+ * The program fills sq[sq_tail % entries] and then moves sq_tail; the
+ * kernel moves sq_head past what it consumed. The kernel puts results
+ * at cq[cq_tail % (2 * entries)] and moves cq_tail; the program moves
+ * cq_head past what it consumed. Consuming stops early rather than
+ * overflow the completion queue.
+ */
+
+#define IORING_MAX 256 /* Entries of a ring, at most, a power of two */
+
+#define IORING_OP_NOP    0
+#define IORING_OP_READ   1 /* read(fd, addr, len) at off */
+#define IORING_OP_WRITE  2 /* write(fd, addr, len) at off */
+#define IORING_OP_OPENAT 3 /* open(addr, len) relative to the cwd */
+#define IORING_OP_CLOSE  4 /* close(fd) */
+
+#define IORING_OFF_CUR UINT64_MAX /* off of the file itself, which moves */
+
+struct ioring_sqe {
+    uint8_t op;
+    uint8_t pad[3];
+    int32_t fd;
+    uint64_t off;
+    uint64_t addr;       /* Buffer, or path for IORING_OP_OPENAT */
+    uint32_t len;        /* Bytes, or open flags for IORING_OP_OPENAT */
+    uint32_t pad2;
+    uint64_t user_data;  /* Passed to the completion as it is */
+};
+
+struct ioring_cqe {
+    uint64_t user_data;
+    int64_t res;         /* What the system call would have returned */
+};
+
+struct ioring {
+    uint32_t sq_head;
+    uint32_t sq_tail;
+    uint32_t cq_head;
+    uint32_t cq_tail;
+    uint32_t entries;    /* Set by io_uring_setup() */
+    uint32_t pad;
+};
+
+#define IORING_SQ(r)    ((struct ioring_sqe*)((struct ioring*)(r) + 1))
+#define IORING_CQ(r, n) ((struct ioring_cqe*)(IORING_SQ(r) + (n)))
+#define IORING_SIZE(n)  (sizeof(struct ioring) + (n) * sizeof(struct ioring_sqe) + 2 * (n) * sizeof(struct ioring_cqe))
+
+#endif  // INC_IORING_H_
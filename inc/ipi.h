@@ -0,0 +1,18 @@
+#ifndef INC_IPI_H_
+#define INC_IPI_H_
+
+#include <stdint.h>
+
+/* Messages, one bit each, so that several can be pending at once. */
+#define IPI_WAKE    (1 << 0) /* Get out of wfi and recheck the run queue */
+#define IPI_RESCHED (1 << 1) /* Yield if something else is queued here */
+#define IPI_STOP    (1 << 2) /* Halt, another CPU panicked */
+#define NIPI        3
+
+void ipi_init();
+void ipi_send(int, int);
+void ipi_broadcast(int);
+int ipi_intr();
+uint64_t ipi_count(int);
+
+#endif  // INC_IPI_H_
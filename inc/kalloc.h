@@ -1,10 +1,40 @@
 #ifndef INC_KALLOC_H_
 #define INC_KALLOC_H_
 
+#include <stdint.h>
+
+#define MAX_ORDER 10 /* Largest buddy block is 2^MAX_ORDER pages */
+
+/*
+ * Each CPU keeps a small magazine of free pages in front of the
+ * global free list. kalloc() and kfree() only take kmem.lock to
+ * move KMAG_BATCH pages between the magazine and the free list.
+ */
+#define KMAG_SIZE  32
+#define KMAG_BATCH (KMAG_SIZE / 2)
+
+struct kmag {
+    int n;                  /* Number of cached pages */
+    char* page[KMAG_SIZE];  /* Cached free pages */
+    uint64_t hit;           /* kalloc() served from the magazine */
+    uint64_t miss;          /* kalloc() had to refill from kmem */
+};
+
 void alloc_init();
 char* kalloc();
 void kfree(char*);
+char* kalloc_zeroed();
+int kzero_idle();
+char* kalloc_pages(int);
+void kfree_pages(char*, int);
+void kpage_get(char*);
+int kpage_unshare(char*);
+int kpage_shared(char*);
+void kpage_put(char*);
 void free_range(void*, void*);
 void check_free_list();
+uint64_t kmem_free_pages();
+void kmem_register_shrinker(uint64_t (*)(uint64_t));
+void kmem_dump();
 
 #endif  // INC_KALLOC_H_
@@ -0,0 +1,26 @@
+#ifndef INC_KSTAT_H_
+#define INC_KSTAT_H_
+
+#include <stddef.h>
+
+#define KSTAT  2  /* Major device number of the statistics device */
+#define NKSTAT 16 /* Maximum minor device number + 1 */
+
+/* Minor device numbers, one per subsystem. */
+#define KSTAT_LOG     1
+#define KSTAT_DCACHE  2
+#define KSTAT_ICACHE  3
+#define KSTAT_SCHED   4
+#define KSTAT_SYSCALL 5
+#define KSTAT_PROC    6
+#define KSTAT_PCACHE  7
+#define KSTAT_BOOT    8
+
+/*
+ * Each minor is a text snapshot of some counters, written by show()
+ * into a buffer of n bytes; show() returns the resulting length.
+ */
+void kstat_init();
+void kstat_register(int minor, int (*show)(char*, size_t));
+
+#endif  // INC_KSTAT_H_
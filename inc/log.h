@@ -1,11 +1,17 @@
 #ifndef INC_LOG_H_
 #define INC_LOG_H_
 
+#include <stdint.h>
+
 struct buf;
 
 void initlog(int);
 void log_write(struct buf*);
 void begin_op();
 void end_op();
+void begin_op_n(int);
+void end_op_n(int);
+void log_force();
+void log_discard(uint32_t);
 
 #endif  // INC_LOG_H_
@@ -7,6 +7,12 @@
 #define KERNBASE 0xFFFF000000000000  /* First kernel virtual address */
 #define KERNLINK (KERNBASE + EXTMEM) /* Address where kernel is linked */
 
+#define USERTOP    0x0001000000000000 /* End of user virtual addresses */
+#define MMAPBASE   0x0000400000000000 /* Where mmap() looks for room first */
+#define VDSOBASE   (USERTOP - 0x1000) /* The vDSO page, see vdso.c */
+#define MMAPTOP    VDSOBASE           /* End of what programs may map */
+#define USTACKSIZE 0x10000            /* User stack, allocated on demand */
+
 #define V2P_WO(x) ((x) - KERNBASE) /* Same as V2P, but without casts */
 #define P2V_WO(x) ((x) + KERNBASE) /* Same as P2V, but without casts */
 
@@ -0,0 +1,33 @@
+#ifndef INC_MM_H_
+#define INC_MM_H_
+
+#include <stdint.h>
+
+#include "proc.h"
+#include "sleeplock.h"
+
+/*
+ * An address space, shared by the processes that clone() made with
+ * CLONE_VM. lock serializes changes to what it maps, i.e. page
+ * faults, brk() and mmap(), among the threads that share it.
+ */
+struct mm {
+    int ref;                // Processes using it
+    struct sleeplock lock;
+    uint64_t* pgdir;        // Page table
+    uint64_t asid;          // ... and its ASID, see uvm_switch()
+    uint64_t sz;            // Size of process memory (bytes)
+    uint64_t heap;          // Start of the heap, sz after exec
+    struct inode* exe;      // Program file, for loading on demand
+    struct seg seg[NSEG];   // ... and what to load from it
+    int nseg;
+    struct vma vma[NVMA];   // mmap()ed regions
+};
+
+// kern/proc.c
+
+struct mm* mm_alloc();
+int mm_put(struct mm*);
+void mm_free(struct mm*);
+
+#endif  // INC_MM_H_
@@ -0,0 +1,31 @@
+#ifndef INC_MMAP_H_
+#define INC_MMAP_H_
+
+#include <stdint.h>
+
+#include "proc.h"
+
+struct mm;
+
+/* Dirty pages that mmap_unmap() took out of mm, for mmap_writeback(). */
+struct mmap_page {
+    struct file* f;
+    size_t off;
+    char* page;
+};
+
+struct mmap_wb {
+    int n;
+    struct mmap_page* pg;
+};
+
+struct vma* vma_find(struct mm*, uint64_t);
+int mmap_overlap(struct mm*, uint64_t, uint64_t);
+int mmap_covers(struct mm*, uint64_t, uint64_t);
+int mmap_fault(struct mm*, uint64_t, int);
+int mmap_unmap(struct mm*, uint64_t, uint64_t, struct mmap_wb*);
+void mmap_writeback(struct mmap_wb*);
+int mmap_fork(struct mm*, struct mm*);
+void mmap_exit(struct mm*);
+
+#endif  // INC_MMAP_H_
@@ -24,6 +24,7 @@
 
 #define PGSIZE (1 << L3SHIFT)
 #define BKSIZE (1 << L2SHIFT)
+#define BKORDER (L2SHIFT - L3SHIFT) /* kalloc_pages() order of a block */
 
 #define PTX(level, va) (((uint64_t)(va) >> (39 - 9 * level)) & 0x1FF)
 #define L0X(va)        (((uint64_t)(va) >> L0SHIFT) & 0x1FF)
@@ -42,8 +43,14 @@
 #define PTE_RO     (1 << 7)  /* read-only */
 #define PTE_SH     (3 << 8)  /* Shareability */
 #define PTE_AF     (1 << 10) /* P2066 access flags */
-/* Address in page table or page directory entry */
-#define PTE_ADDR(pte)      ((uint64_t)(pte) & ~(PGSIZE - 1))
+#define PTE_NG     (1 << 11) /* not global: TLB entries belong to the ASID */
+#define PTE_COW    (1UL << 55) /* software: read-only until copied on write */
+#define PTE_DIRTY  (1UL << 56) /* software: written through a shared mapping */
+#define TTBR_ASID_SHIFT 48
+
+/* Address in page table or page directory entry, less the upper attributes */
+#define PTE_ADDR_MASK      0xFFFFFFFFF000
+#define PTE_ADDR(pte)      ((uint64_t)(pte) & PTE_ADDR_MASK)
 #define PTE_FLAGS(pte)     ((uint64_t)(pte) & (PGSIZE - 1))
 
 /* P2061 */
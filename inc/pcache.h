@@ -0,0 +1,22 @@
+#ifndef INC_PCACHE_H_
+#define INC_PCACHE_H_
+
+#include <stdint.h>
+
+#include "file.h"
+
+#define PCACHE_FRAC 16  /* Let the cache grow to 1/PCACHE_FRAC of free memory */
+
+void pcache_init();
+char* pcache_get(struct inode*, uint32_t);
+void pcache_readahead(struct inode*, size_t, size_t);
+void pcache_update(struct inode*, size_t, char*, size_t);
+ssize_t pcache_write(struct inode*, size_t, char*, size_t);
+void pcache_flush(struct inode*);
+void pcache_start();
+void pcache_clock();
+void pcache_throttle();
+void pcache_sync();
+void pcache_purge(struct inode*);
+
+#endif  // INC_PCACHE_H_
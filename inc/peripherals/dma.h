@@ -0,0 +1,52 @@
+#ifndef INC_PERIPHERALS_DMA_H_
+#define INC_PERIPHERALS_DMA_H_
+
+#include "peripherals/base.h"
+
+/* BCM2837 system DMA controller, see BCM2835 ARM Peripherals ch. 4. */
+#define DMA_BASE        (MMIO_BASE + 0x7000)
+#define DMA_CHAN(c)     (DMA_BASE + (c) * 0x100)
+#define DMA_CS(c)       (DMA_CHAN(c) + 0x00)
+#define DMA_CONBLK_AD(c) (DMA_CHAN(c) + 0x04)
+#define DMA_DEBUG(c)    (DMA_CHAN(c) + 0x20)
+#define DMA_INT_STATUS  (DMA_BASE + 0xFE0)
+#define DMA_ENABLE      (DMA_BASE + 0xFF0)
+
+/* CS register */
+#define DMA_CS_ACTIVE   (1 << 0)
+#define DMA_CS_END      (1 << 1)
+#define DMA_CS_INT      (1 << 2)
+#define DMA_CS_ERROR    (1 << 8)
+#define DMA_CS_PRIORITY(p)       ((p) << 16)
+#define DMA_CS_PANIC_PRIORITY(p) ((p) << 20)
+#define DMA_CS_WAIT_WRITES (1 << 28)
+#define DMA_CS_ABORT    (1 << 30)
+#define DMA_CS_RESET    (1 << 31)
+
+/* Transfer information of a control block */
+#define DMA_TI_INTEN    (1 << 0)
+#define DMA_TI_WAIT_RESP (1 << 3)
+#define DMA_TI_DEST_INC (1 << 4)
+#define DMA_TI_DEST_DREQ (1 << 6)
+#define DMA_TI_SRC_INC  (1 << 8)
+#define DMA_TI_SRC_DREQ (1 << 10)
+#define DMA_TI_PERMAP(p) ((p) << 16)
+
+#define DMA_DREQ_EMMC   11
+
+/* Bus addresses as seen by the DMA engine. */
+#define DMA_BUS_PERIPH(a) ((uint32_t)((a) - MMIO_BASE) + 0x7E000000)
+#define DMA_BUS_MEM(p)    ((uint32_t)(p) | 0xC0000000)
+
+/* Control block, must be 32-byte aligned. */
+struct dma_cb {
+    uint32_t ti;
+    uint32_t src;
+    uint32_t dst;
+    uint32_t len;
+    uint32_t stride;
+    uint32_t next;
+    uint32_t pad[2];
+} __attribute__((aligned(32)));
+
+#endif  // INC_PERIPHERALS_DMA_H_
@@ -25,8 +25,15 @@
 #define IRQ_SRC_CORE(i)         (LOCAL_BASE + 0x60 + 4*(i))
 #define IRQ_TIMER               (1 << 11)   /* Local Timer */
 #define IRQ_GPU                 (1 << 8)
+#define IRQ_MAILBOX(m)          (1 << (4 + (m)))
 #define IRQ_CNTPNSIRQ           (1 << 1)    /* Core Timer */
 
+/* Core mailboxes, four 32-bit ones per core, used for IPIs */
+#define CORE_MBOX_CTRL(i)       (LOCAL_BASE + 0x50 + 4*(i))
+#define CORE_MBOX_IRQ(m)        (1 << (m))
+#define CORE_MBOX_SET(i, m)     (LOCAL_BASE + 0x80 + 0x10*(i) + 4*(m))
+#define CORE_MBOX_RDCLR(i, m)   (LOCAL_BASE + 0xC0 + 0x10*(i) + 4*(m))
+
 /* Local timer */
 #define TIMER_ROUTE             (LOCAL_BASE + 0x24)
 #define TIMER_IRQ2CORE(i)       (i)
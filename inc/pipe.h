@@ -0,0 +1,44 @@
+#ifndef INC_PIPE_H_
+#define INC_PIPE_H_
+
+#include "file.h"
+#include "mmu.h"
+#include "sleeplock.h"
+#include "spinlock.h"
+#include "types.h"
+
+#define PIPE_ORDER 4                      /* kalloc_pages() order of a ring */
+#define PIPESIZE   (PGSIZE << PIPE_ORDER) /* Bytes a pipe buffers */
+#define PIPE_WAKE  PGSIZE                 /* Wake writers once this much is free */
+
+/*
+ * A pipe is a ring of PIPESIZE bytes. nread and nwrite only grow,
+ * under lock: [nread, nwrite) holds data, the rest is free. Readers
+ * take rlock and writers wlock for as long as they copy, so that at
+ * most one of each touches the ring and neither holds lock while it
+ * copies, which may fault on user memory or wait for the disk.
+ */
+struct pipe {
+    struct spinlock lock;
+    struct sleeplock rlock;
+    struct sleeplock wlock;
+    char* buf;
+    uint32_t nread;   // Bytes read
+    uint32_t nwrite;  // Bytes written
+    int readopen;     // Read fd is still open
+    int writeopen;    // Write fd is still open
+    int rwait;        // A reader sleeps for data
+    int wwait;        // A writer sleeps for room
+};
+
+void pipe_init();
+int pipe_alloc(struct file**, struct file**);
+void pipe_close(struct pipe*, int);
+ssize_t pipe_readv(struct pipe*, struct iovec*, int);
+ssize_t pipe_writev(struct pipe*, struct iovec*, int);
+ssize_t pipe_splice_in(struct pipe*, struct inode*, size_t*, size_t);
+ssize_t pipe_splice_out(struct pipe*, struct inode*, size_t*, size_t);
+ssize_t pipe_splice(struct pipe*, struct pipe*, size_t);
+ssize_t pipe_tee(struct pipe*, struct pipe*, size_t);
+
+#endif  // INC_PIPE_H_
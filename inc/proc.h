@@ -4,19 +4,73 @@
 #include <stddef.h>
 
 #include "arm.h"
+#include "fpsimd.h"
+#include "kalloc.h"
 #include "spinlock.h"
 #include "trap.h"
 
 #define NCPU       4    /* maximum number of CPUs */
 #define NPROC      64   /* maximum number of processes */
-#define NOFILE     16   /* open files per process */
+#define NOFILE     64   /* fds in the table a process starts with */
+#define NOFILE_MAX 65536 /* fds the table grows to at most */
 #define KSTACKSIZE 4096 /* size of per-process kernel stack */
+#define NSLEEPQ    64   /* buckets of sleeping processes, hashed by chan */
+#define NSEG       8    /* loadable ELF segments per process */
+#define NVMA       16   /* mmap()ed regions per process */
+
+/*
+ * Fair-share scheduling: every runnable process of a CPU gets a turn
+ * within SCHED_LATENCY_US, in proportion to the weight of its nice
+ * value, but runs at least SCHED_MIN_GRAN_US once picked. A process
+ * that wakes up is placed at most SCHED_LATENCY_US / 2 behind the
+ * queue so that interactive ones go first without starving the rest.
+ */
+#define SCHED_LATENCY_US  24000
+#define SCHED_MIN_GRAN_US 4000
+#define NICE_MIN          (-20)
+#define NICE_MAX          19
+
+/*
+ * Flags of clone(), as Linux numbers them. CLONE_VM shares the
+ * address space and CLONE_FILES the fd table; CLONE_THREAD makes a
+ * thread, which is never wait()ed for. CLONE_VFORK holds the caller
+ * until the child execs or exits. The low byte, the signal to
+ * send the parent on exit, and the other flags that musl passes for
+ * a thread are accepted but mean nothing here.
+ */
+#define CLONE_VM             0x00000100
+#define CLONE_FILES          0x00000400
+#define CLONE_VFORK          0x00004000
+#define CLONE_THREAD         0x00010000
+#define CLONE_SETTLS         0x00080000
+#define CLONE_PARENT_SETTID  0x00100000
+#define CLONE_CHILD_CLEARTID 0x00200000
+#define CLONE_CHILD_SETTID   0x01000000
 
 #define thiscpu (&cpus[cpuid()])
 
+/*
+ * Per-CPU queue of RUNNABLE processes, linked through p->rqnext
+ * in order of p->vruntime.
+ */
+struct runq {
+    struct spinlock lock;
+    struct proc* head;
+    int n;
+    uint64_t load;          /* Sum of the weights of queued processes */
+    uint64_t min_vruntime;  /* Never decreases */
+};
+
 struct cpu {
     struct context* scheduler; /* swtch() here to enter scheduler */
     struct proc* proc;         /* The process running on this cpu or null */
+    struct kmag kmag;          /* Per-CPU free page magazine */
+    struct runq rq;            /* Processes waiting to run here */
+    uint64_t nswitch;          /* Processes run */
+    uint64_t nsteal;           /* ... taken from another CPU's queue */
+    uint64_t nidle;            /* Times it went to sleep in wfi */
+    volatile int idle;         /* In or about to enter wfi */
+    struct proc* fpowner;      /* Whose FP/SIMD state was last loaded */
 };
 
 extern struct cpu cpus[];
@@ -38,6 +92,34 @@ struct context {
     uint64_t x30;  // Procedure Link Register
 };
 
+/*
+ * A part of the program image, read from the file on first touch:
+ * memory [va, end) holds filesz bytes from off, then zeros.
+ */
+struct seg {
+    uint64_t va, end;
+    uint64_t off, filesz;
+    int writable;  // Else its file pages are shared read-only, see pcache.c
+};
+
+/* An mmap()ed region; unused if end is 0. */
+struct vma {
+    uint64_t start, end;  // Page aligned
+    int prot;             // PROT_*
+    int flags;            // MAP_SHARED or MAP_PRIVATE
+    struct file* f;       // Mapped file, or 0 if anonymous
+    uint64_t off;         // Offset in f of start
+};
+
+/* Resource usage, times in timestamp() ticks. */
+struct pusage {
+    uint64_t utime;   // Running in user mode
+    uint64_t stime;   // Running in the kernel
+    uint64_t wtime;   // Runnable, waiting for a CPU
+    uint64_t nvcsw;   // Gave up the CPU to sleep
+    uint64_t nivcsw;  // Gave it up still runnable
+};
+
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 struct proc {
@@ -46,21 +128,36 @@ struct proc {
     // p->lock must be held when using these:
     enum procstate state;  // Process state
     void* chan;            // If non-zero, sleeping on chan
+    struct proc* sqnext;   // Next in the sleep queue of chan's bucket
     int killed;            // If non-zero, have been killed
     int xstate;            // Exit status to be returned to parent's wait
-    int pid;               // Process ID
+    int pid;               // Process ID, the thread ID to Linux
+    int cpu;               // CPU it last ran on, whose queue it joins
+    int nice;              // NICE_MIN to NICE_MAX, lower runs more
+    uint64_t vruntime;     // Time run, in timer ticks scaled by weight
+    uint64_t exec_start;   // When it was last put on the CPU or charged
+    struct proc* rqnext;   // Next in the run queue, under its lock
+    uint64_t runnable_at;  // When it was queued
+    struct pusage ru;      // Own usage; times are current as of acct_at
+    uint64_t acct_at;      // When ru was last charged
 
     // wait_lock must be held when using these:
     struct proc* parent;  // Parent process
+    struct pusage cru;    // Usage of children collected by wait()
+    int vfork;            // The parent waits in clone() until cleared
 
     // no lock needs to be held when using these:
+    int tgid;                    // Thread group, the process ID to Linux
+    int thread;                  // Made by CLONE_THREAD: nobody wait()s
+    uint64_t clear_child_tid;    // Zeroed and futex woken on exit
     char* kstack;                // Bottom of kernel stack for this process
-    uint64_t sz;                 // Size of process memory (bytes)
-    uint64_t* pgdir;             // Page table
+    struct mm* mm;               // Address space, 0 for kernel threads
     struct trapframe* tf;        // Trapframe for current syscall
     struct context* context;     // swtch() here to run process
-    struct file* ofile[NOFILE];  // Open files
+    struct files* files;         // Open files
     struct inode* cwd;           // Current directory
+    struct fpsimd fp;            // FP/SIMD registers, see fpsimd.c
+    int fpcpu;                   // CPU last loaded with fp, or -1
     char name[16];               // Process name (debugging)
 };
 
@@ -72,14 +169,22 @@ thisproc()
 
 void proc_init();
 void user_init();
+void kthread_create(char*, void (*)(void*), void*);
 void scheduler();
 void exit(int);
 void sleep(void*, struct spinlock*);
 void wakeup(void*);
 void yield();
-int growproc(int);
+int sched_tick();
+int proc_getnice(int);
+int proc_setnice(int, int);
+int growproc(int64_t);
 int fork();
-int wait();
+int clone(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
+void vfork_done(struct proc*);
+void exit_group(int);
+int wait(struct pusage*);
+void proc_charge(int);
 void proc_dump();
 void trapframe_dump(struct proc*);
 
@@ -0,0 +1,27 @@
+#ifndef INC_PROF_H_
+#define INC_PROF_H_
+
+#include <stdint.h>
+
+#define PROF         4    /* Major device number of the profiler */
+#define PROF_MAXRATE 10000 /* Samples per second per CPU, at most */
+
+/* A PC sample, as read() from the profiler. */
+struct prof_sample {
+    uint64_t pc;
+    uint32_t pid;   /* 0 if the CPU was idle in the scheduler */
+    uint16_t cpu;
+    uint16_t user;  /* 1 if pc is a user address */
+};
+
+/*
+ * Writing a uint32_t rate to the profiler makes every CPU sample the
+ * PC that its timer interrupt hits rate times a second, or stops it
+ * if rate is 0. Reading drains the samples taken since the last
+ * read. A CPU whose buffer is full drops new samples until then.
+ */
+void prof_init();
+void prof_sample(uint64_t pc, int user);
+extern volatile int prof_on;
+
+#endif  // INC_PROF_H_
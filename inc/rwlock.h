@@ -0,0 +1,29 @@
+#ifndef INC_RWLOCK_H_
+#define INC_RWLOCK_H_
+
+#include <stdint.h>
+
+/*
+ * Reader-writer spin lock: any number of readers, or one writer.
+ * A waiting writer holds off new readers, so that a steady stream
+ * of lookups cannot starve it; a reader therefore must not take the
+ * same lock again while it holds it. Waiters sleep in wfe like those
+ * of a spinlock.
+ */
+struct rwlock {
+    volatile int32_t cnt;    /* Readers holding it, or -1 for a writer */
+    volatile uint32_t wwait; /* Writers waiting for it */
+
+    /* For debugging: */
+    char* name;      /* Name of lock. */
+    struct cpu* cpu; /* The cpu holding it for writing. */
+};
+
+void initrwlock(struct rwlock*, char*);
+void read_acquire(struct rwlock*);
+void read_release(struct rwlock*);
+void write_acquire(struct rwlock*);
+void write_release(struct rwlock*);
+int write_holding(struct rwlock*);
+
+#endif  // INC_RWLOCK_H_
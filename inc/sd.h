@@ -22,6 +22,10 @@
 void sd_init();
 void sd_intr();
 void sd_rw(struct buf*);
+void sd_rw_multi(struct buf**, int);
+void sd_submit(struct buf**, int);
+uint32_t sd_erase_unit(uint32_t, uint32_t*);
+void sd_discard(uint32_t, uint32_t, uint32_t);
 void sd_test();
 
 #endif  // INC_SD_H_
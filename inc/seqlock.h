@@ -0,0 +1,61 @@
+#ifndef INC_SEQLOCK_H_
+#define INC_SEQLOCK_H_
+
+#include <stdint.h>
+
+#include "spinlock.h"
+
+/*
+ * Sequence lock, for data read far more often than it is written.
+ * Writers take lock and keep seq odd while they change the data.
+ * Readers take nothing: they copy what they need between
+ * read_seqbegin() and read_seqretry() and start over if a writer got
+ * in between. A reader may thus see torn data and must not trust it
+ * before read_seqretry() says so; any pointer it follows must stay
+ * valid whatever writers do, and any walk must be bounded.
+ */
+struct seqlock {
+    volatile uint32_t seq; /* Odd while a writer is in */
+    struct spinlock lock;  /* Serializes writers */
+};
+
+static inline void
+initseqlock(struct seqlock* sl, char* name)
+{
+    sl->seq = 0;
+    initlock(&sl->lock, name);
+}
+
+static inline uint32_t
+read_seqbegin(struct seqlock* sl)
+{
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE)) & 1)
+        asm volatile("yield");
+    return seq;
+}
+
+/* Did a writer get in since read_seqbegin() returned seq? */
+static inline int
+read_seqretry(struct seqlock* sl, uint32_t seq)
+{
+    asm volatile("dmb ishld" ::: "memory");
+    return __atomic_load_n(&sl->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static inline void
+write_seqlock(struct seqlock* sl)
+{
+    acquire(&sl->lock);
+    __atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELAXED);
+    asm volatile("dmb ishst" ::: "memory");
+}
+
+static inline void
+write_sequnlock(struct seqlock* sl)
+{
+    __atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELEASE);
+    release(&sl->lock);
+}
+
+#endif  // INC_SEQLOCK_H_
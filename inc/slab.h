@@ -0,0 +1,42 @@
+#ifndef INC_SLAB_H_
+#define INC_SLAB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "proc.h"
+#include "spinlock.h"
+
+#define NCACHE       16  /* Maximum number of object caches */
+#define CACHELINE    64  /* Objects are aligned to a cache line */
+#define SLAB_CPU_MAX 16  /* Objects kept in each per-CPU free list */
+
+struct slab;
+
+/*
+ * An object cache hands out fixed-size objects carved out of slabs,
+ * i.e. runs of 2^order pages from the buddy allocator. Each CPU keeps
+ * a small list of free objects so that the common path is lock-free.
+ */
+struct kmem_cache {
+    char* name;
+    size_t size;           /* Object size, rounded up to CACHELINE */
+    int order;             /* Each slab is 2^order pages */
+    int nobj;              /* Objects per slab */
+    struct spinlock lock;  /* Protects partial and the counters below */
+    struct slab* partial;  /* Slabs with at least one free object */
+    uint64_t nslab;        /* Slabs currently allocated */
+    uint64_t inuse;        /* Objects handed out, including CPU lists */
+
+    struct {
+        int n;
+        void* obj[SLAB_CPU_MAX];
+    } cpu[NCPU];
+};
+
+struct kmem_cache* kmem_cache_create(char*, size_t);
+void* kmem_cache_alloc(struct kmem_cache*);
+void kmem_cache_free(struct kmem_cache*, void*);
+void kmem_cache_dump();
+
+#endif  // INC_SLAB_H_
@@ -4,16 +4,27 @@
 #include "proc.h"
 #include "spinlock.h"
 
-/* Long-term locks for processes */
+/*
+ * Long-term locks for processes. Most are held only for a few
+ * microseconds, as around a bread() or ilock() that hits the cache,
+ * so a waiter spins for up to SLEEPLOCK_SPIN_US while the holder is
+ * running on another CPU, and only sleeps if it is not or takes longer.
+ */
+#define SLEEPLOCK_SPIN_US 20
+
 struct sleeplock {
-    int locked;         /* Is the lock held? */
-    struct spinlock lk; /* Spinlock protecting this sleep lock */
+    volatile int locked; /* Is the lock held? */
+    struct spinlock lk;  /* Spinlock protecting this sleep lock */
     int pid;
+    struct proc* owner;  /* The holder, to spin while it runs */
+    int nsleep;          /* Processes sleeping on it */
 };
 
 void initsleeplock(struct sleeplock* lk, char* name);
 void acquiresleep(struct sleeplock* lk);
+int tryacquiresleep(struct sleeplock* lk);
 void releasesleep(struct sleeplock* lk);
 int holdingsleep(struct sleeplock* lk);
+void sleeplock_counts(uint64_t* spun, uint64_t* slept);
 
 #endif  // INC_SLEEPLOCK_H_
@@ -1,17 +1,36 @@
 #ifndef INC_SPINLOCK_H_
 #define INC_SPINLOCK_H_
 
+#include <stdint.h>
+
+/*
+ * Ticket lock: acquire() takes the next ticket and waits in wfe
+ * until owner reaches it, so CPUs get the lock in the order they
+ * asked for it. release() serves the next ticket and sev wakes them.
+ */
 struct spinlock {
-    volatile int locked;
+    volatile uint16_t next;  /* Next ticket to hand out */
+    volatile uint16_t owner; /* Ticket now holding the lock */
 
     /* For debugging: */
     char* name;      /* Name of lock. */
     struct cpu* cpu; /* The cpu holding the lock. */
+
+    /* Statistics, updated by the holder: */
+    uint64_t nacquire; /* Times acquired */
+    uint64_t ncontend; /* ... after waiting for another CPU */
+    uint64_t nspin;    /* Wakeups from wfe while waiting */
+    uint64_t maxhold;  /* Longest hold, in timestamp() ticks */
+    uint64_t since;    /* When the holder got it */
+
+    struct spinlock* lnext; /* All listed locks, for lock_dump() */
 };
 
 int holding(struct spinlock*);
 void acquire(struct spinlock*);
 void release(struct spinlock*);
 void initlock(struct spinlock*, char*);
+void initlock_unlisted(struct spinlock*, char*);
+void lock_dump();
 
 #endif  // INC_SPINLOCK_H_
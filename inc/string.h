@@ -110,37 +110,11 @@ strfind(const char* s, char c)
     return (char*)s;
 }
 
-static inline void*
-memset(void* v, int c, size_t n)
-{
-    char* p = (char*)v;
-    int m = n;
-    while (--m >= 0) *p++ = c;
-    return v;
-}
-
-static inline void*
-memmove(void* dst, const void* src, size_t n)
-{
-    const char* s = (char*)src;
-    char* d = (char*)dst;
-
-    if (s < d && s + n > d) {
-        s += n;
-        d += n;
-        while (n-- > 0) *--d = *--s;
-    } else {
-        while (n-- > 0) *d++ = *s++;
-    }
-
-    return dst;
-}
-
-static inline void*
-memcpy(void* dst, const void* src, size_t n)
-{
-    return memmove(dst, src, n);
-}
+/* kern/string.S */
+void* memset(void*, int, size_t);
+void* memmove(void*, const void*, size_t);
+void* memcpy(void*, const void*, size_t);
+int copy_user(void*, const void*, size_t);
 
 static inline int
 memcmp(const void* v1, const void* v2, size_t n)
@@ -7,18 +7,22 @@
 #include "types.h"
 
 #define MAXARG   32
+#define MAXPATH  128 /* Bytes of a path, with its nul */
 
 // kern/syscall.c
 
 int fetchint(uint64_t, int64_t*);
-int fetchstr(uint64_t, char**);
+int fetchstr(uint64_t, char*, size_t);
 int argint(int, uint64_t*);
 int argptr(int, char**, int);
-int argstr(int, char**);
+int checkrange(uint64_t, uint64_t);
+int argstr(int, char*, size_t);
 
 // kern/syscall1.c
 
 int sys_gettid();
+int sys_getpid();
+int sys_set_tid_address();
 int sys_ioctl();
 int sys_rt_sigprocmask();
 
@@ -29,26 +33,58 @@ int sys_yield();
 size_t sys_brk();
 int sys_clone();
 int sys_wait4();
+int sys_getrusage();
 int sys_exit();
+int sys_exit_group();
+int sys_getpriority();
+int sys_setpriority();
 
 // kern/sysfile.c
 
 int sys_dup();
 ssize_t sys_read();
 ssize_t sys_write();
+ssize_t sys_readv();
 ssize_t sys_writev();
 int sys_close();
 int sys_fstat();
 int sys_fstatat();
+ssize_t sys_getdents64();
 int sys_openat();
 int sys_mkdirat();
 int sys_mknodat();
 int sys_chdir();
+int sys_pipe2();
+ssize_t sys_splice();
+ssize_t sys_tee();
+int sys_fsync();
+int sys_fdatasync();
+int sys_sync();
+
+// kern/mmap.c
+
+size_t sys_mmap();
+int sys_munmap();
+
+// kern/futex.c
+
+int sys_futex();
+
+// kern/ioring.c
+
+int sys_io_uring_setup();
+int sys_io_uring_enter();
+
+// kern/vdso.c
+
+int sys_clock_gettime();
+int sys_clock_getres();
 
 // kern/exec.c
 
 int execve(char*, char* const*, char* const*);
 
+void syscall_init();
 int syscall1(struct trapframe*);
 
 #endif  // INC_SYSCALL1_H_
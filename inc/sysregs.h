@@ -20,9 +20,10 @@
 #define HCR_VALUE HCR_RW
 
 /* CPACR_EL1, Architectural Feature Access Control Register. */
-#define CPACR_FP_EN    (3 << 20)
+#define CPACR_FP_EN    (3 << 20) /* FP/SIMD at EL0 and EL1 */
+#define CPACR_FP_EL1   (1 << 20) /* ... at EL1 only, EL0 traps */
 #define CPACR_TRACE_EN (0 << 28)
-#define CPACR_VALUE    (CPACR_FP_EN | CPACR_TRACE_EN)
+#define CPACR_VALUE    (CPACR_FP_EL1 | CPACR_TRACE_EN)
 
 /* SCR_EL3, Secure Configuration Register (EL3). */
 #define SCR_RESERVED (3 << 4)
@@ -34,18 +35,32 @@
 
 /* SPSR_EL1/2/3, Saved Program Status Register. */
 #define SPSR_MASK_ALL  (7 << 6)
+#define SPSR_M         (0xf << 0) /* Exception level and stack taken from */
+#define SPSR_EL0t      (0 << 0)
 #define SPSR_EL1h      (5 << 0)
 #define SPSR_EL2h      (9 << 0)
 #define SPSR_EL3_VALUE (SPSR_MASK_ALL | SPSR_EL2h)
 #define SPSR_EL2_VALUE (SPSR_MASK_ALL | SPSR_EL1h)
 
+/* CNTKCTL_EL1, Counter-timer Kernel Control Register. */
+#define CNTKCTL_EL0VCTEN (1 << 1) /* EL0 may read cntvct_el0 */
+
 /* Exception Class in ESR_EL1. */
 #define EC_SHIFT   26
 #define EC_UNKNOWN 0x00
+#define EC_FP      0x07 /* FP/SIMD access trapped by CPACR_EL1 */
 #define EC_SVC64   0x15
 #define EC_DABORT  0x24
+#define EC_DABORT_EL1 0x25
 #define EC_IABORT  0x20
 
 #define ISS_MASK 0xFFFFFF
 
+/* ISS of a data abort. */
+#define ISS_WNR        (1 << 6)  /* Caused by a write */
+#define ISS_FSC(iss)   ((iss) & 0x3C)  /* Fault status code, less the level */
+#define FSC_TRANSLATION 0x04
+#define FSC_ACCESS      0x08
+#define FSC_PERMISSION  0x0C
+
 #endif  // INC_SYSREGS_H_
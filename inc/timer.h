@@ -1,8 +1,14 @@
 #ifndef INC_TIMER_H_
 #define INC_TIMER_H_
 
+#include <stdint.h>
+
+#define HZ 250 /* Timer interrupts per second on each CPU */
+
 void timer_init();
 void timer_reset();
+void timer_set_rate(uint32_t);
+void timer_stop();
 void timer();
 
 #endif  // INC_TIMER_H_
@@ -0,0 +1,55 @@
+#ifndef INC_TRACE_H_
+#define INC_TRACE_H_
+
+#include <stdint.h>
+
+#define TRACE 3 /* Major device number of the trace device */
+
+/* Event types, with what a and b hold. */
+enum {
+    TR_CLOCK,   /* First of every read(). a: timestamp() Hz, b: events lost */
+    TR_SWITCH,  /* Process pid put on the CPU */
+    TR_SLEEP,   /* a: chan */
+    TR_WAKEUP,  /* a: pid woken, b: chan */
+    TR_FORK,    /* a: child pid */
+    TR_EXIT,    /* a: status */
+    TR_EXEC,    /* a: argc, b: entry point */
+    TR_SYSCALL, /* a: number, b: first argument */
+    TR_SYSRET,  /* a: number, b: return value */
+    TR_BGET,    /* a: blockno, b: 1 if it was cached */
+    TR_COMMIT,  /* a: blocks, b: microseconds taken */
+    TR_SDSTART, /* a: first blockno, b: blocks, plus 1 << 32 if writing */
+    TR_SDDONE,  /* a: first blockno, b: blocks */
+    TR_SDERASE, /* a: first blockno, b: blocks */
+    NTRACETYPE
+};
+
+/* An event, as read() from the trace device. */
+struct trace_event {
+    uint64_t ts;   /* timestamp() */
+    uint16_t type; /* TR_* */
+    uint16_t cpu;
+    uint32_t pid;  /* Running process, 0 if none */
+    uint64_t a, b;
+};
+
+/*
+ * Writing a uint32_t to the trace device sets trace_mask, the types
+ * recorded by bit; none are on at boot, so that a tracepoint is
+ * the not-taken branch it is predicted to be. Reading it drains
+ * the events recorded since the last read, in order on each CPU
+ * but with the CPUs one after the other.
+ */
+extern uint32_t trace_mask;
+
+void trace_init();
+void trace_record(int, uint64_t, uint64_t);
+
+/* A tracepoint: a test and a branch while its type is off. */
+static inline void
+trace(int type, uint64_t a, uint64_t b)
+{
+    if (__builtin_expect(trace_mask & (1u << type), 0)) trace_record(type, a, b);
+}
+
+#endif  // INC_TRACE_H_
@@ -7,7 +7,6 @@ struct trapframe {
     // Additional registers used to support musl
     uint64_t _padding;  // for 16-byte aligned
     uint64_t tpidr_el0;
-    __uint128_t q0;
 
     // Special Registers
     uint64_t sp_el0;    // Stack Pointer
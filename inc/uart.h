@@ -1,9 +1,15 @@
 #ifndef INC_UART_H_
 #define INC_UART_H_
 
+#include <stddef.h>
+
+#include "types.h"
+
 void uart_init();
 void uart_intr();
 void uart_putchar(int);
+ssize_t uart_write(char*, size_t);
+void uart_flush();
 int  uart_getchar();
 
 #endif  // INC_UART_H_
@@ -0,0 +1,19 @@
+#ifndef INC_VDSO_H_
+#define INC_VDSO_H_
+
+#include <stdint.h>
+
+/*
+ * What the vDSO code reads from its own page, at vdso_data in
+ * vdso.S. Set once at boot.
+ */
+struct vdso_data {
+    uint64_t freq;  // cntvct_el0 ticks a second
+    uint64_t base;  // cntvct_el0 at boot, time 0 of every clock
+    uint64_t res;   // Nanoseconds a tick, rounded up
+};
+
+void vdso_init();
+int vdso_map(uint64_t*);
+
+#endif  // INC_VDSO_H_
@@ -6,7 +6,12 @@
 #include "file.h"
 #include "proc.h"
 
-void vm_free(uint64_t*, int);
+uint64_t* pgdir_walk(uint64_t*, const void*, int64_t);
+int map_region(uint64_t*, void*, uint64_t, uint64_t, int64_t);
+int uvm_alloc_block(uint64_t*, uint64_t, int64_t);
+void uvm_unmap(uint64_t*, uint64_t, uint64_t, int);
+void vm_init();
+void vm_free(uint64_t*);
 void uvm_clear(uint64_t*, char*);
 uint64_t* pgdir_init();
 void uvm_init(uint64_t*, char*, uint64_t);
@@ -14,8 +19,16 @@ int uvm_load(uint64_t*, char*, struct inode*, uint64_t, uint64_t);
 uint64_t uvm_alloc(uint64_t*, uint64_t, uint64_t);
 uint64_t uvm_dealloc(uint64_t*, uint64_t, uint64_t);
 void uvm_switch(struct proc*);
-int uvm_copy(uint64_t*, uint64_t*, uint64_t);
+void uvm_detach();
+uint64_t asid_rollovers();
+int uvm_copy(uint64_t*, uint64_t*, uint64_t, uint64_t, int);
+int uvm_fault(struct proc*, uint64_t, int);
+void uvm_prefault(struct proc*, uint64_t, size_t, int);
+ssize_t uvm_readi(struct inode*, char*, size_t, size_t);
 int copyout(uint64_t*, uint64_t, char*, uint64_t);
+char* uva2ka(uint64_t*, char*);
+char* uva2ka_get(uint64_t*, char*);
+char* uva2ka_fault(struct proc*, uint64_t);
 
 void check_map_region();
 
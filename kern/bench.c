@@ -0,0 +1,241 @@
+#include "bench.h"
+
+#include "arm.h"
+#include "buf.h"
+#include "console.h"
+#include "file.h"
+#include "fs.h"
+#include "kalloc.h"
+#include "log.h"
+#include "mmu.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "spinlock.h"
+#include "string.h"
+#include "types.h"
+
+/*
+ * Micro-benchmarks of kernel primitives, run in the context of the
+ * process that reads the device. Anything that needs a user process,
+ * such as fork() and wait(), is timed by user/src/bench instead.
+ */
+#define BENCH_LOCK_ITERS 10000 /* acquire()/release() pairs per CPU */
+#define BENCH_MISS       64    /* Uncached blocks bread() at most */
+#define BENCH_BATCH      64    /* Pages held at once by kalloc_batch */
+
+static struct {
+    struct sleeplock lock;  // One run at a time
+    char* report;           // Of the last run, PGSIZE bytes
+    size_t len;
+} bench;
+
+/*
+ * Lock contention: CPUs other than the reader's are borrowed through
+ * one kernel thread each, kept asleep between runs since kernel
+ * threads never exit.
+ */
+static struct {
+    struct spinlock lock;    // Protects round and nthr
+    int round;               // Bumped to start a round
+    int nthr;                // Helpers that take part in it
+    int ready;               // Helpers about to start
+    int done;                // Helpers through
+    volatile int go;         // Everybody is ready
+    int nhelper;             // Helpers created so far
+    uint64_t cpus;           // CPUs that took part, one bit each
+    struct spinlock target;  // What they contend for
+} contend;
+
+static int
+bench_line(char* name, uint64_t iters, uint64_t ticks)
+{
+    if (bench.len >= PGSIZE) return -1;
+    uint64_t ns = iters ? ticks * 1000000000 / timerfreq() / iters : 0;
+    bench.len += snprintf(bench.report + bench.len, PGSIZE - bench.len, "%s %lld %lld %lld\n", name, iters, ticks, ns);
+    return 0;
+}
+
+static void
+contend_loop()
+{
+    __atomic_fetch_or(&contend.cpus, 1ULL << cpuid(), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&contend.ready, 1, __ATOMIC_RELEASE);
+    // Yield rather than spin: whoever we wait for may be queued here.
+    while (!contend.go) yield();
+    for (int i = 0; i < BENCH_LOCK_ITERS; i++) {
+        acquire(&contend.target);
+        release(&contend.target);
+    }
+}
+
+static void
+bench_helper(void* arg)
+{
+    int id = (int)(uint64_t)arg, seen = 0;
+    while (1) {
+        acquire(&contend.lock);
+        while (contend.round == seen) sleep(&contend.round, &contend.lock);
+        seen = contend.round;
+        int part = id < contend.nthr;
+        release(&contend.lock);
+        if (part) {
+            contend_loop();
+            __atomic_fetch_add(&contend.done, 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/* acquire()/release() of one lock by ncpu CPUs at once. */
+static void
+bench_lock(int ncpu)
+{
+    static char* names[] = {"lock_1", "lock_2", "lock_3", "lock_4"};
+    char* name = names[MIN(ncpu, 4) - 1];
+
+    while (contend.nhelper < ncpu - 1) {
+        kthread_create("bench", bench_helper, (void*)(uint64_t)contend.nhelper);
+        contend.nhelper++;
+    }
+
+    acquire(&contend.lock);
+    contend.nthr = ncpu - 1;
+    contend.ready = contend.done = contend.go = 0;
+    contend.cpus = 0;
+    contend.round++;
+    wakeup(&contend.round);
+    release(&contend.lock);
+
+    while (__atomic_load_n(&contend.ready, __ATOMIC_ACQUIRE) < ncpu - 1) yield();
+    uint64_t t = timestamp();
+    contend.go = 1;
+    contend_loop();
+    while (__atomic_load_n(&contend.done, __ATOMIC_ACQUIRE) < ncpu - 1) yield();
+    t = timestamp() - t;
+
+    bench_line(name, BENCH_LOCK_ITERS, t);
+    int n = __builtin_popcountll(contend.cpus);
+    if (n < ncpu && bench.len < PGSIZE)
+        bench.len += snprintf(bench.report + bench.len, PGSIZE - bench.len, "# %s ran on %d CPUs\n", name, n);
+}
+
+static void
+bench_kalloc()
+{
+    int n = 10000;
+    uint64_t t = timestamp();
+    for (int i = 0; i < n; i++) {
+        char* p = kalloc();
+        if (p) kfree(p);
+    }
+    bench_line("kalloc_kfree", n, timestamp() - t);
+
+    // Past the per-CPU magazine, if it is smaller than a batch.
+    char* p[BENCH_BATCH];
+    int rounds = 100, got = 0;
+    t = timestamp();
+    for (int r = 0; r < rounds; r++) {
+        int k = 0;
+        while (k < BENCH_BATCH && (p[k] = kalloc())) k++;
+        got += k;
+        while (k > 0) kfree(p[--k]);
+    }
+    bench_line("kalloc_batch", got, timestamp() - t);
+}
+
+/* There and back through swtch(), to the scheduler and out again. */
+static void
+bench_yield()
+{
+    int n = 2000;
+    uint64_t t = timestamp();
+    for (int i = 0; i < n; i++) yield();
+    bench_line("yield", n, timestamp() - t);
+}
+
+static void
+bench_bread()
+{
+    struct superblock sb;
+    readsb(ROOTDEV, &sb);
+
+    int n = 10000;
+    uint64_t t = timestamp();
+    for (int i = 0; i < n; i++) brelse(bread(ROOTDEV, sb.inodestart));
+    bench_line("bread_hit", n, timestamp() - t);
+
+    // Blocks at the end of the disk, mostly free: nobody caches them.
+    uint32_t b = sb.size;
+    uint64_t ticks = 0;
+    n = 0;
+    while (n < BENCH_MISS && b > sb.bmapstart) {
+        if (bcached(ROOTDEV, --b)) continue;
+        t = timestamp();
+        brelse(bread(ROOTDEV, b));
+        ticks += timestamp() - t;
+        n++;
+    }
+    bench_line("bread_miss", n, ticks);
+}
+
+/* Look up a path of depth components, all "." of the root. */
+static void
+bench_namei(int depth)
+{
+    static char* names[] = {"namei_1", "namei_4", "namei_16"};
+    char path[2 * 16 + 2] = "/";
+    for (int i = 0; i < depth; i++) strncpy(path + 1 + 2 * i, "./", 3);
+
+    int n = 1000;
+    begin_op();
+    uint64_t t = timestamp();
+    for (int i = 0; i < n; i++) {
+        struct inode* ip = namei(path);
+        if (ip) iput(ip);
+    }
+    t = timestamp() - t;
+    end_op();
+    bench_line(names[depth == 1 ? 0 : depth == 4 ? 1 : 2], n, t);
+}
+
+static void
+bench_run()
+{
+    bench.len = snprintf(bench.report, PGSIZE, "# freq %lld\n", timerfreq());
+    bench_kalloc();
+    for (int ncpu = 1; ncpu <= NCPU && ncpu <= 4; ncpu++) bench_lock(ncpu);
+    bench_yield();
+    bench_bread();
+    bench_namei(1);
+    bench_namei(4);
+    bench_namei(16);
+    bench.len = MIN(bench.len, PGSIZE - 1);
+}
+
+static ssize_t
+bench_read(struct inode* ip, char* dst, size_t off, ssize_t n)
+{
+    // Like the console, do not hold our inode while this goes on.
+    iunlock(ip);
+    acquiresleep(&bench.lock);
+    if (!off) bench_run();
+    if (off >= bench.len)
+        n = 0;
+    else
+        n = MIN((size_t)n, bench.len - off);
+    if (copy_user(dst, bench.report + off, n) < 0) n = -1;
+    releasesleep(&bench.lock);
+    ilock(ip);
+    return n;
+}
+
+void
+bench_init()
+{
+    initsleeplock(&bench.lock, "bench");
+    initlock(&contend.lock, "bench");
+    initlock(&contend.target, "bench_target");
+    if (!(bench.report = kalloc()))
+        panic("\tbench_init: no memory for the report.\n");
+    devsw[BENCH].read = bench_read;
+    cprintf("bench_init: success.\n");
+}
@@ -1,7 +1,7 @@
 /*
  * Buffer cache.
  *
- * The buffer cache is a linked list of buf structures holding
+ * The buffer cache is a hash table of buf structures holding
  * cached copies of disk block contents.  Caching disk blocks
  * in memory reduces the number of disk reads and also provides
  * a synchronization point for disk blocks used by multiple processes.
@@ -23,39 +23,169 @@
 #include "buf.h"
 #include "console.h"
 #include "fs.h"
+#include "kalloc.h"
+#include "mmu.h"
 #include "sd.h"
+#include "slab.h"
 #include "sleeplock.h"
 #include "spinlock.h"
+#include "string.h"
+#include "trace.h"
+#include "types.h"
 
+#define BCACHE_FRAC 16 /* Let the cache grow to 1/BCACHE_FRAC of free memory */
+
+struct bucket {
+    struct spinlock lock;
+    struct buf* head;
+};
+
+/*
+ * Buffers are indexed by (dev, blockno) in a hash table. Each bucket
+ * has its own lock, which protects the chain as well as refcnt of
+ * the buffers on it, so cache hits on different blocks never contend.
+ *
+ * Buffers are allocated on demand until the cache reaches bcache.max,
+ * which binit() derives from the amount of free memory. After that,
+ * a miss recycles a buffer picked by a clock sweep over the ring of
+ * all buffers: brelse() sets b->used, and the hand clears it and
+ * takes the first unused, clean buffer whose bit is already clear.
+ * bcache.lock protects the ring and serializes recycling; it is only
+ * taken on a miss.
+ */
 struct {
     struct spinlock lock;
-    struct buf buf[NBUF];
+    struct kmem_cache* cache;
+    int n;                  // Buffers allocated
+    int max;                // Upper bound on n
+    struct buf* hand;       // Clock hand in the ring through cnext
+    struct buf* hand_prev;  // Buffer before the hand
 
-    // Linked list of all buffers, through prev / next.
-    // Sorted by how recently the buffer was used.
-    // head.next is the most recent, head.prev is the least.
-    struct buf head;
+    int nbucket;  // Power of two
+    struct bucket* bucket;
+
+    // Statistics, updated without locks.
+    uint64_t nread;     // bread() calls
+    uint64_t nmiss;     // bread() calls that went to the disk
+    uint64_t ra_issue;  // Blocks read ahead
+    uint64_t ra_hit;    // Read-ahead blocks later found by bread()
+    uint64_t ra_waste;  // Read-ahead blocks recycled before any use
 } bcache;
 
+static inline struct bucket*
+bhash(uint32_t dev, uint32_t blockno)
+{
+    return &bcache.bucket[((blockno * 2654435761u) ^ dev) & (bcache.nbucket - 1)];
+}
+
+static uint64_t bshrink(uint64_t);
+
 void
 binit()
 {
     initlock(&bcache.lock, "bcache");
+    bcache.cache = kmem_cache_create("buf", sizeof(struct buf));
+    if (!bcache.cache) panic("\tbinit: failed to create buf cache.\n");
 
-    // Create linked list of buffers
-    bcache.head.prev = &bcache.head;
-    bcache.head.next = &bcache.head;
-    for (struct buf* b = bcache.buf; b < bcache.buf + NBUF; ++b) {
-        b->next = bcache.head.next;
-        b->prev = &bcache.head;
-        initsleeplock(&b->lock, "buffer");
-        bcache.head.next->prev = b;
-        bcache.head.next = b;
+    bcache.max = kmem_free_pages() / BCACHE_FRAC * PGSIZE / sizeof(struct buf);
+    bcache.max = MAX(bcache.max, NBUF);
+
+    // About four buffers per bucket, in at most a MAX_ORDER block.
+    int order = 0;
+    bcache.nbucket = PGSIZE / sizeof(struct bucket);
+    while (bcache.nbucket * 4 < bcache.max && order < MAX_ORDER) {
+        bcache.nbucket *= 2;
+        order++;
+    }
+    if (!(bcache.bucket = (struct bucket*)kalloc_pages(order)))
+        panic("\tbinit: failed to allocate hash table.\n");
+    for (int i = 0; i < bcache.nbucket; i++) {
+        initlock(&bcache.bucket[i].lock, "bcache.bucket");
+        bcache.bucket[i].head = NULL;
     }
 
+    kmem_register_shrinker(bshrink);
+    cprintf("binit: up to %d buffers, %d buckets.\n", bcache.max, bcache.nbucket);
     cprintf("binit: success.\n");
 }
 
+/*
+ * Take b off its hash chain if nobody uses it. Caller must hold
+ * bcache.lock, which keeps b->dev and b->blockno stable.
+ * Returns 1 with b->refcnt set to 1 on success.
+ */
+static int
+bunhash(struct buf* b)
+{
+    struct bucket* h = bhash(b->dev, b->blockno);
+
+    acquire(&h->lock);
+    if (b->refcnt || (b->flags & B_DIRTY)) {
+        release(&h->lock);
+        return 0;
+    }
+    struct buf** pp = &h->head;
+    while (*pp != b) pp = &(*pp)->hnext;
+    *pp = b->hnext;
+    b->refcnt = 1;
+    release(&h->lock);
+    return 1;
+}
+
+static inline void
+bclock_advance()
+{
+    bcache.hand_prev = bcache.hand;
+    bcache.hand = bcache.hand->cnext;
+}
+
+/*
+ * Get a buffer that is on no hash chain, with refcnt 1.
+ * Caller must hold bcache.lock.
+ */
+static struct buf*
+bnew()
+{
+    struct buf* b;
+
+    if (bcache.n < bcache.max && (b = kmem_cache_alloc(bcache.cache))) {
+        memset(b, 0, sizeof(*b));
+        initsleeplock(&b->lock, "buffer");
+        b->refcnt = 1;
+
+        // Insert behind the hand so it is the last to be swept.
+        if (!bcache.hand) {
+            b->cnext = b;
+            bcache.hand = b;
+        } else {
+            b->cnext = bcache.hand;
+            bcache.hand_prev->cnext = b;
+        }
+        bcache.hand_prev = b;
+        bcache.n++;
+        return b;
+    }
+
+    // Recycle with the clock algorithm. Two full turns clear every
+    // used bit, so if nothing turns up by then, everything is busy.
+    for (int i = 0; i < 2 * bcache.n; i++, bclock_advance()) {
+        b = bcache.hand;
+        if (b->refcnt || (b->flags & B_DIRTY)) continue;
+        if (b->used) {
+            b->used = 0;
+            continue;
+        }
+        if (bunhash(b)) {
+            if (b->flags & B_RA)
+                __atomic_fetch_add(&bcache.ra_waste, 1, __ATOMIC_RELAXED);
+            bclock_advance();
+            return b;
+        }
+    }
+    panic("\tbget: no buffers.\n");
+    return NULL;
+}
+
 /*
  * Look through buffer cache for block on device dev.
  * If not found, allocate a buffer.
@@ -64,35 +194,100 @@ binit()
 static struct buf*
 bget(uint32_t dev, uint32_t blockno)
 {
-    cprintf("bget: dev %d blockno %d\n", dev, blockno);
-    acquire(&bcache.lock);
+    struct bucket* h = bhash(dev, blockno);
+    struct buf* b;
 
     // Is the block already cached?
-    for (struct buf* b = bcache.head.next; b != &bcache.head; b = b->next) {
+    acquire(&h->lock);
+    for (b = h->head; b; b = b->hnext) {
         if (b->dev == dev && b->blockno == blockno) {
             b->refcnt++;
-            release(&bcache.lock);
+            release(&h->lock);
+            trace(TR_BGET, blockno, 1);
             acquiresleep(&b->lock);
             return b;
         }
     }
+    release(&h->lock);
 
     // Not cached.
-    // Recycle the least recently used (LRU) unused buffer.
-    for (struct buf* b = bcache.head.prev; b != &bcache.head; b = b->prev) {
-        if (!b->refcnt && !(b->flags & B_DIRTY)) {
-            b->dev = dev;
-            b->blockno = blockno;
-            b->flags = 0;
-            b->refcnt = 1;
+    acquire(&bcache.lock);
+
+    // Someone else may have cached it while we held no lock.
+    acquire(&h->lock);
+    for (b = h->head; b; b = b->hnext) {
+        if (b->dev == dev && b->blockno == blockno) {
+            b->refcnt++;
+            release(&h->lock);
             release(&bcache.lock);
+            trace(TR_BGET, blockno, 1);
             acquiresleep(&b->lock);
             return b;
         }
     }
+    release(&h->lock);
 
-    panic("\tbget: no buffers.\n");
-    return NULL;
+    b = bnew();
+    b->dev = dev;
+    b->blockno = blockno;
+    b->flags = 0;
+
+    acquire(&h->lock);
+    b->hnext = h->head;
+    h->head = b;
+    release(&h->lock);
+
+    release(&bcache.lock);
+    trace(TR_BGET, blockno, 0);
+    acquiresleep(&b->lock);
+    return b;
+}
+
+/*
+ * Is the block cached? Only a hint, the answer may change right away.
+ */
+int
+bcached(uint32_t dev, uint32_t blockno)
+{
+    struct bucket* h = bhash(dev, blockno);
+    struct buf* b;
+
+    acquire(&h->lock);
+    for (b = h->head; b; b = b->hnext)
+        if (b->dev == dev && b->blockno == blockno) break;
+    release(&h->lock);
+    return b != NULL;
+}
+
+/*
+ * Memory-pressure hook called by kalloc(): free unused clean
+ * buffers worth about npages pages. Returns the number of pages
+ * that were handed back (an estimate, since slab pages are shared).
+ */
+static uint64_t
+bshrink(uint64_t npages)
+{
+    // kalloc() may be called on the recycling path itself.
+    if (holding(&bcache.lock) || holding(&bcache.cache->lock)) return 0;
+
+    uint64_t want = npages * (PGSIZE / bcache.cache->size), freed = 0;
+
+    acquire(&bcache.lock);
+    for (int i = bcache.n; i > 0 && freed < want && bcache.n > NBUF; i--) {
+        struct buf* b = bcache.hand;
+        if (b->used || !bunhash(b)) {
+            b->used = 0;
+            bclock_advance();
+            continue;
+        }
+        bcache.hand = b->cnext;
+        bcache.hand_prev->cnext = b->cnext;
+        bcache.n--;
+        kmem_cache_free(bcache.cache, b);
+        freed++;
+    }
+    release(&bcache.lock);
+    return freed * bcache.cache->size / PGSIZE;
 }
 
 /*
@@ -101,14 +296,95 @@ bget(uint32_t dev, uint32_t blockno)
 struct buf*
 bread(uint32_t dev, uint32_t blockno)
 {
-    // Logical block address of the first absolute sector in partition 2,
-    // where our file system locates.
-    const uint32_t LBA = 0x20800;
-    struct buf* b = bget(dev, blockno + LBA);
-    if (!(b->flags & B_VALID)) sd_rw(b);
+    struct buf* b = bget(dev, blockno);
+    __atomic_fetch_add(&bcache.nread, 1, __ATOMIC_RELAXED);
+    if (b->flags & B_RA) {
+        b->flags &= ~B_RA;
+        __atomic_fetch_add(&bcache.ra_hit, 1, __ATOMIC_RELAXED);
+    }
+    if (!(b->flags & B_VALID)) {
+        __atomic_fetch_add(&bcache.nmiss, 1, __ATOMIC_RELAXED);
+        sd_rw(b);
+    }
     return b;
 }
 
+/*
+ * Return a locked buf for the indicated block without reading it.
+ * The caller is going to overwrite all of its data.
+ */
+struct buf*
+bgetblk(uint32_t dev, uint32_t blockno)
+{
+    return bget(dev, blockno);
+}
+
+/*
+ * Make sure n locked bufs, at most a page of pointers, hold valid
+ * data, reading the missing ones with as few multi-block commands as
+ * possible.
+ */
+void
+bread_multi(struct buf** bs, int n)
+{
+    if (n > (int)(PGSIZE / sizeof(struct buf*))) panic("\tbread_multi: too many bufs.\n");
+    struct buf** rd = (struct buf**)kalloc();
+    if (!rd) panic("\tbread_multi: out of memory.\n");
+    int nrd = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (!holdingsleep(&bs[i]->lock)) panic("\tbread_multi: buf not locked.\n");
+        if (!(bs[i]->flags & B_VALID)) rd[nrd++] = bs[i];
+    }
+    __atomic_fetch_add(&bcache.nmiss, nrd, __ATOMIC_RELAXED);
+    sd_rw_multi(rd, nrd);
+    kfree((char*)rd);
+}
+
+/*
+ * Write the contents of n locked bufs to disk. Bufs that are
+ * adjacent on disk go out in one multi-block command.
+ */
+void
+bwrite_multi(struct buf** bs, int n)
+{
+    for (int i = 0; i < n; i++) {
+        if (!holdingsleep(&bs[i]->lock)) panic("\tbwrite_multi: buf not locked.\n");
+        bs[i]->flags |= B_DIRTY;
+    }
+    sd_rw_multi(bs, n);
+}
+
+/*
+ * Bring n blocks, at most a page of pointers, into the cache ahead of
+ * use, skipping the ones that are already there. The buffers are
+ * marked B_RA until the first bread() of them, which counts a
+ * read-ahead hit. Without the memory for that, nothing is read.
+ */
+void
+breadahead(uint32_t dev, uint32_t* blockno, int n)
+{
+    struct buf** bs = NULL;
+    if (n > (int)(PGSIZE / sizeof(struct buf*)) || !(bs = (struct buf**)kalloc())) return;
+    int nb = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (bcached(dev, blockno[i])) continue;
+        struct buf* b = bget(dev, blockno[i]);
+        if (b->flags & B_VALID)
+            brelse(b);
+        else
+            bs[nb++] = b;
+    }
+
+    // The driver releases them as they come in; whoever wants one
+    // first blocks on its lock until then.
+    for (int i = 0; i < nb; i++) bs[i]->flags |= B_RA | B_ASYNC;
+    __atomic_fetch_add(&bcache.ra_issue, nb, __ATOMIC_RELAXED);
+    sd_submit(bs, nb);
+    kfree((char*)bs);
+}
+
 /*
  * Write b's contents to disk. Must be locked.
  */
@@ -122,40 +398,56 @@ bwrite(struct buf* b)
 
 /*
  * Release a locked buffer.
- * Move to the head of the most-recently-used list.
+ * Mark it recently used for the clock sweep.
  */
 void
 brelse(struct buf* b)
 {
     if (!holdingsleep(&b->lock)) panic("\tbrelse: buffer not locked.\n");
+    brelse_io(b);
+}
+
+/*
+ * Release a buffer on behalf of whoever submitted it B_ASYNC.
+ * Called by the driver when the I/O completes, possibly from
+ * interrupt context, so it cannot check the lock owner.
+ */
+void
+brelse_io(struct buf* b)
+{
     releasesleep(&b->lock);
 
-    acquire(&bcache.lock);
+    struct bucket* h = bhash(b->dev, b->blockno);
+    acquire(&h->lock);
     b->refcnt--;
-    if (!b->refcnt) {
-        // No one is waiting for it.
-        b->next->prev = b->prev;
-        b->prev->next = b->next;
-        b->next = bcache.head.next;
-        b->prev = &bcache.head;
-        bcache.head.next->prev = b;
-        bcache.head.next = b;
-    }
-    release(&bcache.lock);
+    b->used = 1;
+    release(&h->lock);
 }
 
 void
 bpin(struct buf* b)
 {
-    acquire(&bcache.lock);
+    struct bucket* h = bhash(b->dev, b->blockno);
+    acquire(&h->lock);
     b->refcnt++;
-    release(&bcache.lock);
+    release(&h->lock);
 }
 
 void
 bunpin(struct buf* b)
 {
-    acquire(&bcache.lock);
+    struct bucket* h = bhash(b->dev, b->blockno);
+    acquire(&h->lock);
     b->refcnt--;
-    release(&bcache.lock);
+    release(&h->lock);
+}
+
+/* Print buffer cache statistics to the console. */
+void
+bcache_dump()
+{
+    cprintf("bcache: %d/%d buffers, %lld reads, %lld misses\n", bcache.n,
+            bcache.max, bcache.nread, bcache.nmiss);
+    cprintf("bcache: read-ahead %lld issued, %lld hit, %lld wasted\n",
+            bcache.ra_issue, bcache.ra_hit, bcache.ra_waste);
 }
@@ -4,8 +4,12 @@
 #include <stdint.h>
 
 #include "arm.h"
+#include "buf.h"
 #include "file.h"
+#include "ipi.h"
+#include "kalloc.h"
 #include "proc.h"
+#include "slab.h"
 #include "spinlock.h"
 #include "uart.h"
 
@@ -36,48 +40,60 @@ consputc(int c)
 }
 
 static ssize_t
-console_write(struct inode* ip, char* buf, ssize_t n)
+console_write(struct inode* ip, char* buf, size_t off, ssize_t n)
 {
     iunlock(ip);
-    acquire(&conslock);
-    for (size_t i = 0; i < n; i++) consputc(buf[i] & 0xff);
-    release(&conslock);
+    ssize_t r = uart_write(buf, n);
     ilock(ip);
-    return n;
+    return r;
 }
 
+/* How far a console_read() has got, across calls of console_take(). */
+struct console_take {
+    size_t got;  // Bytes taken
+    int done;    // Past a newline or ^D
+};
+
+/*
+ * Take up to n bytes of input into buf for console_read(), sleeping
+ * until there is some, and stopping after a newline. Called with
+ * conslock held.
+ */
 static ssize_t
-console_read(struct inode* ip, char* dst, ssize_t n)
+console_take(char* buf, size_t n, void* arg)
 {
-    iunlock(ip);
-    size_t target = n;
-    acquire(&conslock);
-    while (n > 0) {
+    struct console_take* t = arg;
+    size_t m = 0;
+    while (!t->done && m < n) {
         while (input.r == input.w) {
-            if (thisproc()->killed) {
-                release(&conslock);
-                ilock(ip);
-                return -1;
-            }
+            if (thisproc()->killed) return -1;
             sleep(&input.r, &conslock);
         }
         int c = input.buf[input.r++ % INPUT_BUF];
         if (c == C('D')) {  // EOF
-            if (n < target) {
+            if (t->got + m) {
                 // Save ^D for next time, to make sure
                 // caller gets a 0-byte result.
                 input.r--;
             }
+            t->done = 1;
             break;
         }
-        *dst++ = c;
-        --n;
-        if (c == '\n') break;
+        buf[m++] = c;
+        t->done = c == '\n';
     }
-    release(&conslock);
-    ilock(ip);
+    t->got += m;
+    return m;
+}
 
-    return target - n;
+static ssize_t
+console_read(struct inode* ip, char* dst, size_t off, ssize_t n)
+{
+    struct console_take t = {0, 0};
+    iunlock(ip);
+    ssize_t r = dev_bounce(&conslock, dst, n, 0, console_take, &t);
+    ilock(ip);
+    return r;
 }
 
 void
@@ -90,14 +106,14 @@ console_init()
 }
 
 static void
-printint(int64_t x, int base, int sign)
+printint(void (*putch)(int, void*), void* arg, int64_t x, int base, int sign)
 {
     static char digit[] = "0123456789abcdef";
-    static char buf[64];
+    char buf[64];
 
     if (sign && x < 0) {
         x = -x;
-        uart_putchar('-');
+        putch('-', arg);
     }
 
     int i = 0;
@@ -106,17 +122,18 @@ printint(int64_t x, int base, int sign)
         buf[i++] = digit[t % base];
     } while (t /= base);
 
-    while (i--) uart_putchar(buf[i]);
+    while (i--) putch(buf[i], arg);
 }
 
+/* Format fmt, passing each output character to putch with arg. */
 void
-vprintfmt(void (*putch)(int), const char* fmt, va_list ap)
+vprintfmt(void (*putch)(int, void*), void* arg, const char* fmt, va_list ap)
 {
     int i, c;
     char* s;
     for (i = 0; (c = fmt[i] & 0xff) != 0; i++) {
         if (c != '%') {
-            putch(c);
+            putch(c, arg);
             continue;
         }
 
@@ -128,38 +145,75 @@ vprintfmt(void (*putch)(int), const char* fmt, va_list ap)
         switch (c) {
         case 'u':
             if (l == 2)
-                printint(va_arg(ap, int64_t), 10, 0);
+                printint(putch, arg, va_arg(ap, int64_t), 10, 0);
             else
-                printint(va_arg(ap, uint32_t), 10, 0);
+                printint(putch, arg, va_arg(ap, uint32_t), 10, 0);
             break;
         case 'd':
             if (l == 2)
-                printint(va_arg(ap, int64_t), 10, 1);
+                printint(putch, arg, va_arg(ap, int64_t), 10, 1);
             else
-                printint(va_arg(ap, int), 10, 1);
+                printint(putch, arg, va_arg(ap, int), 10, 1);
             break;
         case 'x':
             if (l == 2)
-                printint(va_arg(ap, int64_t), 16, 0);
+                printint(putch, arg, va_arg(ap, int64_t), 16, 0);
             else
-                printint(va_arg(ap, uint32_t), 16, 0);
+                printint(putch, arg, va_arg(ap, uint32_t), 16, 0);
             break;
-        case 'p': printint((uint64_t)va_arg(ap, void*), 16, 0); break;
-        case 'c': putch(va_arg(ap, int)); break;
+        case 'p': printint(putch, arg, (uint64_t)va_arg(ap, void*), 16, 0); break;
+        case 'c': putch(va_arg(ap, int), arg); break;
         case 's':
             if ((s = (char*)va_arg(ap, char*)) == 0) s = "(null)";
-            for (; *s; s++) putch(*s);
+            for (; *s; s++) putch(*s, arg);
             break;
-        case '%': putch('%'); break;
+        case '%': putch('%', arg); break;
         default:
             /* Print unknown % sequence to draw attention. */
-            putch('%');
-            putch(c);
+            putch('%', arg);
+            putch(c, arg);
             break;
         }
     }
 }
 
+static void
+uart_putch(int c, void* arg)
+{
+    uart_putchar(c);
+}
+
+struct sbuf {
+    char* p;
+    char* end;
+};
+
+static void
+sbuf_putch(int c, void* arg)
+{
+    struct sbuf* sb = arg;
+    if (sb->p < sb->end) *sb->p = c;
+    sb->p++;
+}
+
+/*
+ * Format into buf, which holds n bytes, always NUL-terminated.
+ * Returns the length of the whole output, which may be n or more
+ * if it was cut short.
+ */
+int
+snprintf(char* buf, size_t n, const char* fmt, ...)
+{
+    va_list ap;
+    struct sbuf sb = {buf, buf + n};
+
+    va_start(ap, fmt);
+    vprintfmt(sbuf_putch, &sb, fmt, ap);
+    va_end(ap);
+    if (n) buf[MIN(sb.p - buf, (int64_t)n - 1)] = '\0';
+    return sb.p - buf;
+}
+
 /* Print to the console. */
 void
 cprintf(const char* fmt, ...)
@@ -172,7 +226,7 @@ cprintf(const char* fmt, ...)
         while (1) {}
     }
     va_start(ap, fmt);
-    vprintfmt(uart_putchar, fmt, ap);
+    vprintfmt(uart_putch, NULL, fmt, ap);
     va_end(ap);
     release(&conslock);
 }
@@ -180,7 +234,7 @@ cprintf(const char* fmt, ...)
 void
 console_intr(int (*getc)())
 {
-    int c, do_proc_dump = 0;
+    int c, do_proc_dump = 0, do_kmem_dump = 0, do_bcache_dump = 0, do_lock_dump = 0;
 
     acquire(&conslock);
     if (panicked >= 0) {
@@ -195,6 +249,15 @@ console_intr(int (*getc)())
             // proc_dump() locks cons.lock indirectly; invoke later
             do_proc_dump = 1;
             break;
+        case C('K'):  // Page allocator counters.
+            do_kmem_dump = 1;
+            break;
+        case C('B'):  // Buffer cache counters.
+            do_bcache_dump = 1;
+            break;
+        case C('L'):  // Lock statistics.
+            do_lock_dump = 1;
+            break;
         case C('U'):  // Kill line.
             while (input.e != input.w
                    && input.buf[(input.e - 1) % INPUT_BUF] != '\n') {
@@ -226,6 +289,12 @@ console_intr(int (*getc)())
     release(&conslock);
 
     if (do_proc_dump) proc_dump();
+    if (do_kmem_dump) {
+        kmem_dump();
+        kmem_cache_dump();
+    }
+    if (do_bcache_dump) bcache_dump();
+    if (do_lock_dump) lock_dump();
 }
 
 void
@@ -236,15 +305,17 @@ panic(const char* fmt, ...)
     acquire(&conslock);
     if (panicked < 0) {
         panicked = cpuid();
+        ipi_broadcast(IPI_STOP);
     } else {
         release(&conslock);
         while (1) {}
     }
     va_start(ap, fmt);
-    vprintfmt(uart_putchar, fmt, ap);
+    vprintfmt(uart_putch, NULL, fmt, ap);
     va_end(ap);
     release(&conslock);
 
     cprintf("%s:%d: kernel panic at CPU %d.\n", __FILE__, __LINE__, cpuid());
+    uart_flush();
     while (1) {}
 }
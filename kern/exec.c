@@ -2,20 +2,22 @@
 
 #include "console.h"
 #include "file.h"
+#include "kalloc.h"
 #include "log.h"
 #include "memlayout.h"
+#include "mm.h"
 #include "mmu.h"
 #include "proc.h"
 #include "string.h"
 #include "syscall1.h"
+#include "trace.h"
 #include "trap.h"
+#include "vdso.h"
 #include "vm.h"
 
 int
 execve(char* path, char* const argv[], char* const envp[])
 {
-    cprintf("exec: start '%s'.\n", path);
-
     // Read program file.
 
     begin_op();
@@ -30,6 +32,9 @@ execve(char* path, char* const argv[], char* const envp[])
     // Check ELF header.
 
     uint64_t* pgdir = NULL;
+    struct inode* exe = NULL;
+    struct mm* mm = NULL;
+    Elf64_Phdr* phdr = NULL;
     Elf64_Ehdr elf;
     if (readi(ip, (char*)&elf, 0, sizeof(elf)) != sizeof(elf)) {
         cprintf("exec: failed to read ELF.\n");
@@ -40,104 +45,112 @@ execve(char* path, char* const argv[], char* const envp[])
         goto bad;
     }
     pgdir = pgdir_init();
-    if (!pgdir) {
+    mm = mm_alloc();
+    if (!pgdir || !mm) {
         cprintf("exec: failed to init pgdir.\n");
         goto bad;
     }
 
-    // Load program into memory.
+    // Note where the program goes: its pages are read on first touch.
+    // The program headers are read all at once.
 
-    Elf64_Phdr ph;
-    int off = elf.e_phoff;
+    if (elf.e_phentsize != sizeof(Elf64_Phdr) || elf.e_phnum > PGSIZE / sizeof(Elf64_Phdr)) {
+        cprintf("exec: bad program header table.\n");
+        goto bad;
+    }
+    size_t phsize = elf.e_phnum * sizeof(Elf64_Phdr);
+    if (!(phdr = (Elf64_Phdr*)kalloc()) || readi(ip, (char*)phdr, elf.e_phoff, phsize) != phsize) {
+        cprintf("exec: failed to read program headers.\n");
+        goto bad;
+    }
     uint64_t sz = 0;
-    for (int i = 0; i < elf.e_phnum; ++i, off += sizeof(ph)) {
-        if (readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph)) {
-            cprintf("exec: failed to read program header.\n");
-            goto bad;
-        }
-        if (ph.p_type != PT_LOAD) continue;
-        if (ph.p_memsz < ph.p_filesz) {
+    struct seg seg[NSEG];
+    int nseg = 0;
+    for (Elf64_Phdr* ph = phdr; ph < phdr + elf.e_phnum; ++ph) {
+        if (ph->p_type != PT_LOAD) continue;
+        if (ph->p_memsz < ph->p_filesz) {
             cprintf("exec: memory size < file size.\n");
             goto bad;
         }
-        if (ph.p_vaddr + ph.p_memsz < ph.p_vaddr) {
+        if (ph->p_vaddr + ph->p_memsz < ph->p_vaddr) {
             cprintf("exec: addr overflowed.\n");
             goto bad;
         }
-        sz = uvm_alloc(pgdir, sz, ph.p_vaddr + ph.p_memsz);
-        if (!sz) {
-            cprintf("exec: failed to allocate uvm.\n");
+        if (ph->p_vaddr + ph->p_memsz > MMAPTOP) {
+            cprintf("exec: addr out of user space.\n");
             goto bad;
         }
-        if (ph.p_vaddr % PGSIZE) {
+        if (ph->p_vaddr % PGSIZE) {
             cprintf("exec: addr not page aligned.\n");
             goto bad;
         }
-        if (uvm_load(pgdir, (char*)ph.p_vaddr, ip, ph.p_offset, ph.p_filesz)
-            < 0) {
-            cprintf("exec: failed to load uvm.\n");
+        if (nseg == NSEG) {
+            cprintf("exec: too many segments.\n");
             goto bad;
         }
+        seg[nseg++] = (struct seg){ph->p_vaddr, ph->p_vaddr + ph->p_memsz, ph->p_offset, ph->p_filesz,
+                                   (ph->p_flags & PF_W) != 0};
+        sz = MAX(sz, ph->p_vaddr + ph->p_memsz);
     }
-    iunlockput(ip);
+    kfree((char*)phdr);
+    phdr = NULL;
+    iunlock(ip);
     end_op();
+    exe = ip;
     ip = NULL;
 
     // Allocate user stack.
 
-    // Allocate two pages at the next page boundary.
-    // Make the first inaccessible. Use the second as the user stack.
+    // Put an inaccessible page at the next page boundary, then the
+    // stack. Only its top page is needed now, for the arguments.
     sz = ROUNDUP(sz, PGSIZE);
-    sz = uvm_alloc(pgdir, sz, sz + 2 * PGSIZE);
-    if (!sz) {
+    if (!uvm_alloc(pgdir, sz, sz + PGSIZE)) {
         cprintf("exec: failed to allocate uvm.\n");
         goto bad;
     }
-    uvm_clear(pgdir, (char*)(sz - 2 * PGSIZE));
-    uint64_t sp = sz;
-
-    // Push auxiliary vectors.
-
-    uint64_t auxv[] = {0, AT_PAGESZ, PGSIZE, AT_NULL};
-    sp -= sizeof(auxv);
-    sp -= sp % 0x10;  // 16-byte aligned
-    if (copyout(pgdir, sp, (char*)auxv, sizeof(auxv)) < 0) {
-        cprintf("exec: failed to push auxiliary vectors.\n");
+    uvm_clear(pgdir, (char*)sz);
+    sz += PGSIZE + USTACKSIZE;
+    if (!uvm_alloc(pgdir, sz - PGSIZE, sz)) {
+        cprintf("exec: failed to allocate uvm.\n");
         goto bad;
     }
+    uint64_t sp = sz;
 
-    // FIXME: Push environment pointers.
-    sp -= 8;
-    sp -= sp % 0x10;
-    if (copyout(pgdir, sp, (char*)envp, 8) < 0) {
-        cprintf("exec: failed to push environment pointers.\n");
+    if (vdso_map(pgdir) < 0) {
+        cprintf("exec: failed to map vdso.\n");
         goto bad;
     }
 
-    // Push argument strings.
+    // Push argument strings, then what the C library's _start looks
+    // for at sp: argc, argv[] and NULL, envp[] (empty) and NULL, then
+    // the auxiliary vector, which it finds past the end of envp[].
 
     uint64_t argc = 0;
-    uint64_t ustack[MAXARG + 1];
+    uint64_t ustack[1 + MAXARG + 1 + 1 + 6];
     for (; argv[argc]; ++argc) {
         if (argc >= MAXARG) {
             cprintf("exec: too many arguments.\n");
             goto bad;
         }
         sp -= strlen(argv[argc]) + 1;
-        sp -= sp % 0x10;
         if (copyout(pgdir, sp, argv[argc], strlen(argv[argc]) + 1) < 0) {
             cprintf("exec: failed to push argument strings.\n");
             goto bad;
         }
-        ustack[argc] = sp;
+        ustack[1 + argc] = sp;
     }
-    ustack[argc] = 0;
-    ustack[0] = argc;
-
-    uint64_t stack_size = (argc + 1) * sizeof(uint64_t);
-    sp -= stack_size;
-    sp -= sp % 0x10;
-    if (copyout(pgdir, sp, (char*)ustack, stack_size) < 0) {
+    int n = 0;
+    ustack[n++] = argc;
+    n += argc;
+    ustack[n++] = 0;  // End of argv[]
+    ustack[n++] = 0;  // End of envp[]
+    uint64_t auxv[] = {AT_SYSINFO_EHDR, VDSOBASE, AT_PAGESZ, PGSIZE, AT_NULL, 0};
+    memcpy(&ustack[n], auxv, sizeof(auxv));
+    n += ARRAY_SIZE(auxv);
+
+    sp -= n * sizeof(uint64_t);
+    sp -= sp % 0x10;  // 16-byte aligned
+    if (copyout(pgdir, sp, (char*)ustack, n * sizeof(uint64_t)) < 0) {
         cprintf("exec: failed to push argv[] pointers.\n");
         goto bad;
     }
@@ -152,23 +165,36 @@ execve(char* path, char* const argv[], char* const envp[])
         if (*s == '/') last = s + 1;
     strncpy(p->name, last, sizeof(p->name));
 
-    // Commit to the user image.
-    uint64_t* old_pgdir = p->pgdir;
-    p->pgdir = pgdir;
-    p->sz = sz;
+    // Commit to the user image, in an address space of its own:
+    // other threads that shared the old one keep it.
+    struct mm* old = p->mm;
+    mm->pgdir = pgdir;
+    mm->sz = mm->heap = sz;
+    mm->exe = exe;
+    memcpy(mm->seg, seg, sizeof(seg));
+    mm->nseg = nseg;
+    p->mm = mm;
+    fpsimd_exec(p);
     p->tf->sp_el0 = sp;
     p->tf->elr_el1 = elf.e_entry;
     uvm_switch(p);
-    if (old_pgdir) vm_free(old_pgdir, 4);
+    if (mm_put(old)) mm_free(old);
+    vfork_done(p);
 
-    cprintf("exec: end '%s'.\n", path);
+    trace(TR_EXEC, argc, elf.e_entry);
     return argc;
 
 bad:
-    if (pgdir) vm_free(pgdir, 4);
+    if (phdr) kfree((char*)phdr);
+    if (pgdir) vm_free(pgdir);
+    if (mm) mm_free(mm);
     if (ip) {
         iunlockput(ip);
         end_op();
+    } else if (exe) {
+        begin_op();
+        iput(exe);
+        end_op();
     }
 
     cprintf("exec: failed to run '%s'.\n", path);
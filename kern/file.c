@@ -4,21 +4,34 @@
 
 #include "file.h"
 #include "console.h"
+#include "kalloc.h"
 #include "log.h"
+#include "pcache.h"
+#include "pipe.h"
+#include "proc.h"
 #include "sleeplock.h"
+#include "slab.h"
 #include "spinlock.h"
+#include "string.h"
 #include "types.h"
+#include "vm.h"
 
 struct devsw devsw[NDEV];
 
+// Open files come from a slab cache, so there is no system-wide limit,
+// and their ref counts are atomic, so there is no system-wide lock.
 struct {
-    struct spinlock lock;
-    struct file file[NFILE];
+    struct kmem_cache* cache;
 } ftable;
 
+static struct kmem_cache* files_cache;  // Fd tables
+
 void file_init()
 {
-    initlock(&ftable.lock, "ftable");
+    if (!(ftable.cache = kmem_cache_create("file", sizeof(struct file))))
+        panic("\tfile_init: failed to create file cache.\n");
+    if (!(files_cache = kmem_cache_create("files", sizeof(struct files))))
+        panic("\tfile_init: failed to create files cache.\n");
     cprintf("file_init: success.\n");
 }
 
@@ -27,16 +40,12 @@ void file_init()
  */
 struct file* file_alloc()
 {
-    acquire(&ftable.lock);
-    for (struct file* f = ftable.file; f < ftable.file + NFILE; ++f) {
-        if (!f->ref) {
-            f->ref = 1;
-            release(&ftable.lock);
-            return f;
-        }
-    }
-    release(&ftable.lock);
-    return NULL;
+    struct file* f = kmem_cache_alloc(ftable.cache);
+    if (!f)
+        return NULL;
+    memset(f, 0, sizeof(*f));
+    f->ref = 1;
+    return f;
 }
 
 /*
@@ -44,11 +53,8 @@ struct file* file_alloc()
  */
 struct file* file_dup(struct file* f)
 {
-    acquire(&ftable.lock);
-    if (f->ref < 1)
+    if (__atomic_fetch_add(&f->ref, 1, __ATOMIC_RELAXED) < 1)
         panic("\tfile_dup: invalid file.\n");
-    f->ref++;
-    release(&ftable.lock);
     return f;
 }
 
@@ -57,24 +63,22 @@ struct file* file_dup(struct file* f)
  */
 void file_close(struct file* f)
 {
-    acquire(&ftable.lock);
-    if (f->ref < 1)
+    int ref = __atomic_sub_fetch(&f->ref, 1, __ATOMIC_ACQ_REL);
+    if (ref < 0)
         panic("\tfile_close: invalid file.\n");
-    if (--f->ref > 0) {
-        release(&ftable.lock);
+    if (ref > 0)
         return;
-    }
 
     struct file ff = *f;
-    f->ref = 0;
-    f->type = FD_NONE;
-    release(&ftable.lock);
+    kmem_cache_free(ftable.cache, f);
 
-    if (ff.type == FD_INODE) {
+    if (ff.type == FD_PIPE) {
+        pipe_close(ff.pipe, ff.writable);
+    } else if (ff.type == FD_INODE) {
         begin_op();
         iput(ff.ip);
         end_op();
-    } else {
+    } else if (ff.type != FD_NONE && ff.type != FD_RING) {
         panic("\tfile_close: unsupported type.\n");
     }
 }
@@ -94,60 +98,408 @@ int file_stat(struct file* f, struct stat* st)
 }
 
 /*
- * Read from file f.
+ * Called after a read of r bytes at off: keep the read-ahead window
+ * in front of a sequential reader, doubling it up to RA_MAX blocks
+ * while the pattern holds. Caller must hold f->ip->lock.
  */
-ssize_t file_read(struct file* f, char* addr, ssize_t n)
+static void file_readahead(struct file* f, size_t off, size_t r)
+{
+    if (off != f->ra_next) {
+        f->ra_win = 0;
+        f->ra_end = 0;
+    } else {
+        f->ra_win = f->ra_win ? MIN(f->ra_win * 2, RA_MAX) : RA_MIN;
+    }
+    f->ra_next = off + r;
+    if (!f->ra_win)
+        return;
+
+    // Refill once less than half of the window is left, so that
+    // blocks are fetched in batches rather than one by one.
+    size_t end = f->ra_next + f->ra_win * BSIZE;
+    size_t start = MAX(f->ra_next, f->ra_end);
+    if (f->ra_end < f->ra_next + f->ra_win * BSIZE / 2) {
+        readahead(f->ip, start, end - start);
+        f->ra_end = end;
+    }
+}
+
+/*
+ * Fault in the buffers of iov before f->ip is locked, see
+ * uvm_prefault(): for writing if write is set, and then only as far
+ * as the file may go from off.
+ */
+static void file_prefault(struct file* f, struct iovec* iov, int iovcnt, size_t off, int write)
+{
+    size_t max = write && f->ip->type == T_FILE ? f->ip->size - MIN(off, f->ip->size) : SIZE_MAX;
+    for (int v = 0; v < iovcnt && max; v++) {
+        size_t n = MIN(iov[v].iov_len, max);
+        uvm_prefault(thisproc(), (uint64_t)iov[v].iov_base, n, write);
+        max -= n;
+    }
+}
+
+/*
+ * Read from file f at *off into the iovcnt buffers of iov in turn,
+ * under one lock of the inode, stopping at the first short read.
+ */
+static ssize_t file_readv_at(struct file* f, struct iovec* iov, int iovcnt, size_t* off)
 {
     if (!f->readable)
         return -1;
+    if (f->type == FD_PIPE)
+        return pipe_readv(f->pipe, iov, iovcnt);
     if (f->type == FD_INODE) {
+        file_prefault(f, iov, iovcnt, *off, 1);
         ilock(f->ip);
-        int r = readi(f->ip, addr, f->off, n);
-        if (r > 0)
-            f->off += r;
+        int direct = f->direct && f->ip->type == T_FILE;
+        size_t start = *off;
+        ssize_t tot = 0;
+        for (int v = 0; v < iovcnt; v++) {
+            if (!iov[v].iov_len)
+                continue;
+            int r = direct ? readi_direct(f->ip, iov[v].iov_base, *off, iov[v].iov_len)
+                           : readi(f->ip, iov[v].iov_base, *off, iov[v].iov_len);
+            if (r < 0) {
+                if (!tot)
+                    tot = -1;
+                break;
+            }
+            *off += r;
+            tot += r;
+            if (r < iov[v].iov_len)
+                break;
+        }
+        if (tot > 0 && f->ip->type == T_FILE && !direct)
+            file_readahead(f, start, tot);
         iunlock(f->ip);
-        return r;
+        return tot;
     }
-    panic("\tfile_read: unsupported type.\n");
+    panic("\tfile_readv: unsupported type.\n");
     return 0;
 }
 
+ssize_t file_readv(struct file* f, struct iovec* iov, int iovcnt)
+{
+    return file_readv_at(f, iov, iovcnt, &f->off);
+}
+
+/* Read from file f at off, leaving its offset alone, as pread() does. */
+ssize_t file_pread(struct file* f, char* addr, size_t n, size_t off)
+{
+    struct iovec v = {addr, n};
+    if (f->type != FD_INODE)
+        return -1;
+    return file_readv_at(f, &v, 1, &off);
+}
+
 /*
- * Write to file f.
+ * Read from file f.
  */
-ssize_t file_write(struct file* f, char* addr, ssize_t n)
+ssize_t file_read(struct file* f, char* addr, ssize_t n)
+{
+    struct iovec v = {addr, n};
+    return file_readv(f, &v, 1);
+}
+
+/*
+ * Write the iovcnt buffers of iov to file f at *off in turn. A device
+ * gets them all under one lock of its inode. A file gets them gathered
+ * into as few log transactions as possible.
+ */
+static ssize_t file_writev_at(struct file* f, struct iovec* iov, int iovcnt, size_t* off)
 {
     if (!f->writable)
         return -1;
-    if (f->type == FD_INODE) {
-        // Write a few blocks at a time to avoid exceeding the maximum log
-        // transaction size, including i-node, indirect block, allocation
-        // blocks, and 2 blocks of slop for non-aligned writes. This really
-        // belongs lower down, since writei() might be writing a device like the
-        // console.
-        int max = ((MAXOPBLOCKS - 4) / 2) * 512;
-        int i = 0;
-        while (i < n) {
-            int n1 = n - i;
-            if (n1 > max)
-                n1 = max;
-
-            begin_op();
-            ilock(f->ip);
-            int r = writei(f->ip, addr + i, f->off, n1);
-            if (r > 0)
-                f->off += r;
-            iunlock(f->ip);
-            end_op();
-
-            if (r < 0)
+    if (f->type == FD_PIPE)
+        return pipe_writev(f->pipe, iov, iovcnt);
+    if (f->type != FD_INODE)
+        panic("\tfile_writev: unsupported type.\n");
+
+    ssize_t tot = 0;
+    file_prefault(f, iov, iovcnt, *off, 0);
+    ilock(f->ip);
+    if (f->ip->type == T_DEV) {
+        for (int v = 0; v < iovcnt && tot >= 0; v++) {
+            int r = writei(f->ip, iov[v].iov_base, *off, iov[v].iov_len);
+            if (r < 0) {
+                tot = -1;
+            } else {
+                *off += r;
+                tot += r;
+            }
+        }
+        iunlock(f->ip);
+        return tot;
+    }
+    iunlock(f->ip);
+
+    // Write a few blocks per transaction to avoid exceeding the maximum
+    // log transaction size, including i-node, indirect block, allocation
+    // blocks, and 2 blocks of slop for non-aligned writes. The bytes of
+    // consecutive buffers land next to each other in the file, so the
+    // bound holds for any number of them.
+    size_t max = ((MAXOPBLOCKS - 4) / 2) * BSIZE;
+    int v = 0;
+    size_t done = 0;  // Written of iov[v]
+    while (v < iovcnt) {
+        int r = 0;
+        begin_op();
+        ilock(f->ip);
+        for (size_t room = max; v < iovcnt && room; ) {
+            size_t n1 = MIN(iov[v].iov_len - done, room);
+            if (n1 && (r = writei(f->ip, (char*)iov[v].iov_base + done, *off, n1)) < 0)
                 break;
-            if (r != n1)
-                panic("\tfile_write: partial data written.\n");
-            i += r;
+            if (n1 && r != n1) {  // The buffer faulted
+                *off += r;
+                tot += r;
+                r = -1;
+                break;
+            }
+            *off += n1;
+            tot += n1;
+            done += n1;
+            room -= n1;
+            if (done == iov[v].iov_len) {
+                v++;
+                done = 0;
+            }
         }
-        return i == n ? n : -1;
+        iunlock(f->ip);
+        end_op();
+        if (r < 0)
+            return tot ? tot : -1;
+        pcache_throttle();
     }
-    panic("\tfile_write: unsupported type.\n");
+    return tot;
+}
+
+ssize_t file_writev(struct file* f, struct iovec* iov, int iovcnt)
+{
+    return file_writev_at(f, iov, iovcnt, &f->off);
+}
+
+/* Write to file f at off, leaving its offset alone, as pwrite() does. */
+ssize_t file_pwrite(struct file* f, char* addr, size_t n, size_t off)
+{
+    struct iovec v = {addr, n};
+    if (f->type != FD_INODE)
+        return -1;
+    return file_writev_at(f, &v, 1, &off) == n ? n : -1;
+}
+
+/*
+ * Write to file f.
+ */
+ssize_t file_write(struct file* f, char* addr, ssize_t n)
+{
+    struct iovec v = {addr, n};
+    return file_writev(f, &v, 1) == n ? n : -1;
+}
+
+/*
+ * Put what was written to f on disk, as fsync() does: its dirty
+ * pages, then the log with its size and blocks.
+ */
+int file_sync(struct file* f)
+{
+    if (f->type != FD_INODE)
+        return -1;
+    pcache_flush(f->ip);
+    log_force();
     return 0;
 }
+
+/*
+ * Move up to n bytes between the user memory at u and a device whose
+ * state lk guards, a page at a time through a kernel buffer: user
+ * memory may fault, and a fault may sleep, so it is only touched with
+ * lk released. With lk held, xfer(buf, m, arg) takes the m bytes just
+ * copied in from u if write, or else puts up to m bytes in buf for the
+ * copy out to u, and returns how many; fewer than m ends the transfer.
+ * Returns the bytes moved, or -1 if none were and xfer or a copy failed.
+ */
+ssize_t dev_bounce(struct spinlock* lk, char* u, size_t n, int write,
+                   ssize_t (*xfer)(char*, size_t, void*), void* arg)
+{
+    char* buf = kalloc();
+    if (!buf)
+        return -1;
+    ssize_t tot = 0, r;
+    size_t m;
+    do {
+        m = MIN(n - tot, PGSIZE);
+        if (write && copy_user(buf, u + tot, m) < 0) {
+            r = -1;
+        } else {
+            acquire(lk);
+            r = xfer(buf, m, arg);
+            release(lk);
+        }
+        if (r > 0 && !write && copy_user(u + tot, buf, r) < 0)
+            r = -1;
+        if (r < 0) {
+            if (!tot)
+                tot = -1;
+            break;
+        }
+        tot += r;
+    } while (r == m && tot < n);
+    kfree(buf);
+    return tot;
+}
+
+/*
+ * Per-process fd tables. A table starts with the NOFILE fds inside
+ * its struct files, and doubles into kalloc_pages() memory whenever
+ * it runs out, up to NOFILE_MAX. A bit per fd in fdmap tells which
+ * are open, so finding the lowest free one takes a word at a time.
+ */
+
+// kalloc_pages() order of a table of n fds with its bitmap.
+static int fd_order(int n)
+{
+    size_t size = n * sizeof(struct file*) + n / 8;
+    int order = 0;
+    while ((PGSIZE << order) < size)
+        order++;
+    return order;
+}
+
+// An empty table.
+struct files* files_alloc()
+{
+    struct files* t = kmem_cache_alloc(files_cache);
+    if (!t)
+        return NULL;
+    memset(t, 0, sizeof(*t));
+    t->ref = 1;
+    initlock_unlisted(&t->lock, "files");
+    t->nofile = NOFILE;
+    t->ofile = t->ofile0;
+    t->fdmap = t->fdmap0;
+    return t;
+}
+
+// Grow t to at least n fds. Caller holds t->lock.
+static int fd_grow(struct files* t, int n)
+{
+    int nofile = t->nofile;
+    while (nofile < n)
+        nofile *= 2;
+    if (nofile > NOFILE_MAX)
+        return -1;
+
+    int order = fd_order(nofile);
+    char* mem = kalloc_pages(order);
+    if (!mem)
+        return -1;
+    memset(mem, 0, PGSIZE << order);
+    struct file** ofile = (struct file**)mem;
+    uint64_t* fdmap = (uint64_t*)(ofile + nofile);
+    memmove(ofile, t->ofile, t->nofile * sizeof(*ofile));
+    memmove(fdmap, t->fdmap, t->nofile / 8);
+
+    if (t->ofile != t->ofile0)
+        kfree_pages((char*)t->ofile, fd_order(t->nofile));
+    t->nofile = nofile;
+    t->ofile = ofile;
+    t->fdmap = fdmap;
+    return 0;
+}
+
+// A table with the open files of t, for fork().
+struct files* files_copy(struct files* t)
+{
+    struct files* nt = files_alloc();
+    if (!nt)
+        return NULL;
+    acquire(&t->lock);
+    if (t->nofile > nt->nofile && fd_grow(nt, t->nofile) < 0) {
+        release(&t->lock);
+        kmem_cache_free(files_cache, nt);
+        return NULL;
+    }
+    for (int w = 0; w < t->nofile / 64; w++) {
+        for (uint64_t m = t->fdmap[w]; m; m &= m - 1) {
+            int fd = w * 64 + __builtin_ctzll(m);
+            nt->ofile[fd] = file_dup(t->ofile[fd]);
+        }
+        nt->fdmap[w] = t->fdmap[w];
+    }
+    release(&t->lock);
+    return nt;
+}
+
+// Drop a reference to t, closing its files with the last one.
+void files_put(struct files* t)
+{
+    if (__atomic_sub_fetch(&t->ref, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    for (int w = 0; w < t->nofile / 64; w++) {
+        for (uint64_t m = t->fdmap[w]; m; m &= m - 1)
+            file_close(t->ofile[w * 64 + __builtin_ctzll(m)]);
+    }
+    if (t->ofile != t->ofile0)
+        kfree_pages((char*)t->ofile, fd_order(t->nofile));
+    kmem_cache_free(files_cache, t);
+}
+
+/*
+ * The open file at fd of p, or 0. It comes with a reference of its
+ * own, since another thread may close fd meanwhile: file_close() it.
+ */
+struct file* fd_get(struct proc* p, uint64_t fd)
+{
+    struct files* t = p->files;
+    if (!t)
+        return 0;
+    acquire(&t->lock);
+    struct file* f = fd < t->nofile ? t->ofile[fd] : 0;
+    if (f)
+        file_dup(f);
+    release(&t->lock);
+    return f;
+}
+
+/*
+ * Give f the lowest free fd of p no less than from, growing the table
+ * if need be. Takes over the file reference from caller on success.
+ */
+int fd_alloc(struct proc* p, struct file* f, int from)
+{
+    struct files* t = p->files;
+    acquire(&t->lock);
+    for (;;) {
+        for (int w = from / 64; w < t->nofile / 64; w++) {
+            uint64_t free = ~t->fdmap[w];
+            if (w == from / 64)
+                free &= ~0ULL << (from % 64);
+            if (free) {
+                int fd = w * 64 + __builtin_ctzll(free);
+                t->fdmap[w] |= 1ULL << (fd % 64);
+                t->ofile[fd] = f;
+                release(&t->lock);
+                return fd;
+            }
+        }
+        if (fd_grow(t, MAX(t->nofile + 1, from + 1)) < 0) {
+            release(&t->lock);
+            return -1;
+        }
+    }
+}
+
+// Take the open file at fd out of p, and return it, or 0 if none.
+struct file* fd_remove(struct proc* p, uint64_t fd)
+{
+    struct files* t = p->files;
+    acquire(&t->lock);
+    struct file* f = fd < t->nofile ? t->ofile[fd] : 0;
+    if (f) {
+        t->ofile[fd] = 0;
+        t->fdmap[fd / 64] &= ~(1ULL << (fd % 64));
+    }
+    release(&t->lock);
+    return f;
+}
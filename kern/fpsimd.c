@@ -0,0 +1,71 @@
+#include "fpsimd.h"
+
+#include "arm.h"
+#include "proc.h"
+#include "string.h"
+#include "sysregs.h"
+
+/*
+ * Lazy FP/SIMD switching. A process starts every turn on a CPU with
+ * its EL0 FP/SIMD accesses trapped; if it makes one, fpsimd_trap()
+ * loads its registers, unless this CPU still holds them from its last
+ * turn here, and lets it run untrapped. When it gives up the CPU, the
+ * registers are saved back only if it did. A process that never uses
+ * them costs nothing, and one that keeps the CPU to itself reloads
+ * nothing.
+ *
+ * p->fpcpu is the CPU whose registers last got loaded with p->fp, and
+ * c->fpowner the process whose registers c last loaded: both have to
+ * agree for the registers to still be p's.
+ */
+
+static int
+fp_live()
+{
+    return (rcpacr() & CPACR_FP_EN) == CPACR_FP_EN;
+}
+
+/* p made an FP/SIMD access at EL0 while it was trapped. */
+void
+fpsimd_trap(struct proc* p)
+{
+    struct cpu* c = thiscpu;
+    int id = cpuid();
+
+    lcpacr(rcpacr() | CPACR_FP_EN);
+    if (c->fpowner != p || p->fpcpu != id) {
+        fp_restore(&p->fp);
+        c->fpowner = p;
+        p->fpcpu = id;
+    }
+}
+
+/* p gives up this CPU: save its registers if it used them. */
+void
+fpsimd_switch_out(struct proc* p)
+{
+    if (!fp_live())
+        return;
+    fp_save(&p->fp);
+    lcpacr((rcpacr() & ~CPACR_FP_EN) | CPACR_FP_EL1);
+}
+
+/* Give np, being forked from p, the registers of p. */
+void
+fpsimd_fork(struct proc* np, struct proc* p)
+{
+    if (fp_live())
+        fp_save(&p->fp);
+    np->fp = p->fp;
+    np->fpcpu = -1;
+}
+
+/* Start p, exec()ing a new program, with zeroed registers. */
+void
+fpsimd_exec(struct proc* p)
+{
+    if (fp_live())
+        lcpacr((rcpacr() & ~CPACR_FP_EN) | CPACR_FP_EL1);
+    memset(&p->fp, 0, sizeof(p->fp));
+    p->fpcpu = -1;
+}
@@ -16,17 +16,31 @@
 #include "buf.h"
 #include "console.h"
 #include "file.h"
+#include "kalloc.h"
+#include "kstat.h"
 #include "log.h"
+#include "mm.h"
 #include "mmu.h"
+#include "pcache.h"
 #include "proc.h"
+#include "rwlock.h"
+#include "sd.h"
+#include "seqlock.h"
+#include "slab.h"
 #include "sleeplock.h"
 #include "spinlock.h"
 #include "string.h"
 #include "types.h"
+#include "vm.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+#define ICACHE_FRAC 64 /* Let the inode cache grow to 1/ICACHE_FRAC of free memory */
+#define DIRECT_ORDER 3 /* readi_direct() moves up to 2^DIRECT_ORDER pages of bufs */
+
 static void itrunc(struct inode*);
+static void dcache_init();
+static void dcache_purge(uint32_t, uint32_t);
 
 // There should be one superblock per disk device,
 // but we run with only one device.
@@ -44,13 +58,14 @@ readsb(int dev, struct superblock* sb)
 }
 
 /*
- * Zero a block.
+ * Zero a block. Its old contents do not matter, so it is not read.
  */
 static void
 bzero(int dev, int bno)
 {
-    struct buf* b = bread(dev, bno);
+    struct buf* b = bgetblk(dev, bno);
     memset(b->data, 0, BSIZE);
+    b->flags |= B_VALID;
     log_write(b);
     brelse(b);
 }
@@ -58,21 +73,149 @@ bzero(int dev, int bno)
 /* Blocks. */
 
 /*
- * Allocate a zeroed disk block.
+ * In-memory summary of the free bitmap: how many blocks each bitmap
+ * block has free, so that full ones are skipped without reading
+ * them, and where the last allocation without a goal ended.
+ *
+ * The card erases sectors of eunit blocks, from block efirst on.
+ * Allocations without a goal fill one wholly free sector after the
+ * other, so that files freed later free whole sectors, which
+ * bdiscard() then erases.
+ */
+static struct {
+    struct spinlock lock;
+    int nbmap;         // Number of bitmap blocks
+    uint16_t* nfree;   // Free blocks under each bitmap block
+    uint32_t cursor;   // Where to start when there is no goal
+    uint32_t eunit;    // Blocks per erase sector, 0 if not erasing
+    uint32_t efirst;   // First block that starts one
+} bsum;
+
+/*
+ * Count the free blocks of each bitmap block. Run after log
+ * recovery, so that the bitmap is up to date.
+ */
+static void
+bsum_init(int dev)
+{
+    initlock(&bsum.lock, "bsum");
+    bsum.nbmap = (sb.size + BPB - 1) / BPB;
+    if (bsum.nbmap * sizeof(uint16_t) > PGSIZE || !(bsum.nfree = (uint16_t*)kalloc()))
+        panic("\tbsum_init: cannot track %d bitmap blocks.\n", bsum.nbmap);
+
+    uint32_t nfree = 0;
+    for (int i = 0; i < bsum.nbmap; ++i) {
+        struct buf* bp = bread(dev, sb.bmapstart + i);
+        bsum.nfree[i] = 0;
+        for (int bi = 0; bi < BPB && i * BPB + bi < sb.size; ++bi)
+            if (!(bp->data[bi / 8] & (1 << (bi % 8)))) bsum.nfree[i]++;
+        nfree += bsum.nfree[i];
+        brelse(bp);
+    }
+    bsum.cursor = sb.size - sb.nblocks;
+
+    // Only sectors that fit in a bitmap block are worth the trouble.
+    bsum.eunit = sd_erase_unit(dev, &bsum.efirst);
+    if (bsum.eunit < 8 || bsum.eunit > BPB) bsum.eunit = 0;
+    cprintf("bsum_init: %d free blocks, erase sectors of %d.\n", nfree, bsum.eunit);
+}
+
+/* Are blocks [b, b + n) all free? */
+static int
+bfree_range(uint32_t dev, uint32_t b, uint32_t n)
+{
+    struct buf* bp = NULL;
+    int ok = 1;
+    for (uint32_t i = b; ok && i < b + n; ++i) {
+        if (!bp || bp->blockno != BBLOCK(i, sb)) {
+            if (bp) brelse(bp);
+            bp = bread(dev, BBLOCK(i, sb));
+        }
+        ok = !(bp->data[(i % BPB) / 8] & (1 << (i % 8)));
+    }
+    if (bp) brelse(bp);
+    return ok;
+}
+
+/* First erase sector at or after block b, which may start one. */
+static uint32_t
+bsector(uint32_t b)
+{
+    if (b <= bsum.efirst) return bsum.efirst;
+    return b + (bsum.eunit - (b - bsum.efirst) % bsum.eunit) % bsum.eunit;
+}
+
+/*
+ * The first wholly free erase sector from block from on, wrapping
+ * around, or 0 if there is none. Sectors that straddle bitmap
+ * blocks are passed over.
+ */
+static uint32_t
+bsector_free(uint32_t dev, uint32_t from)
+{
+    uint32_t unit = bsum.eunit;
+    int start = from / BPB;
+    for (int k = 0; k <= bsum.nbmap; ++k) {
+        int i = (start + k) % bsum.nbmap;
+        if (bsum.nfree[i] < unit) continue;  // A hint, rechecked below.
+
+        struct buf* bp = bread(dev, sb.bmapstart + i);
+        uint32_t end = MIN((uint32_t)(i + 1) * BPB, sb.size);
+        for (uint32_t g = bsector(k ? i * BPB : from); g + unit <= end; g += unit) {
+            uint32_t j = 0;
+            while (j < unit && !(bp->data[(g + j) % BPB / 8] & (1 << ((g + j) % 8)))) ++j;
+            if (j == unit) {
+                brelse(bp);
+                return g;
+            }
+        }
+        brelse(bp);
+    }
+    return 0;
+}
+
+/*
+ * Allocate a zeroed disk block, at goal or as soon after it as
+ * possible, so that a file's blocks end up next to each other.
+ * Without a goal, continue where the last such allocation left off,
+ * or in the next wholly free erase sector once that one is full.
  */
 static uint32_t
-balloc(uint32_t dev)
+balloc(uint32_t dev, uint32_t goal)
 {
-    for (int b = 0; b < sb.size; b += BPB) {
-        struct buf* bp = bread(dev, BBLOCK(b, sb));
-        for (int bi = 0; bi < BPB && b + bi < sb.size; ++bi) {
+    int nogoal = !goal || goal >= sb.size;
+    if (nogoal) {
+        goal = bsum.cursor;
+        if (bsum.eunit && (goal == bsector(goal) || !bfree_range(dev, goal, 1))) {
+            uint32_t g = bsector_free(dev, goal);
+            if (g) goal = g;
+        }
+    }
+
+    // Start with the rest of goal's bitmap block and wrap around,
+    // coming back to its beginning last.
+    int start = goal / BPB;
+    for (int k = 0; k <= bsum.nbmap; ++k) {
+        int i = (start + k) % bsum.nbmap;
+        if (!bsum.nfree[i]) continue;  // A hint, rechecked below.
+
+        struct buf* bp = bread(dev, sb.bmapstart + i);
+        for (int bi = k ? 0 : goal % BPB; bi < BPB && i * BPB + bi < sb.size; ++bi) {
+            if (bp->data[bi / 8] == 0xff) {  // Skip full bytes.
+                bi |= 7;
+                continue;
+            }
             int m = 1 << (bi % 8);
             if (!(bp->data[bi / 8] & m)) {  // Is block free?
                 bp->data[bi / 8] |= m;      // Mark block in use.
                 log_write(bp);
+                acquire(&bsum.lock);
+                bsum.nfree[i]--;
+                if (nogoal || goal == bsum.cursor) bsum.cursor = i * BPB + bi + 1;
+                release(&bsum.lock);
                 brelse(bp);
-                bzero(dev, b + bi);
-                return b + bi;
+                bzero(dev, i * BPB + bi);
+                return i * BPB + bi;
             }
         }
         brelse(bp);
@@ -93,7 +236,34 @@ bfree(int dev, uint32_t b)
     if (!(bp->data[bi / 8] & m)) panic("\tbfree: freeing a free block.\n");
     bp->data[bi / 8] &= ~m;
     log_write(bp);
+    acquire(&bsum.lock);
+    bsum.nfree[b / BPB]++;
+    release(&bsum.lock);
     brelse(bp);
+    if (bsum.eunit) log_discard(b);
+}
+
+/*
+ * Erase the sectors around blocks [start, start + n) that are
+ * wholly free, now that their freeing has committed. Called by
+ * the log flusher, while no FS system call can run.
+ */
+void
+bdiscard(uint32_t dev, uint32_t start, uint32_t n)
+{
+    uint32_t unit = bsum.eunit, run = 0, nrun = 0;
+    if (!unit) return;
+    uint32_t s = start < bsum.efirst ? bsum.efirst : bsector(start + 1) - unit;
+    for (; s < start + n && s + unit <= sb.size; s += unit) {
+        if (bfree_range(dev, s, unit)) {
+            if (!nrun) run = s;
+            nrun += unit;
+            continue;
+        }
+        sd_discard(dev, run, nrun);
+        nrun = 0;
+    }
+    sd_discard(dev, run, nrun);
 }
 
 /*
@@ -123,7 +293,8 @@ bfree(int dev, uint32_t b)
  *   the reference and link counts have fallen to zero.
  *
  * * Referencing in cache: an entry in the inode cache
- *   is free if ip->ref is zero. Otherwise ip->ref tracks
+ *   is unused if ip->ref is zero, and may then be recycled
+ *   for another inode. Otherwise ip->ref tracks
  *   the number of in-memory pointers to the entry (open
  *   files and current directories). iget() finds or
  *   creates a cache entry and increments its ref; iput()
@@ -133,7 +304,7 @@ bfree(int dev, uint32_t b)
  *   cache entry is only correct when ip->valid is 1.
  *   ilock() reads the inode from
  *   the disk and sets ip->valid, while iput() clears
- *   ip->valid if ip->ref has fallen to zero.
+ *   ip->valid when it frees the inode.
  *
  * * Locked: file system code may only examine and modify
  *   the information in an inode and its content if it
@@ -157,37 +328,120 @@ bfree(int dev, uint32_t b)
  * have locked the inodes involved; this lets callers create
  * multi-step atomic operations.
  *
- * The icache.lock spin-lock protects the allocation of icache
- * entries. Since ip->ref indicates whether an entry is free,
+ * The icache.lock reader-writer lock protects the allocation of
+ * icache entries. Since ip->ref indicates whether an entry is free,
  * and ip->dev and ip->inum indicate which i-node an entry
  * holds, one must hold icache.lock while using any of those fields.
+ * Lookups of inodes in use, the common case, only read the hash
+ * chains and bump ip->ref, so they hold it for reading and bump with
+ * an atomic add; ip->ref cannot drop to 0 meanwhile, as only holders
+ * for writing decrement it.
+ *
+ * Inodes are hashed by (dev, inum) and allocated from a slab cache
+ * until there are icache.max of them, derived from free memory by
+ * iinit(). An inode whose last reference goes away stays hashed,
+ * with its contents still valid, on an LRU list; iget() takes it back
+ * from there without reading the disk, and a miss with the cache
+ * full recycles the least recently used one.
  *
  * An ip->lock sleep-lock protects all ip-> fields other than ref,
  * dev, and inum.  One must hold ip->lock in order to
  * read or write that inode's ip->valid, ip->size, ip->type, &c.
  */
 
-struct {
-    struct spinlock lock;
-    struct inode inode[NINODE];
+static struct {
+    struct rwlock lock;
+    struct kmem_cache* cache;
+    int n;                  // Inodes allocated
+    int max;                // Upper bound on n, unless all are in use
+    int nbucket;            // Power of two
+    struct inode** bucket;
+    struct inode lru;       // Head of the LRU list, least recently used last
+    int nlru;               // Inodes on the LRU list
+
+    uint64_t nget;   // iget() calls, counted with atomics
+    uint64_t nmiss;  // iget() calls that had to set up an inode
 } icache;
 
+static uint64_t ishrink(uint64_t);
+static int icache_stat(char*, size_t);
+
 void
 iinit(int dev)
 {
-    initlock(&icache.lock, "icache");
-    for (int i = 0; i < NINODE; ++i)
-        initsleeplock(&icache.inode[i].lock, "inode");
+    initrwlock(&icache.lock, "icache");
+    icache.cache = kmem_cache_create("inode", sizeof(struct inode));
+    if (!icache.cache) panic("\tiinit: failed to create inode cache.\n");
+
+    icache.max = kmem_free_pages() / ICACHE_FRAC * PGSIZE / sizeof(struct inode);
+    icache.max = MAX(icache.max, NINODE);
+
+    // About two inodes per bucket, in at most a MAX_ORDER block.
+    int order = 0;
+    icache.nbucket = PGSIZE / sizeof(struct inode*);
+    while (icache.nbucket * 2 < icache.max && order < MAX_ORDER) {
+        icache.nbucket *= 2;
+        order++;
+    }
+    if (!(icache.bucket = (struct inode**)kalloc_pages(order)))
+        panic("\tiinit: failed to allocate hash table.\n");
+    memset(icache.bucket, 0, icache.nbucket * sizeof(struct inode*));
+    icache.lru.lprev = icache.lru.lnext = &icache.lru;
+    kmem_register_shrinker(ishrink);
+    kstat_register(KSTAT_ICACHE, icache_stat);
 
     readsb(dev, &sb);
     cprintf(
         "super block: size %d nblocks %d ninodes %d nlog %d logstart %d inodestart %d bmapstart %d\n",
         sb.size, sb.nblocks, sb.ninodes, sb.nlog, sb.logstart, sb.inodestart,
         sb.bmapstart);
+    bsum_init(dev);
+    dcache_init();
+    pcache_start();
 
+    cprintf("iinit: up to %d inodes, %d buckets.\n", icache.max, icache.nbucket);
     cprintf("iinit: success.\n");
 }
 
+static inline struct inode**
+ihash(uint32_t dev, uint32_t inum)
+{
+    return &icache.bucket[((inum * 2654435761u) ^ dev) & (icache.nbucket - 1)];
+}
+
+/* Take ip off its hash chain.  Caller holds icache.lock. */
+static void
+iunhash(struct inode* ip)
+{
+    struct inode** pp = ihash(ip->dev, ip->inum);
+    while (*pp != ip) pp = &(*pp)->hnext;
+    *pp = ip->hnext;
+}
+
+/* Caller holds icache.lock. */
+static void
+ilru_del(struct inode* ip)
+{
+    ip->lprev->lnext = ip->lnext;
+    ip->lnext->lprev = ip->lprev;
+    icache.nlru--;
+}
+
+/*
+ * Put ip on the LRU list, at the front unless it holds nothing
+ * worth keeping.  Caller holds icache.lock.
+ */
+static void
+ilru_add(struct inode* ip)
+{
+    struct inode* at = ip->valid ? &icache.lru : icache.lru.lprev;
+    ip->lnext = at->lnext;
+    ip->lprev = at;
+    at->lnext->lprev = ip;
+    at->lnext = ip;
+    icache.nlru++;
+}
+
 static struct inode* iget(uint32_t, uint32_t);
 
 /*
@@ -245,29 +499,56 @@ iupdate(struct inode* ip)
 static struct inode*
 iget(uint32_t dev, uint32_t inum)
 {
-    acquire(&icache.lock);
+    __atomic_fetch_add(&icache.nget, 1, __ATOMIC_RELAXED);
 
-    // Is the inode already cached?
-    struct inode* empty = NULL;
-    for (int i = 0; i < NINODE; ++i) {
-        struct inode* ip = &icache.inode[i];
-        if (ip->ref > 0 && ip->dev == dev && ip->inum == inum) {
-            ip->ref++;
-            release(&icache.lock);
+    // Is the inode already cached and in use?
+    struct inode* ip;
+    read_acquire(&icache.lock);
+    for (ip = *ihash(dev, inum); ip; ip = ip->hnext) {
+        if (ip->dev == dev && ip->inum == inum && ip->ref) {
+            __atomic_fetch_add(&ip->ref, 1, __ATOMIC_RELAXED);
+            read_release(&icache.lock);
             return ip;
         }
-        if (!empty && !ip->ref) empty = ip;  // remember empty slot
     }
+    read_release(&icache.lock);
 
-    // Recycle an inode cache entry.
-    if (!empty) panic("\tiget: no inodes.\n");
+    // Look again, as anything may have happened since.
+    write_acquire(&icache.lock);
+    for (ip = *ihash(dev, inum); ip; ip = ip->hnext) {
+        if (ip->dev == dev && ip->inum == inum) {
+            if (!ip->ref++) ilru_del(ip);
+            write_release(&icache.lock);
+            return ip;
+        }
+    }
+    icache.nmiss++;
+
+    // Allocate a new entry, or recycle the least recently used one.
+    ip = NULL;
+    if (icache.n < icache.max || !icache.nlru) {
+        if ((ip = kmem_cache_alloc(icache.cache))) {
+            memset(ip, 0, sizeof(*ip));
+            initsleeplock(&ip->lock, "inode");
+            icache.n++;
+        } else if (!icache.nlru)
+            panic("\tiget: no inodes.\n");
+    }
+    if (!ip) {
+        ip = icache.lru.lprev;
+        ilru_del(ip);
+        iunhash(ip);
+        pcache_purge(ip);
+    }
 
-    struct inode* ip = empty;
     ip->dev = dev;
     ip->inum = inum;
     ip->ref = 1;
     ip->valid = 0;
-    release(&icache.lock);
+    struct inode** h = ihash(dev, inum);
+    ip->hnext = *h;
+    *h = ip;
+    write_release(&icache.lock);
     return ip;
 }
 
@@ -278,9 +559,9 @@ iget(uint32_t dev, uint32_t inum)
 struct inode*
 idup(struct inode* ip)
 {
-    acquire(&icache.lock);
-    ip->ref++;
-    release(&icache.lock);
+    read_acquire(&icache.lock);
+    __atomic_fetch_add(&ip->ref, 1, __ATOMIC_RELAXED);
+    read_release(&icache.lock);
     return ip;
 }
 
@@ -307,6 +588,8 @@ ilock(struct inode* ip)
         ip->nlink = dip->nlink;
         ip->size = dip->size;
         memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+        ip->leaf = 0;
+        ip->goal = 0;
         ip->valid = 1;
         brelse(bp);
     }
@@ -336,25 +619,65 @@ iunlock(struct inode* ip)
 void
 iput(struct inode* ip)
 {
-    acquire(&icache.lock);
+    write_acquire(&icache.lock);
     if (ip->ref == 1 && ip->valid && !ip->nlink) {
         // ip->ref == 1 means no other process can have ip locked,
         // so this acquiresleep() won't block (or deadlock).
         acquiresleep(&ip->lock);
-        release(&icache.lock);
+        write_release(&icache.lock);
 
         // inode has no links and no other references: truncate and free.
         itrunc(ip);
         ip->type = 0;
         iupdate(ip);
         ip->valid = 0;
+        dcache_purge(ip->dev, ip->inum);
+        pcache_purge(ip);
 
         releasesleep(&ip->lock);
-        acquire(&icache.lock);
+        write_acquire(&icache.lock);
+    }
+
+    if (!--ip->ref) ilru_add(ip);
+    write_release(&icache.lock);
+}
+
+/*
+ * Memory-pressure hook called by kalloc(): free unreferenced inodes,
+ * least recently used first, worth about npages pages.
+ */
+static uint64_t
+ishrink(uint64_t npages)
+{
+    // kalloc() may be called from iget() itself.
+    if (write_holding(&icache.lock) || holding(&icache.cache->lock)) return 0;
+
+    uint64_t want = npages * (PGSIZE / icache.cache->size), freed = 0;
+
+    write_acquire(&icache.lock);
+    while (freed < want && icache.nlru && icache.n > NINODE) {
+        struct inode* ip = icache.lru.lprev;
+        ilru_del(ip);
+        iunhash(ip);
+        pcache_purge(ip);
+        icache.n--;
+        kmem_cache_free(icache.cache, ip);
+        freed++;
     }
+    write_release(&icache.lock);
+    return freed * icache.cache->size / PGSIZE;
+}
 
-    ip->ref--;
-    release(&icache.lock);
+static int
+icache_stat(char* buf, size_t n)
+{
+    read_acquire(&icache.lock);
+    int len = snprintf(
+        buf, n, "inodes %d max %d unused %d buckets %d get %lld miss %lld\n",
+        icache.n, icache.max, icache.nlru, icache.nbucket, icache.nget,
+        icache.nmiss);
+    read_release(&icache.lock);
+    return len;
 }
 
 /*
@@ -373,38 +696,113 @@ iunlockput(struct inode* ip)
  * The content (data) associated with each inode is stored
  * in blocks on the disk. The first NDIRECT block numbers
  * are listed in ip->addrs[].  The next NINDIRECT blocks are
- * listed in block ip->addrs[NDIRECT].
- *
- * Return the disk block address of the nth block in inode ip.
- * If there is no such block, bmap allocates one.
+ * listed in block ip->addrs[NDIRECT], the NDINDIRECT after
+ * those in a two-level tree of indirect blocks rooted at
+ * ip->addrs[NDIRECT + 1], and the NTINDIRECT after those in a
+ * three-level tree rooted at ip->addrs[NDIRECT + 2].
+ */
+
+/*
+ * Allocate a block for ip right after the one it got last, or
+ * after the block in front of the ones being written.
+ */
+static uint32_t
+iballoc(struct inode* ip)
+{
+    uint32_t b = balloc(ip->dev, ip->goal);
+    ip->goal = b + 1;
+    return b;
+}
+
+/*
+ * Return entry i of indirect block addr, allocating a block for
+ * it if alloc is set and it is missing.
  */
 static uint32_t
-bmap(struct inode* ip, uint32_t bn)
+bmap_ind(struct inode* ip, uint32_t addr, uint32_t i, int alloc)
 {
+    struct buf* bp = bread(ip->dev, addr);
+    uint32_t* a = (uint32_t*)bp->data;
+    addr = a[i];
+    if (!addr && alloc) {
+        a[i] = addr = iballoc(ip);
+        log_write(bp);
+    }
+    brelse(bp);
+    return addr;
+}
+
+/*
+ * Return the disk block address of the nth block in inode ip.
+ * If there is no such block, bmap allocates one if alloc is set,
+ * and returns 0 otherwise.
+ *
+ * The last indirect block that maps data blocks is remembered in
+ * ip->leaf, so that walking a large file costs one lookup per
+ * block rather than one per level.
+ */
+uint32_t
+bmap(struct inode* ip, uint32_t bn, int alloc)
+{
+    // First allocation since the inode was loaded: aim next to the
+    // previous block of the file.
+    if (alloc && !ip->goal && bn) {
+        uint32_t prev = bmap(ip, bn - 1, 0);
+        ip->goal = prev ? prev + 1 : 0;
+    }
+
     if (bn < NDIRECT) {
         // Load direct block, allocating if necessary.
         uint32_t addr = ip->addrs[bn];
-        if (!addr) ip->addrs[bn] = addr = balloc(ip->dev);
+        if (!addr && alloc) ip->addrs[bn] = addr = iballoc(ip);
         return addr;
     }
-    bn -= NDIRECT;
-
-    if (bn < NINDIRECT) {
-        // Load indirect block, allocating if necessary.
-        uint32_t addr = ip->addrs[NDIRECT];
-        if (!addr) ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-        struct buf* bp = bread(ip->dev, addr);
-        uint32_t* a = (uint32_t*)bp->data;
-        addr = a[bn];
-        if (!addr) {
-            a[bn] = addr = balloc(ip->dev);
-            log_write(bp);
-        }
-        brelse(bp);
-        return addr;
+
+    if (ip->leaf && bn - ip->leaf_bn < NINDIRECT)
+        return bmap_ind(ip, ip->leaf, bn - ip->leaf_bn, alloc);
+
+    // Find the tree bn falls in, and the number of blocks it maps.
+    uint32_t fbn = bn, span = NINDIRECT;
+    int level = 0;
+    for (bn -= NDIRECT; bn >= span; span *= NINDIRECT) {
+        bn -= span;
+        if (++level > 2) panic("\tbmap: out of range.\n");
     }
-    panic("\tbmap: out of range.\n");
-    return 0;
+
+    // Load indirect blocks, allocating if necessary.
+    uint32_t addr = ip->addrs[NDIRECT + level];
+    if (!addr) {
+        if (!alloc) return 0;
+        ip->addrs[NDIRECT + level] = addr = iballoc(ip);
+    }
+    for (span /= NINDIRECT; span > 1; span /= NINDIRECT) {
+        if (!(addr = bmap_ind(ip, addr, bn / span, alloc))) return 0;
+        bn %= span;
+    }
+
+    ip->leaf = addr;
+    ip->leaf_bn = fbn - bn;
+    return bmap_ind(ip, addr, bn, alloc);
+}
+
+/*
+ * Free indirect block addr and everything below it, level being
+ * the number of indirect levels under it.
+ */
+static void
+itrunc_ind(struct inode* ip, uint32_t addr, int level)
+{
+    struct buf* bp = bread(ip->dev, addr);
+    uint32_t* a = (uint32_t*)bp->data;
+    for (int j = 0; j < NINDIRECT; ++j) {
+        if (!a[j]) continue;
+        if (level)
+            itrunc_ind(ip, a[j], level - 1);
+        else
+            bfree(ip->dev, a[j]);
+    }
+    brelse(bp);
+    bfree(ip->dev, addr);
 }
 
 /*
@@ -425,17 +823,15 @@ itrunc(struct inode* ip)
         }
     }
 
-    if (ip->addrs[NDIRECT]) {
-        struct buf* bp = bread(ip->dev, ip->addrs[NDIRECT]);
-        uint32_t* a = (uint32_t*)bp->data;
-        for (int j = 0; j < NINDIRECT; ++j) {
-            if (a[j]) bfree(ip->dev, a[j]);
+    for (int level = 0; level < 3; ++level) {
+        if (ip->addrs[NDIRECT + level]) {
+            itrunc_ind(ip, ip->addrs[NDIRECT + level], level);
+            ip->addrs[NDIRECT + level] = 0;
         }
-        brelse(bp);
-        bfree(ip->dev, ip->addrs[NDIRECT]);
-        ip->addrs[NDIRECT] = 0;
     }
 
+    ip->leaf = 0;
+    ip->goal = 0;
     ip->size = 0;
     iupdate(ip);
 }
@@ -462,7 +858,7 @@ stati(struct inode* ip, struct stat* st)
 }
 
 /*
- * Read data from inode.
+ * Read data from inode. Returns the bytes read, short if dst faults.
  * Caller must hold ip->lock.
  */
 ssize_t
@@ -471,50 +867,143 @@ readi(struct inode* ip, char* dst, size_t off, size_t n)
     if (ip->type == T_DEV) {
         if (ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].read)
             return -1;
-        return devsw[ip->major].read(ip, dst, n);
+        return devsw[ip->major].read(ip, dst, off, n);
     }
 
     if (off > ip->size || off + n < off) return -1;
     if (off + n > ip->size) n = ip->size - off;
 
+    // Through the page cache, see pcache.c.
     for (size_t tot = 0, m = 0; tot < n; tot += m, off += m, dst += m) {
-        struct buf* bp = bread(ip->dev, bmap(ip, off / BSIZE));
-        m = min(n - tot, BSIZE - off % BSIZE);
-        memmove(dst, bp->data + off % BSIZE, m);
-        brelse(bp);
+        char* page = pcache_get(ip, off / PGSIZE);
+        if (!page) return tot ? tot : -1;
+        m = min(n - tot, PGSIZE - off % PGSIZE);
+        int bad = copy_user(dst, page + off % PGSIZE, m) < 0;
+        kpage_put(page);
+        if (bad) return tot ? tot : -1;
     }
     return n;
 }
 
 /*
- * Write data to inode.
+ * Read data from inode straight into the user memory at dst,
+ * bypassing the buffer cache, for files opened O_DIRECT.
+ *
+ * Whole blocks that are on disk and not cached are read from the
+ * card in runs. The driver moves each block into the user page that
+ * holds its destination, pinned with a reference until it is done, so
+ * that an munmap() by another thread cannot free it meanwhile. Partial
+ * blocks, holes, cached blocks (which may be newer than the disk),
+ * destinations that straddle pages or are not word-aligned or are in
+ * 2 MiB blocks, and runs for which mm->lock is not free go through
+ * readi() instead, as does the whole read if the file has dirty pages.
+ * mm->lock is only tried for, since faults take it before inode locks.
+ * Returns the bytes read, short if readi() falls short.
+ * Caller must hold ip->lock.
+ */
+ssize_t
+readi_direct(struct inode* ip, char* dst, size_t off, size_t n)
+{
+    if (off > ip->size || off + n < off) return -1;
+    if (off + n > ip->size) n = ip->size - off;
+
+    // The disk is behind a file with dirty pages.
+    struct buf* bufs = ip->ndirty ? NULL : (struct buf*)kalloc_pages(DIRECT_ORDER);
+    if (!bufs) return readi(ip, dst, off, n);
+    int max = (PGSIZE << DIRECT_ORDER) / sizeof(struct buf);
+    struct buf* run[max];
+    struct mm* mm = thisproc()->mm;
+    size_t tot = 0;
+
+    for (size_t m = 0; tot < n; tot += m, off += m, dst += m) {
+        int nb = 0;
+        int pin = off % BSIZE == 0 && tot + BSIZE <= n && tryacquiresleep(&mm->lock);
+        for (; pin && nb < max && tot + (nb + 1) * BSIZE <= n; nb++) {
+            char* u = dst + nb * BSIZE;
+            if ((uint64_t)u % 4 || (uint64_t)u % PGSIZE + BSIZE > PGSIZE)
+                break;
+            uint32_t addr = bmap(ip, off / BSIZE + nb, 0);
+            if (!addr || bcached(ip->dev, addr))
+                break;
+            char* ka = uva2ka_get(mm->pgdir, u);
+            if (!ka)
+                break;
+            struct buf* b = run[nb] = &bufs[nb];
+            b->flags = 0;
+            b->dev = ip->dev;
+            b->blockno = addr;
+            b->ext = (uint8_t*)ka;
+        }
+        if (pin)
+            releasesleep(&mm->lock);
+
+        if (nb) {
+            sd_rw_multi(run, nb);
+            for (int i = 0; i < nb; i++)
+                kpage_put((char*)ROUNDDOWN((uint64_t)run[i]->ext, PGSIZE));
+            m = nb * BSIZE;
+        } else {
+            m = min(n - tot, BSIZE - off % BSIZE);
+            ssize_t r = readi(ip, dst, off, m);
+            if (r != m) {  // Out of memory, or dst faulted
+                if (r > 0) tot += r;
+                break;
+            }
+        }
+    }
+    kfree_pages((char*)bufs, DIRECT_ORDER);
+    return tot || !n ? tot : -1;
+}
+
+/*
+ * Prefetch [off, off+n) of ip into the page cache. Nothing past the
+ * end of the file is read or allocated.
  * Caller must hold ip->lock.
  */
+void
+readahead(struct inode* ip, size_t off, size_t n)
+{
+    pcache_readahead(ip, off, n);
+}
+
+/*
+ * Write data to inode. Returns the bytes written, short if src
+ * faults. Caller must hold ip->lock.
+ */
 ssize_t
 writei(struct inode* ip, char* src, size_t off, size_t n)
 {
     if (ip->type == T_DEV) {
         if (ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].write)
             return -1;
-        return devsw[ip->major].write(ip, src, n);
+        return devsw[ip->major].write(ip, src, off, n);
     }
 
     if (off > ip->size || off + n < off) return -1;
     if (off + n > MAXFILE * BSIZE) return -1;
 
-    for (size_t tot = 0, m = 0; tot < n; tot += m, off += m, src += m) {
-        struct buf* bp = bread(ip->dev, bmap(ip, off / BSIZE));
-        m = min(n - tot, BSIZE - off % BSIZE);
-        memmove(bp->data + off % BSIZE, src, m);
-        log_write(bp);
-        brelse(bp);
+    // Regular files are written back later, see pcache.c.
+    ssize_t tot = pcache_write(ip, off, src, n);
+    if (tot < 0) {
+        // A block src faulted on is logged as it is, like the cache.
+        for (size_t m = tot = 0; tot < n; tot += m, off += m, src += m) {
+            struct buf* bp = bread(ip->dev, bmap(ip, off / BSIZE, 1));
+            m = min(n - tot, BSIZE - off % BSIZE);
+            int bad = copy_user(bp->data + off % BSIZE, src, m) < 0;
+            log_write(bp);
+            pcache_update(ip, off, (char*)bp->data + off % BSIZE, m);
+            brelse(bp);
+            if (bad) break;
+        }
+    } else {
+        off += tot;
     }
 
-    if (n > 0 && off > ip->size) {
+    if (tot > 0 && off > ip->size) {
         ip->size = off;
         iupdate(ip);
     }
-    return n;
+    return tot || !n ? tot : -1;
 }
 
 /* Directories. */
@@ -525,15 +1014,340 @@ namecmp(const char* s, const char* t)
     return strncmp(s, t, DIRSIZ);
 }
 
+/*
+ * Directory name cache.
+ *
+ * Remembers the result of dirlookup() by (dev, directory inum, name),
+ * including names that were not found (inum 0), so that resolving the
+ * same path again neither scans the directory nor reads its blocks.
+ * Entries are hashed for lookup and kept on a list for reuse.
+ *
+ * Lookups take no lock, so that path walks on different CPUs do not
+ * serialize: they read under dcache.lock, a seqlock, and retry if a
+ * change got in. The entries are never freed, so a lookup that races
+ * with one can follow a wrong chain but never a dangling pointer.
+ * Since a lookup cannot move its entry to the front of the list, it
+ * only marks it referenced, and reuse gives a referenced entry a
+ * second chance at the front instead.
+ *
+ * The cache is only valid as long as every change to a directory goes
+ * through dirlink() or dcache_remove(), both called with the directory
+ * locked, as is dirlookup().
+ */
+#define DCHASH 64
+
+struct dentry {
+    uint32_t dev;
+    uint32_t parent;        // Inum of the directory
+    char name[DIRSIZ];
+    uint32_t inum;          // 0 if name is not in the directory
+    uint32_t off;           // Byte offset of the dirent if inum != 0
+    uint8_t referenced;     // Looked up since it was last moved
+    struct dentry* hnext;   // Hash chain
+    struct dentry* prev;    // Reuse list, most recently used first
+    struct dentry* next;
+};
+
+static struct {
+    struct seqlock lock;
+    struct dentry entry[NDCACHE];
+    struct dentry* hash[DCHASH];
+    struct dentry lru;      // Head of the reuse list
+    uint64_t nhit, nneg, nmiss;  // Counted by lookups, with atomics
+    uint64_t nremove;
+} dcache;
+
+static int dcache_stat(char*, size_t);
+
+static void
+dcache_init()
+{
+    initseqlock(&dcache.lock, "dcache");
+    dcache.lru.prev = dcache.lru.next = &dcache.lru;
+    for (struct dentry* d = dcache.entry; d < dcache.entry + NDCACHE; d++) {
+        d->parent = 0;  // Unused, inum 0 is never a directory
+        d->next = dcache.lru.next;
+        d->prev = &dcache.lru;
+        dcache.lru.next->prev = d;
+        dcache.lru.next = d;
+    }
+    kstat_register(KSTAT_DCACHE, dcache_stat);
+}
+
+static uint32_t
+dcache_hash(uint32_t dev, uint32_t parent, char* name)
+{
+    uint32_t h = dev * 31 + parent;
+    for (int i = 0; i < DIRSIZ && name[i]; i++)
+        h = h * 31 + (uint8_t)name[i];
+    return h % DCHASH;
+}
+
+/* Move d to the front of the reuse list.  Caller holds dcache.lock. */
+static void
+dcache_touch(struct dentry* d)
+{
+    d->referenced = 0;
+    d->prev->next = d->next;
+    d->next->prev = d->prev;
+    d->next = dcache.lru.next;
+    d->prev = &dcache.lru;
+    dcache.lru.next->prev = d;
+    dcache.lru.next = d;
+}
+
+/* Unhash d and make it the next to be reused.  Caller holds dcache.lock. */
+static void
+dcache_drop(struct dentry* d)
+{
+    struct dentry** pp = &dcache.hash[dcache_hash(d->dev, d->parent, d->name)];
+    while (*pp != d) pp = &(*pp)->hnext;
+    *pp = d->hnext;
+    d->parent = 0;
+    d->referenced = 0;
+
+    d->prev->next = d->next;
+    d->next->prev = d->prev;
+    d->prev = dcache.lru.prev;
+    d->next = &dcache.lru;
+    dcache.lru.prev->next = d;
+    dcache.lru.prev = d;
+}
+
+/*
+ * Caller holds dcache.lock, or reads under it and checks the result
+ * with read_seqretry(). A chain changing under a reader may look
+ * endless, hence the bound.
+ */
+static struct dentry*
+dcache_find(struct inode* dp, char* name)
+{
+    struct dentry* d = dcache.hash[dcache_hash(dp->dev, dp->inum, name)];
+    for (int n = 0; d && n < NDCACHE; d = d->hnext, n++)
+        if (d->dev == dp->dev && d->parent == dp->inum &&
+            !namecmp(d->name, name))
+            return d;
+    return 0;
+}
+
+/*
+ * Look name up in the cache.  Return -1 if it is not cached,
+ * otherwise its inum, which is 0 if the name is known to be absent.
+ */
+static int
+dcache_lookup(struct inode* dp, char* name, size_t* poff)
+{
+    int inum;
+    uint32_t off, seq;
+    struct dentry* d;
+    do {
+        seq = read_seqbegin(&dcache.lock);
+        d = dcache_find(dp, name);
+        inum = d ? d->inum : -1;
+        off = d ? d->off : 0;
+    } while (read_seqretry(&dcache.lock, seq));
+
+    if (d) {
+        // Only a hint, so it does not matter if d was reused since.
+        __atomic_store_n(&d->referenced, 1, __ATOMIC_RELAXED);
+        if (inum && poff) *poff = off;
+    }
+    __atomic_fetch_add(inum > 0 ? &dcache.nhit : inum ? &dcache.nmiss : &dcache.nneg, 1, __ATOMIC_RELAXED);
+    return inum;
+}
+
+/* Record that name in dp is inum at byte offset off, or absent if inum is 0. */
+static void
+dcache_enter(struct inode* dp, char* name, uint32_t inum, uint32_t off)
+{
+    write_seqlock(&dcache.lock);
+    struct dentry* d = dcache_find(dp, name);
+    if (!d) {
+        d = dcache.lru.prev;
+        for (int n = 0; d->referenced && n < NDCACHE; n++) {
+            dcache_touch(d);
+            d = dcache.lru.prev;
+        }
+        if (d->parent) dcache_drop(d);
+        d->dev = dp->dev;
+        d->parent = dp->inum;
+        strncpy(d->name, name, DIRSIZ);
+        uint32_t h = dcache_hash(d->dev, d->parent, d->name);
+        d->hnext = dcache.hash[h];
+        dcache.hash[h] = d;
+    }
+    d->inum = inum;
+    d->off = off;
+    dcache_touch(d);
+    write_sequnlock(&dcache.lock);
+}
+
+/*
+ * Forget name in dp.  Whoever clears a dirent must call this,
+ * with dp locked, before unlocking dp.
+ */
+void
+dcache_remove(struct inode* dp, char* name)
+{
+    write_seqlock(&dcache.lock);
+    struct dentry* d = dcache_find(dp, name);
+    if (d) {
+        dcache_drop(d);
+        dcache.nremove++;
+    }
+    write_sequnlock(&dcache.lock);
+}
+
+/*
+ * Forget everything about inode inum of dev, which is being freed:
+ * the names in it if it was a directory and any name still bound to it.
+ */
+static void
+dcache_purge(uint32_t dev, uint32_t inum)
+{
+    write_seqlock(&dcache.lock);
+    for (struct dentry* d = dcache.entry; d < dcache.entry + NDCACHE; d++)
+        if (d->parent && d->dev == dev &&
+            (d->parent == inum || d->inum == inum))
+            dcache_drop(d);
+    write_sequnlock(&dcache.lock);
+}
+
+static int
+dcache_stat(char* buf, size_t n)
+{
+    uint64_t hit, neg, miss, remove;
+    uint32_t seq;
+    do {
+        seq = read_seqbegin(&dcache.lock);
+        hit = __atomic_load_n(&dcache.nhit, __ATOMIC_RELAXED);
+        neg = __atomic_load_n(&dcache.nneg, __ATOMIC_RELAXED);
+        miss = __atomic_load_n(&dcache.nmiss, __ATOMIC_RELAXED);
+        remove = dcache.nremove;
+    } while (read_seqretry(&dcache.lock, seq));
+    return snprintf(buf, n, "entries %d hit %lld negative %lld miss %lld remove %lld\n",
+                    NDCACHE, hit, neg, miss, remove);
+}
+
+/*
+ * Hashed directories, see inc/fs.h.
+ *
+ * Return the first block of the chain of name in dp and set *ptroff
+ * to the byte offset of the pointer to it, or return -1 if dp is a
+ * plain directory.
+ */
+static int
+dirh_bucket(struct inode* dp, char* name, uint32_t* ptroff)
+{
+    if (dp->size < BSIZE) return -1;
+
+    struct buf* b = bread(dp->dev, bmap(dp, 0, 0));
+    struct dirhslot* s = (struct dirhslot*)b->data;
+    int head = -1;
+    if (!s->zero && s->v[0] == DIRH_MAGIC && s->v[1] == DIRH_NBUCKET) {
+        uint32_t h = dirhash(name) % DIRH_NBUCKET;
+        uint32_t i = 1 + h / DIRH_NPTR;
+        head = s[i].v[h % DIRH_NPTR];
+        *ptroff = i * sizeof(*s) + sizeof(s->zero) +
+                  h % DIRH_NPTR * sizeof(s->v[0]);
+    }
+    brelse(b);
+    return head;
+}
+
+/*
+ * Look for name in the chain starting at file block fbn.  Return its
+ * inum and set *poff, or return 0 and set *last to the last block of
+ * the chain and *poff to a free slot in it, or 0 if there is none.
+ */
+static uint32_t
+dirh_scan(struct inode* dp, char* name, uint32_t fbn, uint32_t* last,
+          size_t* poff)
+{
+    *poff = 0;
+    while (fbn) {
+        struct buf* b = bread(dp->dev, bmap(dp, fbn, 0));
+        struct dirent* de = (struct dirent*)b->data;
+        for (int i = 1; i < DIRH_NSLOT; i++) {
+            if (!de[i].inum) {
+                if (!*poff) *poff = fbn * BSIZE + i * sizeof(*de);
+            } else if (!namecmp(name, de[i].name)) {
+                uint32_t inum = de[i].inum;
+                *poff = fbn * BSIZE + i * sizeof(*de);
+                brelse(b);
+                return inum;
+            }
+        }
+        *last = fbn;
+        fbn = ((struct dirhslot*)de)->v[0];
+        brelse(b);
+    }
+    return 0;
+}
+
+/*
+ * Add (name, inum) to hashed directory dp, whose chain for name
+ * starts at head with its pointer at ptroff.  Name must be absent.
+ */
+static int
+dirh_link(struct inode* dp, char* name, uint32_t inum, int head,
+          uint32_t ptroff)
+{
+    struct dirent de;
+    uint32_t last = 0;
+    size_t off;
+    dirh_scan(dp, name, head, &last, &off);
+
+    if (!off) {
+        // Chain is full, append a block to the directory and to the chain.
+        uint32_t fbn = dp->size / BSIZE;
+        if (fbn > 0xffff) return -1;
+
+        struct dirhslot hdr = {0};
+        if (writei(dp, (char*)&hdr, fbn * BSIZE, sizeof(hdr)) != sizeof(hdr))
+            panic("\tdirh_link: write error.\n");
+        dp->size = (fbn + 1) * BSIZE;
+        iupdate(dp);
+
+        uint16_t ptr = fbn;
+        if (last) ptroff = last * BSIZE + sizeof(hdr.zero);
+        if (writei(dp, (char*)&ptr, ptroff, sizeof(ptr)) != sizeof(ptr))
+            panic("\tdirh_link: write error.\n");
+        off = fbn * BSIZE + sizeof(de);
+    }
+
+    strncpy(de.name, name, DIRSIZ);
+    de.inum = inum;
+    if (writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+        panic("\tdirh_link: write error.\n");
+
+    dcache_enter(dp, name, inum, off);
+    return 0;
+}
+
 /*
  * Look for a directory entry in a directory.
  * If found, set *poff to byte offset of entry.
+ * Caller must hold dp->lock.
  */
 struct inode*
 dirlookup(struct inode* dp, char* name, size_t* poff)
 {
     if (dp->type != T_DIR) panic("\tdirlookup: not DIR.\n");
 
+    int inum = dcache_lookup(dp, name, poff);
+    if (inum >= 0) return inum ? iget(dp->dev, inum) : 0;
+
+    uint32_t ptroff, last;
+    size_t off;
+    int head = dirh_bucket(dp, name, &ptroff);
+    if (head >= 0) {
+        if (!(inum = dirh_scan(dp, name, head, &last, &off))) off = 0;
+        dcache_enter(dp, name, inum, off);
+        if (inum && poff) *poff = off;
+        return inum ? iget(dp->dev, inum) : 0;
+    }
+
     struct dirent de;
     for (size_t off = 0; off < dp->size; off += sizeof(de)) {
         if (readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
@@ -541,10 +1355,12 @@ dirlookup(struct inode* dp, char* name, size_t* poff)
         if (!de.inum) continue;
         if (!namecmp(name, de.name)) {
             // entry matches path element
+            dcache_enter(dp, name, de.inum, off);
             if (poff) *poff = off;
             return iget(dp->dev, de.inum);
         }
     }
+    dcache_enter(dp, name, 0, 0);
     return 0;
 }
 
@@ -563,6 +1379,10 @@ dirlink(struct inode* dp, char* name, uint32_t inum)
         return -1;
     }
 
+    uint32_t ptroff;
+    int head = dirh_bucket(dp, name, &ptroff);
+    if (head >= 0) return dirh_link(dp, name, inum, head, ptroff);
+
     /* Look for an empty dirent. */
     ssize_t off = 0;
     for (; off < dp->size; off += sizeof(de)) {
@@ -576,6 +1396,8 @@ dirlink(struct inode* dp, char* name, uint32_t inum)
     if (writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
         panic("\tdirlink: write error.\n");
 
+    // Replaces the negative entry dirlookup() left above.
+    dcache_enter(dp, name, inum, off);
     return 0;
 }
 
@@ -618,13 +1440,14 @@ skipelem(char* path, char* name)
  *
  * If parent != 0, return the inode for the parent and copy the final
  * path element into name, which must have room for DIRSIZ bytes.
+ * A relative path starts from dp, or the current directory if 0.
  * Must be called inside a transaction since it calls iput().
  */
 static struct inode*
-namex(char* path, int nameiparent, char* name)
+namex(struct inode* dp, char* path, int nameiparent, char* name)
 {
     struct inode* ip = NULL;
-    ip = (*path == '/') ? iget(ROOTDEV, ROOTINO) : idup(thisproc()->cwd);
+    ip = (*path == '/') ? iget(ROOTDEV, ROOTINO) : idup(dp ? dp : thisproc()->cwd);
 
     while ((path = skipelem(path, name))) {
         ilock(ip);
@@ -656,11 +1479,19 @@ struct inode*
 namei(char* path)
 {
     char name[DIRSIZ];
-    return namex(path, 0, name);
+    return namex(0, path, 0, name);
+}
+
+/* Like namei(), but a relative path starts from directory dp. */
+struct inode*
+nameiat(struct inode* dp, char* path)
+{
+    char name[DIRSIZ];
+    return namex(dp, path, 0, name);
 }
 
 struct inode*
 nameiparent(char* path, char* name)
 {
-    return namex(path, 1, name);
+    return namex(0, path, 1, name);
 }
@@ -0,0 +1,250 @@
+#include "futex.h"
+
+#include <sys/mman.h>
+
+#include "console.h"
+#include "memlayout.h"
+#include "mm.h"
+#include "mmap.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "spinlock.h"
+#include "syscall1.h"
+#include "types.h"
+#include "vm.h"
+
+/*
+ * Futexes. A waiter sleeps on a word of user memory until another
+ * thread wakes that word. Words are told apart by key: the address
+ * space and the user address, or, for a word in a MAP_SHARED region
+ * that other processes may map elsewhere, the physical page and offset
+ * alone. Waiters are hashed by key into buckets, whose locks are held
+ * while the word is compared, so that a wakeup that follows a change
+ * of the word cannot be missed. FUTEX_REQUEUE moves waiters to the
+ * bucket of another word without waking them, as a condition variable
+ * broadcast does to have them wait for the mutex one by one.
+ */
+
+struct futex_waiter {
+    struct mm* mm;  // Address space, or 0 for a shared word
+    uint64_t addr;  // User address, or kernel address if shared
+    struct proc* p;
+    struct futex_bucket* q;  // Bucket it is queued in
+    struct futex_waiter* next;
+    int woken;
+};
+
+struct futex_bucket {
+    struct spinlock lock;
+    struct futex_waiter* head;
+};
+
+static struct futex_bucket futexq[NFUTEX];
+
+void
+futex_init()
+{
+    for (struct futex_bucket* q = futexq; q < &futexq[NFUTEX]; ++q)
+        initlock(&q->lock, "futex");
+}
+
+/*
+ * Find the key of the word at uaddr of p for w, and return its kernel
+ * address, or 0 if p may not write it. Caller must hold p->mm->lock.
+ */
+static int*
+futex_key(struct proc* p, uint64_t uaddr, int private, struct futex_waiter* w)
+{
+    if (uaddr % sizeof(int) || uaddr >= USERTOP)
+        return 0;
+    int* kaddr = (int*)uva2ka_fault(p, uaddr);
+    if (!kaddr)
+        return 0;
+    struct vma* v = private ? 0 : vma_find(p->mm, uaddr);
+    if (v && (v->flags & MAP_SHARED)) {
+        w->mm = 0;
+        w->addr = (uint64_t)kaddr;
+    } else {
+        w->mm = p->mm;
+        w->addr = uaddr;
+    }
+    return kaddr;
+}
+
+static struct futex_bucket*
+futex_bucket(struct futex_waiter* w)
+{
+    return &futexq[((uint64_t)w->mm ^ w->addr) / sizeof(int) % NFUTEX];
+}
+
+/*
+ * Sleep until woken if the word at uaddr of p still holds val.
+ * Returns 0 when woken, or -1 if the word differs, is not there,
+ * or p was killed.
+ */
+int
+futex_wait(struct proc* p, uint64_t uaddr, int val, int private)
+{
+    struct futex_waiter w = {.p = p};
+
+    acquiresleep(&p->mm->lock);
+    volatile int* kaddr = futex_key(p, uaddr, private, &w);
+    if (!kaddr) {
+        releasesleep(&p->mm->lock);
+        return -1;
+    }
+    struct futex_bucket* q = futex_bucket(&w);
+    acquire(&q->lock);
+    // Still under mm->lock, so that the page cannot go away.
+    if (*kaddr != val) {
+        release(&q->lock);
+        releasesleep(&p->mm->lock);
+        return -1;
+    }
+    w.q = q;
+    w.next = q->head;
+    q->head = &w;
+    releasesleep(&p->mm->lock);
+
+    while (!w.woken && !p->killed) {
+        sleep(&w, &q->lock);
+        // Follow w if it was requeued while asleep. Only the holder
+        // of both bucket locks moves it.
+        while (q != w.q) {
+            release(&q->lock);
+            q = w.q;
+            acquire(&q->lock);
+        }
+    }
+    if (!w.woken) {
+        for (struct futex_waiter** pp = &q->head; *pp; pp = &(*pp)->next) {
+            if (*pp == &w) {
+                *pp = w.next;
+                break;
+            }
+        }
+    }
+    release(&q->lock);
+    return w.woken ? 0 : -1;
+}
+
+/*
+ * Wake up to n waiters with the key of key from bucket q, and move up
+ * to nmove of the rest to the key and bucket of to, if set. Returns
+ * how many were woken or moved. Caller must hold the bucket locks.
+ */
+static int
+futex_move(struct futex_bucket* q, struct futex_waiter* key, int n, struct futex_waiter* to, int nmove)
+{
+    struct futex_bucket* q2 = to ? futex_bucket(to) : 0;
+    int woken = 0, moved = 0;
+    for (struct futex_waiter** pp = &q->head; *pp && (woken < n || moved < nmove);) {
+        struct futex_waiter* w = *pp;
+        if (w->mm != key->mm || w->addr != key->addr) {
+            pp = &w->next;
+        } else if (woken < n) {
+            *pp = w->next;
+            w->woken = 1;
+            wakeup(w);
+            woken++;
+        } else if (q2 == q) {
+            w->mm = to->mm;
+            w->addr = to->addr;
+            pp = &w->next;
+            moved++;
+        } else {
+            *pp = w->next;
+            w->mm = to->mm;
+            w->addr = to->addr;
+            w->q = q2;
+            w->next = q2->head;
+            q2->head = w;
+            moved++;
+        }
+    }
+    return woken + moved;
+}
+
+/* Wake up to n waiters on the word at uaddr of p. Returns how many. */
+int
+futex_wake(struct proc* p, uint64_t uaddr, int n, int private)
+{
+    struct futex_waiter key;
+
+    acquiresleep(&p->mm->lock);
+    int* kaddr = futex_key(p, uaddr, private, &key);
+    releasesleep(&p->mm->lock);
+    if (!kaddr)
+        return -1;
+
+    struct futex_bucket* q = futex_bucket(&key);
+    acquire(&q->lock);
+    int r = futex_move(q, &key, n, 0, 0);
+    release(&q->lock);
+    return r;
+}
+
+/*
+ * Wake up to n waiters on the word at uaddr of p, and have up to nmove
+ * of the rest wait on the word at uaddr2 instead. With cmp set, only
+ * if the word at uaddr still holds val. Returns how many were woken or
+ * moved, or -1.
+ */
+int
+futex_requeue(struct proc* p, uint64_t uaddr, int n, int nmove, uint64_t uaddr2, int cmp, int val,
+              int private)
+{
+    struct futex_waiter key, to;
+
+    acquiresleep(&p->mm->lock);
+    volatile int* kaddr = futex_key(p, uaddr, private, &key);
+    if (!kaddr || !futex_key(p, uaddr2, private, &to)) {
+        releasesleep(&p->mm->lock);
+        return -1;
+    }
+
+    // Take the two bucket locks in the order of the table.
+    struct futex_bucket *q = futex_bucket(&key), *q2 = futex_bucket(&to);
+    struct futex_bucket *lo = MIN(q, q2), *hi = MAX(q, q2);
+    acquire(&lo->lock);
+    if (hi != lo)
+        acquire(&hi->lock);
+    int r = -1;
+    if (!cmp || *kaddr == val)
+        r = futex_move(q, &key, n, &to, nmove);
+    if (hi != lo)
+        release(&hi->lock);
+    release(&lo->lock);
+    releasesleep(&p->mm->lock);
+    return r;
+}
+
+/*
+ * futex(uaddr, op, val, timeout, uaddr2, val3). The requeues take the
+ * number to move in place of timeout. Timeouts of FUTEX_WAIT are not
+ * supported: it waits until woken.
+ */
+int
+sys_futex()
+{
+    uint64_t uaddr, op, val, val2, uaddr2, val3;
+    if (argint(0, &uaddr) < 0 || argint(1, &op) < 0 || argint(2, &val) < 0
+        || argint(3, &val2) < 0 || argint(4, &uaddr2) < 0 || argint(5, &val3) < 0)
+        return -1;
+
+    struct proc* p = thisproc();
+    int private = (op & FUTEX_PRIVATE_FLAG) != 0;
+    switch (op & ~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME)) {
+    case FUTEX_WAIT:
+        return futex_wait(p, uaddr, (int)val, private);
+    case FUTEX_WAKE:
+        return futex_wake(p, uaddr, (int)val, private);
+    case FUTEX_REQUEUE:
+        return futex_requeue(p, uaddr, (int)val, (int)val2, uaddr2, 0, 0, private);
+    case FUTEX_CMP_REQUEUE:
+        return futex_requeue(p, uaddr, (int)val, (int)val2, uaddr2, 1, (int)val3, private);
+    default:
+        cprintf("sys_futex: op %d unsupported.\n", (int)op);
+        return -1;
+    }
+}
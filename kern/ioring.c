@@ -0,0 +1,192 @@
+#include "ioring.h"
+
+#include "console.h"
+#include "file.h"
+#include "fs.h"
+#include "proc.h"
+#include "string.h"
+#include "syscall1.h"
+#include "types.h"
+
+/*
+ * Batched system calls through a ring in user memory, see ioring.h.
+ * One io_uring_enter() trap runs a whole batch of reads, writes,
+ * opens and closes. The reads of a batch get their blocks asked of
+ * the card before the first of them waits for any, so that the SD
+ * queue holds all of them at once instead of one at a time.
+ */
+
+#define IORING_BATCH 8 /* Entries copied onto the kernel stack at a time */
+
+int
+sys_io_uring_setup()
+{
+    uint64_t n, addr;
+    if (argint(0, &n) < 0 || argint(1, &addr) < 0)
+        return -1;
+    if (!n || n > IORING_MAX || (n & (n - 1)) || addr % 8 || checkrange(addr, IORING_SIZE(n)) < 0)
+        return -1;
+    struct ioring hdr = {.entries = n};
+    if (copy_user((char*)addr, &hdr, sizeof(hdr)) < 0)
+        return -1;
+
+    struct file* f = file_alloc();
+    if (!f)
+        return -1;
+    f->type = FD_RING;
+    f->ring = addr;
+    f->nring = n;
+    int fd = fd_alloc(thisproc(), f, 0);
+    if (fd < 0) {
+        file_close(f);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Load the ring index at u into *v, ordered before what it guards,
+ * or store v there after it. The ring is user memory, which only
+ * copy_user() may touch; either fails if it faults.
+ */
+static int
+ring_load(uint32_t* u, uint32_t* v)
+{
+    if (copy_user(v, u, sizeof(*v)) < 0)
+        return -1;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return 0;
+}
+
+static int
+ring_store(uint32_t* u, uint32_t v)
+{
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return copy_user(u, &v, sizeof(v));
+}
+
+/* Where a read or write of e starts in f. */
+static size_t
+ioring_off(struct file* f, struct ioring_sqe* e)
+{
+    return e->off == IORING_OFF_CUR ? f->off : e->off;
+}
+
+/* Bring what the reads of batch e will want into the page cache. */
+static void
+ioring_prefetch(struct proc* p, struct ioring_sqe* e, int n)
+{
+    for (int i = 0; i < n; i++) {
+        struct file* f = e[i].op == IORING_OP_READ ? fd_get(p, e[i].fd) : 0;
+        if (!f)
+            continue;
+        if (f->type == FD_INODE && !f->direct && f->readable) {
+            ilock(f->ip);
+            readahead(f->ip, ioring_off(f, &e[i]), e[i].len);
+            iunlock(f->ip);
+        }
+        file_close(f);
+    }
+}
+
+/* Run e as the system call it stands for. */
+static int64_t
+ioring_run(struct proc* p, struct ioring_sqe* e)
+{
+    struct file* f;
+    char path[MAXPATH];
+    int64_t r;
+
+    switch (e->op) {
+    case IORING_OP_NOP:
+        return 0;
+    case IORING_OP_READ:
+    case IORING_OP_WRITE:
+        if (checkrange(e->addr, e->len) < 0 || !(f = fd_get(p, e->fd)))
+            return -1;
+        if (e->op == IORING_OP_READ)
+            r = e->off == IORING_OFF_CUR ? file_read(f, (char*)e->addr, e->len)
+                                         : file_pread(f, (char*)e->addr, e->len, e->off);
+        else
+            r = e->off == IORING_OFF_CUR ? file_write(f, (char*)e->addr, e->len)
+                                         : file_pwrite(f, (char*)e->addr, e->len, e->off);
+        file_close(f);
+        return r;
+    case IORING_OP_OPENAT:
+        if (fetchstr(e->addr, path, sizeof(path)) < 0)
+            return -1;
+        return file_open(path, e->len);
+    case IORING_OP_CLOSE:
+        if (!(f = fd_remove(p, e->fd)))
+            return -1;
+        file_close(f);
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Consume up to to_submit entries of the submission queue of the
+ * ring at fd, in batches, and return how many. min_complete and flags
+ * mean nothing: every entry is complete by the time this returns.
+ */
+int
+sys_io_uring_enter()
+{
+    uint64_t fd, to_submit;
+    if (argint(0, &fd) < 0 || argint(1, &to_submit) < 0)
+        return -1;
+
+    struct proc* p = thisproc();
+    struct file* f = fd_get(p, fd);
+    if (!f)
+        return -1;
+    if (f->type != FD_RING || checkrange(f->ring, IORING_SIZE(f->nring)) < 0) {
+        file_close(f);
+        return -1;
+    }
+
+    uint32_t n = f->nring;
+    struct ioring* r = (struct ioring*)f->ring;
+    struct ioring_sqe* sq = IORING_SQ(r);
+    struct ioring_cqe* cq = IORING_CQ(r, n);
+
+    uint32_t head, tail, cq_head, cq_tail;
+    if (ring_load(&r->sq_head, &head) < 0 || ring_load(&r->sq_tail, &tail) < 0
+        || ring_load(&r->cq_tail, &cq_tail) < 0 || ring_load(&r->cq_head, &cq_head) < 0) {
+        file_close(f);
+        return -1;
+    }
+    uint32_t cq_used = cq_tail - cq_head;
+    if (tail - head > n || cq_used > 2 * n) {
+        file_close(f);
+        return -1;
+    }
+    to_submit = MIN(to_submit, MIN(tail - head, 2 * n - cq_used));
+
+    struct ioring_sqe e[IORING_BATCH];
+    uint32_t done = 0;
+    while (done < to_submit) {
+        // Copy the batch first: the program may reuse its entries
+        // as soon as sq_head moves past them.
+        // A fault on the ring ends the call, with what is consumed.
+        int nb = MIN(to_submit - done, IORING_BATCH);
+        for (int i = 0; i < nb; i++)
+            if (copy_user(&e[i], &sq[(head + done + i) & (n - 1)], sizeof(e[i])) < 0)
+                goto out;
+        ioring_prefetch(p, e, nb);
+        for (int i = 0; i < nb; i++) {
+            struct ioring_cqe c = {.user_data = e[i].user_data, .res = ioring_run(p, &e[i])};
+            if (copy_user(&cq[cq_tail & (2 * n - 1)], &c, sizeof(c)) < 0
+                || ring_store(&r->cq_tail, ++cq_tail) < 0)
+                goto out;
+        }
+        done += nb;
+        if (ring_store(&r->sq_head, head + done) < 0)
+            goto out;
+    }
+out:
+    file_close(f);
+    return done < to_submit && !done ? -1 : done;
+}
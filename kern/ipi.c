@@ -0,0 +1,60 @@
+#include "ipi.h"
+
+#include "arm.h"
+#include "peripherals/irq.h"
+#include "proc.h"
+
+/*
+ * Inter-processor interrupts through mailbox 0 of the local
+ * peripherals. Writing bits to a core's mailbox ORs them in and
+ * raises its IRQ until the core clears them, so each bit is one kind
+ * of message and a message sent twice before it is seen is seen once.
+ *
+ * TLB shootdowns need no message: tlbi ...is broadcasts to the inner
+ * shareable domain, i.e. every CPU, and the ASID rollover flush is
+ * done by each CPU the next time it switches address spaces.
+ */
+#define IPI_MBOX 0
+
+static uint64_t nsent[NIPI];
+
+void
+ipi_init()
+{
+    put32(CORE_MBOX_CTRL(cpuid()), CORE_MBOX_IRQ(IPI_MBOX));
+}
+
+void
+ipi_send(int cpu, int msg)
+{
+    for (int i = 0; i < NIPI; i++)
+        if (msg & (1 << i)) __atomic_fetch_add(&nsent[i], 1, __ATOMIC_RELAXED);
+    disb();  // What the message is about must be visible first
+    put32(CORE_MBOX_SET(cpu, IPI_MBOX), msg);
+}
+
+/* Send msg to every CPU but this one. */
+void
+ipi_broadcast(int msg)
+{
+    for (int i = 0; i < NCPU; i++)
+        if (i != cpuid()) ipi_send(i, msg);
+}
+
+/* Take the messages sent to this CPU. */
+int
+ipi_intr()
+{
+    int msg = get32(CORE_MBOX_RDCLR(cpuid(), IPI_MBOX));
+    put32(CORE_MBOX_RDCLR(cpuid(), IPI_MBOX), msg);
+    return msg;
+}
+
+/* Number of IPIs with message msg sent so far. */
+uint64_t
+ipi_count(int msg)
+{
+    for (int i = 0; i < NIPI; i++)
+        if (msg == 1 << i) return nsent[i];
+    return 0;
+}
@@ -5,58 +5,331 @@
 #include "console.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "proc.h"
 #include "spinlock.h"
 #include "string.h"
 #include "types.h"
 
 extern char end[];
 
+#define NPAGE (PHYSTOP / PGSIZE) /* Number of physical page frames */
+
 /*
- * Free page's list element struct.
- * We store each free page's run structure in the free page itself.
+ * Free block's list element struct.
+ * We store each free block's run structure in its first page.
  */
 struct run {
     struct run* next;
+    struct run* prev;
+};
+
+/*
+ * Per-frame metadata, indexed by physical frame number.
+ * Only the first frame of a free buddy block has PG_FREE set,
+ * and its order field tells how large the block is.
+ * For user pages, ref counts the page tables sharing the page
+ * besides its first owner; see kpage_get().
+ */
+#define PG_FREE 1
+
+struct page {
+    uint8_t flags;
+    uint8_t order;
+    uint16_t ref;
 };
 
 struct {
     struct spinlock lock;
-    struct run* free_list; /* Free list of physical pages */
+    struct page* page;                     /* Frame metadata, NPAGE entries */
+    char* start;                           /* First allocatable page */
+    struct run* free_list[MAX_ORDER + 1];  /* Free blocks of each order */
+    uint64_t nfree;                        /* Free pages in the lists */
 } kmem;
 
+/*
+ * Pool of pages that idle CPUs have already cleared, so that
+ * kalloc_zeroed() does not memset on the fault/fork path.
+ * The list link is kept in the first word and cleared on the way out.
+ */
+#define NZPOOL 64
+
+struct {
+    struct spinlock lock;
+    struct run* list;
+    int n;
+} zpool;
+
+static inline uint64_t
+v2pfn(void* v)
+{
+    return V2P(v) / PGSIZE;
+}
+
+static inline struct run*
+pfn2v(uint64_t pfn)
+{
+    return (struct run*)P2V(pfn * PGSIZE);
+}
+
+static void
+list_push(int order, struct run* r)
+{
+    r->prev = 0;
+    r->next = kmem.free_list[order];
+    if (r->next) r->next->prev = r;
+    kmem.free_list[order] = r;
+}
+
+static void
+list_remove(int order, struct run* r)
+{
+    if (r->prev)
+        r->prev->next = r->next;
+    else
+        kmem.free_list[order] = r->next;
+    if (r->next) r->next->prev = r->prev;
+}
+
+/*
+ * Put a block of 2^order pages back, merging it with its buddy
+ * as long as the buddy is free and of the same order.
+ * Caller must hold kmem.lock.
+ */
+static void
+buddy_free(uint64_t pfn, int order)
+{
+    uint64_t b;
+
+    kmem.nfree += 1 << order;
+    for (; order < MAX_ORDER; order++) {
+        b = pfn ^ (1 << order);
+        if (b + (1 << order) > NPAGE || !(kmem.page[b].flags & PG_FREE)
+            || kmem.page[b].order != order)
+            break;
+        list_remove(order, pfn2v(b));
+        kmem.page[b].flags = 0;
+        pfn &= ~(uint64_t)(1 << order);
+    }
+    kmem.page[pfn].flags = PG_FREE;
+    kmem.page[pfn].order = order;
+    list_push(order, pfn2v(pfn));
+}
+
+/*
+ * Take a block of 2^order pages off the free lists, splitting
+ * a larger block if needed. Caller must hold kmem.lock.
+ */
+static char*
+buddy_alloc(int order)
+{
+    struct run* r;
+    uint64_t pfn;
+    int k;
+
+    for (k = order; k <= MAX_ORDER && !kmem.free_list[k]; k++)
+        ;
+    if (k > MAX_ORDER) return 0;
+
+    r = kmem.free_list[k];
+    list_remove(k, r);
+    pfn = v2pfn(r);
+    kmem.page[pfn].flags = 0;
+    while (k > order) {
+        k--;
+        kmem.page[pfn + (1 << k)].flags = PG_FREE;
+        kmem.page[pfn + (1 << k)].order = k;
+        list_push(k, pfn2v(pfn + (1 << k)));
+    }
+    kmem.page[pfn].order = order;
+    kmem.nfree -= 1 << order;
+    return (char*)r;
+}
+
 void
 alloc_init()
 {
     initlock(&kmem.lock, "kmem_lock"); /* Init kmem lock */
-    free_range(end, P2V(PHYSTOP));
+    initlock(&zpool.lock, "zpool_lock");
+
+    /* Frame metadata lives right after the kernel image. */
+    kmem.page = (struct page*)ROUNDUP((char*)end, PGSIZE);
+    memset(kmem.page, 0, NPAGE * sizeof(struct page));
+    kmem.start = ROUNDUP((char*)(kmem.page + NPAGE), PGSIZE);
+
+    free_range(kmem.start, P2V(PHYSTOP));
     cprintf("alloc_init: success.\n");
 }
 
+/*
+ * Callbacks that release cached memory when kalloc() runs dry.
+ * Each is asked for a number of pages and returns how many it freed.
+ */
+#define NSHRINKER 4
+
+static uint64_t (*shrinker[NSHRINKER])(uint64_t);
+
+void
+kmem_register_shrinker(uint64_t (*fn)(uint64_t))
+{
+    for (int i = 0; i < NSHRINKER; i++) {
+        if (!shrinker[i]) {
+            shrinker[i] = fn;
+            return;
+        }
+    }
+    panic("\tkmem_register_shrinker: too many shrinkers.\n");
+}
+
+static uint64_t
+kmem_shrink(uint64_t npages)
+{
+    uint64_t freed = 0;
+    for (int i = 0; i < NSHRINKER && shrinker[i] && freed < npages; i++)
+        freed += shrinker[i](npages - freed);
+    return freed;
+}
+
+/* Number of free pages in the buddy allocator. */
+uint64_t
+kmem_free_pages()
+{
+    return kmem.nfree;
+}
+
+static int
+kvalid(char* v, int order)
+{
+    return !((uint64_t)v % (PGSIZE << order)) && v >= kmem.start
+           && V2P(v) + (PGSIZE << order) <= PHYSTOP;
+}
+
+/*
+ * Move up to KMAG_BATCH pages from the global free lists into m.
+ * Interrupts are always disabled in the kernel, so nothing else
+ * can touch this CPU's magazine while we are here.
+ */
+static void
+kmag_refill(struct kmag* m)
+{
+    char* p;
+
+    acquire(&kmem.lock);
+    while (m->n < KMAG_BATCH && (p = buddy_alloc(0))) m->page[m->n++] = p;
+    release(&kmem.lock);
+}
+
+/* Give the oldest KMAG_BATCH pages of m back to the buddy allocator. */
+static void
+kmag_drain(struct kmag* m)
+{
+    int i;
+
+    acquire(&kmem.lock);
+    for (i = 0; i < KMAG_BATCH; i++) buddy_free(v2pfn(m->page[i]), 0);
+    release(&kmem.lock);
+
+    m->n -= KMAG_BATCH;
+    memmove(m->page, m->page + KMAG_BATCH, m->n * sizeof(m->page[0]));
+}
+
 /* Free the page of physical memory pointed at by v. */
 void
 kfree(char* v)
 {
-    struct run* r;
+    struct kmag* m;
 
-    if ((uint64_t)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
-        panic("\tkfree: invalid address: 0x%p\n", V2P(v));
+    if (!kvalid(v, 0)) panic("\tkfree: invalid address: 0x%p\n", V2P(v));
 
+#ifdef DEBUG
     /* Fill with junk to catch dangling refs. */
     memset(v, 1, PGSIZE);
+#endif
 
-    r = (struct run*)v;
-    acquire(&kmem.lock);
-    r->next = kmem.free_list;
-    kmem.free_list = r;
-    release(&kmem.lock);
+    m = &thiscpu->kmag;
+    if (m->n == KMAG_SIZE) kmag_drain(m);
+    m->page[m->n++] = v;
 }
 
+/*
+ * Take another reference to page v, which is about to be mapped
+ * a second time, e.g. shared copy-on-write by fork().
+ */
+void
+kpage_get(char* v)
+{
+    if (!kvalid(v, 0)) panic("\tkpage_get: invalid address: 0x%p\n", V2P(v));
+    if (__atomic_fetch_add(&kmem.page[v2pfn(v)].ref, 1, __ATOMIC_RELAXED) == 0xFFFF)
+        panic("\tkpage_get: too many references.\n");
+}
+
+/*
+ * Drop a reference to page v. Returns 1 if others still use it,
+ * or 0 if this was the last one, which leaves v to the caller.
+ */
+int
+kpage_unshare(char* v)
+{
+    uint16_t* ref = &kmem.page[v2pfn(v)].ref;
+    uint16_t old = __atomic_load_n(ref, __ATOMIC_RELAXED);
+    while (old && !__atomic_compare_exchange_n(
+                      ref, &old, old - 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        ;
+    return old != 0;
+}
+
+/* Is page v mapped more than once? A hint unless the caller owns all maps. */
+int
+kpage_shared(char* v)
+{
+    return __atomic_load_n(&kmem.page[v2pfn(v)].ref, __ATOMIC_ACQUIRE) != 0;
+}
+
+/* Drop a reference to page v and free it with the last one. */
+void
+kpage_put(char* v)
+{
+    if (!kpage_unshare(v)) kfree(v);
+}
+
+/*
+ * Hand [vstart, vend) to the buddy allocator, in the largest
+ * naturally aligned blocks that fit.
+ */
 void
 free_range(void* vstart, void* vend)
 {
     char* p;
+    uint64_t pfn;
+    int order;
+
+    acquire(&kmem.lock);
     p = ROUNDUP((char*)vstart, PGSIZE);
-    for (; p + PGSIZE <= (char*)vend; p += PGSIZE) kfree(p);
+    while (p + PGSIZE <= (char*)vend) {
+        pfn = v2pfn(p);
+        for (order = MAX_ORDER; order > 0; order--)
+            if (!(pfn & ((1 << order) - 1))
+                && p + (PGSIZE << order) <= (char*)vend)
+                break;
+        buddy_free(pfn, order);
+        p += PGSIZE << order;
+    }
+    release(&kmem.lock);
+}
+
+/* Pop a page off the zeroed pool, or return 0 if it is empty. */
+static char*
+zpool_take()
+{
+    struct run* r;
+
+    acquire(&zpool.lock);
+    if ((r = zpool.list)) {
+        zpool.list = r->next;
+        zpool.n--;
+    }
+    release(&zpool.lock);
+    if (r) r->next = 0;
+    return (char*)r;
 }
 
 /*
@@ -67,20 +340,131 @@ free_range(void* vstart, void* vend)
 char*
 kalloc()
 {
-    struct run* p;
+    struct kmag* m = &thiscpu->kmag;
+
+    if (m->n) {
+        m->hit++;
+    } else {
+        m->miss++;
+        kmag_refill(m);
+        if (!m->n && kmem_shrink(KMAG_BATCH)) kmag_refill(m);
+        if (!m->n) return zpool_take();
+    }
+    return m->page[--m->n];
+}
+
+/* Allocate one page filled with zeros. */
+char*
+kalloc_zeroed()
+{
+    char* p;
+
+    if ((p = zpool_take())) return p;
+    if ((p = kalloc())) memset(p, 0, PGSIZE);
+    return p;
+}
+
+/*
+ * Called by an idle CPU from scheduler(): clear one more page for
+ * the zeroed pool. Returns 0 if the pool is full or memory is short.
+ */
+int
+kzero_idle()
+{
+    char* p;
+
+    if (zpool.n >= NZPOOL || kmem.nfree < NZPOOL) return 0;
+    if (!(p = kalloc())) return 0;
+    memset(p, 0, PGSIZE);
+
+    acquire(&zpool.lock);
+    ((struct run*)p)->next = zpool.list;
+    zpool.list = (struct run*)p;
+    zpool.n++;
+    release(&zpool.lock);
+    return 1;
+}
+
+/*
+ * Allocate 2^order physically contiguous pages, aligned to their size.
+ * Returns 0 if no such block is available.
+ */
+char*
+kalloc_pages(int order)
+{
+    char* p;
+
+    if (order < 0 || order > MAX_ORDER) return 0;
+    if (order == 0) return kalloc();
+
     acquire(&kmem.lock);
-    p = kmem.free_list;
-    if (p) kmem.free_list = p->next;
+    p = buddy_alloc(order);
+    release(&kmem.lock);
+    return p;
+}
+
+/* Free a block returned by kalloc_pages(order). */
+void
+kfree_pages(char* v, int order)
+{
+    if (order == 0) {
+        kfree(v);
+        return;
+    }
+    if (order < 0 || order > MAX_ORDER || !kvalid(v, order))
+        panic("\tkfree_pages: invalid block: 0x%p order %d\n", V2P(v), order);
+
+#ifdef DEBUG
+    memset(v, 1, PGSIZE << order);
+#endif
+
+    acquire(&kmem.lock);
+    buddy_free(v2pfn(v), order);
     release(&kmem.lock);
-    return (char*)p;
 }
 
 void
 check_free_list()
 {
     struct run* p;
-    if (!kmem.free_list) panic("\tcheck_free_list: free_list is null.\n");
+    uint64_t n = 0;
+    int order;
 
-    for (p = kmem.free_list; p; p = p->next) { assert((void*)p > (void*)end); }
+    acquire(&kmem.lock);
+    for (order = 0; order <= MAX_ORDER; order++) {
+        for (p = kmem.free_list[order]; p; p = p->next) {
+            assert((void*)p >= (void*)kmem.start);
+            assert(kmem.page[v2pfn(p)].flags & PG_FREE);
+            assert(kmem.page[v2pfn(p)].order == order);
+            assert(!(v2pfn(p) & ((1 << order) - 1)));
+            n += 1 << order;
+        }
+    }
+    assert(n == kmem.nfree);
+    release(&kmem.lock);
+    if (!n) panic("\tcheck_free_list: free_list is null.\n");
     cprintf("check_free_list: passed.\n");
 }
+
+/* Print free block counts and per-CPU magazine counters to the console. */
+void
+kmem_dump()
+{
+    struct kmag* m;
+    struct run* p;
+    int i, n;
+
+    acquire(&kmem.lock);
+    cprintf("kmem: %lld free pages, %d zeroed\n", kmem.nfree, zpool.n);
+    for (i = 0; i <= MAX_ORDER; i++) {
+        for (n = 0, p = kmem.free_list[i]; p; p = p->next) n++;
+        cprintf("  order %d: %d\n", i, n);
+    }
+    release(&kmem.lock);
+
+    for (i = 0; i < NCPU; i++) {
+        m = &cpus[i].kmag;
+        cprintf("cpu %d: kmag %d/%d hit %lld miss %lld\n", i, m->n, KMAG_SIZE,
+                m->hit, m->miss);
+    }
+}
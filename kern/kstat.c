@@ -0,0 +1,48 @@
+#include "kstat.h"
+
+#include "console.h"
+#include "file.h"
+#include "kalloc.h"
+#include "mmu.h"
+#include "string.h"
+#include "types.h"
+
+/*
+ * The statistics device. Every read formats a fresh snapshot of the
+ * minor's counters and returns the part at the file offset, so that
+ * `cat logstat' prints the whole thing once.
+ */
+static int (*kstat_show[NKSTAT])(char*, size_t);
+
+void
+kstat_register(int minor, int (*show)(char*, size_t))
+{
+    if (minor <= 0 || minor >= NKSTAT || kstat_show[minor])
+        panic("\tkstat_register: bad minor %d.\n", minor);
+    kstat_show[minor] = show;
+}
+
+static ssize_t
+kstat_read(struct inode* ip, char* dst, size_t off, ssize_t n)
+{
+    if (ip->minor <= 0 || ip->minor >= NKSTAT || !kstat_show[ip->minor])
+        return -1;
+
+    char* buf = kalloc();
+    if (!buf) return -1;
+    size_t len = MIN(kstat_show[ip->minor](buf, PGSIZE), PGSIZE - 1);
+    if (off >= len)
+        n = 0;
+    else
+        n = MIN((size_t)n, len - off);
+    if (copy_user(dst, buf + off, n) < 0) n = -1;
+    kfree(buf);
+    return n;
+}
+
+void
+kstat_init()
+{
+    devsw[KSTAT].read = kstat_read;
+    cprintf("kstat_init: success.\n");
+}
@@ -11,78 +11,152 @@
  * its start and end. Usually begin_op() just increments
  * the count of in-progress FS system calls and returns.
  * But if it thinks the log is close to running out, it
- * sleeps until the last outstanding end_op() commits.
+ * sleeps until the next commit.
  *
- * The log is a physical re-do log containing disk blocks.
+ * Commits are done by the log flusher kernel thread, so end_op()
+ * does not wait for the disk. The flusher lets a transaction grow
+ * over several system calls before it closes it (group commit).
+ * Callers that need their updates on disk call log_force().
+ *
+ * The log is a physical re-do log containing disk blocks. It is
+ * circular: committed transactions pile up behind each other and
+ * their blocks stay dirty in the cache. Only when the log runs low
+ * on space are they all written home at once (checkpoint), and
+ * the tail of the log moves past them.
  * The on-disk log format:
- *   header block, containing block #s for block A, B, C, ...
- *   block A
- *   block B
- *   block C
- *   ...
- * Log appends are synchronous.
+ *   header block, containing the tail and its sequence number
+ *   circular area of transactions, each of which is
+ *     descriptor block, containing seq and block #s for A, B, C, ...
+ *     block A
+ *     block B
+ *     block C
+ *     ...
+ *     commit block, containing seq
+ * A transaction counts only once its commit block is on disk,
+ * recovery replays transactions from the tail in sequence order
+ * until one does not match. The descriptor and data blocks go out
+ * as one multi-block request, as do the home blocks of a checkpoint.
+ *
+ * Blocks a transaction frees are remembered, merged into extents,
+ * and once it has committed the flusher hands them to bdiscard(),
+ * before any later transaction can allocate them again.
  */
 
+#include "log.h"
+
 #include "buf.h"
 #include "console.h"
 #include "file.h"
+#include "kalloc.h"
+#include "kstat.h"
+#include "mmu.h"
+#include "proc.h"
 #include "sleeplock.h"
 #include "spinlock.h"
 #include "string.h"
+#include "trace.h"
 #include "types.h"
 
+#define LOG_DESC   0x4c4f4744  // "LOGD"
+#define LOG_COMMIT 0x4c4f4743  // "LOGC"
+#define LOGHASH    256         // Slots of the absorption index, > 2 * LOGSIZE
+#define NDISCARD   32          // Extents of freed blocks a transaction remembers
+
+/* Contents of the header block. */
+struct logheader {
+    uint32_t tail;  // Offset of the oldest live transaction in the area
+    uint32_t seq;   // Its sequence number
+};
+
 /*
- * Contents of the header block, used for both the on-disk header block
- * and to keep track in memory of logged block # before commit.
+ * Contents of the descriptor and commit blocks, and used to
+ * keep track in memory of logged block # before commit.
  */
-struct logheader {
-    int n;
-    int block[LOGSIZE];
+struct logdesc {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t n;
+    uint32_t block[LOGSIZE];
 };
 
 struct log {
     struct spinlock lock;
     int start;
-    int size;
-    int outstanding;  // How many FS sys calls are executing.
+    int size;         // Blocks in the circular area, after the header.
+    int outstanding;  // MAXOPBLOCKS reservations of executing FS sys calls.
     int committing;   // In commit(), please wait.
     int dev;
-    struct logheader lh;
+    int urgent;         // Somebody waits for the commit, don't linger.
+    uint64_t ncommit;   // How many commits are done.
+    // Only the flusher touches these, while committing:
+    uint32_t head;      // Offset where the next transaction goes
+    uint32_t used;      // Blocks between tail and head
+    uint32_t seq;       // Sequence number of the next transaction
+    struct logheader hdr;
+    uint32_t* ckpt;     // Home blocks awaiting checkpoint
+    int nckpt;
+    struct logdesc lh;  // The open transaction
+    // Open addressing index of lh.block[], slot + 1 or 0 if empty.
+    uint16_t hash[LOGHASH];
+    // Blocks freed by the open transaction, under lock.
+    struct {
+        uint32_t start, n;
+    } discard[NDISCARD];
+    int ndiscard;
+
+    struct {
+        uint64_t nabsorb;     // Absorbed log_write()s of the open transaction
+        uint64_t ncommit;     // Totals over all commits
+        uint64_t nblock;
+        uint64_t nabsorbed;
+        uint64_t ncheckpoint;
+        uint64_t nckptblock;
+        uint64_t commit_us;
+        uint64_t max_us;
+        uint64_t last_nblock;  // The latest commit
+        uint64_t last_nabsorb;
+        uint64_t last_us;
+    } stat;
 } log;
 
 static void recover_from_log();
 static void commit();
+static void log_flusher(void*);
+static void discard();
+static int log_stat(char*, size_t);
 
 void
 initlog(int dev)
 {
-    if (sizeof(struct logheader) >= BSIZE)
-        panic("\tinitlog: logheader is too big.\n");
+    if (sizeof(struct logdesc) > BSIZE)
+        panic("\tinitlog: logdesc is too big.\n");
 
     struct superblock sb;
     initlock(&log.lock, "log");
     readsb(dev, &sb);
     log.start = sb.logstart;
-    log.size = sb.nlog;
+    log.size = sb.nlog - 1;
     log.dev = dev;
+    if (log.size < LOGSIZE + 2)
+        panic("\tinitlog: log of %d blocks is too small.\n", sb.nlog);
+
+    // Every pending block took at least one slot of the area.
+    int order = 0;
+    while ((PGSIZE << order) < log.size * sizeof(uint32_t)) order++;
+    if (!(log.ckpt = (uint32_t*)kalloc_pages(order)))
+        panic("\tinitlog: failed to allocate checkpoint list.\n");
+
     recover_from_log();
-    cprintf("initlog: success.\n");
+    kthread_create("log_flusher", log_flusher, NULL);
+    kstat_register(KSTAT_LOG, log_stat);
+    cprintf("initlog: %d log blocks, success.\n", sb.nlog);
 }
 
-/*
- * Copy committed blocks from log to their home location.
- */
-static void
-install_trans()
-{
-    for (int i = 0; i < log.lh.n; ++i) {
-        struct buf* log_buf = bread(log.dev, log.start + i + 1);
-        struct buf* dst_buf = bread(log.dev, log.lh.block[i]);
-        memmove(dst_buf->data, log_buf->data, BSIZE);
-        brelse(log_buf);
-        bwrite(dst_buf);
-        brelse(dst_buf);
-    }
+/* Block number of offset off of the circular area. */
+static uint32_t
+log_block(uint32_t off)
+{
+    return log.start + 1 + off % log.size;
 }
 
 /*
@@ -92,34 +166,124 @@ static void
 read_head()
 {
     struct buf* buf = bread(log.dev, log.start);
-    struct logheader* lh = (struct logheader*)(buf->data);
-    log.lh.n = lh->n;
-    for (int i = 0; i < log.lh.n; ++i) log.lh.block[i] = lh->block[i];
+    memmove(&log.hdr, buf->data, sizeof(log.hdr));
     brelse(buf);
 }
 
 /*
  * Write in-memory log header to disk.
  * This is the true point at which the
- * current transaction commits.
+ * checkpointed transactions leave the log.
  */
 static void
 write_head()
 {
-    struct buf* buf = bread(log.dev, log.start);
-    struct logheader* lh = (struct logheader*)(buf->data);
-    lh->n = log.lh.n;
-    for (int i = 0; i < log.lh.n; ++i) lh->block[i] = log.lh.block[i];
+    struct buf* buf = bgetblk(log.dev, log.start);
+    memset(buf->data, 0, BSIZE);
+    memmove(buf->data, &log.hdr, sizeof(log.hdr));
     bwrite(buf);
     brelse(buf);
 }
 
+/*
+ * Write every committed block home and empty the log.
+ * Only called right after a commit by the flusher, when the cache
+ * holds nothing but committed data.
+ */
+static void
+checkpoint()
+{
+    int n = log.nckpt;
+    struct buf** bs = (struct buf**)kalloc_pages(0);
+    if (!bs) panic("\tcheckpoint: out of memory.\n");
+
+    for (int done = 0; done < n;) {
+        int m = MIN(n - done, (int)(PGSIZE / sizeof(struct buf*)));
+        for (int i = 0; i < m; ++i) bs[i] = bread(log.dev, log.ckpt[done + i]);
+
+        // Sort by block number so that adjacent blocks merge into one request.
+        for (int i = 1; i < m; ++i) {
+            struct buf* b = bs[i];
+            int j = i;
+            for (; j > 0 && bs[j - 1]->blockno > b->blockno; --j)
+                bs[j] = bs[j - 1];
+            bs[j] = b;
+        }
+
+        for (int i = 0; i < m; ++i) bs[i]->flags &= ~B_CKPT;
+        bwrite_multi(bs, m);
+        for (int i = 0; i < m; ++i) brelse(bs[i]);
+        done += m;
+    }
+    kfree_pages((char*)bs, 0);
+
+    log.stat.ncheckpoint++;
+    log.stat.nckptblock += n;
+    log.nckpt = 0;
+    log.used = 0;
+    log.hdr.tail = log.head % log.size;
+    log.hdr.seq = log.seq;
+    write_head();
+}
+
+/*
+ * Replay committed transactions from the tail, writing their
+ * blocks home as it goes.
+ */
 static void
 recover_from_log()
 {
+    // Both arrays in a page, kept off the stack.
+    struct buf** log_buf = (struct buf**)kalloc_pages(0);
+    if (!log_buf) panic("\trecover_from_log: out of memory.\n");
+    struct buf** dst_buf = log_buf + LOGSIZE;
+
     read_head();
-    install_trans();  // if committed, copy from log to disk
-    log.lh.n = 0;
+    uint32_t off = log.hdr.tail, seq = log.hdr.seq;
+    int ntrans = 0;
+
+    while (1) {
+        struct buf* d = bread(log.dev, log_block(off));
+        struct logdesc* desc = (struct logdesc*)d->data;
+        int n = desc->n;
+        if (desc->magic != LOG_DESC || desc->seq != seq || n > LOGSIZE) {
+            brelse(d);
+            break;
+        }
+
+        struct buf* c = bread(log.dev, log_block(off + 1 + n));
+        struct logdesc* com = (struct logdesc*)c->data;
+        int ok = com->magic == LOG_COMMIT && com->seq == seq;
+        brelse(c);
+        if (!ok) {
+            brelse(d);
+            break;
+        }
+
+        for (int i = 0; i < n; ++i)
+            log_buf[i] = bgetblk(log.dev, log_block(off + 1 + i));
+        bread_multi(log_buf, n);
+        for (int i = 0; i < n; ++i) {
+            dst_buf[i] = bgetblk(log.dev, desc->block[i]);
+            memmove(dst_buf[i]->data, log_buf[i]->data, BSIZE);
+            brelse(log_buf[i]);
+        }
+        brelse(d);
+        bwrite_multi(dst_buf, n);
+        for (int i = 0; i < n; ++i) brelse(dst_buf[i]);
+
+        off += n + 2;
+        seq++;
+        ntrans++;
+    }
+    kfree_pages((char*)log_buf, 0);
+
+    if (ntrans) cprintf("initlog: replayed %d transactions.\n", ntrans);
+    log.head = off % log.size;
+    log.used = 0;
+    log.seq = seq;
+    log.hdr.tail = log.head;
+    log.hdr.seq = seq;
     write_head();  // clear the log
 }
 
@@ -128,16 +292,28 @@ recover_from_log()
  */
 void
 begin_op()
+{
+    begin_op_n(1);
+}
+
+/*
+ * Start an operation that may write up to n * MAXOPBLOCKS blocks,
+ * such as the writeback of a page, and reserve log space for it.
+ */
+void
+begin_op_n(int n)
 {
     acquire(&log.lock);
     while (1) {
         if (log.committing) {
             sleep(&log, &log.lock);
-        } else if (log.lh.n + (log.outstanding + 1) * MAXOPBLOCKS > LOGSIZE) {
+        } else if (log.lh.n + (log.outstanding + n) * MAXOPBLOCKS > LOGSIZE) {
             // This op might exhaust log space; wait for commit.
+            log.urgent = 1;
+            wakeup(&log.lh);
             sleep(&log, &log.lock);
         } else {
-            ++log.outstanding;
+            log.outstanding += n;
             release(&log.lock);
             break;
         }
@@ -146,60 +322,167 @@ begin_op()
 
 /*
  * Called at the end of each FS system call.
- * Commits if this was the last outstanding operation.
+ * Hands the transaction to the flusher if this was the last
+ * outstanding operation, without waiting for the commit.
  */
 void
 end_op()
 {
-    int do_commit = 0;
+    end_op_n(1);
+}
 
+/* End an operation started with begin_op_n(n). */
+void
+end_op_n(int n)
+{
     acquire(&log.lock);
-    --log.outstanding;
-    if (log.committing) panic("\tend_op: log is committing.\n");
-    if (!log.outstanding) {
-        do_commit = 1;
-        log.committing = 1;
-    } else {
-        // begin_op() may be waiting for log space, and decrementing
-        // log.outstanding has decreased the amount of reserved space.
-        wakeup(&log);
+    log.outstanding -= n;
+    if (!log.outstanding && log.lh.n) wakeup(&log.lh);
+    // begin_op() may be waiting for log space, and decrementing
+    // log.outstanding has decreased the amount of reserved space.
+    // The flusher may be waiting for the last op of a closed
+    // transaction.
+    wakeup(&log);
+    release(&log.lock);
+}
+
+/*
+ * Wait until the updates of every FS system call that has
+ * finished are on disk. Must be called outside of begin_op() /
+ * end_op().
+ */
+void
+log_force()
+{
+    acquire(&log.lock);
+    // Whatever is logged goes out with the commit in progress if
+    // there is one, since it was closed after those ops ended,
+    // or with the next one otherwise.
+    if (log.lh.n || log.committing) {
+        uint64_t target = log.ncommit + 1;
+        log.urgent = 1;
+        wakeup(&log.lh);
+        while (log.ncommit < target) sleep(&log, &log.lock);
     }
     release(&log.lock);
+}
+
+/*
+ * The log flusher thread. Woken when a transaction has blocks and
+ * no FS system call is inside it, it lets other runnable processes
+ * add to the batch for one round, then closes the transaction,
+ * waits for the ops still in it and commits.
+ */
+static void
+log_flusher(void* arg)
+{
+    acquire(&log.lock);
+    while (1) {
+        while (!log.lh.n || (log.outstanding && !log.urgent))
+            sleep(&log.lh, &log.lock);
+
+        if (!log.urgent) {
+            release(&log.lock);
+            yield();
+            acquire(&log.lock);
+        }
+
+        log.committing = 1;
+        while (log.outstanding) sleep(&log, &log.lock);
+        log.urgent = 0;
+        release(&log.lock);
 
-    if (do_commit) {
         commit();
+        discard();
+
         acquire(&log.lock);
         log.committing = 0;
+        ++log.ncommit;
         wakeup(&log);
-        release(&log.lock);
     }
 }
 
 /*
- * Copy modified blocks from cache to log.
+ * Copy modified blocks from cache to the log at log.head, after a
+ * descriptor. The log blocks are overwritten entirely, so they are
+ * not read first, and they go out as one multi-block write.
+ * Blocks seen for the first time join the checkpoint list.
  */
 static void
 write_log()
 {
-    for (int i = 0; i < log.lh.n; ++i) {
-        struct buf* log_buf = bread(log.dev, log.start + i + 1);
+    struct buf** log_buf = (struct buf**)kalloc_pages(0);
+    if (!log_buf) panic("\twrite_log: out of memory.\n");
+    int n = log.lh.n;
+
+    log_buf[0] = bgetblk(log.dev, log_block(log.head));
+    log.lh.magic = LOG_DESC;
+    log.lh.seq = log.seq;
+    memset(log_buf[0]->data, 0, BSIZE);
+    memmove(log_buf[0]->data, &log.lh, sizeof(log.lh));
+
+    for (int i = 0; i < n; ++i) {
+        log_buf[i + 1] = bgetblk(log.dev, log_block(log.head + 1 + i));
         struct buf* cache_buf = bread(log.dev, log.lh.block[i]);
-        memmove(log_buf->data, cache_buf->data, BSIZE);
+        memmove(log_buf[i + 1]->data, cache_buf->data, BSIZE);
+        if (!(cache_buf->flags & B_CKPT)) {
+            cache_buf->flags |= B_CKPT;
+            log.ckpt[log.nckpt++] = log.lh.block[i];
+        }
         brelse(cache_buf);
-        bwrite(log_buf);
-        brelse(log_buf);
     }
+    bwrite_multi(log_buf, n + 1);
+    for (int i = 0; i <= n; ++i) brelse(log_buf[i]);
+    kfree_pages((char*)log_buf, 0);
+}
+
+/*
+ * Write the commit block of the transaction at log.head.
+ * This is the true point at which the current transaction commits.
+ */
+static void
+write_commit()
+{
+    struct buf* buf = bgetblk(log.dev, log_block(log.head + 1 + log.lh.n));
+    struct logdesc* com = (struct logdesc*)buf->data;
+    memset(buf->data, 0, BSIZE);
+    com->magic = LOG_COMMIT;
+    com->seq = log.seq;
+    bwrite(buf);
+    brelse(buf);
 }
 
 static void
 commit()
 {
     if (log.lh.n > 0) {
+        uint64_t t = timestamp();
+        int n = log.lh.n;
+
         write_log();
-        write_head();
-        install_trans();
+        write_commit();
+        log.head = (log.head + n + 2) % log.size;
+        log.used += n + 2;
+        log.seq++;
         log.lh.n = 0;
-        write_head();  // erase the transaction from the log
+        memset(log.hash, 0, sizeof(log.hash));
+
+        // Make sure the next transaction fits, whatever its size.
+        if (log.size - log.used < LOGSIZE + 2) checkpoint();
+
+        t = (timestamp() - t) * 1000000 / timerfreq();
+        trace(TR_COMMIT, n, t);
+        acquire(&log.lock);
+        log.stat.ncommit++;
+        log.stat.nblock += n;
+        log.stat.nabsorbed += log.stat.nabsorb;
+        log.stat.commit_us += t;
+        log.stat.max_us = MAX(log.stat.max_us, t);
+        log.stat.last_nblock = n;
+        log.stat.last_nabsorb = log.stat.nabsorb;
+        log.stat.last_us = t;
+        log.stat.nabsorb = 0;
+        release(&log.lock);
     }
 }
 
@@ -217,19 +500,77 @@ commit()
 void
 log_write(struct buf* b)
 {
-    if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+    if (log.lh.n >= LOGSIZE)
         panic("\tlog_write: transaction is too big.\n");
     if (log.outstanding < 1) panic("\tlog_write: outside of transaction.\n");
 
     acquire(&log.lock);
-    int i = 0;
-    for (; i < log.lh.n; ++i) {
-        if (log.lh.block[i] == b->blockno) break;  // log absorption
+    uint32_t h = (b->blockno * 2654435761u) % LOGHASH;
+    for (; log.hash[h]; h = (h + 1) % LOGHASH) {
+        if (log.lh.block[log.hash[h] - 1] == b->blockno) break;  // log absorption
     }
-    if (i == log.lh.n) {
-        log.lh.block[i] = b->blockno;
-        ++log.lh.n;
+    if (log.hash[h]) {
+        log.stat.nabsorb++;
+    } else {
+        log.lh.block[log.lh.n] = b->blockno;
+        log.hash[h] = ++log.lh.n;
     }
     b->flags |= B_DIRTY;  // prevent eviction
     release(&log.lock);
 }
+
+/*
+ * Caller has freed block b inside a transaction. Remember it for
+ * discard(); extents that do not fit are simply not discarded.
+ */
+void
+log_discard(uint32_t b)
+{
+    acquire(&log.lock);
+    int n = log.ndiscard;
+    if (n && log.discard[n - 1].start + log.discard[n - 1].n == b) {
+        log.discard[n - 1].n++;
+    } else if (n && log.discard[n - 1].start == b + 1) {
+        log.discard[n - 1].start--;
+        log.discard[n - 1].n++;
+    } else if (n < NDISCARD) {
+        log.discard[n].start = b;
+        log.discard[n].n = 1;
+        log.ndiscard++;
+    }
+    release(&log.lock);
+}
+
+/*
+ * Discard the blocks freed by the transaction that just committed.
+ * Only called by the flusher, while no FS system call can run.
+ */
+static void
+discard()
+{
+    for (int i = 0; i < log.ndiscard; i++)
+        bdiscard(log.dev, log.discard[i].start, log.discard[i].n);
+    log.ndiscard = 0;
+}
+
+/* Print the log counters for the statistics device. */
+static int
+log_stat(char* buf, size_t n)
+{
+    acquire(&log.lock);
+    uint64_t nc = MAX(log.stat.ncommit, 1UL);
+    int len = snprintf(
+        buf, n,
+        "size %d used %d open %d outstanding %d\n"
+        "commits %lld blocks %lld absorbed %lld avg_blocks %lld\n"
+        "commit_us avg %lld max %lld\n"
+        "last blocks %lld absorbed %lld us %lld\n"
+        "checkpoints %lld blocks %lld\n",
+        log.size, log.used, log.lh.n, log.outstanding, log.stat.ncommit,
+        log.stat.nblock, log.stat.nabsorbed, log.stat.nblock / nc,
+        log.stat.commit_us / nc, log.stat.max_us, log.stat.last_nblock,
+        log.stat.last_nabsorb, log.stat.last_us, log.stat.ncheckpoint,
+        log.stat.nckptblock);
+    release(&log.lock);
+    return len;
+}
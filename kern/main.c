@@ -1,64 +1,153 @@
 #include <stdint.h>
 
 #include "arm.h"
+#include "bench.h"
+#include "boot.h"
 #include "buf.h"
 #include "console.h"
 #include "file.h"
+#include "futex.h"
+#include "ipi.h"
 #include "kalloc.h"
+#include "kstat.h"
+#include "pcache.h"
+#include "pipe.h"
 #include "proc.h"
+#include "prof.h"
 #include "sd.h"
 #include "spinlock.h"
 #include "string.h"
+#include "syscall1.h"
 #include "timer.h"
+#include "trace.h"
 #include "trap.h"
+#include "vdso.h"
 #include "vm.h"
 
-static struct spinlock start_lock = {0};
-volatile static int started = 0;
+/*
+ * Boot in stages. CPU 0 sets up what every CPU depends on, then lets
+ * the others do their own setup while it does the rest; all of them
+ * schedule once the first process exists. The SD card, which takes
+ * long to come up, is left to forkret(), where waiting for it does
+ * not hold anything else up.
+ *
+ * stage lives in .data: CPU 0 zeroes .bss while the others poll it.
+ */
+#define STAGE_CORE  1 /* Memory, processes and interrupts are set up */
+#define STAGE_READY 2 /* The first process is runnable */
+
+__attribute__((section(".data"))) volatile static int stage = 0;
+
+static struct {
+    const char* name;
+    int cpu;
+    uint64_t start;  // Ticks since power-on
+    uint64_t ticks;
+} steps[NBOOTSTEP];
+static int nsteps;
+
+void boot_step(const char* name, uint64_t start) {
+    int i = __atomic_fetch_add(&nsteps, 1, __ATOMIC_RELAXED);
+    if (i >= NBOOTSTEP) return;
+    steps[i].name = name;
+    steps[i].cpu = cpuid();
+    steps[i].start = start;
+    steps[i].ticks = timestamp() - start;
+}
+
+static int boot_stat(char* buf, size_t n) {
+    size_t len = 0;
+    int m = MIN(__atomic_load_n(&nsteps, __ATOMIC_RELAXED), NBOOTSTEP);
+    for (int i = 0; i < m && len < n; ++i) {
+        if (!steps[i].name) continue;  // Still being recorded
+        len += snprintf(buf + len, n - len, "cpu%d %s at %lld took %lld\n", steps[i].cpu, steps[i].name,
+                        ticks2us(steps[i].start), ticks2us(steps[i].ticks));
+    }
+    return MIN(len, n);
+}
+
+/* The root file system is up: boot is over. */
+void boot_done() {
+    cprintf("main: boot took %lld us.\n", ticks2us(timestamp()));
+}
+
+static void stage_set(int s) {
+    __atomic_store_n(&stage, s, __ATOMIC_RELEASE);
+    asm volatile("dsb ishst; sev");
+}
+
+static void stage_wait(int s) {
+    // A sev between the load and wfe is latched, so no wakeup is lost.
+    while (__atomic_load_n(&stage, __ATOMIC_ACQUIRE) < s)
+        asm volatile("wfe");
+}
 
 void main() {
     extern char edata[], end[], vectors[];
 
-    acquire(&start_lock);
-    if (!started) {
+    if (cpuid() == 0) {
         memset(edata, 0, end - edata);
 
-        console_init();
+        BOOT_STEP("console_init", console_init());
 
         cprintf("main: [CPU %d] init started.\n", cpuid());
 
-        alloc_init();
+        BOOT_STEP("alloc_init", alloc_init());
 
-        proc_init();
+        BOOT_STEP("vm_init", vm_init());
+
+        BOOT_STEP("proc_init", proc_init());
 
         lvbar(vectors);
 
-        irq_init();
+        BOOT_STEP("irq_init", irq_init());
 
-        timer_init();
+        stage_set(STAGE_CORE);  // allow APs to set themselves up
 
-        file_init();
+        BOOT_STEP("timer_init", timer_init());
 
-        binit();
+        ipi_init();
 
-        sd_init();
+        BOOT_STEP("file_init", file_init());
 
-        user_init();
+        BOOT_STEP("pipe_init", pipe_init());
 
-        started = 1;
+        BOOT_STEP("futex_init", futex_init());
 
-        release(&start_lock);  // allow APs to run
+        BOOT_STEP("vdso_init", vdso_init());
 
-    } else {
-        release(&start_lock);
+        BOOT_STEP("kstat_init", kstat_init());
 
-        cprintf("main: [CPU %d] init started.\n", cpuid());
+        BOOT_STEP("trace_init", trace_init());
+
+        BOOT_STEP("prof_init", prof_init());
+
+        BOOT_STEP("bench_init", bench_init());
+
+        BOOT_STEP("syscall_init", syscall_init());
+
+        BOOT_STEP("binit", binit());
+
+        BOOT_STEP("pcache_init", pcache_init());
+
+        BOOT_STEP("user_init", user_init());
+
+        kstat_register(KSTAT_BOOT, boot_stat);
+
+        stage_set(STAGE_READY);  // allow APs to run
+
+        cprintf("main: [CPU %d] init success.\n", cpuid());
+    } else {
+        stage_wait(STAGE_CORE);
 
         lvbar(vectors);
 
-        timer_init();
+        BOOT_STEP("timer_init", timer_init());
+
+        ipi_init();
+
+        stage_wait(STAGE_READY);
     }
-    cprintf("main: [CPU %d] init success.\n", cpuid());
 
     scheduler();
 }
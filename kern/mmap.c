@@ -0,0 +1,374 @@
+#include "mmap.h"
+
+#include <sys/mman.h>
+
+#include "console.h"
+#include "file.h"
+#include "kalloc.h"
+#include "log.h"
+#include "memlayout.h"
+#include "mm.h"
+#include "mmu.h"
+#include "pcache.h"
+#include "string.h"
+#include "syscall1.h"
+#include "types.h"
+#include "vm.h"
+
+/*
+ * mmap()ed regions. A process has up to NVMA of them above its heap,
+ * placed from MMAPBASE up unless MAP_FIXED. Their pages are mapped
+ * on first touch, zeroed or from the page cache.
+ *
+ * File mappings map the pages of the page cache itself: MAP_SHARED
+ * ones as they are, so that every process that maps or read()s the
+ * file sees the same data, and MAP_PRIVATE ones copy-on-write if
+ * writable. MAP_SHARED pages are mapped into fork()ed children as
+ * they are, and pages of a shared file mapping start read-only so
+ * that the first write can mark them PTE_DIRTY: those get written
+ * back to the file on munmap and exit.
+ *
+ * Faults fill pages with mm->lock held, taking the inode lock of the
+ * file under it, so nothing may wait for mm->lock while it holds an
+ * inode lock. Dirty pages are therefore written back only once
+ * mm->lock is released: mmap_unmap() collects them, with a reference
+ * to each page and file, and mmap_writeback() writes them.
+ */
+
+struct vma*
+vma_find(struct mm* mm, uint64_t va)
+{
+    for (struct vma* v = mm->vma; v < mm->vma + NVMA; ++v)
+        if (v->start <= va && va < v->end) return v;
+    return 0;
+}
+
+static struct vma*
+vma_alloc(struct mm* mm)
+{
+    for (struct vma* v = mm->vma; v < mm->vma + NVMA; ++v)
+        if (!v->end) return v;
+    return 0;
+}
+
+/* Does [start, end) overlap any region of mm? */
+int
+mmap_overlap(struct mm* mm, uint64_t start, uint64_t end)
+{
+    for (struct vma* v = mm->vma; v < mm->vma + NVMA; ++v)
+        if (v->start < end && start < v->end) return 1;
+    return 0;
+}
+
+/* Does one region of mm cover all of [va, va + n)? */
+int
+mmap_covers(struct mm* mm, uint64_t va, uint64_t n)
+{
+    struct vma* v = vma_find(mm, va);
+    return v && n <= v->end - va;
+}
+
+/* Lowest free range of len bytes for a new region, or 0. */
+static uint64_t
+mmap_place(struct mm* mm, uint64_t len)
+{
+    uint64_t va = MAX(MMAPBASE, ROUNDUP(mm->sz, PGSIZE));
+    for (int i = 0; i < NVMA; ++i) {
+        struct vma* v = &mm->vma[i];
+        if (v->start < va + len && va < v->end) {
+            va = v->end;
+            i = -1;  // Start over above it
+        }
+    }
+    return va + len <= MMAPTOP ? va : 0;
+}
+
+static int
+vma_shared_file(struct vma* v)
+{
+    return v->f && (v->flags & MAP_SHARED);
+}
+
+/*
+ * Map page-aligned va of region v, not mapped yet, or the whole
+ * 2 MiB block around it if v is anonymous and covers the block.
+ */
+static int
+vma_fill(struct mm* mm, struct vma* v, uint64_t va, int write)
+{
+    uint64_t perm = PTE_USER | PTE_PAGE;
+    if (!(v->prot & PROT_WRITE))
+        perm |= PTE_RO;
+    else if (vma_shared_file(v))
+        perm |= write ? PTE_DIRTY : PTE_RO;
+    else if (v->f)
+        perm |= PTE_RO | PTE_COW;  // A private copy of the cached page
+
+    uint64_t b = ROUNDDOWN(va, BKSIZE);
+    if (!v->f && b >= v->start && b + BKSIZE <= v->end && !uvm_alloc_block(mm->pgdir, b, perm))
+        return 0;
+
+    char* mem = v->f ? pcache_get(v->f->ip, (v->off + (va - v->start)) / PGSIZE) : kalloc_zeroed();
+    if (!mem) return -1;
+
+    uint64_t* pte = pgdir_walk(mm->pgdir, (void*)va, 0);
+    if (pte && (*pte & PTE_P)) {
+        kpage_put(mem);  // Mapped while we read
+        return 0;
+    }
+    if (map_region(mm->pgdir, (void*)va, PGSIZE, (uint64_t)mem, perm)) {
+        kpage_put(mem);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Handle a fault at va of mm above its heap: map the page if it is in
+ * a region that allows the access, or note that a shared file page
+ * is about to be dirtied. Returns 0 if the access can be retried.
+ */
+int
+mmap_fault(struct mm* mm, uint64_t va, int write)
+{
+    struct vma* v = vma_find(mm, va);
+    if (!v || !(v->prot & (write ? PROT_WRITE : PROT_READ | PROT_EXEC)))
+        return -1;
+
+    va = PTE_ADDR(va);
+    uint64_t* pte = pgdir_walk(mm->pgdir, (void*)va, 0);
+    if (!pte || !(*pte & PTE_P)) return vma_fill(mm, v, va, write);
+    if (!vma_shared_file(v)) return -1;
+    *pte = (*pte & ~PTE_RO) | PTE_DIRTY;
+    tlbi_va(va);
+    return 0;
+}
+
+/*
+ * Write page back to ip at off. Like file_write(), a few blocks per
+ * transaction; unlike it, never past the end of the file. Caller
+ * holds no mm->lock.
+ */
+static void
+page_writeback(struct inode* ip, size_t off, char* page)
+{
+    size_t max = ((MAXOPBLOCKS - 4) / 2) * BSIZE;
+
+    for (size_t i = 0; i < PGSIZE; i += max) {
+        begin_op();
+        ilock(ip);
+        if (off + i < ip->size)
+            writei(ip, page + i, off + i, MIN(MIN(PGSIZE - i, max), ip->size - off - i));
+        iunlock(ip);
+        end_op();
+    }
+}
+
+/* The dirty page at va of shared file region v in mm, or 0. */
+static char*
+vma_dirty(struct mm* mm, struct vma* v, uint64_t va)
+{
+    uint64_t* pte = pgdir_walk(mm->pgdir, (void*)va, 0);
+    return pte && (*pte & PTE_P) && (*pte & PTE_DIRTY) ? P2V(PTE_ADDR(*pte)) : 0;
+}
+
+/*
+ * Unmap [start, end) of region v. Its dirty pages go to wb, or are
+ * written back at once if wb is 0.
+ */
+static void
+vma_release(struct mm* mm, struct vma* v, uint64_t start, uint64_t end, struct mmap_wb* wb)
+{
+    for (uint64_t va = start; vma_shared_file(v) && va < end; va += PGSIZE) {
+        char* page = vma_dirty(mm, v, va);
+        size_t off = v->off + (va - v->start);
+        if (page && !wb) {
+            page_writeback(v->f->ip, off, page);
+        } else if (page) {
+            kpage_get(page);
+            wb->pg[wb->n++] = (struct mmap_page){file_dup(v->f), off, page};
+        }
+    }
+    uvm_unmap(mm->pgdir, start, (end - start) / PGSIZE, 1);
+    tlbi_all();
+}
+
+/* kalloc_pages() order of room for n dirty pages. */
+static int
+wb_order(int n)
+{
+    int order = 0;
+    while ((PGSIZE << order) < n * sizeof(struct mmap_page)) order++;
+    return order;
+}
+
+/*
+ * Write back and drop the dirty pages that mmap_unmap() put in wb,
+ * once mm->lock is released.
+ */
+void
+mmap_writeback(struct mmap_wb* wb)
+{
+    for (int i = 0; i < wb->n; i++) {
+        page_writeback(wb->pg[i].f->ip, wb->pg[i].off, wb->pg[i].page);
+        kpage_put(wb->pg[i].page);
+        file_close(wb->pg[i].f);
+    }
+    if (wb->pg) kfree_pages((char*)wb->pg, wb_order(wb->n));
+    wb->pg = 0;
+    wb->n = 0;
+}
+
+/*
+ * Remove [start, end) from the regions of mm. A region may lose its
+ * head or tail, or be split in two. The dirty pages go to wb, for
+ * mmap_writeback(), or are written back at once if wb is 0, which
+ * only a caller without mm->lock may ask. Returns 0, or -1 if there
+ * is no room for the second half of a split or the dirty pages.
+ */
+int
+mmap_unmap(struct mm* mm, uint64_t start, uint64_t end, struct mmap_wb* wb)
+{
+    if (wb) {
+        // Room for all of them up front, so nothing fails half-way.
+        int n = 0;
+        for (struct vma* v = mm->vma; v < mm->vma + NVMA; ++v)
+            for (uint64_t va = MAX(v->start, start); vma_shared_file(v) && va < MIN(v->end, end); va += PGSIZE)
+                n += vma_dirty(mm, v, va) != 0;
+        wb->n = 0;
+        wb->pg = 0;
+        if (n && (wb_order(n) > MAX_ORDER || !(wb->pg = (struct mmap_page*)kalloc_pages(wb_order(n)))))
+            return -1;
+    }
+    for (struct vma* v = mm->vma; v < mm->vma + NVMA; ++v) {
+        if (v->end <= start || end <= v->start) continue;
+        uint64_t lo = MAX(v->start, start), hi = MIN(v->end, end);
+
+        if (v->start < lo && hi < v->end) {
+            struct vma* w = vma_alloc(mm);
+            if (!w) return -1;
+            *w = *v;
+            w->off += hi - v->start;
+            w->start = hi;
+            if (w->f) file_dup(w->f);
+            v->end = hi;
+        }
+        vma_release(mm, v, lo, hi, wb);
+        if (lo == v->start && hi == v->end) {
+            if (v->f) file_close(v->f);
+            memset(v, 0, sizeof(*v));
+        } else if (lo == v->start) {
+            v->off += hi - v->start;
+            v->start = hi;
+        } else {
+            v->end = lo;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Give the new address space nmm the regions of mm. Shared ones are
+ * populated first so that both really map the same pages.
+ */
+int
+mmap_fork(struct mm* nmm, struct mm* mm)
+{
+    for (struct vma* v = mm->vma; v < mm->vma + NVMA; ++v) {
+        if (!v->end) continue;
+        int shared = v->flags & MAP_SHARED;
+        for (uint64_t va = v->start; shared && va < v->end; va += PGSIZE) {
+            uint64_t* pte = pgdir_walk(mm->pgdir, (void*)va, 0);
+            if ((!pte || !(*pte & PTE_P)) && vma_fill(mm, v, va, 0) < 0) return -1;
+        }
+        if (uvm_copy(mm->pgdir, nmm->pgdir, v->start, v->end, shared) < 0) return -1;
+    }
+    // Nothing can fail from here on.
+    for (int i = 0; i < NVMA; ++i) {
+        nmm->vma[i] = mm->vma[i];
+        if (nmm->vma[i].f) file_dup(nmm->vma[i].f);
+    }
+    return 0;
+}
+
+/* Drop all regions of mm, once nothing uses it. */
+void
+mmap_exit(struct mm* mm)
+{
+    mmap_unmap(mm, 0, USERTOP, 0);
+}
+
+size_t
+sys_mmap()
+{
+    uint64_t addr, len, prot, flags, fd, off;
+    if (argint(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0
+        || argint(3, &flags) < 0 || argint(4, &fd) < 0 || argint(5, &off) < 0)
+        return -1;
+
+    struct proc* p = thisproc();
+    struct mm* mm = p->mm;
+    struct file* f = 0;
+    struct mmap_wb wb = {0};
+    len = ROUNDUP(len, PGSIZE);
+    if (!len || len > MMAPTOP || off % PGSIZE || !(flags & (MAP_SHARED | MAP_PRIVATE)))
+        return -1;
+    if (!(flags & MAP_ANONYMOUS)) {
+        if (!(f = fd_get(p, fd)))
+            return -1;
+        if (f->type != FD_INODE || f->ip->type != T_FILE || !f->readable
+            || ((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)) {
+            file_close(f);
+            return -1;
+        }
+    }
+
+    acquiresleep(&mm->lock);
+    if (!vma_alloc(mm))
+        goto bad;
+    if (flags & MAP_FIXED) {
+        if (addr % PGSIZE || addr < mm->sz || addr + len > MMAPTOP || addr + len < addr
+            || mmap_unmap(mm, addr, addr + len, &wb) < 0)
+            goto bad;
+    } else if (!(addr = mmap_place(mm, len))) {
+        goto bad;
+    }
+
+    struct vma* v = vma_alloc(mm);  // Splitting a region may have taken it
+    if (!v)
+        goto bad;
+    v->start = addr;
+    v->end = addr + len;
+    v->prot = prot;
+    v->flags = flags & (MAP_SHARED | MAP_PRIVATE);
+    v->f = f;  // Takes over the reference of fd_get()
+    v->off = f ? off : 0;
+    releasesleep(&mm->lock);
+    mmap_writeback(&wb);
+    return addr;
+
+bad:
+    releasesleep(&mm->lock);
+    mmap_writeback(&wb);
+    if (f)
+        file_close(f);
+    return -1;
+}
+
+int
+sys_munmap()
+{
+    uint64_t addr, len;
+    if (argint(0, &addr) < 0 || argint(1, &len) < 0)
+        return -1;
+    len = ROUNDUP(len, PGSIZE);
+    if (addr % PGSIZE || !len || addr + len > MMAPTOP || addr + len < addr)
+        return -1;
+    struct mm* mm = thisproc()->mm;
+    struct mmap_wb wb;
+    acquiresleep(&mm->lock);
+    int r = mmap_unmap(mm, addr, addr + len, &wb);
+    releasesleep(&mm->lock);
+    mmap_writeback(&wb);
+    return r;
+}
@@ -0,0 +1,737 @@
+#include "pcache.h"
+
+#include "buf.h"
+#include "console.h"
+#include "file.h"
+#include "kalloc.h"
+#include "kstat.h"
+#include "log.h"
+#include "mmu.h"
+#include "proc.h"
+#include "sd.h"
+#include "slab.h"
+#include "sleeplock.h"
+#include "spinlock.h"
+#include "string.h"
+#include "types.h"
+
+/*
+ * Page cache.
+ *
+ * File data is cached in whole pages, per inode, in a radix tree
+ * keyed by page index rooted at ip->pages. readi() and writei() copy
+ * through it, exec and mmap() map its pages into processes: read-only
+ * for program text, as they are for MAP_SHARED file mappings, and
+ * copy-on-write for private writable ones. So every process that
+ * reads, runs or maps a file sees the same copy of its data, and a
+ * program that is run again faults in its text without reading the
+ * disk or allocating. The buffer cache is left with metadata and the
+ * data blocks that writei() puts through the log on their way home.
+ *
+ * Pages are read in with the inode locked, straight from the card
+ * into the page for blocks the buffer cache does not hold, and from
+ * the buffer cache, which may be newer than the disk, for the others.
+ * writei() of a regular file, also under the inode lock, only copies
+ * into the cached pages and marks them dirty; the file size goes
+ * through the log as before, but the blocks are neither allocated nor
+ * written yet. Directories, and files whose pages cannot be cached,
+ * write through: the blocks as before, and the cached pages they are
+ * in. So the cache is never stale, and a page that is cached is never
+ * read again.
+ *
+ * Inodes with dirty pages are on a list, oldest first, that holds a
+ * reference to each. The writeback thread flushes them once they are
+ * PCACHE_EXPIRE seconds old, or right away while more than dirty_bg
+ * pages are dirty; writers that find more than dirty_max wait for it.
+ * pcache_flush() writes a few pages per transaction: blocks already
+ * on disk and not in the buffer cache go straight from the pages to
+ * the card in one request, the others, new ones included, go through
+ * the buffer cache and the log. fsync() flushes the file itself.
+ *
+ * The cache owns a reference to each page, and each mapping another
+ * one. It grows up to pcache.max pages; past that, and when kalloc()
+ * runs dry, a clock sweep over the ring of all entries recycles those
+ * that are clean, that nobody maps and nobody used since the hand
+ * last passed. When
+ * an inode leaves the inode cache or is freed, its pages go too.
+ * pcache.lock protects the trees, the ring and the dirty list. Nothing
+ * is allocated under it, since kalloc() may come back through a
+ * shrinker.
+ */
+#define PCNODE_BITS  7
+#define PCNODE_SLOTS (1 << PCNODE_BITS)
+#define PCLEVELS     3 /* Enough for MAXFILE */
+#define PCACHE_RA    (RA_MAX * BSIZE / PGSIZE + 1) /* Pages one readahead() reads */
+#define PCACHE_ORDER 3 /* pcache_read() moves up to 2^PCACHE_ORDER pages of bufs */
+#define PCACHE_EXPIRE 5  /* Seconds a page may stay dirty */
+#define PCACHE_OPS    3  /* MAXOPBLOCKS reserved by each transaction of pcache_flush() */
+#define PCACHE_WB     16 /* Pages one transaction of pcache_flush() writes at most */
+
+struct pcnode {
+    void* slot[PCNODE_SLOTS];  // Nodes of the next level, or cpages
+};
+
+struct cpage {
+    struct inode* ip;
+    uint32_t idx;         // Page index in the file
+    char* page;
+    int used;             // Looked up since the clock hand last passed
+    int dirty;            // Newer than the disk
+    struct cpage* hnext;  // Free list while being dropped
+    struct cpage* cnext;  // Clock ring
+    struct cpage* cprev;
+};
+
+static struct {
+    struct spinlock lock;
+    struct kmem_cache* cache;
+    struct kmem_cache* node;
+    struct cpage* hand;  // Clock hand in the ring
+    int n;               // Pages cached
+    int max;             // Upper bound on n
+    struct inode* dhead; // Inodes with dirty pages, oldest first
+    struct inode* dtail;
+    int ndirty;          // Dirty pages
+    int dirty_bg;        // Write back regardless of age past this many
+    int dirty_max;       // Make writers wait past this many
+    struct inode* wb;    // What the writeback thread flushes
+    uint64_t nwb;        // How many it flushed
+
+    // Statistics, updated without locks.
+    uint64_t nget;       // Pages looked up
+    uint64_t nmiss;      // ... that had to be read
+    uint64_t nra;        // Pages read ahead
+    uint64_t nwrite;     // Pages written back
+    uint64_t nthrottle;  // Writers that had to wait
+} pcache;
+
+/*
+ * The leaf slot of page idx of ip. Missing nodes on the way are taken
+ * from *spare, which is then cleared; if there is none, returns 0.
+ * Caller holds pcache.lock.
+ */
+static struct cpage**
+pcache_slot(struct inode* ip, uint32_t idx, struct pcnode** spare)
+{
+    if (idx >> (PCLEVELS * PCNODE_BITS)) return 0;
+    struct pcnode** np = &ip->pages;
+    for (int l = PCLEVELS - 1;; l--) {
+        if (!*np) {
+            if (!spare || !*spare) return 0;
+            *np = *spare;
+            *spare = NULL;
+        }
+        void** slot = &(*np)->slot[(idx >> (l * PCNODE_BITS)) & (PCNODE_SLOTS - 1)];
+        if (!l) return (struct cpage**)slot;
+        np = (struct pcnode**)slot;
+    }
+}
+
+static struct cpage*
+pcache_find(struct inode* ip, uint32_t idx)
+{
+    struct cpage** slot = pcache_slot(ip, idx, NULL);
+    return slot ? *slot : NULL;
+}
+
+/* Take c off its tree and the ring. Caller holds pcache.lock. */
+static void
+pcache_unlink(struct cpage* c)
+{
+    *pcache_slot(c->ip, c->idx, NULL) = NULL;
+    c->ip->npages--;
+
+    if (pcache.hand == c) pcache.hand = c->cnext != c ? c->cnext : NULL;
+    c->cprev->cnext = c->cnext;
+    c->cnext->cprev = c->cprev;
+    pcache.n--;
+}
+
+/*
+ * Recycle up to n entries that nobody maps, with the clock algorithm.
+ * Two full turns clear every used bit. Caller holds pcache.lock.
+ * Returns the entries taken off the cache, chained through hnext.
+ */
+static struct cpage*
+pcache_sweep(int n)
+{
+    struct cpage* freed = NULL;
+    for (int i = 0, turns = 2 * pcache.n; n && pcache.hand && i < turns; i++) {
+        struct cpage* c = pcache.hand;
+        pcache.hand = c->cnext;
+        if (c->dirty || kpage_shared(c->page)) continue;
+        if (c->used) {
+            c->used = 0;
+            continue;
+        }
+        pcache_unlink(c);
+        c->hnext = freed;
+        freed = c;
+        n--;
+    }
+    return freed;
+}
+
+static int
+pcache_free(struct cpage* c)
+{
+    int n = 0;
+    for (struct cpage* next; c; c = next, n++) {
+        next = c->hnext;
+        kpage_put(c->page);
+        kmem_cache_free(pcache.cache, c);
+    }
+    return n;
+}
+
+/* Memory-pressure hook called by kalloc(). */
+static uint64_t
+pshrink(uint64_t npages)
+{
+    if (holding(&pcache.lock)) return 0;
+    acquire(&pcache.lock);
+    struct cpage* freed = pcache_sweep(npages);
+    release(&pcache.lock);
+    return pcache_free(freed);
+}
+
+static int
+pcache_stat(char* buf, size_t n)
+{
+    acquire(&pcache.lock);
+    int len = snprintf(buf, n,
+                       "pages %d max %d get %lld miss %lld readahead %lld\n"
+                       "dirty %d background %d max %d written %lld throttled %lld\n",
+                       pcache.n, pcache.max, pcache.nget, pcache.nmiss, pcache.nra,
+                       pcache.ndirty, pcache.dirty_bg, pcache.dirty_max, pcache.nwrite,
+                       pcache.nthrottle);
+    release(&pcache.lock);
+    return len;
+}
+
+void
+pcache_init()
+{
+    initlock(&pcache.lock, "pcache");
+    pcache.cache = kmem_cache_create("cpage", sizeof(struct cpage));
+    pcache.node = kmem_cache_create("pcnode", sizeof(struct pcnode));
+    if (!pcache.cache || !pcache.node) panic("\tpcache_init: failed to create caches.\n");
+    pcache.max = kmem_free_pages() / PCACHE_FRAC;
+    pcache.dirty_bg = MAX(pcache.max / 8, 1);
+    pcache.dirty_max = MAX(pcache.max / 4, 1);
+    kmem_register_shrinker(pshrink);
+    kstat_register(KSTAT_PCACHE, pcache_stat);
+    cprintf("pcache_init: up to %d pages.\n", pcache.max);
+}
+
+/*
+ * Read the contents of pages idx[0..n) of ip into the zeroed pages
+ * at pages[0..n). Caller holds ip->lock.
+ */
+static void
+pcache_read(struct inode* ip, char** pages, uint32_t* idx, int n)
+{
+    struct buf* bufs = (struct buf*)kalloc_pages(PCACHE_ORDER);
+    int max = bufs ? (PGSIZE << PCACHE_ORDER) / sizeof(struct buf) : 0;
+    struct buf* run[max + 1];
+    int nb = 0;
+
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < PGSIZE / BSIZE; j++) {
+            size_t off = (size_t)idx[i] * PGSIZE + j * BSIZE;
+            if (off >= ip->size) break;
+            uint32_t addr = bmap(ip, off / BSIZE, 0);
+            if (!addr) continue;  // A hole reads as zeros
+            char* dst = pages[i] + j * BSIZE;
+            if (bcached(ip->dev, addr) || !max) {
+                struct buf* bp = bread(ip->dev, addr);
+                memmove(dst, bp->data, BSIZE);
+                brelse(bp);
+                continue;
+            }
+            struct buf* b = run[nb] = &bufs[nb];
+            b->flags = 0;
+            b->dev = ip->dev;
+            b->blockno = addr;
+            b->ext = (uint8_t*)dst;
+            if (++nb == max) {
+                sd_rw_multi(run, nb);
+                nb = 0;
+            }
+        }
+    }
+    sd_rw_multi(run, nb);
+    if (bufs) kfree_pages((char*)bufs, PCACHE_ORDER);
+}
+
+/*
+ * Cache mem as page idx of ip, taking a reference for the caller too
+ * if ref is set. Returns -1 if there is no room, which leaves mem to
+ * the caller. Caller holds ip->lock, and nobody has cached the page.
+ */
+static int
+pcache_insert(struct inode* ip, uint32_t idx, char* mem, int ref)
+{
+    struct cpage* c = kmem_cache_alloc(pcache.cache);
+    if (!c) return -1;
+    c->ip = ip;
+    c->idx = idx;
+    c->page = mem;
+    c->used = 1;
+    c->dirty = 0;
+
+    struct pcnode* spare = NULL;
+    struct cpage** slot;
+    struct cpage* freed = NULL;
+    for (;;) {
+        acquire(&pcache.lock);
+        if (pcache.n >= pcache.max) freed = pcache_sweep(1);
+        if (pcache.n >= pcache.max) {
+            slot = NULL;
+            break;
+        }
+        if ((slot = pcache_slot(ip, idx, &spare)) || idx >> (PCLEVELS * PCNODE_BITS)) break;
+        // A node is missing on the way.
+        release(&pcache.lock);
+        pcache_free(freed);
+        freed = NULL;
+        if (!(spare = kmem_cache_alloc(pcache.node))) {
+            kmem_cache_free(pcache.cache, c);
+            return -1;
+        }
+        memset(spare, 0, sizeof(*spare));
+    }
+    if (slot) {
+        *slot = c;
+        ip->npages++;
+        if (!pcache.hand) {
+            c->cnext = c->cprev = c;
+            pcache.hand = c;
+        } else {
+            // Insert behind the hand so it is the last to be swept.
+            c->cnext = pcache.hand;
+            c->cprev = pcache.hand->cprev;
+            c->cprev->cnext = c;
+            pcache.hand->cprev = c;
+        }
+        pcache.n++;
+        if (ref) kpage_get(mem);
+    }
+    release(&pcache.lock);
+
+    pcache_free(freed);
+    if (spare) kmem_cache_free(pcache.node, spare);
+    if (!slot) kmem_cache_free(pcache.cache, c);
+    return slot ? 0 : -1;
+}
+
+/* Page idx of ip with a reference taken, if it is cached. */
+static char*
+pcache_lookup(struct inode* ip, uint32_t idx)
+{
+    __atomic_fetch_add(&pcache.nget, 1, __ATOMIC_RELAXED);
+    acquire(&pcache.lock);
+    struct cpage* c = pcache_find(ip, idx);
+    if (c) {
+        c->used = 1;
+        kpage_get(c->page);
+    }
+    release(&pcache.lock);
+    return c ? c->page : NULL;
+}
+
+/*
+ * Return page idx of ip, the contents of the file from idx * PGSIZE
+ * and zeros past its end, with a reference taken for the caller to
+ * map or copy it. Returns 0 if out of memory. ip may be locked.
+ */
+char*
+pcache_get(struct inode* ip, uint32_t idx)
+{
+    int locked = holdingsleep(&ip->lock);
+    if (!locked) ilock(ip);
+
+    char* mem = pcache_lookup(ip, idx);
+    if (!mem && (mem = kalloc_zeroed())) {
+        __atomic_fetch_add(&pcache.nmiss, 1, __ATOMIC_RELAXED);
+        pcache_read(ip, &mem, &idx, 1);
+        pcache_insert(ip, idx, mem, 1);  // Else the caller's alone
+    }
+
+    if (!locked) iunlock(ip);
+    return mem;
+}
+
+/*
+ * Read the pages that hold [off, off + n) of ip into the cache, as
+ * far as they are not there yet, in one go. Caller holds ip->lock.
+ */
+void
+pcache_readahead(struct inode* ip, size_t off, size_t n)
+{
+    if (ip->type != T_FILE || off >= ip->size) return;
+    if (off + n > ip->size) n = ip->size - off;
+
+    char* pages[PCACHE_RA];
+    uint32_t idx[PCACHE_RA];
+    int np = 0;
+    for (uint32_t i = off / PGSIZE; i <= (off + n - 1) / PGSIZE && np < PCACHE_RA; i++) {
+        acquire(&pcache.lock);
+        struct cpage* c = pcache_find(ip, i);
+        release(&pcache.lock);
+        if (c) continue;
+        if (!(pages[np] = kalloc_zeroed())) break;
+        idx[np++] = i;
+    }
+    if (!np) return;
+
+    __atomic_fetch_add(&pcache.nra, np, __ATOMIC_RELAXED);
+    pcache_read(ip, pages, idx, np);
+    for (int i = 0; i < np; i++)
+        if (pcache_insert(ip, idx[i], pages[i], 0) < 0) kfree(pages[i]);
+}
+
+/*
+ * Copy n bytes at src, just written to ip at off, into the cached
+ * pages that hold them. Caller holds ip->lock.
+ */
+void
+pcache_update(struct inode* ip, size_t off, char* src, size_t n)
+{
+    if (!ip->npages) return;
+    for (size_t tot = 0, m = 0; tot < n; tot += m, off += m, src += m) {
+        m = MIN(n - tot, PGSIZE - off % PGSIZE);
+        acquire(&pcache.lock);
+        struct cpage* c = pcache_find(ip, off / PGSIZE);
+        char* page = c ? c->page : NULL;
+        if (page) kpage_get(page);
+        release(&pcache.lock);
+        if (!page) continue;
+        if (page + off % PGSIZE != src)  // Written back from the page itself
+            memmove(page + off % PGSIZE, src, m);
+        kpage_put(page);
+    }
+}
+
+/* Append ip to the dirty list. Caller holds pcache.lock. */
+static void
+pcache_list(struct inode* ip)
+{
+    ip->dirtied = timestamp();
+    ip->dnext = NULL;
+    if (pcache.dtail)
+        pcache.dtail->dnext = ip;
+    else
+        pcache.dhead = ip;
+    pcache.dtail = ip;
+}
+
+/* Take the oldest inode off the dirty list. Caller holds pcache.lock. */
+static struct inode*
+pcache_pop()
+{
+    struct inode* ip = pcache.dhead;
+    if (!(pcache.dhead = ip->dnext)) pcache.dtail = NULL;
+    ip->dnext = NULL;
+    ip->dirtied = 0;
+    return ip;
+}
+
+/*
+ * Copy n bytes at src into the cached pages of ip from off and mark
+ * them dirty, as writei() of a regular file. Returns the bytes copied,
+ * short if src faults, or -1 if a page cannot be cached, for the
+ * caller to write through instead; the pages done so far stay dirty,
+ * which does no harm. A page src faulted on is marked dirty as well,
+ * because part of it may have changed. Caller holds ip->lock.
+ */
+ssize_t
+pcache_write(struct inode* ip, size_t off, char* src, size_t n)
+{
+    if (ip->type != T_FILE) return -1;
+    for (size_t tot = 0, m = 0; tot < n; tot += m, off += m, src += m) {
+        m = MIN(n - tot, PGSIZE - off % PGSIZE);
+        char* page = pcache_get(ip, off / PGSIZE);
+        if (!page) return -1;
+        int bad = 0;
+        if (page + off % PGSIZE != src)  // Written back from the page itself
+            bad = copy_user(page + off % PGSIZE, src, m) < 0;
+
+        int listed = 0, kick = 0;
+        acquire(&pcache.lock);
+        struct cpage* c = pcache_find(ip, off / PGSIZE);
+        int cached = c && c->page == page;
+        if (cached && !c->dirty) {
+            c->dirty = 1;
+            ip->ndirty++;
+            kick = ++pcache.ndirty == pcache.dirty_bg;
+            if (!ip->dirtied) {
+                pcache_list(ip);
+                listed = 1;
+            }
+        }
+        release(&pcache.lock);
+        kpage_put(page);
+
+        if (!cached) return -1;  // The caller's alone with it
+        if (listed) idup(ip);  // For the list; nobody can flush it before we unlock
+        if (kick) wakeup(&pcache.dhead);
+        if (bad) return tot;
+    }
+    return n;
+}
+
+/*
+ * The first dirty page of ip from page index from. Caller holds
+ * pcache.lock.
+ */
+static struct cpage*
+pcache_next_dirty(struct pcnode* node, int l, uint32_t base, uint32_t from)
+{
+    uint32_t span = 1U << (l * PCNODE_BITS);
+    for (int i = 0; node && i < PCNODE_SLOTS; i++) {
+        uint32_t lo = base + i * span;
+        if (!node->slot[i] || lo + span <= from) continue;
+        if (l) {
+            struct cpage* c = pcache_next_dirty(node->slot[i], l - 1, lo, from);
+            if (c) return c;
+        } else if (((struct cpage*)node->slot[i])->dirty) {
+            return node->slot[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Write back dirty pages of ip from page index from, as many as one
+ * transaction takes: up to PCACHE_WB pages, at most one of which
+ * goes through the log. Returns the index to go on from, or -1 if
+ * there is nothing left. Caller holds ip->lock, and is inside
+ * begin_op_n(PCACHE_OPS), which is enough for a page of new blocks
+ * with the indirect and bitmap blocks they need, and the inode.
+ */
+static uint32_t
+pcache_flush_some(struct inode* ip, uint32_t from, struct buf* bufs, int max)
+{
+    struct buf* run[max + 1];
+    char* pinned[PCACHE_WB];
+    int nb = 0, np = 0, logged = 0;
+
+    for (int done = 0; done < PCACHE_WB; done++) {
+        acquire(&pcache.lock);
+        struct cpage* c = pcache_next_dirty(ip->pages, PCLEVELS - 1, 0, from);
+        release(&pcache.lock);
+        if (!c) {
+            from = -1;
+            break;
+        }
+
+        // Dirty pages stay put while we hold ip->lock, see pcache_sweep().
+        size_t off = (size_t)c->idx * PGSIZE;
+        int nblk = off < ip->size ? MIN(PGSIZE, ip->size - off + BSIZE - 1) / BSIZE : 0;
+        int vialog = !max;
+        for (int j = 0; j < nblk && !vialog; j++) {
+            uint32_t addr = bmap(ip, off / BSIZE + j, 0);
+            vialog = !addr || bcached(ip->dev, addr);
+        }
+        if ((vialog && logged) || (!vialog && nb + nblk > max)) break;
+
+        acquire(&pcache.lock);
+        c->dirty = 0;
+        ip->ndirty--;
+        pcache.ndirty--;
+        char* page = c->page;
+        kpage_get(page);
+        release(&pcache.lock);
+        from = c->idx + 1;
+
+        for (int j = 0; j < nblk; j++) {
+            if (vialog) {
+                struct buf* bp = bread(ip->dev, bmap(ip, off / BSIZE + j, 1));
+                memmove(bp->data, page + j * BSIZE, BSIZE);
+                log_write(bp);
+                brelse(bp);
+            } else {
+                struct buf* b = run[nb] = &bufs[nb];
+                nb++;
+                b->flags = B_DIRTY;
+                b->dev = ip->dev;
+                b->blockno = bmap(ip, off / BSIZE + j, 0);
+                b->ext = (uint8_t*)page + j * BSIZE;
+            }
+        }
+        if (vialog) {
+            logged = 1;
+            kpage_put(page);
+        } else {
+            pinned[np++] = page;  // Until the card has it
+        }
+        __atomic_fetch_add(&pcache.nwrite, 1, __ATOMIC_RELAXED);
+    }
+
+    sd_rw_multi(run, nb);
+    for (int i = 0; i < np; i++) kpage_put(pinned[i]);
+    if (logged) iupdate(ip);  // bmap() may have allocated
+    wakeup(&pcache.ndirty);
+    return from;
+}
+
+/*
+ * Write back the pages of ip that are dirty, as far as it takes.
+ * Called with a reference to ip, and neither its lock nor a
+ * transaction. The data is on disk once the log is forced too.
+ */
+void
+pcache_flush(struct inode* ip)
+{
+    struct buf* bufs = (struct buf*)kalloc_pages(PCACHE_ORDER);
+    int max = bufs ? (PGSIZE << PCACHE_ORDER) / sizeof(struct buf) : 0;
+
+    for (uint32_t from = 0; from != (uint32_t)-1 && ip->ndirty;) {
+        begin_op_n(PCACHE_OPS);
+        ilock(ip);
+        from = pcache_flush_some(ip, from, bufs, max);
+        iunlock(ip);
+        end_op_n(PCACHE_OPS);
+    }
+    if (bufs) kfree_pages((char*)bufs, PCACHE_ORDER);
+}
+
+/*
+ * Flush ip, just taken off the dirty list with the reference of the
+ * list, and put it back at the end if it is dirty again and nobody
+ * put it back yet.
+ */
+static void
+pcache_writeback_inode(struct inode* ip)
+{
+    pcache_flush(ip);
+    acquire(&pcache.lock);
+    int relist = ip->ndirty && !ip->dirtied;
+    if (relist) pcache_list(ip);
+    release(&pcache.lock);
+    if (!relist) {
+        // The last reference to an unlinked file frees it.
+        begin_op();
+        iput(ip);
+        end_op();
+    }
+}
+
+/*
+ * The writeback thread. Flushes the oldest dirty inode whenever it
+ * has been dirty for PCACHE_EXPIRE seconds, or more than dirty_bg
+ * pages are dirty. pcache_clock() wakes it to look at the ages.
+ */
+static void
+pcache_writeback(void* arg)
+{
+    acquire(&pcache.lock);
+    while (1) {
+        struct inode* ip = pcache.dhead;
+        if (!ip || (pcache.ndirty < pcache.dirty_bg
+                    && timestamp() - ip->dirtied < PCACHE_EXPIRE * timerfreq())) {
+            sleep(&pcache.dhead, &pcache.lock);
+            continue;
+        }
+        pcache.wb = pcache_pop();
+        release(&pcache.lock);
+        pcache_writeback_inode(ip);
+        acquire(&pcache.lock);
+        pcache.wb = NULL;
+        pcache.nwb++;
+        wakeup(&pcache.wb);
+    }
+}
+
+/* Start the writeback thread, once the file system is up. */
+void
+pcache_start()
+{
+    kthread_create("pcache_writeback", pcache_writeback, NULL);
+}
+
+/* Called by the clock interrupt about once a second. */
+void
+pcache_clock()
+{
+    if (pcache.dhead) wakeup(&pcache.dhead);
+}
+
+/*
+ * Make writers wait while too many pages are dirty. Called outside
+ * of any lock and transaction.
+ */
+void
+pcache_throttle()
+{
+    if (pcache.ndirty <= pcache.dirty_max) return;
+    __atomic_fetch_add(&pcache.nthrottle, 1, __ATOMIC_RELAXED);
+    acquire(&pcache.lock);
+    while (pcache.ndirty > pcache.dirty_max) {
+        wakeup(&pcache.dhead);
+        sleep(&pcache.ndirty, &pcache.lock);
+    }
+    release(&pcache.lock);
+}
+
+/*
+ * Write back every inode that was dirty when called, as sync() does,
+ * including the one the writeback thread may be busy with.
+ */
+void
+pcache_sync()
+{
+    uint64_t start = timestamp();
+    acquire(&pcache.lock);
+    while (pcache.dhead && pcache.dhead->dirtied <= start) {
+        struct inode* ip = pcache_pop();
+        release(&pcache.lock);
+        pcache_writeback_inode(ip);
+        acquire(&pcache.lock);
+    }
+    for (uint64_t n = pcache.nwb; pcache.wb && pcache.nwb == n;)
+        sleep(&pcache.wb, &pcache.lock);
+    release(&pcache.lock);
+}
+
+static void
+pcache_purge_node(struct pcnode* node, int l, struct cpage** freed)
+{
+    for (int i = 0; i < PCNODE_SLOTS; i++) {
+        if (!node->slot[i]) continue;
+        if (l) {
+            pcache_purge_node(node->slot[i], l - 1, freed);
+            kmem_cache_free(pcache.node, node->slot[i]);
+        } else {
+            struct cpage* c = node->slot[i];
+            if (c->dirty) {
+                c->ip->ndirty--;
+                pcache.ndirty--;
+            }
+            pcache_unlink(c);
+            c->hnext = *freed;
+            *freed = c;
+        }
+    }
+}
+
+/*
+ * Drop all pages of ip, which is being freed or leaves the inode
+ * cache. Mappings keep what they map. Only a freed inode can have
+ * dirty pages here, since the dirty list holds a reference.
+ */
+void
+pcache_purge(struct inode* ip)
+{
+    if (!ip->pages) return;
+    int dirty = ip->ndirty;
+    struct cpage* freed = NULL;
+    acquire(&pcache.lock);
+    pcache_purge_node(ip->pages, PCLEVELS - 1, &freed);
+    release(&pcache.lock);
+    kmem_cache_free(pcache.node, ip->pages);
+    ip->pages = NULL;
+    pcache_free(freed);
+    if (dirty) wakeup(&pcache.ndirty);
+}
@@ -0,0 +1,365 @@
+#include "pipe.h"
+
+#include "console.h"
+#include "file.h"
+#include "fs.h"
+#include "kalloc.h"
+#include "log.h"
+#include "pcache.h"
+#include "proc.h"
+#include "slab.h"
+#include "sleeplock.h"
+#include "spinlock.h"
+#include "string.h"
+#include "types.h"
+
+/*
+ * Pipes. A writer copies in as much as fits before the ring wraps or
+ * fills up, then wakes a sleeping reader once for all of it; a reader
+ * wakes a sleeping writer only once PIPE_WAKE bytes are free, rather
+ * than on every byte that it takes out.
+ *
+ * splice() and tee() move data between a pipe and a file, or between
+ * two pipes, with readi(), writei() or memmove() straight on the ring,
+ * never through user memory.
+ */
+
+static struct kmem_cache* pipe_cache;
+
+void
+pipe_init()
+{
+    if (!(pipe_cache = kmem_cache_create("pipe", sizeof(struct pipe))))
+        panic("\tpipe_init: failed to create pipe cache.\n");
+}
+
+/* Make a pipe read from f0 and written to f1. */
+int
+pipe_alloc(struct file** f0, struct file** f1)
+{
+    struct pipe* pi = 0;
+
+    *f0 = *f1 = 0;
+    if (!(*f0 = file_alloc()) || !(*f1 = file_alloc()))
+        goto bad;
+    if (!(pi = kmem_cache_alloc(pipe_cache)))
+        goto bad;
+    if (!(pi->buf = kalloc_pages(PIPE_ORDER)))
+        goto bad;
+    initlock_unlisted(&pi->lock, "pipe");  // Freed with the pipe
+    initsleeplock(&pi->rlock, "pipe reader");
+    initsleeplock(&pi->wlock, "pipe writer");
+    pi->nread = pi->nwrite = 0;
+    pi->readopen = pi->writeopen = 1;
+    pi->rwait = pi->wwait = 0;
+
+    (*f0)->type = FD_PIPE;
+    (*f0)->readable = 1;
+    (*f0)->pipe = pi;
+    (*f1)->type = FD_PIPE;
+    (*f1)->writable = 1;
+    (*f1)->pipe = pi;
+    return 0;
+
+bad:
+    if (pi)
+        kmem_cache_free(pipe_cache, pi);
+    if (*f0)
+        file_close(*f0);
+    if (*f1)
+        file_close(*f1);
+    return -1;
+}
+
+/* Close the write end of pi if writable, else its read end. */
+void
+pipe_close(struct pipe* pi, int writable)
+{
+    acquire(&pi->lock);
+    if (writable) {
+        pi->writeopen = 0;
+        wakeup(&pi->nread);
+    } else {
+        pi->readopen = 0;
+        wakeup(&pi->nwrite);
+    }
+    if (pi->readopen || pi->writeopen) {
+        release(&pi->lock);
+        return;
+    }
+    release(&pi->lock);
+    kfree_pages(pi->buf, PIPE_ORDER);
+    kmem_cache_free(pipe_cache, pi);
+}
+
+/*
+ * Find room in pi for the holder of pi->wlock, waiting for some if
+ * wait. Sets *at to it and returns how much there is before the ring
+ * wraps, or 0 if there is none, or -1 if nobody will read it.
+ */
+static ssize_t
+pipe_room(struct pipe* pi, char** at, int wait)
+{
+    acquire(&pi->lock);
+    while (wait && pi->readopen && pi->nwrite - pi->nread == PIPESIZE) {
+        if (thisproc()->killed) {
+            release(&pi->lock);
+            return -1;
+        }
+        pi->wwait = 1;
+        sleep(&pi->nwrite, &pi->lock);
+    }
+    ssize_t n = -1;
+    if (pi->readopen) {
+        uint32_t w = pi->nwrite % PIPESIZE;
+        n = MIN(PIPESIZE - (pi->nwrite - pi->nread), PIPESIZE - w);
+        *at = pi->buf + w;
+    }
+    release(&pi->lock);
+    return n;
+}
+
+/* The holder of pi->wlock has put n bytes at the room it found. */
+static void
+pipe_written(struct pipe* pi, size_t n)
+{
+    acquire(&pi->lock);
+    pi->nwrite += n;
+    if (pi->rwait) {
+        pi->rwait = 0;
+        wakeup(&pi->nread);
+    }
+    release(&pi->lock);
+}
+
+/*
+ * Find the data of pi past its first skip bytes for the holder of
+ * pi->rlock, waiting for some if wait. Sets *at to it and returns how
+ * much there is before the ring wraps, or 0 if there is none or the
+ * writer is gone, or -1 if the caller was killed while waiting.
+ */
+static ssize_t
+pipe_data(struct pipe* pi, size_t skip, char** at, int wait)
+{
+    acquire(&pi->lock);
+    while (wait && pi->writeopen && pi->nwrite - pi->nread <= skip) {
+        if (thisproc()->killed) {
+            release(&pi->lock);
+            return -1;
+        }
+        pi->rwait = 1;
+        sleep(&pi->nread, &pi->lock);
+    }
+    ssize_t n = 0;
+    if (pi->nwrite - pi->nread > skip) {
+        uint32_t r = (pi->nread + skip) % PIPESIZE;
+        n = MIN(pi->nwrite - pi->nread - skip, PIPESIZE - r);
+        *at = pi->buf + r;
+    }
+    release(&pi->lock);
+    return n;
+}
+
+/* The holder of pi->rlock is done with n bytes of the data it found. */
+static void
+pipe_consumed(struct pipe* pi, size_t n)
+{
+    acquire(&pi->lock);
+    pi->nread += n;
+    if (pi->wwait && PIPESIZE - (pi->nwrite - pi->nread) >= PIPE_WAKE) {
+        pi->wwait = 0;
+        wakeup(&pi->nwrite);
+    }
+    release(&pi->lock);
+}
+
+/*
+ * Write all of the iovcnt buffers of iov to pi, unless nobody reads
+ * or a buffer faults.
+ */
+ssize_t
+pipe_writev(struct pipe* pi, struct iovec* iov, int iovcnt)
+{
+    ssize_t tot = 0;
+    char* at;
+
+    acquiresleep(&pi->wlock);
+    for (int v = 0; v < iovcnt; v++) {
+        for (size_t done = 0; done < iov[v].iov_len; ) {
+            ssize_t m = pipe_room(pi, &at, 1);
+            if (m < 0) {
+                releasesleep(&pi->wlock);
+                return tot ? tot : -1;
+            }
+            m = MIN(m, iov[v].iov_len - done);
+            if (copy_user(at, (char*)iov[v].iov_base + done, m) < 0) {
+                releasesleep(&pi->wlock);
+                return tot ? tot : -1;
+            }
+            pipe_written(pi, m);
+            done += m;
+            tot += m;
+        }
+    }
+    releasesleep(&pi->wlock);
+    return tot;
+}
+
+/*
+ * Read from pi into the iovcnt buffers of iov in turn, waiting only
+ * while it is empty and nothing has been read yet.
+ */
+ssize_t
+pipe_readv(struct pipe* pi, struct iovec* iov, int iovcnt)
+{
+    ssize_t tot = 0, m = 0;
+    char* at;
+
+    acquiresleep(&pi->rlock);
+    for (int v = 0; v < iovcnt && m >= 0; v++) {
+        size_t done = 0;
+        while (done < iov[v].iov_len && (m = pipe_data(pi, 0, &at, tot == 0)) > 0) {
+            m = MIN(m, iov[v].iov_len - done);
+            if (copy_user((char*)iov[v].iov_base + done, at, m) < 0) {
+                m = -1;
+                break;
+            }
+            pipe_consumed(pi, m);
+            done += m;
+            tot += m;
+        }
+        if (done < iov[v].iov_len)
+            break;
+    }
+    releasesleep(&pi->rlock);
+    return tot || m >= 0 ? tot : -1;
+}
+
+/*
+ * Read up to n bytes of ip at *off straight into pi, advancing *off,
+ * and waiting for room only while nothing has been moved yet.
+ */
+ssize_t
+pipe_splice_in(struct pipe* pi, struct inode* ip, size_t* off, size_t n)
+{
+    ssize_t tot = 0;
+    char* at;
+
+    acquiresleep(&pi->wlock);
+    while (tot < n) {
+        ssize_t m = pipe_room(pi, &at, tot == 0);
+        if (m <= 0) {
+            if (m < 0 && !tot)
+                tot = -1;
+            break;
+        }
+        m = MIN(m, n - tot);
+        ilock(ip);
+        ssize_t r = readi(ip, at, *off, m);
+        if (r > 0)
+            *off += r;
+        iunlock(ip);
+        if (r < 0) {
+            if (!tot)
+                tot = -1;
+            break;
+        }
+        pipe_written(pi, r);
+        tot += r;
+        if (r < m)
+            break;  // End of file
+    }
+    releasesleep(&pi->wlock);
+    return tot;
+}
+
+/*
+ * Write up to n bytes of pi straight to ip at *off, advancing *off,
+ * and waiting for data only while nothing has been moved yet. Like
+ * file_writev(), a few blocks per transaction.
+ */
+ssize_t
+pipe_splice_out(struct pipe* pi, struct inode* ip, size_t* off, size_t n)
+{
+    ssize_t tot = 0, m = 0;
+    size_t max = ((MAXOPBLOCKS - 4) / 2) * BSIZE;
+    int dev = ip->type == T_DEV;
+    char* at;
+
+    acquiresleep(&pi->rlock);
+    while (tot < n && (m = pipe_data(pi, 0, &at, tot == 0)) > 0) {
+        m = MIN(MIN(m, n - tot), max);
+        if (!dev)
+            begin_op();
+        ilock(ip);
+        ssize_t r = writei(ip, at, *off, m);
+        if (r > 0)
+            *off += r;
+        iunlock(ip);
+        if (!dev) {
+            end_op();
+            pcache_throttle();
+        }
+        if (r < 0) {
+            m = -1;
+            break;
+        }
+        pipe_consumed(pi, r);
+        tot += r;
+        if (r < m)
+            break;
+    }
+    releasesleep(&pi->rlock);
+    return tot || m >= 0 ? tot : -1;
+}
+
+/*
+ * Copy up to n bytes of src to dst, taking them out of src if move,
+ * and waiting for data in src, then for room in dst, only before the
+ * first byte.
+ */
+static ssize_t
+pipe_copy(struct pipe* src, struct pipe* dst, size_t n, int move)
+{
+    ssize_t tot = 0, m;
+    char *from, *to;
+
+    if (src == dst)
+        return -1;
+    acquiresleep(&src->rlock);
+    if ((m = pipe_data(src, 0, &from, 1)) <= 0) {
+        releasesleep(&src->rlock);
+        return m;
+    }
+    acquiresleep(&dst->wlock);
+    while (tot < n && (m = pipe_data(src, move ? 0 : tot, &from, 0)) > 0) {
+        ssize_t room = pipe_room(dst, &to, tot == 0);
+        if (room <= 0) {
+            m = room;
+            break;
+        }
+        m = MIN(MIN(m, room), n - tot);
+        memmove(to, from, m);
+        pipe_written(dst, m);
+        if (move)
+            pipe_consumed(src, m);
+        tot += m;
+    }
+    releasesleep(&dst->wlock);
+    releasesleep(&src->rlock);
+    return tot || m >= 0 ? tot : -1;
+}
+
+/* Move up to n bytes from src to dst. */
+ssize_t
+pipe_splice(struct pipe* src, struct pipe* dst, size_t n)
+{
+    return pipe_copy(src, dst, n, 1);
+}
+
+/* Copy up to n bytes of src to dst, leaving them in src as well. */
+ssize_t
+pipe_tee(struct pipe* src, struct pipe* dst, size_t n)
+{
+    return pipe_copy(src, dst, n, 0);
+}
@@ -1,15 +1,28 @@
 #include "proc.h"
 
 #include "arm.h"
+#include "boot.h"
 #include "console.h"
 #include "file.h"
+#include "ipi.h"
 #include "kalloc.h"
+#include "kstat.h"
 #include "log.h"
+#include "futex.h"
+#include "memlayout.h"
+#include "mm.h"
+#include "mmap.h"
 #include "mmu.h"
+#include "sd.h"
+#include "sleeplock.h"
+#include "slab.h"
 #include "spinlock.h"
 #include "string.h"
+#include "timer.h"
+#include "trace.h"
 #include "trap.h"
 #include "types.h"
+#include "vdso.h"
 #include "vm.h"
 
 struct cpu cpus[NCPU];
@@ -18,14 +31,27 @@ struct {
     struct proc proc[NPROC];
 } ptable;
 
+/*
+ * Sleeping processes, hashed by the channel they sleep on, so that
+ * wakeup() only looks at processes that may be waiting for it.
+ * A bucket's lock protects its list and the sqnext links on it.
+ */
+static struct sleepq {
+    struct spinlock lock;
+    struct proc* head;
+} sleepq[NSLEEPQ];
+
 static struct proc* initproc;
 
+static struct kmem_cache* mm_cache;  // Address spaces
+
 int nextpid = 1;
 struct spinlock pid_lock;
 
 struct spinlock wait_lock;
 
 void forkret();
+extern void kthread_start();
 extern void usertrapret(struct trapframe*);
 extern void trapret();
 void swtch(struct context**, struct context*);
@@ -46,9 +72,211 @@ void proc_init() {
     for (struct proc* p = ptable.proc; p < &ptable.proc[NPROC]; ++p) {
         initlock(&p->lock, "proc_lock");
     }
+    for (struct cpu* c = cpus; c < &cpus[NCPU]; ++c) {
+        initlock(&c->rq.lock, "runq");
+    }
+    for (struct sleepq* q = sleepq; q < &sleepq[NSLEEPQ]; ++q) {
+        initlock(&q->lock, "sleepq");
+    }
+    if (!(mm_cache = kmem_cache_create("mm", sizeof(struct mm))))
+        panic("\tproc_init: failed to create mm cache.\n");
     cprintf("proc_init: success.\n");
 }
 
+/*
+ * Weight of each nice value, as in Linux: one step up gives about
+ * 10% less CPU time than the neighbour. Nice 0 weighs NICE_0_WEIGHT.
+ */
+#define NICE_0_WEIGHT 1024
+static const int nice_weight[NICE_MAX - NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916,
+    9548,  7620,  6100,  4904,  3906,  3121,  2501,  1991,  1586,  1277,
+    1024,  820,   655,   526,   423,   335,   272,   215,   172,   137,
+    110,   87,    70,    56,    45,    36,    29,    23,    18,    15,
+};
+
+static inline uint64_t us2ticks(uint64_t us) {
+    return timerfreq() / 1000 * us / 1000;
+}
+
+static inline int proc_weight(struct proc* p) {
+    return nice_weight[p->nice - NICE_MIN];
+}
+
+/*
+ * Charge the running process p for the time since it was last charged.
+ * Caller must hold p->lock.
+ */
+static void proc_account(struct proc* p) {
+    uint64_t now = timestamp();
+    p->vruntime += (now - p->exec_start) * NICE_0_WEIGHT / proc_weight(p);
+    p->exec_start = now;
+}
+
+/*
+ * Make p RUNNABLE and queue it on the CPU it last ran on,
+ * to keep its cache lines warm. Caller must hold p->lock.
+ */
+static void proc_runnable(struct proc* p) {
+    struct runq* rq = &cpus[p->cpu].rq;
+
+    acquire(&rq->lock);
+    if (p->state == RUNNING) {
+        proc_account(p);
+    } else {
+        // Waking up or new: credit it for some of the time it did
+        // not run, but no more than half a period.
+        uint64_t credit = us2ticks(SCHED_LATENCY_US / 2);
+        if (rq->min_vruntime > credit)
+            p->vruntime = MAX(p->vruntime, rq->min_vruntime - credit);
+    }
+    p->state = RUNNABLE;
+    p->runnable_at = timestamp();
+
+    struct proc** pp = &rq->head;
+    while (*pp && (*pp)->vruntime <= p->vruntime)
+        pp = &(*pp)->rqnext;
+    p->rqnext = *pp;
+    *pp = p;
+    rq->n++;
+    rq->load += proc_weight(p);
+    release(&rq->lock);
+
+    // Wake up the CPU it is queued on if that one idles, or else
+    // any idle CPU, which will steal it. If none idles, have the CPU
+    // it is queued on switch to it now rather than at its next tick
+    // if p is owed more than a slice. c->proc is only a hint here.
+    disb();
+    struct cpu* c = &cpus[p->cpu];
+    for (int i = 0; !c->idle && i < NCPU; ++i) {
+        if (cpus[i].idle)
+            c = &cpus[i];
+    }
+    if (c == thiscpu)
+        return;
+    struct proc* cur = c->proc;
+    if (c->idle)
+        ipi_send(c - cpus, IPI_WAKE);
+    else if (cur && p->vruntime + us2ticks(SCHED_MIN_GRAN_US) < cur->vruntime)
+        ipi_send(c - cpus, IPI_RESCHED);
+}
+
+/* Take the process that has run least from rq, or return NULL. */
+static struct proc* runq_pop(struct runq* rq) {
+    acquire(&rq->lock);
+    struct proc* p = rq->head;
+    if (p) {
+        rq->head = p->rqnext;
+        rq->n--;
+        rq->load -= proc_weight(p);
+        rq->min_vruntime = MAX(rq->min_vruntime, p->vruntime);
+    }
+    release(&rq->lock);
+    return p;
+}
+
+/*
+ * Pick the next process for this CPU: the head of its own queue,
+ * or else one stolen from the CPU with the longest queue.
+ * The queue lengths are read without locks, as hints.
+ */
+static struct proc* runq_next(struct cpu* c) {
+    struct proc* p = runq_pop(&c->rq);
+    if (p)
+        return p;
+
+    struct cpu* victim = NULL;
+    for (struct cpu* v = cpus; v < &cpus[NCPU]; ++v) {
+        if (v != c && v->rq.n > 0 && (!victim || v->rq.n > victim->rq.n))
+            victim = v;
+    }
+    if (victim && (p = runq_pop(&victim->rq))) {
+        // Keep its lead or lag relative to the queue it came from.
+        int64_t v = p->vruntime - victim->rq.min_vruntime + c->rq.min_vruntime;
+        p->vruntime = MAX(v, 0);
+        c->nsteal++;
+    }
+    return p;
+}
+
+/* Is there anything this CPU could run or steal? A hint. */
+static int runq_ready() {
+    for (struct cpu* v = cpus; v < &cpus[NCPU]; ++v) {
+        if (v->rq.n > 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int sched_stat(char* buf, size_t n) {
+    size_t len = 0;
+    for (int i = 0; i < NCPU && len < n; ++i) {
+        len += snprintf(buf + len, n - len, "cpu%d queued %d switch %lld steal %lld idle %lld\n",
+                        i, cpus[i].rq.n, cpus[i].nswitch, cpus[i].nsteal, cpus[i].nidle);
+    }
+    if (len < n)
+        len += snprintf(buf + len, n - len, "asid rollovers %lld\n", asid_rollovers());
+    uint64_t spun, slept;
+    sleeplock_counts(&spun, &slept);
+    if (len < n)
+        len += snprintf(buf + len, n - len, "sleeplock spun %lld slept %lld\n", spun, slept);
+    if (len < n)
+        len += snprintf(buf + len, n - len, "ipi wake %lld resched %lld\n", ipi_count(IPI_WAKE),
+                        ipi_count(IPI_RESCHED));
+    return MIN(len, n);
+}
+
+/*
+ * Usage of every process, in microseconds. Read without locks, so
+ * the numbers of a process may be from slightly different times.
+ */
+static int proc_stat(char* buf, size_t n) {
+    size_t len = 0;
+    for (struct proc* p = ptable.proc; p < &ptable.proc[NPROC] && len < n; ++p) {
+        if (p->state == UNUSED)
+            continue;
+        len += snprintf(buf + len, n - len, "%d %s user %lld sys %lld wait %lld vcsw %lld ivcsw %lld\n",
+                        p->pid, p->name, ticks2us(p->ru.utime), ticks2us(p->ru.stime),
+                        ticks2us(p->ru.wtime), p->ru.nvcsw, p->ru.nivcsw);
+    }
+    return MIN(len, n);
+}
+
+/* A new address space, with no page table yet. */
+struct mm* mm_alloc() {
+    struct mm* mm = kmem_cache_alloc(mm_cache);
+    if (!mm)
+        return NULL;
+    memset(mm, 0, sizeof(*mm));
+    mm->ref = 1;
+    initsleeplock(&mm->lock, "mm");
+    return mm;
+}
+
+/*
+ * Drop a reference to mm. The last one unmaps its regions and lets
+ * go of the program file, and returns 1: the caller then frees mm
+ * with mm_free() once no CPU may be using its page table.
+ */
+int mm_put(struct mm* mm) {
+    if (__atomic_sub_fetch(&mm->ref, 1, __ATOMIC_ACQ_REL) > 0)
+        return 0;
+    mmap_exit(mm);
+    if (mm->exe) {
+        begin_op();
+        iput(mm->exe);
+        end_op();
+    }
+    mm->exe = NULL;
+    return 1;
+}
+
+void mm_free(struct mm* mm) {
+    if (mm->pgdir)
+        vm_free(mm->pgdir);
+    kmem_cache_free(mm_cache, mm);
+}
+
 /*
  * Free a proc structure and the data hanging from it,
  * including user pages.
@@ -63,10 +291,16 @@ static void proc_free(struct proc* p) {
     if (p->kstack)
         kfree(p->kstack);
     p->kstack = NULL;
-    p->sz = 0;
-    if (p->pgdir)
-        vm_free(p->pgdir, 4);
-    p->pgdir = NULL;
+    memset(&p->ru, 0, sizeof(p->ru));
+    memset(&p->cru, 0, sizeof(p->cru));
+    // Still set only if p was the last user of it, see exit().
+    if (p->mm)
+        mm_free(p->mm);
+    p->mm = NULL;
+    p->tgid = 0;
+    p->thread = 0;
+    p->clear_child_tid = 0;
+    p->vfork = 0;
     p->tf = NULL;
     p->name[0] = '\0';
     p->state = UNUSED;
@@ -87,6 +321,11 @@ static struct proc* proc_alloc() {
         }
 
         p->pid = pid_next();
+        p->cpu = cpuid();
+        p->nice = 0;
+        p->vruntime = 0;
+        p->tgid = p->pid;
+        p->fpcpu = -1;
 
         // Allocate kernel stack.
         if (!(p->kstack = kalloc())) {
@@ -129,12 +368,12 @@ void user_init() {
     initproc = p;
 
     // Allocate a user page table.
-    if (!(p->pgdir = pgdir_init()))
-        panic("\tuser_init: page table failed to allocate.\n");
-    p->sz = PGSIZE;
+    if (!(p->mm = mm_alloc()) || !(p->mm->pgdir = pgdir_init()) || !(p->files = files_alloc()))
+        panic("\tuser_init: address space failed to allocate.\n");
+    p->mm->sz = p->mm->heap = PGSIZE;
 
     // Copy initcode into the page table.
-    uvm_init(p->pgdir, _binary_obj_user_initcode_start, (uint64_t)_binary_obj_user_initcode_size);
+    uvm_init(p->mm->pgdir, _binary_obj_user_initcode_start, (uint64_t)_binary_obj_user_initcode_size);
 
     // Set up trapframe to prepare for the first "return" from kernel to user.
     memset(p->tf, 0, sizeof(*p->tf));
@@ -144,18 +383,48 @@ void user_init() {
     p->tf->elr_el1 = 0;      // exception link register
 
     strncpy(p->name, "initproc", sizeof(p->name));
-    p->state = RUNNABLE;
     p->cwd = namei("/");
+    proc_runnable(p);
     release(&p->lock);
+    kstat_register(KSTAT_SCHED, sched_stat);
+    kstat_register(KSTAT_PROC, proc_stat);
 
     cprintf("user_init: proc %d (%s) success.\n", p->pid, p->name, cpuid());
 }
 
+/*
+ * Start a kernel thread running fn(arg). It has no user memory,
+ * runs with interrupts off like the rest of the kernel and never
+ * returns, so fn should sleep when it has nothing to do.
+ */
+void kthread_create(char* name, void (*fn)(void*), void* arg) {
+    struct proc* p = proc_alloc();
+    if (!p)
+        panic("\tkthread_create: process failed to allocate.\n");
+
+    // Picked up from the callee-saved registers by kthread_start.
+    p->context->x19 = (uint64_t)fn;
+    p->context->x20 = (uint64_t)arg;
+    p->context->x30 = (uint64_t)kthread_start;
+
+    strncpy(p->name, name, sizeof(p->name));
+    proc_runnable(p);
+    release(&p->lock);
+}
+
+void kthread_main(void (*fn)(void*), void* arg) {
+    // Still holding p->lock from scheduler.
+    release(&thisproc()->lock);
+    fn(arg);
+    panic("\tkthread_main: kernel thread %s returned.\n", thisproc()->name);
+}
+
 /*
  * Per-CPU process scheduler
  * Each CPU calls scheduler() after setting itself up.
  * Scheduler never returns. It loops, doing:
- *  - choose a process to run
+ *  - choose a process to run from this CPU's run queue,
+ *    or steal one from another CPU's
  *  - swtch to start running that process
  *  - eventually that process transfers control
  *    via swtch back to the scheduler.
@@ -165,29 +434,63 @@ void scheduler() {
     c->proc = NULL;
 
     while (1) {
-        // Loop over process table looking for process to run.
-        for (struct proc* p = ptable.proc; p < &ptable.proc[NPROC]; ++p) {
+        struct proc* p = runq_next(c);
+        if (p) {
+            // The CPU that queued p may still be switching away from
+            // it; p->lock is released only once that is done.
             acquire(&p->lock);
-            if (p->state != RUNNABLE) {
-                release(&p->lock);
-                continue;
-            }
+            if (p->state != RUNNABLE)
+                panic("\tscheduler: queued proc %d not runnable.\n", p->pid);
 
             // Switch to chosen process. It is the process's job
             // to release its lock and then reacquire it
             // before jumping back to us.
             c->proc = p;
-            uvm_switch(p);
+            if (p->mm)  // Kernel threads run on whatever was there.
+                uvm_switch(p);
             p->state = RUNNING;
-            // cprintf("scheduler: run proc %d at CPU %d.\n", p->pid, cpuid());
+            p->cpu = cpuid();
+            p->exec_start = p->acct_at = timestamp();
+            p->ru.wtime += p->exec_start - p->runnable_at;
+            c->nswitch++;
+            trace(TR_SWITCH, 0, 0);
 
             swtch(&c->scheduler, p->context);
 
             // Process is done running for now.
             // It should have changed its p->state before coming back.
+            proc_charge(0);
             c->proc = NULL;
+            if (p->state == ZOMBIE) {
+                // Its page table may be freed by whoever reaps it, or
+                // by the last of its threads to go, so stop using it.
+                // Nobody wait()s for a thread: it reaps itself.
+                uvm_detach();
+                if (p->thread)
+                    proc_free(p);
+            }
             release(&p->lock);
+        } else if (!kzero_idle()) {
+            // Nothing to run, and no page to clear for kalloc_zeroed():
+            // stop the tick and sleep until an interrupt. Whoever queues
+            // work after c->idle is visible sends an IPI, which ends wfi
+            // even though interrupts are masked here.
+            c->idle = 1;
+            disb();
+            if (!runq_ready()) {
+                timer_stop();
+                c->nidle++;
+                wfi();
+                timer_reset();
+            }
+            c->idle = 0;
         }
+
+        // Let pending interrupts in, e.g. the SD card completing
+        // the request that everyone is sleeping on.
+        sti();
+        disb();
+        cli();
     }
 }
 
@@ -203,7 +506,12 @@ void sched() {
         panic("\tsched: process not locked.\n");
     if (p->state == RUNNING)
         panic("\tsched: process running.\n");
+    if (p->state == SLEEPING)
+        p->ru.nvcsw++;
+    else if (p->state == RUNNABLE)
+        p->ru.nivcsw++;
 
+    fpsimd_switch_out(p);
     swtch(&p->context, c->scheduler);
 }
 
@@ -224,11 +532,20 @@ void forkret() {
         // of a regular process (e.g., they call sleep), and thus cannot
         // be run from main().
         first = 0;
-        iinit(ROOTDEV);
-        initlog(ROOTDEV);
+        // The card is only needed from here on, and the other CPUs
+        // run while it sleeps for the MBR.
+        BOOT_STEP("sd_init", sd_init());
+#ifdef SD_TEST
+        sd_test();
+#endif
+        // Recover the log first, iinit() looks at the free bitmap.
+        BOOT_STEP("initlog", initlog(ROOTDEV));
+        BOOT_STEP("iinit", iinit(ROOTDEV));
+        boot_done();
     }
 
     // Pass trapframe pointer as an argument when calling trapret.
+    proc_charge(0);
     usertrapret(tf);
 }
 
@@ -240,27 +557,50 @@ void reparent(struct proc* p) {
     for (struct proc* pc = ptable.proc; pc < &ptable.proc[NPROC]; ++pc) {
         if (pc->parent == p) {
             pc->parent = initproc;
+            wakeup(initproc);
         }
     }
 }
 
 /*
- * Exit the current process. Does not return.
+ * Store val in the int at user address va of p, even if the page is
+ * copy-on-write. Returns 0, or -1 if p may not write there.
+ */
+static int put_user_int(struct proc* p, uint64_t va, int val) {
+    if (va % sizeof(int) || va >= USERTOP)
+        return -1;
+    acquiresleep(&p->mm->lock);
+    int* ka = (int*)uva2ka_fault(p, va);
+    if (ka)
+        *ka = val;
+    releasesleep(&p->mm->lock);
+    return ka ? 0 : -1;
+}
+
+/*
+ * Exit the current thread. Does not return.
  * An exited process remains in the zombie state
- * until its parent calls wait() to find out it exited.
+ * until its parent calls wait() to find out it exited;
+ * a thread is freed as soon as it is off its CPU.
  */
 void exit(int status) {
     struct proc* p = thisproc();
 
     if (p == initproc)
         panic("\texit: initproc exiting.\n");
+    trace(TR_EXIT, status, 0);
 
-    for (int fd = 0; fd < NOFILE; ++fd) {
-        if (p->ofile[fd]) {
-            file_close(p->ofile[fd]);
-            p->ofile[fd] = 0;
-        }
-    }
+    if (p->clear_child_tid && !put_user_int(p, p->clear_child_tid, 0))
+        futex_wake(p, p->clear_child_tid, 1, 0);
+
+    files_put(p->files);
+    p->files = NULL;
+
+    // The last thread out keeps the mm for proc_free(), which frees
+    // its page table once p is off this CPU.
+    if (!mm_put(p->mm))
+        p->mm = NULL;
+    vfork_done(p);
 
     begin_op();
     iput(p->cwd);
@@ -272,6 +612,10 @@ void exit(int status) {
     // Give any children to init.
     reparent(p);
 
+    // Parent might be sleeping in wait().
+    if (!p->thread)
+        wakeup(p->parent);
+
     acquire(&p->lock);
     p->xstate = status;
     p->state = ZOMBIE;
@@ -283,6 +627,47 @@ void exit(int status) {
     panic("\texit: zombie returned!\n");
 }
 
+/*
+ * Take sleeping p off its sleep queue. Returns 0 if wakeup() already
+ * has, and is about to make p runnable. Caller must hold p->lock.
+ */
+static int sleepq_remove(struct proc* p) {
+    struct sleepq* q = &sleepq[((uint64_t)p->chan >> 3) % NSLEEPQ];
+    int found = 0;
+    acquire(&q->lock);
+    for (struct proc** pp = &q->head; *pp; pp = &(*pp)->sqnext) {
+        if (*pp == p) {
+            *pp = p->sqnext;
+            found = 1;
+            break;
+        }
+    }
+    release(&q->lock);
+    return found;
+}
+
+/*
+ * Exit every thread of the current process. The others are only
+ * marked killed, and woken if asleep; they exit on their way back
+ * to user space.
+ */
+void exit_group(int status) {
+    struct proc* p = thisproc();
+
+    for (struct proc* q = ptable.proc; q < &ptable.proc[NPROC]; ++q) {
+        if (q == p || q->tgid != p->tgid)
+            continue;
+        acquire(&q->lock);
+        if (q->tgid == p->tgid && q->state != UNUSED && q->state != ZOMBIE) {
+            q->killed = 1;
+            if (q->state == SLEEPING && sleepq_remove(q))
+                proc_runnable(q);
+        }
+        release(&q->lock);
+    }
+    exit(status);
+}
+
 /*
  * Atomically release lock and sleep on chan.
  * Reacquires lock when awakened.
@@ -298,11 +683,20 @@ void sleep(void* chan, struct spinlock* lk) {
     // so it's okay to release lk.
 
     acquire(&p->lock);
-    release(lk);
+    proc_account(p);
+    trace(TR_SLEEP, (uint64_t)chan, 0);
 
-    // Go to sleep.
+    // Go to sleep. wakeup() finds p in the queue as soon as lk is
+    // released, and then waits for p->lock until p is off the CPU.
+    struct sleepq* q = &sleepq[((uint64_t)chan >> 3) % NSLEEPQ];
     p->chan = chan;
     p->state = SLEEPING;
+    acquire(&q->lock);
+    p->sqnext = q->head;
+    q->head = p;
+    release(&q->lock);
+
+    release(lk);
     sched();
 
     // Tidy up.
@@ -318,15 +712,98 @@ void sleep(void* chan, struct spinlock* lk) {
  * Must be called without any p->lock.
  */
 void wakeup(void* chan) {
+    struct sleepq* q = &sleepq[((uint64_t)chan >> 3) % NSLEEPQ];
+    struct proc* woken = NULL;
+
+    // Unlink the sleepers first: taking p->lock under q->lock
+    // would invert the order sleep() takes them in.
+    acquire(&q->lock);
+    for (struct proc** pp = &q->head; *pp;) {
+        struct proc* p = *pp;
+        if (p->chan == chan) {
+            *pp = p->sqnext;
+            p->sqnext = woken;
+            woken = p;
+        } else {
+            pp = &p->sqnext;
+        }
+    }
+    release(&q->lock);
+
+    while (woken) {
+        struct proc* p = woken;
+        woken = p->sqnext;
+        acquire(&p->lock);
+        if (p->state == SLEEPING && p->chan == chan) {
+            trace(TR_WAKEUP, p->pid, (uint64_t)chan);
+            proc_runnable(p);
+        }
+        release(&p->lock);
+    }
+}
+
+/*
+ * Called on each timer interrupt with a process running. Return
+ * whether it has used up its timeslice, which is its share of
+ * SCHED_LATENCY_US among the processes of this CPU.
+ */
+int sched_tick() {
+    struct proc* p = thisproc();
+    struct runq* rq = &thiscpu->rq;
+
+    if (!rq->n)
+        return 0;
+    uint64_t w = proc_weight(p);
+    uint64_t slice = us2ticks(SCHED_LATENCY_US) * w / (rq->load + w);
+    slice = MAX(slice, us2ticks(SCHED_MIN_GRAN_US));
+    return timestamp() - p->exec_start >= slice;
+}
+
+/* Return the nice value of process pid, or of the caller if pid is 0. */
+int proc_getnice(int pid) {
+    if (!pid)
+        return thisproc()->nice;
     for (struct proc* p = ptable.proc; p < &ptable.proc[NPROC]; ++p) {
-        if (p != thisproc()) {
-            acquire(&p->lock);
-            if (p->state == SLEEPING && p->chan == chan) {
-                p->state = RUNNABLE;
-            }
+        acquire(&p->lock);
+        if (p->pid == pid && p->state != UNUSED) {
+            int nice = p->nice;
+            release(&p->lock);
+            return nice;
+        }
+        release(&p->lock);
+    }
+    return NICE_MIN - 1;
+}
+
+/*
+ * Set the nice value of process pid, or of the caller if pid is 0,
+ * clamped to [NICE_MIN, NICE_MAX]. Return -1 if there is no such process.
+ */
+int proc_setnice(int pid, int nice) {
+    nice = MIN(MAX(nice, NICE_MIN), NICE_MAX);
+    for (struct proc* p = ptable.proc; p < &ptable.proc[NPROC]; ++p) {
+        if (pid ? p->pid != pid : p != thisproc())
+            continue;
+        acquire(&p->lock);
+        if (p->state == UNUSED || (pid && p->pid != pid)) {
             release(&p->lock);
+            return -1;
+        }
+        // If queued, its weight is part of the load of the queue.
+        struct runq* rq = &cpus[p->cpu].rq;
+        acquire(&rq->lock);
+        for (struct proc* q = rq->head; q; q = q->rqnext) {
+            if (q == p) {
+                rq->load += nice_weight[nice - NICE_MIN] - proc_weight(p);
+                break;
+            }
         }
+        p->nice = nice;
+        release(&rq->lock);
+        release(&p->lock);
+        return 0;
     }
+    return -1;
 }
 
 /*
@@ -335,7 +812,7 @@ void wakeup(void* chan) {
 void yield() {
     struct proc* p = thisproc();
     acquire(&p->lock);
-    p->state = RUNNABLE;
+    proc_runnable(p);
     // cprintf("yield: proc %d gives up CPU %d.\n", p->pid, cpuid());
     sched();
     release(&p->lock);
@@ -345,77 +822,187 @@ void yield() {
  * Grow current process's memory by n bytes.
  * Return 0 on success, -1 on failure.
  */
-int growproc(int n) {
-    struct proc* p = thisproc();
-    uint64_t sz = p->sz;
-    if (n > 0) {
-        if (!(sz = uvm_alloc(p->pgdir, sz, sz + n)))
-            return -1;
-    } else if (n < 0) {
-        if (!(sz = uvm_dealloc(p->pgdir, sz, sz + n)))
-            return -1;
+int growproc(int64_t n) {
+    struct mm* mm = thisproc()->mm;
+    int r = -1;
+    acquiresleep(&mm->lock);
+    uint64_t sz = mm->sz + n;
+    if (n > 0 && (sz < mm->sz || sz > MMAPTOP || mmap_overlap(mm, mm->sz, sz)))
+        goto out;
+    if (n < 0 && (sz > mm->sz || sz < mm->heap))
+        goto out;
+    // Growing only moves the end: pages are allocated on first touch.
+    if (n < 0) {
+        uvm_dealloc(mm->pgdir, mm->sz, sz);
+        tlbi_all();
     }
-    p->sz = sz;
-    uvm_switch(p);
-    return 0;
+    mm->sz = sz;
+    r = 0;
+out:
+    releasesleep(&mm->lock);
+    return r;
+}
+
+/* Give the new address space nmm a copy-on-write copy of mm. */
+static int mm_copy(struct mm* nmm, struct mm* mm) {
+    if (!(nmm->pgdir = pgdir_init()))
+        return -1;
+    acquiresleep(&mm->lock);
+    int r = -1;
+    if (uvm_copy(mm->pgdir, nmm->pgdir, 0, mm->sz, 0) >= 0 && mmap_fork(nmm, mm) >= 0
+        && vdso_map(nmm->pgdir) >= 0) {
+        nmm->sz = mm->sz;
+        nmm->heap = mm->heap;
+        if (mm->exe)
+            nmm->exe = idup(mm->exe);
+        memcpy(nmm->seg, mm->seg, sizeof(mm->seg));
+        nmm->nseg = mm->nseg;
+        r = 0;
+    }
+    releasesleep(&mm->lock);
+    return r;
 }
 
 /*
- * Create a new process copying p as the parent.
- * Sets up stack to return as if from system call.
- * Caller must set state of returned proc to RUNNABLE.
+ * Create a new process or thread copying p as the parent, as Linux's
+ * clone() does with the subset of flags in proc.h. It starts on stack,
+ * if set, and returns 0 there. Returns the pid of the child to p.
  */
-int fork() {
+int clone(uint64_t flags, uint64_t stack, uint64_t ptid, uint64_t tls, uint64_t ctid) {
+    struct proc* p = thisproc();
+    if ((flags & CLONE_THREAD) && !(flags & CLONE_VM))
+        return -1;
+
     // Allocate process
     struct proc* np = proc_alloc();
     if (!np)
         return -1;
+    // Nobody else touches an EMBRYO, and copying memory may sleep.
+    release(&np->lock);
 
-    struct proc* p = thisproc();
-
-    // Copy user memory from parent to child
-    if (uvm_copy(p->pgdir, np->pgdir, p->sz) < 0) {
-        proc_free(np);
-        release(&np->lock);
-        return -1;
+    if (flags & CLONE_VM) {
+        __atomic_fetch_add(&p->mm->ref, 1, __ATOMIC_RELAXED);
+        np->mm = p->mm;
+    } else if (!(np->mm = mm_alloc()) || mm_copy(np->mm, p->mm) < 0) {
+        goto bad;
+    }
+    if (flags & CLONE_FILES) {
+        __atomic_fetch_add(&p->files->ref, 1, __ATOMIC_RELAXED);
+        np->files = p->files;
+    } else if (!(np->files = files_copy(p->files))) {
+        goto bad;
     }
-    np->sz = p->sz;
 
     // Copy saved user registers
     memcpy(np->tf, p->tf, sizeof(*p->tf));
 
-    // Cause fork to return 0 in the child
+    // Cause clone to return 0 in the child
     np->tf->x0 = 0;
-
-    // Increment reference counts on open file descriptors
-    for (int i = 0; i < NOFILE; ++i) {
-        if (p->ofile[i])
-            np->ofile[i] = file_dup(p->ofile[i]);
+    if (stack)
+        np->tf->sp_el0 = stack;
+    if (flags & CLONE_SETTLS)
+        np->tf->tpidr_el0 = tls;
+    if ((flags & CLONE_PARENT_SETTID) && put_user_int(p, ptid, np->pid) < 0)
+        goto bad;
+    if ((flags & CLONE_CHILD_SETTID) && put_user_int(np, ctid, np->pid) < 0)
+        goto bad;
+    if (flags & CLONE_CHILD_CLEARTID)
+        np->clear_child_tid = ctid;
+    if (flags & CLONE_THREAD) {
+        np->tgid = p->tgid;
+        np->thread = 1;
     }
+    fpsimd_fork(np, p);
+
     np->cwd = idup(p->cwd);
 
     strncpy(np->name, p->name, sizeof(p->name));
+    np->nice = p->nice;
+    np->vruntime = p->vruntime;
 
     int pid = np->pid;
-
-    release(&np->lock);
+    trace(TR_FORK, pid, 0);
 
     acquire(&wait_lock);
     np->parent = p;
+    // Threads reap themselves, so only wait for a process.
+    np->vfork = (flags & CLONE_VFORK) && !(flags & CLONE_THREAD);
     release(&wait_lock);
 
     acquire(&np->lock);
-    np->state = RUNNABLE;
+    proc_runnable(np);
     release(&np->lock);
 
+    // np runs on our stack: wait until it is off our memory. Only we
+    // can reap it, so it stays around until then.
+    acquire(&wait_lock);
+    while (np->vfork)
+        sleep(&np->vfork, &wait_lock);
+    release(&wait_lock);
+
     return pid;
+
+bad:
+    if (np->files)
+        files_put(np->files);
+    np->files = NULL;
+    if (np->mm && !mm_put(np->mm))
+        np->mm = NULL;  // Still p's
+    acquire(&np->lock);
+    proc_free(np);
+    release(&np->lock);
+    return -1;
+}
+
+/*
+ * p no longer uses the memory of the parent that made it with
+ * CLONE_VFORK, having exec()ed or exited: let the parent go on.
+ */
+void vfork_done(struct proc* p) {
+    acquire(&wait_lock);
+    if (p->vfork) {
+        p->vfork = 0;
+        wakeup(&p->vfork);
+    }
+    release(&wait_lock);
+}
+
+/* A copy of the current process. The exit signal is ignored anyway. */
+int fork() {
+    return clone(0, 0, 0, 0, 0);
+}
+
+/*
+ * Charge the process running here for the time since it was last
+ * charged: as user time if user, since it comes from user mode, or
+ * else as kernel time. Called on each way in and out of the kernel.
+ */
+void proc_charge(int user) {
+    struct proc* p = thisproc();
+    if (!p)
+        return;
+    uint64_t now = timestamp();
+    if (user)
+        p->ru.utime += now - p->acct_at;
+    else
+        p->ru.stime += now - p->acct_at;
+    p->acct_at = now;
+}
+
+static void pusage_add(struct pusage* a, struct pusage* b) {
+    a->utime += b->utime;
+    a->stime += b->stime;
+    a->wtime += b->wtime;
+    a->nvcsw += b->nvcsw;
+    a->nivcsw += b->nivcsw;
 }
 
 /*
- * Wait for a child process to exit and return its pid.
+ * Wait for a child process to exit and return its pid, and if ru is
+ * not NULL, the usage of the child and of the children it waited for.
  * Return -1 if this process has no children.
  */
-int wait() {
+int wait(struct pusage* ru) {
     struct proc* p = thisproc();
     acquire(&wait_lock);
 
@@ -423,13 +1010,19 @@ int wait() {
         // Scan through table looking for exited children.
         int havekids = 0;
         for (struct proc* np = ptable.proc; np < &ptable.proc[NPROC]; ++np) {
-            if (np->parent != p)
+            if (np->parent != p || np->thread)
                 continue;
             havekids = 1;
             if (np->state == ZOMBIE) {
-                // Found one.
+                // Found one. Its lock is held until it is off its CPU.
+                acquire(&np->lock);
                 int pid = np->pid;
+                pusage_add(&np->ru, &np->cru);
+                pusage_add(&p->cru, &np->ru);
+                if (ru)
+                    *ru = np->ru;
                 proc_free(np);
+                release(&np->lock);
                 release(&wait_lock);
                 return pid;
             }
@@ -0,0 +1,105 @@
+#include "prof.h"
+
+#include "arm.h"
+#include "console.h"
+#include "file.h"
+#include "kalloc.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "string.h"
+#include "timer.h"
+#include "types.h"
+
+/*
+ * One ring of samples per CPU, filled by its own timer interrupt and
+ * drained by readers on any CPU: the CPU only moves head and readers
+ * only tail, so neither takes a lock from the other.
+ */
+#define PROF_ORDER 5  // kalloc_pages() order of a ring
+#define NPROF      ((PGSIZE << PROF_ORDER) / sizeof(struct prof_sample))
+
+static struct {
+    struct prof_sample* buf;
+    uint64_t head;     // Samples taken, written by its CPU only
+    uint64_t tail;     // Samples drained, under proflock
+    uint64_t ndrop;    // Samples dropped for want of room
+} ring[NCPU];
+
+static struct spinlock proflock;  // Serializes readers
+
+volatile int prof_on;
+
+/* Record a sample of this CPU. Called from the timer interrupt. */
+void
+prof_sample(uint64_t pc, int user)
+{
+    int id = cpuid();
+    uint64_t head = ring[id].head;
+    if (head - __atomic_load_n(&ring[id].tail, __ATOMIC_ACQUIRE) >= NPROF) {
+        ring[id].ndrop++;
+        return;
+    }
+    struct prof_sample* s = &ring[id].buf[head % NPROF];
+    s->pc = pc;
+    s->pid = thisproc() ? thisproc()->pid : 0;
+    s->cpu = id;
+    s->user = user;
+    __atomic_store_n(&ring[id].head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Drain up to n bytes of samples into buf. Called with proflock held. */
+static ssize_t
+prof_drain(char* buf, size_t n, void* arg)
+{
+    struct prof_sample* out = (struct prof_sample*)buf;
+    size_t max = n / sizeof(*out), k = 0;
+
+    for (int id = 0; id < NCPU; id++) {
+        uint64_t head = __atomic_load_n(&ring[id].head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring[id].tail;
+        for (; tail < head && k < max; tail++)
+            out[k++] = ring[id].buf[tail % NPROF];
+        __atomic_store_n(&ring[id].tail, tail, __ATOMIC_RELEASE);
+    }
+    return k * sizeof(*out);
+}
+
+static ssize_t
+prof_read(struct inode* ip, char* dst, size_t off, ssize_t n)
+{
+    n -= n % sizeof(struct prof_sample);
+    return dev_bounce(&proflock, dst, n, 0, prof_drain, NULL);
+}
+
+static ssize_t
+prof_write(struct inode* ip, char* src, size_t off, ssize_t n)
+{
+    uint32_t rate;
+    if (n != sizeof(rate) || copy_user(&rate, src, sizeof(rate)) < 0) return -1;
+    if (rate > PROF_MAXRATE) return -1;
+
+    prof_on = rate != 0;
+    timer_set_rate(rate ? rate : HZ);
+    if (!rate) {
+        uint64_t ndrop = 0;
+        for (int id = 0; id < NCPU; id++)
+            ndrop += ring[id].ndrop;
+        if (ndrop)
+            cprintf("prof: %lld samples dropped so far.\n", ndrop);
+    }
+    return n;
+}
+
+void
+prof_init()
+{
+    initlock(&proflock, "prof");
+    for (int id = 0; id < NCPU; id++) {
+        if (!(ring[id].buf = (struct prof_sample*)kalloc_pages(PROF_ORDER)))
+            panic("\tprof_init: no memory for the ring of CPU %d.\n", id);
+    }
+    devsw[PROF].read = prof_read;
+    devsw[PROF].write = prof_write;
+    cprintf("prof_init: %d samples per CPU, success.\n", (int)NPROF);
+}
@@ -0,0 +1,58 @@
+#include "rwlock.h"
+#include "console.h"
+#include "proc.h"
+#include "types.h"
+
+void initrwlock(struct rwlock* rw, char* name) {
+    rw->cnt = 0;
+    rw->wwait = 0;
+    rw->name = name;
+    rw->cpu = NULL;
+}
+
+int write_holding(struct rwlock* rw) {
+    return rw->cnt < 0 && rw->cpu == thiscpu;
+}
+
+void read_acquire(struct rwlock* rw) {
+    if (write_holding(rw))
+        panic("\tread_acquire: lock %s at CPU %d held for writing.\n", rw->name, cpuid());
+
+    for (;;) {
+        int32_t c = __atomic_load_n(&rw->cnt, __ATOMIC_RELAXED);
+        if (c >= 0 && !__atomic_load_n(&rw->wwait, __ATOMIC_RELAXED)
+            && __atomic_compare_exchange_n(&rw->cnt, &c, c + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+        asm volatile("wfe");
+    }
+}
+
+void read_release(struct rwlock* rw) {
+    if (rw->cnt <= 0)
+        panic("\tread_release: lock %s at CPU %d not held for reading.\n", rw->name, cpuid());
+    if (__atomic_sub_fetch(&rw->cnt, 1, __ATOMIC_RELEASE) == 0)
+        asm volatile("dsb ishst; sev");
+}
+
+void write_acquire(struct rwlock* rw) {
+    if (write_holding(rw))
+        panic("\twrite_acquire: lock %s at CPU %d already held.\n", rw->name, cpuid());
+
+    __atomic_fetch_add(&rw->wwait, 1, __ATOMIC_RELAXED);
+    for (;;) {
+        int32_t c = 0;
+        if (__atomic_compare_exchange_n(&rw->cnt, &c, -1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        asm volatile("wfe");
+    }
+    __atomic_fetch_sub(&rw->wwait, 1, __ATOMIC_RELAXED);
+    rw->cpu = thiscpu;
+}
+
+void write_release(struct rwlock* rw) {
+    if (!write_holding(rw))
+        panic("\twrite_release: lock %s at CPU %d not held.\n", rw->name, cpuid());
+    rw->cpu = NULL;
+    __atomic_store_n(&rw->cnt, 0, __ATOMIC_RELEASE);
+    asm volatile("dsb ishst; sev");
+}
@@ -5,14 +5,20 @@
 #include "arm.h"
 #include "buf.h"
 #include "console.h"
+#include "kalloc.h"
+#include "mmu.h"
+#include "peripherals/dma.h"
 #include "peripherals/gpio.h"
 #include "peripherals/mbox.h"
 #include "proc.h"
 #include "sleeplock.h"
 #include "string.h"
+#include "trace.h"
 
 // Private functions
-static void _sd_start(struct buf* b);
+static void _sd_start();
+static void _sd_handle();
+static void _sd_set_dma(int on);
 static void _sd_delayus(uint32_t cnt);
 static int _sd_init();
 static void _sd_parse_cid();
@@ -343,6 +349,8 @@ static EmmcCommand sd_command_table[] = {
 #define CSD1VN_TRAN_SPEED 0xff000000
 
 #define CSD1VN_CCC                0x00fff000
+#define CSD1VN_CCC_SHIFT          12
+#define CSD1VN_CCC_ERASE          0x00000020  // Command class 5, after the shift
 #define CSD1VN_READ_BL_LEN        0x00000f00
 #define CSD1VN_READ_BL_LEN_SHIFT  8
 #define CSD1VN_READ_BL_PARTIAL    0x00000080
@@ -353,6 +361,7 @@ static EmmcCommand sd_command_table[] = {
 #define CSD2VN_ERASE_BLK_EN       0x00000040
 #define CSD2VN_ERASE_SECTOR_SIZEH 0x0000003f
 #define CSD3VN_ERASE_SECTOR_SIZEL 0x80000000
+#define CSD3VN_ERASE_SECTOR_SIZEL_SHIFT 31
 
 #define CSD3VN_WP_GRP_SIZE 0x7f000000
 
@@ -469,6 +478,7 @@ typedef struct SdDescriptor {
     unsigned int ocr;
     unsigned int support;
     unsigned int file_format;
+    unsigned int erase_blocks;  // Blocks of an erase sector, 0 if it cannot erase
     unsigned char type;
     unsigned char uhsi;
     unsigned char init;
@@ -487,8 +497,37 @@ static SdDescriptor sd_card;
 
 static int sd_host_ver = 0;
 static int sd_debug = 0;
+static int sd_dma = 0;  // Data phase by system DMA rather than PIO
 static int sd_base_clock;
 
+// Device ROOTDEV is the second partition, device 0 is the raw card.
+static uint32_t sd_fs_lba;
+
+#define SD_MAX_MULTI 128  // Blocks per multi-block command
+
+/*
+ * Requests waiting for the card in FIFO order, linked through qnext,
+ * and the bufs of the one command in flight.
+ */
+static struct {
+    struct spinlock lock;
+    struct buf* head;
+    struct buf* tail;
+    struct buf* cur[SD_MAX_MULTI];  // Bufs of the command in flight
+    int n;                          // Number of them, 0 if the card is idle
+    int done;                       // Blocks moved through the FIFO so far
+    int setcnt;                     // Sent SET_BLOCKCNT, no STOP_TRANS needed
+    int erasing;                    // sd_discard() has the card, start nothing
+} sdq;
+
+/*
+ * DMA channel for the data phase, paced by the EMMC DREQ.
+ * One control block per buf, chained, so every block lands
+ * straight in its buf->data.
+ */
+#define SD_DMA_CHAN 5
+static struct dma_cb sd_cb[SD_MAX_MULTI];
+
 #define MBX_PROP_CLOCK_EMMC 1
 
 static uint32_t
@@ -498,7 +537,7 @@ _parse_uint32_t(uint8_t* bytes)
            | (((uint32_t)bytes[1]) << 8) | (((uint32_t)bytes[0]) << 0);
 }
 
-static void
+static uint32_t
 _parse_partition_entry(uint8_t* entry, int id)
 {
     cprintf("sd_init: Partition %d: ", id);
@@ -533,6 +572,7 @@ _parse_partition_entry(uint8_t* entry, int id)
 
     uint32_t sectorno = _parse_uint32_t(&entry[12]);
     cprintf("- Number of sectors: %d\n", sectorno);
+    return lba;
 }
 
 /*
@@ -550,9 +590,14 @@ sd_init()
      * Remember to call sd_init() at somewhere.
      */
 
+    initlock(&sdq.lock, "sd");
     _sd_init();
     asserts(sd_card.init, "\tFailed to initialize SD card.\n");
 
+    put32(DMA_ENABLE, get32(DMA_ENABLE) | (1 << SD_DMA_CHAN));
+    put32(DMA_CS(SD_DMA_CHAN), DMA_CS_RESET);
+    _sd_set_dma(1);
+
     /*
      * Read and parse 1st block (MBR) and collect whatever
      * information you want.
@@ -565,7 +610,8 @@ sd_init()
 
     uint8_t* partitions = mbr.data + 0x1BE;
     for (int i = 0; i < 4; ++i) {
-        _parse_partition_entry(partitions + (i << 4), i + 1);
+        uint32_t lba = _parse_partition_entry(partitions + (i << 4), i + 1);
+        if (i == 1) sd_fs_lba = lba;
     }
 
     uint8_t* ending = mbr.data + 0x1FE;
@@ -583,21 +629,132 @@ _sd_delayus(uint32_t c)
 }
 
 /*
- * Start the request for b. Caller must hold sdlock.
+ * Card address of block blockno of dev. Blocks of ROOTDEV are
+ * relative to the start of the file system partition.
+ * Address is different depending on the card type.
+ * HC passes address as block number.
+ * SC passes address straight through.
+ */
+static int
+_sd_sector(uint32_t dev, uint32_t blockno)
+{
+    uint32_t sector = blockno + (dev == ROOTDEV ? sd_fs_lba : 0);
+    return sd_card.type == SD_TYPE_2_HC ? sector : sector << 9;
+}
+
+/* Card address of b. */
+static int
+_sd_addr(struct buf* b)
+{
+    return _sd_sector(b->dev, b->blockno);
+}
+
+/*
+ * Select DMA or PIO for the data phase. In DMA mode the FIFO ready
+ * interrupts are masked off, the only one that matters is DATA_DONE.
+ * The queue must be idle.
  */
 static void
-_sd_start(struct buf* b)
+_sd_set_dma(int on)
 {
-    // Address is different depending on the card type.
-    // HC passes address as block number.
-    // SC passes address straight through.
-    int blockno = sd_card.type == SD_TYPE_2_HC ? b->blockno : b->blockno << 9;
+    uint32_t rdy = INT_READ_RDY | INT_WRITE_RDY;
+    sd_dma = on;
+    *EMMC_IRPT_MASK = on ? 0xffffffff & ~rdy : 0xffffffff;
+    *EMMC_IRPT_EN = 0xffffffff & ~INT_CMD_DONE & ~(on ? rdy : 0);
+}
+
+/*
+ * Set up the DMA chain for the bufs in sdq.cur[] and start the
+ * channel. Caller must hold sdq.lock.
+ */
+static void
+_sd_dma_start(int write)
+{
+    uint32_t fifo = DMA_BUS_PERIPH((uint64_t)EMMC_DATA);
+
+    for (int i = 0; i < sdq.n; i++) {
+        struct dma_cb* cb = &sd_cb[i];
+        uint8_t* data = bdata(sdq.cur[i]);
+        uint32_t mem = DMA_BUS_MEM(V2P(data));
+
+        asserts(
+            !((uint64_t)data & 0x3),
+            "\tOnly support word-aligned buffers.\n");
+        cb->ti = DMA_TI_PERMAP(DMA_DREQ_EMMC) | DMA_TI_WAIT_RESP
+                 | (write ? DMA_TI_DEST_DREQ | DMA_TI_SRC_INC
+                          : DMA_TI_SRC_DREQ | DMA_TI_DEST_INC);
+        cb->src = write ? mem : fifo;
+        cb->dst = write ? fifo : mem;
+        cb->len = BSIZE;
+        cb->stride = 0;
+        cb->next = i + 1 < sdq.n ? DMA_BUS_MEM(V2P(&sd_cb[i + 1])) : 0;
+
+        // Push out what the CPU wrote, and drop lines that could be
+        // evicted over the incoming data.
+        dccivac(data, BSIZE);
+    }
+    dccivac(sd_cb, sdq.n * sizeof(sd_cb[0]));
+    disb();
+
+    put32(DMA_CONBLK_AD(SD_DMA_CHAN), DMA_BUS_MEM(V2P(sd_cb)));
+    put32(
+        DMA_CS(SD_DMA_CHAN), DMA_CS_ACTIVE | DMA_CS_PRIORITY(8)
+                                 | DMA_CS_PANIC_PRIORITY(15)
+                                 | DMA_CS_WAIT_WRITES);
+}
+
+/*
+ * The card is done with the DMA'd command. Make sure the channel
+ * is too, and that the CPU sees what it wrote. Caller must hold
+ * sdq.lock.
+ */
+static void
+_sd_dma_finish()
+{
+    // DATA_DONE of a read comes once the FIFO is drained, but the
+    // last beats may still be on their way to memory.
+    int count = 1000;
+    while ((get32(DMA_CS(SD_DMA_CHAN)) & DMA_CS_ACTIVE) && count--)
+        _sd_delayus(1);
+
+    uint32_t cs = get32(DMA_CS(SD_DMA_CHAN));
+    asserts(
+        !(cs & (DMA_CS_ACTIVE | DMA_CS_ERROR)),
+        "\tEMMC ERROR: DMA not done: cs 0x%x, debug 0x%x\n", cs,
+        get32(DMA_DEBUG(SD_DMA_CHAN)));
+    put32(DMA_CS(SD_DMA_CHAN), DMA_CS_END);
+
+    if (!(sdq.cur[0]->flags & B_DIRTY))
+        for (int i = 0; i < sdq.n; i++) dccivac(bdata(sdq.cur[i]), BSIZE);
+    disb();
+    sdq.done = sdq.n;
+}
+
+/*
+ * Start the request at the head of the queue. Bufs queued right
+ * behind it that follow it on disk and go in the same direction
+ * ride along in one multi-block command. Caller must hold sdq.lock.
+ */
+static void
+_sd_start()
+{
+    struct buf* b = sdq.head;
     int write = b->flags & B_DIRTY;
-    int cmd = write ? IX_WRITE_SINGLE : IX_READ_SINGLE;
+    int resp;
 
-    // cprintf(
-    //     "_sd_start: CPU %d, flag 0x%x, blockno %d, write=%d.\n", cpuid(),
-    //     b->flags, blockno, write);
+    sdq.n = 0;
+    do {
+        sdq.cur[sdq.n++] = b;
+        b = b->qnext;
+    } while (b && sdq.n < SD_MAX_MULTI && b->dev == sdq.cur[0]->dev
+             && b->blockno == sdq.cur[0]->blockno + sdq.n
+             && (b->flags & B_DIRTY) == write);
+    sdq.head = b;
+    if (!b) sdq.tail = NULL;
+    sdq.done = 0;
+    sdq.setcnt = sdq.n > 1 && (sd_card.support & SD_SUPP_SET_BLOCK_COUNT);
+
+    trace(TR_SDSTART, sdq.cur[0]->blockno, sdq.n | (uint64_t)!!write << 32);
 
     // Ensure that any data operation has completed before doing the transfer.
     disb();
@@ -606,39 +763,104 @@ _sd_start(struct buf* b)
         "\tEMMC ERROR: Interrupt flag should be empty: 0x%x\n",
         *EMMC_INTERRUPT);
 
-    *EMMC_BLKSIZECNT = BSIZE;
+    // Tell the card how many blocks are coming if it can take it,
+    // otherwise stop the transfer explicitly in _sd_done().
+    if (sdq.setcnt) {
+        resp = _sd_send_command_a(IX_SET_BLOCKCNT, sdq.n);
+        asserts(!resp, "\tEMMC ERROR: Set block count error.\n");
+    }
+
+    *EMMC_BLKSIZECNT = (sdq.n << 16) | BSIZE;
 
-    int resp = _sd_send_command_a(cmd, blockno);
+    // The channel waits on DREQ until the card produces or wants data.
+    if (sd_dma) _sd_dma_start(write);
+
+    int cmd = sdq.n == 1 ? (write ? IX_WRITE_SINGLE : IX_READ_SINGLE)
+                         : (write ? IX_WRITE_MULTI : IX_READ_MULTI);
+    resp = _sd_send_command_a(cmd, _sd_addr(sdq.cur[0]));
     asserts(!resp, "\tEMMC ERROR: Send command error.\n");
 
-    uint32_t* intbuf = (uint32_t*)b->data;
+    // Without DMA, the FIFO is driven from _sd_handle() as
+    // READ_RDY/WRITE_RDY come in.
+}
+
+/*
+ * The command in flight has moved all its data. Complete its bufs
+ * and start the next request. Caller must hold sdq.lock.
+ */
+static void
+_sd_done()
+{
+    if (sd_dma) _sd_dma_finish();
+    trace(TR_SDDONE, sdq.cur[0]->blockno, sdq.n);
     asserts(
-        !((uint64_t)b->data & 0x3), "\tOnly support word-aligned buffers.\n");
+        sdq.done == sdq.n, "\tEMMC ERROR: Data done after %d of %d blocks.\n",
+        sdq.done, sdq.n);
 
-    if (write) {
-        resp = _sd_wait_for_interrupt(INT_WRITE_RDY);
-        asserts(!resp, "\tEMMC ERROR: Timeout waiting for ready to write.\n");
-        asserts(
-            !*EMMC_INTERRUPT,
-            "\tEMMC ERROR: Interrupt flag should be empty: 0x%x\n",
-            *EMMC_INTERRUPT);
-        for (int done = 0; done < BSIZE / 4; ++done) {
-            *EMMC_DATA = intbuf[done];
+    if (sdq.n > 1 && !sdq.setcnt) {
+        int resp = _sd_send_command(IX_STOP_TRANS);
+        asserts(!resp, "\tEMMC ERROR: Stop transmission error.\n");
+    }
+
+    for (int i = 0; i < sdq.n; i++) {
+        struct buf* b = sdq.cur[i];
+        b->flags &= ~(B_DIRTY | B_IO);
+        b->flags |= B_VALID;
+        if (b->flags & B_ASYNC) {
+            // Nobody waits for it, so release it on the submitter's behalf.
+            b->flags &= ~B_ASYNC;
+            brelse_io(b);
+        } else {
+            wakeup(b);
         }
-    } else {
-        resp = _sd_wait_for_interrupt(INT_READ_RDY);
-        asserts(!resp, "\tEMMC ERROR: Timeout waiting for ready to read.\n");
+    }
+    sdq.n = 0;
+
+    if (sdq.erasing)
+        wakeup(&sdq.erasing);
+    else if (sdq.head)
+        _sd_start();
+}
+
+/*
+ * Serve whatever the controller has flagged for the command in
+ * flight. Called from the interrupt handler, and by waiters that
+ * cannot sleep. Caller must hold sdq.lock.
+ */
+static void
+_sd_handle()
+{
+    uint32_t i;
+
+    while (sdq.n
+           && (i = *EMMC_INTERRUPT
+                   & (INT_READ_RDY | INT_WRITE_RDY | INT_DATA_DONE
+                      | INT_ERROR_MASK))) {
         asserts(
-            !*EMMC_INTERRUPT,
-            "\tEMMC ERROR: Interrupt flag should be empty: 0x%x\n",
-            *EMMC_INTERRUPT);
-        for (int done = 0; done < BSIZE / 4; ++done) {
-            intbuf[done] = *EMMC_DATA;
+            !(i & INT_ERROR_MASK), "\tEMMC ERROR: Data transfer error: 0x%x\n",
+            i);
+
+        if (i & (INT_READ_RDY | INT_WRITE_RDY)) {
+            *EMMC_INTERRUPT = i & (INT_READ_RDY | INT_WRITE_RDY);
+            asserts(
+                sdq.done < sdq.n, "\tEMMC ERROR: FIFO ready past %d blocks.\n",
+                sdq.n);
+
+            uint32_t* intbuf = (uint32_t*)bdata(sdq.cur[sdq.done++]);
+            asserts(
+                !((uint64_t)intbuf & 0x3),
+                "\tOnly support word-aligned buffers.\n");
+            if (i & INT_WRITE_RDY)
+                for (int k = 0; k < BSIZE / 4; ++k) *EMMC_DATA = intbuf[k];
+            else
+                for (int k = 0; k < BSIZE / 4; ++k) intbuf[k] = *EMMC_DATA;
         }
-    }
 
-    resp = _sd_wait_for_interrupt(INT_DATA_DONE);
-    asserts(!resp, "\tEMMC ERROR: Timeout waiting for data done.\n");
+        if (i & INT_DATA_DONE) {
+            *EMMC_INTERRUPT = INT_DATA_DONE;
+            _sd_done();
+        }
+    }
 }
 
 /*
@@ -647,13 +869,54 @@ _sd_start(struct buf* b)
 void
 sd_intr()
 {
-    int i = *EMMC_INTERRUPT;
-    if (!(i & INT_DATA_DONE)) {
-        cprintf("\tsd_intr: Unexpected SD interrupt: %d\n", i);
-        return;
+    acquire(&sdq.lock);
+    if (sdq.n)
+        _sd_handle();
+    else {
+        int i = *EMMC_INTERRUPT;
+        cprintf("\tsd_intr: Unexpected SD interrupt: 0x%x\n", i);
+        *EMMC_INTERRUPT = i;  // Clear interrupt
     }
-    *EMMC_INTERRUPT = i;  // Clear interrupt
     disb();
+    release(&sdq.lock);
+}
+
+/*
+ * Append b to the request queue and start it if the card is idle.
+ * Caller must hold sdq.lock.
+ */
+static void
+_sd_enqueue(struct buf* b)
+{
+    b->flags |= B_IO;
+    b->qnext = NULL;
+    if (sdq.tail)
+        sdq.tail->qnext = b;
+    else
+        sdq.head = b;
+    sdq.tail = b;
+}
+
+/*
+ * Wait for b to come back from the card. Processes sleep until
+ * sd_intr() wakes them up; before there is any process to put to
+ * sleep (during boot), poll the controller instead.
+ * Caller must hold sdq.lock.
+ */
+static void
+_sd_wait(struct buf* b)
+{
+    if (thisproc()) {
+        while (b->flags & B_IO) sleep(b, &sdq.lock);
+        return;
+    }
+
+    // Wait up to 1 second.
+    for (int count = 1000000; (b->flags & B_IO) && count--;) {
+        _sd_handle();
+        if (b->flags & B_IO) _sd_delayus(1);
+    }
+    asserts(!(b->flags & B_IO), "\tEMMC ERROR: Timeout waiting for data.\n");
 }
 
 /*
@@ -664,94 +927,240 @@ sd_intr()
 void
 sd_rw(struct buf* b)
 {
-    _sd_start(b);
-    b->flags &= ~B_DIRTY;
-    b->flags |= B_VALID;
+    sd_rw_multi(&b, 1);
 }
 
-/* SD card test and benchmark. */
+/*
+ * Queue n bufs for the card without waiting for them. Runs of bufs
+ * that are adjacent on disk and go in the same direction are merged
+ * into one multi-block command, so callers should pass them sorted.
+ * Bufs marked B_ASYNC are released with brelse() when they complete.
+ */
 void
-sd_test()
+sd_submit(struct buf** bs, int n)
 {
-    static struct buf b[1 << 11];
-    int n = sizeof(b) / sizeof(b[0]);
-    int mb = (n * BSIZE) >> 20;
-    assert(mb);
+    if (n <= 0) return;
+    acquire(&sdq.lock);
+    for (int i = 0; i < n; i++) _sd_enqueue(bs[i]);
+    if (!sdq.n && !sdq.erasing) _sd_start();
+    release(&sdq.lock);
+}
+
+/*
+ * Sync n bufs with disk, like sd_rw() on each of them, and wait for
+ * all of them.
+ */
+void
+sd_rw_multi(struct buf** bs, int n)
+{
+    if (n <= 0) return;
+    acquire(&sdq.lock);
+    for (int i = 0; i < n; i++) _sd_enqueue(bs[i]);
+    if (!sdq.n && !sdq.erasing) _sd_start();
+    for (int i = 0; i < n; i++) _sd_wait(bs[i]);
+    release(&sdq.lock);
+}
+
+/*
+ * Size of the card's erase sectors in blocks, 0 if it cannot erase,
+ * and in *first the first block of dev that starts one.
+ */
+uint32_t
+sd_erase_unit(uint32_t dev, uint32_t* first)
+{
+    uint32_t unit = sd_card.erase_blocks;
+    uint32_t lba = dev == ROOTDEV ? sd_fs_lba : 0;
+    *first = unit ? (unit - lba % unit) % unit : 0;
+    return unit;
+}
+
+/*
+ * ERASE blocks [start, start + n) of dev, which hold nothing anyone
+ * will read again, so that the card can reuse them without copying.
+ * The card is busy for a while after the command, during which the
+ * queue holds off and the caller polls, yielding in between. Blocks
+ * that come back erased read as zeros or ones, see SCR_DATA_AFTER_ERASE.
+ */
+void
+sd_discard(uint32_t dev, uint32_t start, uint32_t n)
+{
+    if (!n || !sd_card.erase_blocks) return;
+
+    acquire(&sdq.lock);
+    while (sdq.erasing) sleep(&sdq.erasing, &sdq.lock);
+    sdq.erasing = 1;
+    while (sdq.n) sleep(&sdq.erasing, &sdq.lock);
+    release(&sdq.lock);
+
+    // Nothing else talks to the controller now. Keep the busy end of
+    // ERASE from interrupting, it is polled below.
+    *EMMC_IRPT_EN = 0;
+    int resp = _sd_send_command_a(IX_ERASE_WR_ST, _sd_sector(dev, start));
+    if (!resp) resp = _sd_send_command_a(IX_ERASE_WR_END, _sd_sector(dev, start + n - 1));
+    if (!resp) resp = _sd_send_command_a(IX_ERASE, 0);
+    if (resp) cprintf("sd_discard: erase of %d blocks at %d failed: 0x%x.\n", n, start, resp);
+
+    // Wait for DAT0 to go high again, up to a second per sector.
+    uint64_t t = timestamp(), max = timerfreq() * (n / sd_card.erase_blocks + 1);
+    while ((*EMMC_STATUS & SR_DAT_INHIBIT) && timestamp() - t < max) yield();
+    asserts(
+        !(*EMMC_STATUS & SR_DAT_INHIBIT),
+        "\tEMMC ERROR: Timeout waiting for erase.\n");
+    *EMMC_INTERRUPT = *EMMC_INTERRUPT;
+    trace(TR_SDERASE, start, n);
+
+    acquire(&sdq.lock);
+    _sd_set_dma(sd_dma);
+    sdq.erasing = 0;
+    wakeup(&sdq.erasing);
+    if (sdq.head) _sd_start();
+    release(&sdq.lock);
+}
+
+/*
+ * The benchmark scribbles over the raw card blocks between the MBR
+ * and the boot partition (BOOT_OFFSET in mksd.mk), which hold nothing.
+ */
+#define SD_TEST_BLK0   1
+#define SD_TEST_NBLK   2047
+#define SD_TEST_BYTES  (1 << 20)  // Moved per benchmark run
+#define SD_TEST_QD     8          // Deepest queue tried
+#define SD_TEST_MAXBLK (64 * 1024 / BSIZE)
 
-    int64_t f, t;
+static struct buf* sd_test_ptr[SD_TEST_QD * SD_TEST_MAXBLK];
+
+/*
+ * One closed-loop run: keep qd requests of bsz bytes in the driver
+ * queue until SD_TEST_BYTES have moved, timing each request from
+ * submission to completion. Requests walk the scratch area in order,
+ * or hit random bsz-aligned slots of it.
+ */
+static void
+_sd_bench(
+    struct buf* bufs, uint64_t* lat, int write, int rand, int bsz, int qd)
+{
+    int nb = bsz / BSIZE, nslot = SD_TEST_NBLK / nb;
+    int nreq = SD_TEST_BYTES / bsz;
+    uint64_t t0[SD_TEST_QD], seed = 0x2545F4914F6CDD1D, f, t;
     asm volatile("mrs %[freq], cntfrq_el0" : [freq] "=r"(f));
-    cprintf("sd_test: begin nblocks %d\n", n);
-
-    cprintf("sd_test: sd check rw...\n");
-    // Read / write test
-    for (int i = 1; i < n; i++) {
-        // Backup
-        b[0].flags = 0;
-        b[0].blockno = i;
-        bpin(&b[0]);
-        sd_rw(&b[0]);
-
-        // Write some value
-        b[i].flags = B_DIRTY;
-        b[i].blockno = i;
-        bpin(&b[i]);
-        for (int j = 0; j < BSIZE; j++) b[i].data[j] = i * j & 0xFF;
-        sd_rw(&b[i]);
-
-        memset(b[i].data, 0, sizeof(b[i].data));
-
-        // Read back and check
-        b[i].flags = 0;
-        bpin(&b[i]);
-        sd_rw(&b[i]);
-
-        for (int j = 0; j < BSIZE; j++) assert(b[i].data[j] == (i * j & 0xFF));
-
-        // Restore previous value
-        b[0].flags = B_DIRTY;
-        bpin(&b[0]);
-        sd_rw(&b[0]);
-    }
 
-    // Read benchmark
-    disb();
     t = timestamp();
-    disb();
+    for (int issued = 0, completed = 0; completed < nreq;) {
+        while (issued < nreq && issued - completed < qd) {
+            int q = issued % qd, slot = issued % nslot;
+            if (rand) {
+                seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17;
+                slot = seed % nslot;
+            }
+            for (int j = 0; j < nb; j++) {
+                struct buf* b = &bufs[q * nb + j];
+                b->flags = write ? B_DIRTY : 0;
+                b->dev = 0;
+                b->blockno = SD_TEST_BLK0 + slot * nb + j;
+                sd_test_ptr[q * nb + j] = b;
+            }
+            t0[q] = timestamp();
+            sd_submit(sd_test_ptr + q * nb, nb);
+            issued++;
+        }
 
-    for (int i = 0; i < n; i++) {
-        b[i].flags = 0;
-        b[i].blockno = i;
-        bpin(&b[i]);
-        sd_rw(&b[i]);
+        // The queue is FIFO, so the oldest request finishes first.
+        int q = completed % qd;
+        acquire(&sdq.lock);
+        for (int j = 0; j < nb; j++) _sd_wait(&bufs[q * nb + j]);
+        release(&sdq.lock);
+        lat[completed++] = timestamp() - t0[q];
     }
-
-    disb();
     t = timestamp() - t;
-    disb();
 
+    // Insertion sort is plenty for a couple of thousand samples.
+    for (int i = 1; i < nreq; i++) {
+        uint64_t x = lat[i];
+        int j = i;
+        for (; j > 0 && lat[j - 1] > x; j--) lat[j] = lat[j - 1];
+        lat[j] = x;
+    }
+
+    uint64_t mbx10 = (uint64_t)SD_TEST_BYTES * f * 10 / t >> 20;
     cprintf(
-        "sd_test: read %lld B (%lld MB), t: %lld cycles, speed: %lld.%lld MB/s\n",
-        n * BSIZE, mb, t, mb * f / t, (mb * f * 10 / t) % 10);
+        "sd_test: %s %s %s %d qd %d: %lld.%lld MB/s, %lld IOPS, p50 %lld us, "
+        "p99 %lld us\n",
+        sd_dma ? "dma" : "pio", rand ? "rand" : "seq", write ? "write" : "read",
+        bsz, qd, mbx10 / 10, mbx10 % 10, nreq * f / t,
+        lat[nreq / 2] * 1000000 / f, lat[nreq * 99 / 100] * 1000000 / f);
+}
 
-    // Write benchmark
-    disb();
-    t = timestamp();
-    disb();
+/*
+ * Write a pattern over part of the scratch area, read it back and
+ * compare.
+ */
+static void
+_sd_check(struct buf* bufs)
+{
+    int n = SD_TEST_QD * SD_TEST_MAXBLK / 2;
+    struct buf* rd = bufs + n;
 
     for (int i = 0; i < n; i++) {
-        b[i].flags = B_DIRTY;
-        b[i].blockno = i;
-        bpin(&b[i]);
-        sd_rw(&b[i]);
+        bufs[i].flags = B_DIRTY;
+        bufs[i].dev = 0;
+        bufs[i].blockno = SD_TEST_BLK0 + i;
+        for (int j = 0; j < BSIZE; j++)
+            bufs[i].data[j] = (i * j + sd_dma) & 0xFF;
+        sd_test_ptr[i] = &bufs[i];
     }
+    sd_rw_multi(sd_test_ptr, n);
 
-    disb();
-    t = timestamp() - t;
-    disb();
+    for (int i = 0; i < n; i++) {
+        memset(&rd[i], 0, sizeof(rd[i]));
+        rd[i].blockno = SD_TEST_BLK0 + i;
+        sd_test_ptr[i] = &rd[i];
+    }
+    sd_rw_multi(sd_test_ptr, n);
+
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j < BSIZE; j++)
+            asserts(
+                rd[i].data[j] == ((i * j + sd_dma) & 0xFF),
+                "\tsd_test: %s mismatch at block %d byte %d.\n",
+                sd_dma ? "dma" : "pio", rd[i].blockno, j);
+}
+
+/*
+ * SD card test and benchmark. Sequential and random reads and
+ * writes of 512B, 4K and 64K at queue depths 1 to SD_TEST_QD, with
+ * throughput and p50/p99 latency for each, first in PIO and then in
+ * DMA mode. Run at boot by building with 'make SD_TEST=1'.
+ */
+void
+sd_test()
+{
+    static const int size[] = {BSIZE, 4096, 64 * 1024};
+
+    int order = 0;
+    while ((PGSIZE << order) < SD_TEST_QD * SD_TEST_MAXBLK * sizeof(struct buf))
+        order++;
+    struct buf* bufs = (struct buf*)kalloc_pages(order);
+    uint64_t* lat = (uint64_t*)kalloc_pages(2);
+    assert(bufs && lat && SD_TEST_BYTES / BSIZE * sizeof(*lat) <= 4 * PGSIZE);
+    memset(bufs, 0, PGSIZE << order);
 
     cprintf(
-        "sd_test: write %lld B (%lld MB), t: %lld cycles, speed: %lld.%lld MB/s\n",
-        n * BSIZE, mb, t, mb * f / t, (mb * f * 10 / t) % 10);
+        "sd_test: begin, scratch blocks %d-%d\n", SD_TEST_BLK0,
+        SD_TEST_BLK0 + SD_TEST_NBLK - 1);
+
+    for (int dma = 0; dma <= 1; dma++) {
+        _sd_set_dma(dma);
+        _sd_check(bufs);
+        for (int write = 0; write <= 1; write++)
+            for (int rand = 0; rand <= 1; rand++)
+                for (int s = 0; s < sizeof(size) / sizeof(size[0]); s++)
+                    for (int qd = 1; qd <= SD_TEST_QD; qd <<= 1)
+                        _sd_bench(bufs, lat, write, rand, size[s], qd);
+    }
+
+    kfree_pages((char*)bufs, order);
+    kfree_pages((char*)lat, 2);
+    cprintf("sd_test: end\n");
 }
 
 static int
@@ -1227,8 +1636,10 @@ sd_reset_card(int reset_type)
     // Enable interrupts for command completion values.
     // *EMMC_IRPT_EN   = INT_ALL_MASK;
     // *EMMC_IRPT_MASK = INT_ALL_MASK;
-    // Ignore INT_CMD_DONE and INT_WRITE_RDY.
-    *EMMC_IRPT_EN = 0xffffffff & (~INT_CMD_DONE) & (~INT_WRITE_RDY);
+    // The card comes up polled, without interrupts: another CPU could
+    // take one and clear what we poll for. _sd_set_dma() turns on those
+    // that data transfers run off once the card is up.
+    *EMMC_IRPT_EN = 0;
     *EMMC_IRPT_MASK = 0xffffffff;
     // printf("EMMC: Interrupt enable/mask registers: %08x
     // %08x\n",*EMMC_IRPT_EN,*EMMC_IRPT_MASK); printf("EMMC: Status: %08x,
@@ -1592,4 +2003,17 @@ _sd_parse_csd()
 
     // Get other attributes of the card.
     sd_card.file_format = sd_card.csd[3] & CSD3VN_FILE_FORMAT;
+
+    // The card erases whole sectors of SECTOR_SIZE + 1 write blocks
+    // without having to copy what else shares them.
+    sd_card.erase_blocks = 0;
+    if (((sd_card.csd[1] & CSD1VN_CCC) >> CSD1VN_CCC_SHIFT) & CSD1VN_CCC_ERASE) {
+        int sector = ((sd_card.csd[2] & CSD2VN_ERASE_SECTOR_SIZEH) << 1)
+                     + ((sd_card.csd[3] & CSD3VN_ERASE_SECTOR_SIZEL)
+                        >> CSD3VN_ERASE_SECTOR_SIZEL_SHIFT);
+        int wbl = 1 << ((sd_card.csd[3] & CSD3VN_WRITE_BL_LEN)
+                        >> CSD3VN_WRITE_BL_LEN_SHIFT);
+        sd_card.erase_blocks = (sector + 1) * wbl / BSIZE;
+    }
+    cprintf("- EMMC: erase sector of %d blocks.\n", sd_card.erase_blocks);
 }
@@ -0,0 +1,196 @@
+#include "slab.h"
+
+#include <stdint.h>
+
+#include "console.h"
+#include "kalloc.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "string.h"
+#include "types.h"
+
+/*
+ * Slab header, kept at the beginning of the slab itself.
+ * Buddy blocks are aligned to their size, so the header of an
+ * object's slab is found by rounding the object address down.
+ */
+struct slab {
+    struct kmem_cache* cache;
+    struct slab* next;  /* Link in cache->partial */
+    struct slab* prev;
+    void* free;         /* Free objects, linked through their first word */
+    int inuse;          /* Objects handed out from this slab */
+};
+
+#define SLAB_HDR      ROUNDUP(sizeof(struct slab), CACHELINE)
+#define SLAB_MIN_OBJ  8  /* Grow the slab order until this many fit */
+#define SLAB_MAX_ORD  3
+
+static struct {
+    struct spinlock lock;
+    int n;
+    struct kmem_cache cache[NCACHE];
+} caches = {.lock = {.name = "caches"}};
+
+static inline struct slab*
+obj2slab(struct kmem_cache* c, void* obj)
+{
+    return (struct slab*)ROUNDDOWN((uint64_t)obj, (uint64_t)PGSIZE << c->order);
+}
+
+static void
+partial_add(struct kmem_cache* c, struct slab* s)
+{
+    s->prev = 0;
+    s->next = c->partial;
+    if (s->next) s->next->prev = s;
+    c->partial = s;
+}
+
+static void
+partial_remove(struct kmem_cache* c, struct slab* s)
+{
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        c->partial = s->next;
+    if (s->next) s->next->prev = s->prev;
+}
+
+/*
+ * Create a cache of objects of the given size.
+ * Returns 0 if the object is too large or there are no free caches.
+ */
+struct kmem_cache*
+kmem_cache_create(char* name, size_t size)
+{
+    struct kmem_cache* c;
+    int order;
+
+    size = ROUNDUP(MAX(size, sizeof(void*)), CACHELINE);
+    for (order = 0; order < SLAB_MAX_ORD; order++)
+        if (((PGSIZE << order) - SLAB_HDR) / size >= SLAB_MIN_OBJ) break;
+    if ((PGSIZE << order) - SLAB_HDR < size) return 0;
+
+    acquire(&caches.lock);
+    if (caches.n == NCACHE) {
+        release(&caches.lock);
+        return 0;
+    }
+    c = &caches.cache[caches.n++];
+    release(&caches.lock);
+
+    memset(c, 0, sizeof(*c));
+    initlock(&c->lock, name);
+    c->name = name;
+    c->size = size;
+    c->order = order;
+    c->nobj = ((PGSIZE << order) - SLAB_HDR) / size;
+    return c;
+}
+
+/* Carve a new slab into free objects. Caller must hold c->lock. */
+static struct slab*
+slab_grow(struct kmem_cache* c)
+{
+    struct slab* s;
+    char* p;
+    int i;
+
+    if (!(s = (struct slab*)kalloc_pages(c->order))) return 0;
+    s->cache = c;
+    s->inuse = 0;
+    s->free = 0;
+    for (i = c->nobj - 1; i >= 0; i--) {
+        p = (char*)s + SLAB_HDR + i * c->size;
+        *(void**)p = s->free;
+        s->free = p;
+    }
+    partial_add(c, s);
+    c->nslab++;
+    return s;
+}
+
+/*
+ * Return an object to its slab. Keeps at most one completely free
+ * slab around per cache. Caller must hold c->lock.
+ */
+static void
+slab_put(struct kmem_cache* c, void* obj)
+{
+    struct slab* s = obj2slab(c, obj);
+
+    if (s->cache != c) panic("\tslab_put: object %p not from %s.\n", obj, c->name);
+
+    if (!s->free) partial_add(c, s);
+    *(void**)obj = s->free;
+    s->free = obj;
+    if (--s->inuse == 0 && (s->next || s->prev)) {
+        partial_remove(c, s);
+        kfree_pages((char*)s, c->order);
+        c->nslab--;
+    }
+}
+
+/* Refill this CPU's free list with up to half of SLAB_CPU_MAX objects. */
+static void
+cpu_refill(struct kmem_cache* c, int cpu)
+{
+    struct slab* s;
+    void* obj;
+
+    acquire(&c->lock);
+    while (c->cpu[cpu].n < SLAB_CPU_MAX / 2) {
+        if (!(s = c->partial) && !(s = slab_grow(c))) break;
+        obj = s->free;
+        s->free = *(void**)obj;
+        s->inuse++;
+        if (!s->free) partial_remove(c, s);
+        c->cpu[cpu].obj[c->cpu[cpu].n++] = obj;
+    }
+    release(&c->lock);
+}
+
+/*
+ * Allocate one object from c.
+ * Interrupts are always disabled in the kernel, so the per-CPU
+ * lists need no locking. Returns 0 if memory is exhausted.
+ */
+void*
+kmem_cache_alloc(struct kmem_cache* c)
+{
+    int cpu = cpuid();
+
+    if (!c->cpu[cpu].n) cpu_refill(c, cpu);
+    if (!c->cpu[cpu].n) return 0;
+
+    __atomic_fetch_add(&c->inuse, 1, __ATOMIC_RELAXED);
+    return c->cpu[cpu].obj[--c->cpu[cpu].n];
+}
+
+/* Free an object previously returned by kmem_cache_alloc(c). */
+void
+kmem_cache_free(struct kmem_cache* c, void* obj)
+{
+    int cpu = cpuid(), i;
+
+    if (c->cpu[cpu].n == SLAB_CPU_MAX) {
+        acquire(&c->lock);
+        for (i = 0; i < SLAB_CPU_MAX / 2; i++)
+            slab_put(c, c->cpu[cpu].obj[--c->cpu[cpu].n]);
+        release(&c->lock);
+    }
+    __atomic_fetch_sub(&c->inuse, 1, __ATOMIC_RELAXED);
+    c->cpu[cpu].obj[c->cpu[cpu].n++] = obj;
+}
+
+/* Print the usage of every object cache to the console. */
+void
+kmem_cache_dump()
+{
+    struct kmem_cache* c;
+
+    for (c = caches.cache; c < caches.cache + caches.n; c++)
+        cprintf("slab %s: size %d order %d inuse %lld slabs %lld\n", c->name,
+                (int)c->size, c->order, c->inuse, c->nslab);
+}
@@ -1,21 +1,81 @@
 #include "sleeplock.h"
 
+/* Contended acquires, by how they ended up getting the lock. */
+static uint64_t nspun, nslept;
+
 void
 initsleeplock(struct sleeplock* lk, char* name)
 {
-    initlock(&lk->lk, name);
+    initlock_unlisted(&lk->lk, name);
     lk->locked = 0;
     lk->pid = 0;
+    lk->owner = 0;
+    lk->nsleep = 0;
+}
+
+/*
+ * Spin without lk->lk while the holder runs, until the lock is
+ * released or handed on, or deadline. Returns 0 if sleeping is
+ * the better bet.
+ */
+static int
+spinsleep(struct sleeplock* lk, uint64_t deadline)
+{
+    struct proc* owner = lk->owner;
+    if (!owner || owner == thisproc() || __atomic_load_n(&owner->state, __ATOMIC_RELAXED) != RUNNING)
+        return 0;
+
+    release(&lk->lk);
+    while (__atomic_load_n(&lk->locked, __ATOMIC_RELAXED) && __atomic_load_n(&lk->owner, __ATOMIC_RELAXED) == owner
+           && __atomic_load_n(&owner->state, __ATOMIC_RELAXED) == RUNNING && timestamp() < deadline)
+        asm volatile("yield");
+    acquire(&lk->lk);
+    return 1;
 }
 
 void
 acquiresleep(struct sleeplock* lk)
 {
+    uint64_t deadline = timestamp() + timerfreq() / 1000000 * SLEEPLOCK_SPIN_US;
+    int slept = 0, spun = 0;
+
     acquire(&lk->lk);
-    while (lk->locked) { sleep(lk, &lk->lk); }
+    while (lk->locked) {
+        if (timestamp() < deadline && spinsleep(lk, deadline)) {
+            spun = 1;
+            continue;
+        }
+        lk->nsleep++;
+        sleep(lk, &lk->lk);
+        lk->nsleep--;
+        slept = 1;
+        // Woken on release: worth spinning again if someone got in first.
+        deadline = timestamp() + timerfreq() / 1000000 * SLEEPLOCK_SPIN_US;
+    }
     lk->locked = 1;
     lk->pid = thisproc()->pid;
+    lk->owner = thisproc();
+    release(&lk->lk);
+
+    if (slept)
+        __atomic_fetch_add(&nslept, 1, __ATOMIC_RELAXED);
+    else if (spun)
+        __atomic_fetch_add(&nspun, 1, __ATOMIC_RELAXED);
+}
+
+/* Take lk if nobody holds it, without waiting. Returns 1 if taken. */
+int
+tryacquiresleep(struct sleeplock* lk)
+{
+    acquire(&lk->lk);
+    int r = !lk->locked;
+    if (r) {
+        lk->locked = 1;
+        lk->pid = thisproc()->pid;
+        lk->owner = thisproc();
+    }
     release(&lk->lk);
+    return r;
 }
 
 void
@@ -24,7 +84,8 @@ releasesleep(struct sleeplock* lk)
     acquire(&lk->lk);
     lk->locked = 0;
     lk->pid = 0;
-    wakeup(lk);
+    lk->owner = 0;
+    if (lk->nsleep) wakeup(lk);
     release(&lk->lk);
 }
 
@@ -38,3 +99,10 @@ holdingsleep(struct sleeplock* lk)
     release(&lk->lk);
     return r;
 }
+
+void
+sleeplock_counts(uint64_t* spun, uint64_t* slept)
+{
+    *spun = nspun;
+    *slept = nslept;
+}
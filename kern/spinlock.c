@@ -3,35 +3,96 @@
 #include "console.h"
 #include "proc.h"
 #include "string.h"
+#include "types.h"
+
+/*
+ * Every lock set up by initlock() is on this list, so that its
+ * statistics can be dumped. Locks inside memory that may be freed,
+ * such as those of sleep locks, are left off it.
+ */
+static struct spinlock* locks;
 
 /*
  * Check whether this cpu is holding the lock.
  */
 int holding(struct spinlock* lk) {
     int hold;
-    hold = lk->locked && lk->cpu == thiscpu;
+    hold = lk->next != lk->owner && lk->cpu == thiscpu;
     return hold;
 }
 
-void initlock(struct spinlock* lk, char* name) {
+void initlock_unlisted(struct spinlock* lk, char* name) {
+    memset(lk, 0, sizeof(*lk));
     lk->name = name;
-    lk->locked = 0;
-    lk->cpu = 0;
+}
+
+void initlock(struct spinlock* lk, char* name) {
+    initlock_unlisted(lk, name);
+    lk->lnext = __atomic_load_n(&locks, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&locks, &lk->lnext, lk, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
 }
 
 void acquire(struct spinlock* lk) {
     if (holding(lk))
         panic("\tacquire: lock %s at CPU %d already held.\n", lk->name, cpuid());
 
-    while (lk->locked || __atomic_test_and_set(&lk->locked, __ATOMIC_ACQUIRE)) {
+    uint16_t ticket = __atomic_fetch_add(&lk->next, 1, __ATOMIC_RELAXED);
+    uint64_t spins = 0;
+    // A sev between the load and wfe is latched, so no wakeup is lost.
+    while (__atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) != ticket) {
+        asm volatile("wfe");
+        spins++;
     }
     lk->cpu = thiscpu;
+
+    lk->nacquire++;
+    if (spins) {
+        lk->ncontend++;
+        lk->nspin += spins;
+    }
+    lk->since = timestamp();
 }
 
 void release(struct spinlock* lk) {
     if (!holding(lk)) {
         panic("\trelease: lock %s at CPU %d not held.\n", lk->name, cpuid());
     }
+    uint64_t held = timestamp() - lk->since;
+    if (held > lk->maxhold)
+        lk->maxhold = held;
     lk->cpu = NULL;
-    __atomic_clear(&lk->locked, __ATOMIC_RELEASE);
-}
\ No newline at end of file
+    __atomic_store_n(&lk->owner, lk->owner + 1, __ATOMIC_RELEASE);
+    asm volatile("dsb ishst; sev");
+}
+
+/*
+ * Print the statistics of all listed locks, summed over locks of the
+ * same name. For debugging, so no locking: the counts may be torn.
+ */
+void lock_dump() {
+    uint64_t us = timerfreq() / 1000000;
+
+    cprintf("\n====== LOCK DUMP ======\n");
+    for (struct spinlock* lk = locks; lk; lk = lk->lnext) {
+        struct spinlock* first = locks;
+        while (first != lk && strncmp(first->name, lk->name, 64))
+            first = first->lnext;
+        if (first != lk)
+            continue;  // Counted with an earlier one
+
+        uint64_t n = 0, nacquire = 0, ncontend = 0, nspin = 0, maxhold = 0;
+        for (struct spinlock* l = lk; l; l = l->lnext) {
+            if (strncmp(l->name, lk->name, 64))
+                continue;
+            n++;
+            nacquire += l->nacquire;
+            ncontend += l->ncontend;
+            nspin += l->nspin;
+            maxhold = MAX(maxhold, l->maxhold);
+        }
+        if (nacquire)
+            cprintf("%s x%lld: %lld acquires, %lld contended, %lld spins, max hold %lld us\n", lk->name, n,
+                    nacquire, ncontend, nspin, maxhold / (us ? us : 1));
+    }
+}
@@ -1,9 +1,16 @@
 #include <syscall.h>
 
+#include "arm.h"
 #include "console.h"
+#include "kalloc.h"
+#include "kstat.h"
+#include "mm.h"
+#include "mmap.h"
+#include "mmu.h"
 #include "proc.h"
 #include "string.h"
 #include "syscall1.h"
+#include "trace.h"
 #include "types.h"
 
 /*
@@ -16,58 +23,69 @@
 /* Fetch the int at addr from the current process. */
 int fetchint(uint64_t addr, int64_t* ip) {
     struct proc* p = thisproc();
-    if (addr >= p->sz || addr + 8 > p->sz)
+    if (addr >= p->mm->sz || addr + 8 > p->mm->sz)
         return -1;
 
-    *ip = *(int64_t*)(addr);
-    return 0;
+    return copy_user(ip, (void*)addr, sizeof(*ip));
 }
 
 /*
- * Fetch the nul-terminated string at addr from the current process.
- * Doesn't actually copy the string - just sets *pp to point at it.
- * Returns length of string, not including nul.
+ * Fetch the nul-terminated string at addr from the current process
+ * into buf, which has room for size bytes.
+ * Returns length of string, not including nul, or -1 if it does not
+ * fit or runs into memory that is not the process's.
  */
-int fetchstr(uint64_t addr, char** pp) {
+int fetchstr(uint64_t addr, char* buf, size_t size) {
     struct proc* p = thisproc();
-    if (addr >= p->sz)
+    if (addr >= p->mm->sz)
         return -1;
 
-    *pp = (char*)addr;
-    char* ep = (char*)p->sz;
-    for (char* s = *pp; s < ep; ++s) {
-        if (*s == '\0')
-            return s - *pp;
+    size_t max = MIN(size, p->mm->sz - addr);
+    for (size_t n = 0, m; n < max; n += m) {
+        // A page at a time: the string may end right before a hole.
+        m = MIN(max - n, PGSIZE - (addr + n) % PGSIZE);
+        if (copy_user(buf + n, (char*)addr + n, m) < 0)
+            return -1;
+        char* z = memfind(buf + n, 0, m);
+        if (z < buf + n + m)
+            return z - buf;
     }
     return -1;
 }
 
 /*
- * Fetch the nth (starting from 0) 32-bit system call argument.
- * In our ABI, r0 contains system call index, r1-r4 contain parameters.
- * now we support system calls with at most 4 parameters.
+ * Fetch the nth (starting from 0) word-sized system call argument.
+ * In our ABI, x8 contains system call index, x0-x5 contain parameters.
  */
 int argint(int n, uint64_t* ip) {
-    if (n > 3)
+    if (n > 5)
         panic("\targint: too many system call parameters.\n");
     struct proc* p = thisproc();
 
-    *ip = *(&p->tf->x1 + n);
+    *ip = *(&p->tf->x0 + n);
+    return 0;
+}
+
+/*
+ * Check that [addr, addr + n) lies within the process address space,
+ * either below the heap end or in one mmap()ed region.
+ */
+int checkrange(uint64_t addr, uint64_t n) {
+    struct proc* p = thisproc();
+    if ((addr >= p->mm->sz || addr + n > p->mm->sz || addr + n < addr) && !mmap_covers(p->mm, addr, n))
+        return -1;
     return 0;
 }
 
 /*
  * Fetch the nth word-sized system call argument as a pointer
  * to a block of memory of size n bytes.  Check that the pointer
- * lies within the process address space.
+ * lies within the process address space. The memory is still only
+ * to be touched through copy_user().
  */
 int argptr(int n, char** pp, int size) {
     uint64_t i;
-    if (argint(n, &i) < 0)
-        return -1;
-
-    struct proc* p = thisproc();
-    if ((uint64_t)i >= p->sz || (uint64_t)i + size > p->sz)
+    if (argint(n, &i) < 0 || checkrange(i, size) < 0)
         return -1;
 
     *pp = (char*)i;
@@ -75,44 +93,131 @@ int argptr(int n, char** pp, int size) {
 }
 
 /*
- * Fetch the nth word-sized system call argument as a string pointer.
- * Check that the pointer is valid and the string is nul-terminated.
- * (There is no shared writable memory, so the string can't change
- * between this check and being used by the kernel.)
+ * Fetch the nth word-sized system call argument as a string pointer,
+ * and copy the nul-terminated string into buf, which has room for
+ * size bytes, as fetchstr() does.
  */
-int argstr(int n, char** pp) {
+int argstr(int n, char* buf, size_t size) {
     uint64_t addr;
     if (argint(n, &addr) < 0)
         return -1;
-    cprintf("argstr: n=%d addr=%lld\n", n, addr);
-    return fetchstr(addr, pp);
+    return fetchstr(addr, buf, size);
 }
 
 static func syscalls[] = {
-    [SYS_set_tid_address] = sys_gettid,
+    [SYS_set_tid_address] = sys_set_tid_address,
     [SYS_gettid] = sys_gettid,
+    [SYS_getpid] = sys_getpid,
+    [SYS_futex] = sys_futex,
     [SYS_ioctl] = sys_ioctl,
     [SYS_rt_sigprocmask] = sys_rt_sigprocmask,
     [SYS_brk] = (func)sys_brk,
+    [SYS_mmap] = (func)sys_mmap,
+    [SYS_munmap] = sys_munmap,
     [SYS_execve] = sys_exec,
     [SYS_sched_yield] = sys_yield,
     [SYS_clone] = sys_clone,
     [SYS_wait4] = sys_wait4,
-    // FIXME: exit_group should kill every thread in the current thread group.
-    [SYS_exit_group] = sys_exit,
+    [SYS_getrusage] = sys_getrusage,
+    [SYS_exit_group] = sys_exit_group,
     [SYS_exit] = sys_exit,
     [SYS_dup] = sys_dup,
     [SYS_chdir] = sys_chdir,
     [SYS_fstat] = sys_fstat,
     [SYS_newfstatat] = sys_fstatat,
+    [SYS_getdents64] = (func)sys_getdents64,
     [SYS_mkdirat] = sys_mkdirat,
     [SYS_mknodat] = sys_mknodat,
     [SYS_openat] = sys_openat,
+    [SYS_readv] = (func)sys_readv,
     [SYS_writev] = (func)sys_writev,
     [SYS_read] = (func)sys_read,
+    [SYS_write] = (func)sys_write,
     [SYS_close] = sys_close,
+    [SYS_pipe2] = sys_pipe2,
+    [SYS_splice] = (func)sys_splice,
+    [SYS_tee] = (func)sys_tee,
+    [SYS_fsync] = sys_fsync,
+    [SYS_fdatasync] = sys_fdatasync,
+    [SYS_sync] = sys_sync,
+    [SYS_getpriority] = sys_getpriority,
+    [SYS_io_uring_setup] = sys_io_uring_setup,
+    [SYS_io_uring_enter] = sys_io_uring_enter,
+    [SYS_setpriority] = sys_setpriority,
+    [SYS_clock_gettime] = sys_clock_gettime,
+    [SYS_clock_getres] = sys_clock_getres,
+};
+
+#define NSYSCALL ARRAY_SIZE(syscalls)
+
+/*
+ * Count and latency histogram of each system call, kept per CPU so
+ * that recording one takes no lock and shares no cache line. A call
+ * is recorded by the CPU it returns on. Bucket 0 counts calls that
+ * took under 1 us, bucket i > 0 those that took [2^(i-1), 2^i) us,
+ * and the last one also all longer ones.
+ */
+#define NSYSHIST 16
+
+struct sysstat {
+    uint64_t n;
+    uint64_t ticks;  // Total time taken
+    uint64_t max;
+    uint32_t hist[NSYSHIST];
 };
 
+static struct sysstat* sysstat[NCPU];  // NSYSCALL of them each
+
+static void syscall_record(uint64_t sysno, uint64_t t) {
+    struct sysstat* s = &sysstat[cpuid()][sysno];
+    uint64_t us = ticks2us(t);
+    int b = us ? 64 - __builtin_clzll(us) : 0;
+    s->n++;
+    s->ticks += t;
+    s->max = MAX(s->max, t);
+    s->hist[MIN(b, NSYSHIST - 1)]++;
+}
+
+static int syscall_stat(char* buf, size_t n) {
+    size_t len = 0;
+    for (int i = 0; i < NSYSCALL && len < n; ++i) {
+        struct sysstat sum = {0};
+        for (int c = 0; c < NCPU; ++c) {
+            struct sysstat* s = &sysstat[c][i];
+            sum.n += s->n;
+            sum.ticks += s->ticks;
+            sum.max = MAX(sum.max, s->max);
+            for (int b = 0; b < NSYSHIST; ++b)
+                sum.hist[b] += s->hist[b];
+        }
+        if (!sum.n)
+            continue;
+        len += snprintf(buf + len, n - len, "sys %d calls %lld avg %lld us max %lld us hist", i, sum.n,
+                        ticks2us(sum.ticks) / sum.n, ticks2us(sum.max));
+        int last = NSYSHIST - 1;
+        while (!sum.hist[last])
+            last--;
+        for (int b = 0; b <= last && len < n; ++b)
+            len += snprintf(buf + len, n - len, " %d", sum.hist[b]);
+        if (len < n)
+            len += snprintf(buf + len, n - len, "\n");
+    }
+    return MIN(len, n);
+}
+
+void syscall_init() {
+    size_t size = NSYSCALL * sizeof(struct sysstat);
+    int order = 0;
+    while ((PGSIZE << order) < size)
+        order++;
+    for (int c = 0; c < NCPU; ++c) {
+        if (!(sysstat[c] = (struct sysstat*)kalloc_pages(order)))
+            panic("\tsyscall_init: no memory for statistics.\n");
+        memset(sysstat[c], 0, size);
+    }
+    kstat_register(KSTAT_SYSCALL, syscall_stat);
+}
+
 int syscall1(struct trapframe* tf) {
     struct proc* p = thisproc();
 
@@ -122,8 +227,11 @@ int syscall1(struct trapframe* tf) {
     // 如果num在合法范围内, 并且对应的系统调用函数存在
     // 通过编号来访问系统调用, 并将返回值存储在x0中
     if (sysno >= 0 && sysno < ARRAY_SIZE(syscalls) && syscalls[sysno]) {
-        cprintf("syscall: syscall %d from proc %d\n", sysno, p->pid);
+        trace(TR_SYSCALL, sysno, tf->x0);
+        uint64_t t = timestamp();
         tf->x0 = syscalls[sysno]();
+        syscall_record(sysno, timestamp() - t);
+        trace(TR_SYSRET, sysno, tf->x0);
         return tf->x0;
     }
 
@@ -4,7 +4,8 @@
 #include "proc.h"
 
 /*
- * Use pid instead of tid since we don't have threads.
+ * Every thread is a struct proc with its own pid, which Linux calls
+ * the thread ID; the process ID is that of the first thread.
  */
 int
 sys_gettid()
@@ -12,6 +13,25 @@ sys_gettid()
     return thisproc()->pid;
 }
 
+int
+sys_getpid()
+{
+    return thisproc()->tgid;
+}
+
+/*
+ * Zero the word at the address and futex wake it on exit, which is
+ * how pthread_join() learns that a thread is gone.
+ */
+int
+sys_set_tid_address()
+{
+    uint64_t addr;
+    if (argint(0, &addr) < 0) return -1;
+    thisproc()->clear_child_tid = addr;
+    return thisproc()->pid;
+}
+
 /*
  * Hack TIOCGWINSZ (get window size).
  */
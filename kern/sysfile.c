@@ -8,8 +8,11 @@
 
 #include "console.h"
 #include "file.h"
+#include "kalloc.h"
 #include "log.h"
+#include "pcache.h"
 #include "mmu.h"
+#include "pipe.h"
 #include "proc.h"
 #include "sleeplock.h"
 #include "spinlock.h"
@@ -17,14 +20,10 @@
 #include "syscall1.h"
 #include "types.h"
 
-struct iovec {
-    void* iov_base; /* Starting address. */
-    size_t iov_len; /* Number of bytes to transfer. */
-};
-
 /*
  * Fetch the nth word-sized system call argument as a file descriptor
- * and return both the descriptor and the corresponding struct file.
+ * and return both the descriptor and the corresponding struct file,
+ * referenced as fd_get() does: the caller must file_close() it.
  */
 static int
 argfd(int n, uint64_t* pfd, struct file** pf)
@@ -33,7 +32,7 @@ argfd(int n, uint64_t* pfd, struct file** pf)
     struct file* f;
 
     if (argint(n, &fd) < 0) return -1;
-    if (fd < 0 || fd >= NOFILE || (f = thisproc()->ofile[fd]) == 0) return -1;
+    if ((f = fd_get(thisproc(), fd)) == 0) return -1;
     if (pfd) *pfd = fd;
     if (pf) *pf = f;
     return 0;
@@ -46,15 +45,7 @@ argfd(int n, uint64_t* pfd, struct file** pf)
 static int
 fdalloc(struct file* f)
 {
-    struct proc* p = thisproc();
-
-    for (int fd = 0; fd < NOFILE; ++fd) {
-        if (!p->ofile[fd]) {
-            p->ofile[fd] = f;
-            return fd;
-        }
-    }
-    return -1;
+    return fd_alloc(thisproc(), f, 0);
 }
 
 int
@@ -63,10 +54,9 @@ sys_dup()
     struct file* f;
     if (argfd(0, 0, &f) < 0) return -1;
 
+    // The new fd takes over our reference.
     int fd = fdalloc(f);
-    if (fd < 0) return -1;
-
-    file_dup(f);
+    if (fd < 0) file_close(f);
     return fd;
 }
 
@@ -77,9 +67,11 @@ sys_read()
     uint64_t n;
     char* p;
 
-    if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+    if (argint(2, &n) < 0 || argptr(1, &p, n) < 0 || argfd(0, 0, &f) < 0)
         return -1;
-    return file_read(f, p, n);
+    ssize_t r = file_read(f, p, n);
+    file_close(f);
+    return r;
 }
 
 ssize_t
@@ -89,27 +81,79 @@ sys_write()
     uint64_t n;
     char* p;
 
-    if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+    if (argint(2, &n) < 0 || argptr(1, &p, n) < 0 || argfd(0, 0, &f) < 0)
         return -1;
-    return file_write(f, p, n);
+    ssize_t r = file_write(f, p, n);
+    file_close(f);
+    return r;
+}
+
+/* kalloc_pages() order of an array of n iovecs. */
+static int
+iov_order(uint64_t n)
+{
+    int order = 0;
+    while ((PGSIZE << order) < n * sizeof(struct iovec)) order++;
+    return order;
+}
+
+/*
+ * Copy the iovec array of readv() or writev() into kernel memory,
+ * which the caller frees with iov_free(), and check that every buffer
+ * in it is user memory. The file is fetched last, as argfd() does,
+ * once nothing else can fail.
+ */
+static int
+argiov(struct file** pf, struct iovec** piov, uint64_t* pcnt)
+{
+    uint64_t addr;
+    if (argint(2, pcnt) < 0 || *pcnt > UIO_MAXIOV || argint(1, &addr) < 0
+        || checkrange(addr, *pcnt * sizeof(struct iovec)) < 0)
+        return -1;
+    struct iovec* iov = (struct iovec*)kalloc_pages(iov_order(*pcnt));
+    if (!iov) return -1;
+    if (copy_user(iov, (char*)addr, *pcnt * sizeof(*iov)) < 0) goto bad;
+    for (struct iovec* v = iov; v < iov + *pcnt; ++v)
+        if (v->iov_len && checkrange((uint64_t)v->iov_base, v->iov_len) < 0) goto bad;
+    if (argfd(0, 0, pf) < 0) goto bad;
+    *piov = iov;
+    return 0;
+
+bad:
+    kfree_pages((char*)iov, iov_order(*pcnt));
+    return -1;
+}
+
+static void
+iov_free(struct iovec* iov, uint64_t n)
+{
+    kfree_pages((char*)iov, iov_order(n));
 }
 
 ssize_t
-sys_writev()
+sys_readv()
 {
     struct file* f;
-    uint64_t fd, iovcnt;
     struct iovec* iov;
-    if (argfd(0, &fd, &f) < 0 || argint(2, &iovcnt) < 0
-        || argptr(1, (char**)&iov, iovcnt * sizeof(struct iovec)) < 0) {
-        return -1;
-    }
+    uint64_t iovcnt;
+    if (argiov(&f, &iov, &iovcnt) < 0) return -1;
+    ssize_t r = file_readv(f, iov, iovcnt);
+    file_close(f);
+    iov_free(iov, iovcnt);
+    return r;
+}
 
-    size_t tot = 0;
-    for (struct iovec* p = iov; p < iov + iovcnt; ++p) {
-        tot += file_write(f, p->iov_base, p->iov_len);
-    }
-    return tot;
+ssize_t
+sys_writev()
+{
+    struct file* f;
+    struct iovec* iov;
+    uint64_t iovcnt;
+    if (argiov(&f, &iov, &iovcnt) < 0) return -1;
+    ssize_t r = file_writev(f, iov, iovcnt);
+    file_close(f);
+    iov_free(iov, iovcnt);
+    return r;
 }
 
 int
@@ -117,10 +161,8 @@ sys_close()
 {
     uint64_t fd;
     struct file* f;
-    struct proc* p = thisproc();
 
-    if (argfd(0, &fd, &f) < 0) return -1;
-    p->ofile[fd] = 0;
+    if (argint(0, &fd) < 0 || !(f = fd_remove(thisproc(), fd))) return -1;
     file_close(f);
     return 0;
 }
@@ -129,45 +171,120 @@ int
 sys_fstat()
 {
     struct file* f;
-    struct stat* st;  // user pointer to struct stat
+    char* ust;  // user pointer to struct stat
+    struct stat st;
 
-    if (argfd(0, 0, &f) < 0 || argptr(1, (char**)&st, sizeof(*st)) < 0)
+    if (argptr(1, &ust, sizeof(st)) < 0 || argfd(0, 0, &f) < 0)
         return -1;
-    return file_stat(f, st);
+    int r = file_stat(f, &st);
+    file_close(f);
+    if (r == 0 && copy_user(ust, &st, sizeof(st)) < 0)
+        return -1;
+    return r;
 }
 
 int
 sys_fstatat()
 {
     uint64_t dirfd, flags;
-    char* path;
-    struct stat* st;
+    char path[MAXPATH];
+    char* ust;
+    struct stat st;
 
-    if (argint(0, &dirfd) < 0 || argstr(1, &path) < 0
-        || argptr(2, (char**)&st, sizeof(*st)) < 0 || argint(3, &flags) < 0)
+    if (argint(0, &dirfd) < 0 || argstr(1, path, sizeof(path)) < 0
+        || argptr(2, &ust, sizeof(st)) < 0 || argint(3, &flags) < 0)
         return -1;
 
-    if (dirfd != AT_FDCWD) {
-        cprintf("sys_fstatat: dirfd unimplemented.\n");
-        return -1;
-    }
     if (flags != 0) {
         cprintf("sys_fstatat: flags unimplemented.\n");
         return -1;
     }
+    struct file* f = 0;
+    if (dirfd != AT_FDCWD) {
+        if (!(f = fd_get(thisproc(), dirfd)))
+            return -1;
+        if (f->type != FD_INODE) {
+            file_close(f);
+            return -1;
+        }
+    }
 
     begin_op();
-    struct inode* ip = namei(path);
-    if (!ip) {
-        end_op();
-        return -1;
+    struct inode* ip = nameiat(f ? f->ip : 0, path);
+    if (ip) {
+        ilock(ip);
+        stati(ip, &st);
+        iunlockput(ip);
     }
-    ilock(ip);
-    stati(ip, st);
-    iunlockput(ip);
     end_op();
+    if (f)
+        file_close(f);
+    return ip && copy_user(ust, &st, sizeof(st)) == 0 ? 0 : -1;
+}
 
-    return 0;
+/*
+ * Fill the n bytes at buf with as many entries of directory fd as fit,
+ * from its offset on, and move the offset past them. Returns the bytes
+ * filled, 0 at the end of the directory, or -1 if not even the next
+ * entry fits.
+ */
+ssize_t
+sys_getdents64()
+{
+    struct file* f;
+    uint64_t n;
+    char* buf;
+
+    if (argint(2, &n) < 0 || argptr(1, &buf, n) < 0 || argfd(0, 0, &f) < 0)
+        return -1;
+    if (f->type != FD_INODE) {
+        file_close(f);
+        return -1;
+    }
+
+    struct inode* ip = f->ip;
+    struct dirent de[BSIZE / sizeof(struct dirent)];
+    uint64_t rec[ROUNDUP(sizeof(struct linux_dirent64) + DIRSIZ + 1, 8) / 8];
+    struct linux_dirent64* d = (struct linux_dirent64*)rec;
+    size_t len = 0;
+    int full = 0, bad = 0;
+
+    ilock(ip);
+    if (ip->type != T_DIR) {
+        iunlock(ip);
+        file_close(f);
+        return -1;
+    }
+    while (!full && !bad && f->off < ip->size) {
+        size_t m = MIN(sizeof(de), ip->size - f->off);
+        if (readi(ip, (char*)de, f->off, m) != (ssize_t)m)
+            break;
+        for (size_t i = 0; i < m / sizeof(de[0]); i++) {
+            if (de[i].inum) {
+                size_t namelen = strnlen(de[i].name, DIRSIZ);
+                size_t reclen = ROUNDUP(sizeof(struct linux_dirent64) + namelen + 1, 8);
+                if (len + reclen > n) {
+                    full = 1;
+                    break;
+                }
+                memset(rec, 0, sizeof(rec));
+                d->d_ino = de[i].inum;
+                d->d_off = f->off + sizeof(de[0]);
+                d->d_reclen = reclen;
+                d->d_type = 0;
+                memmove(d->d_name, de[i].name, namelen);
+                if (copy_user(buf + len, rec, reclen) < 0) {
+                    bad = 1;
+                    break;
+                }
+                len += reclen;
+            }
+            f->off += sizeof(de[0]);
+        }
+    }
+    iunlock(ip);
+    file_close(f);
+    return (full || bad) && !len ? -1 : len;
 }
 
 static struct inode*
@@ -211,21 +328,15 @@ create(char* path, short type, short major, short minor)
     return ip;
 }
 
+/*
+ * Open path with the flags of open() on a new fd of the current
+ * process, and return the fd.
+ */
 int
-sys_openat()
+file_open(char* path, uint64_t omode)
 {
-    char* path;
-    uint64_t dirfd, omode;
-
-    if (argint(0, &dirfd) < 0 || argstr(1, &path) < 0 || argint(2, &omode) < 0)
-        return -1;
-
-    if (dirfd != AT_FDCWD) {
-        cprintf("sys_openat: dirfd unimplemented.\n");
-        return -1;
-    }
     if (!(omode & O_LARGEFILE)) {
-        cprintf("sys_openat: expect O_LARGEFILE in open flags.\n");
+        cprintf("file_open: expect O_LARGEFILE in open flags.\n");
         return -1;
     }
 
@@ -268,16 +379,33 @@ sys_openat()
     f->off = 0;
     f->readable = !(omode & O_WRONLY);
     f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
+    f->direct = !!(omode & O_DIRECT);
     return fd;
 }
 
+int
+sys_openat()
+{
+    char path[MAXPATH];
+    uint64_t dirfd, omode;
+
+    if (argint(0, &dirfd) < 0 || argstr(1, path, sizeof(path)) < 0 || argint(2, &omode) < 0)
+        return -1;
+
+    if (dirfd != AT_FDCWD) {
+        cprintf("sys_openat: dirfd unimplemented.\n");
+        return -1;
+    }
+    return file_open(path, omode);
+}
+
 int
 sys_mkdirat()
 {
     uint64_t dirfd, mode;
-    char* path;
+    char path[MAXPATH];
 
-    if (argint(0, &dirfd) < 0 || argstr(1, &path) < 0 || argint(2, &mode) < 0)
+    if (argint(0, &dirfd) < 0 || argstr(1, path, sizeof(path)) < 0 || argint(2, &mode) < 0)
         return -1;
     if (dirfd != AT_FDCWD) {
         cprintf("sys_mkdirat: dirfd unimplemented.\n");
@@ -302,10 +430,10 @@ sys_mkdirat()
 int
 sys_mknodat()
 {
-    char* path;
+    char path[MAXPATH];
     uint64_t dirfd, major, minor;
 
-    if (argint(0, &dirfd) < 0 || argstr(1, &path) < 0 || argint(2, &major) < 0
+    if (argint(0, &dirfd) < 0 || argstr(1, path, sizeof(path)) < 0 || argint(2, &major) < 0
         || argint(3, &minor))
         return -1;
 
@@ -329,12 +457,14 @@ sys_mknodat()
 int
 sys_chdir()
 {
-    char* path;
+    char path[MAXPATH];
     struct proc* p = thisproc();
 
+    if (argstr(0, path, sizeof(path)) < 0)
+        return -1;
     begin_op();
     struct inode* ip;
-    if (argstr(0, &path) < 0 || (ip = namei(path)) == 0) {
+    if ((ip = namei(path)) == 0) {
         end_op();
         return -1;
     }
@@ -350,3 +480,115 @@ sys_chdir()
     p->cwd = ip;
     return 0;
 }
+
+int
+sys_pipe2()
+{
+    char* ufd;
+    struct file *rf, *wf;
+
+    if (argptr(0, &ufd, 2 * sizeof(int)) < 0 || pipe_alloc(&rf, &wf) < 0)
+        return -1;
+    int fd[2];
+    fd[0] = fdalloc(rf);
+    fd[1] = fd[0] < 0 ? -1 : fdalloc(wf);
+    if (fd[1] < 0 || copy_user(ufd, fd, sizeof(fd)) < 0) {
+        if (fd[0] >= 0) fd_remove(thisproc(), fd[0]);
+        if (fd[1] >= 0) fd_remove(thisproc(), fd[1]);
+        file_close(rf);
+        file_close(wf);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Fetch the offset pointer of splice() at argument n for file f into
+ * *paddr, 0 for none, and if there is one, which a pipe cannot take,
+ * the offset it points to into *off.
+ */
+static int
+argoff(int n, struct file* f, uint64_t* paddr, size_t* off)
+{
+    int64_t v;
+    if (argint(n, paddr) < 0) return -1;
+    if (!*paddr) return 0;
+    if (f->type == FD_PIPE || checkrange(*paddr, sizeof(v)) < 0
+        || copy_user(&v, (char*)*paddr, sizeof(v)) < 0 || v < 0)
+        return -1;
+    *off = v;
+    return 0;
+}
+
+ssize_t
+sys_splice()
+{
+    struct file *in = 0, *out = 0;
+    uint64_t offin, offout, len;
+    ssize_t r = -1;
+    size_t off = 0;
+
+    if (argfd(0, 0, &in) < 0 || argfd(2, 0, &out) < 0 || argoff(1, in, &offin, &off) < 0
+        || argoff(3, out, &offout, &off) < 0 || argint(4, &len) < 0)
+        goto out;
+    if (!in->readable || !out->writable)
+        goto out;
+
+    // With an offset pointer, the file offset is left alone.
+    if (in->type == FD_PIPE && out->type == FD_PIPE) {
+        r = pipe_splice(in->pipe, out->pipe, len);
+    } else if (in->type == FD_INODE && out->type == FD_PIPE) {
+        r = pipe_splice_in(out->pipe, in->ip, offin ? &off : &in->off, len);
+        if (offin && copy_user((char*)offin, &off, sizeof(off)) < 0) r = -1;
+    } else if (in->type == FD_PIPE && out->type == FD_INODE) {
+        r = pipe_splice_out(in->pipe, out->ip, offout ? &off : &out->off, len);
+        if (offout && copy_user((char*)offout, &off, sizeof(off)) < 0) r = -1;
+    }
+out:
+    if (in) file_close(in);
+    if (out) file_close(out);
+    return r;
+}
+
+ssize_t
+sys_tee()
+{
+    struct file *in = 0, *out = 0;
+    uint64_t len;
+    ssize_t r = -1;
+
+    if (argint(2, &len) < 0 || argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0)
+        goto out;
+    if (in->type == FD_PIPE && out->type == FD_PIPE && in->readable && out->writable)
+        r = pipe_tee(in->pipe, out->pipe, len);
+out:
+    if (in) file_close(in);
+    if (out) file_close(out);
+    return r;
+}
+
+int
+sys_fsync()
+{
+    struct file* f;
+    if (argfd(0, 0, &f) < 0)
+        return -1;
+    int r = file_sync(f);
+    file_close(f);
+    return r;
+}
+
+/* The size goes through the log anyway, so this is fsync(). */
+int
+sys_fdatasync()
+{
+    return sys_fsync();
+}
+
+int
+sys_sync()
+{
+    pcache_sync();
+    log_force();
+    return 0;
+}
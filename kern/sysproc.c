@@ -1,7 +1,11 @@
 #include <stdint.h>
+#include <sys/resource.h>
 #include <syscall.h>
 
 #include "console.h"
+#include "kalloc.h"
+#include "mm.h"
+#include "mmu.h"
 #include "proc.h"
 #include "string.h"
 #include "syscall1.h"
@@ -9,42 +13,53 @@
 #include "types.h"
 
 int sys_exec() {
-    char* path;
+    char path[MAXPATH];
     char* argv[MAXARG];
     uint64_t uargv;
     int64_t uarg;
+    int r = -1;
 
-    if (argstr(0, &path) < 0 || argint(1, &uargv) < 0) {
+    if (argstr(0, path, sizeof(path)) < 0 || argint(1, &uargv) < 0) {
         cprintf("sys_exec: invalid arguments.\n");
         return -1;
     }
 
     cprintf("sys_exec: exec '%s' uargv %lld\n", path, uargv);
 
-    // 开始解析参数
+    // 开始解析参数, 字符串都拷进同一页中
+    char* strs = kalloc();
+    if (!strs)
+        return -1;
+    size_t used = 0;
     memset(argv, 0, sizeof(argv));
     for (int i = 0;; ++i) {
         if (i >= ARRAY_SIZE(argv)) {
             cprintf("sys_exec: too many arguments.\n");
-            return -1;
+            goto out;
         }
 
-        
         if (fetchint(uargv + sizeof(uint64_t) * i, &uarg) < 0) {
             cprintf("sys_exec: failed to fetch uarg.\n");
-            return -1;
+            goto out;
         }
         if (!uarg) {
             argv[i] = NULL;
             break;
         }
-        if (fetchstr(uarg, &argv[i]) < 0) {
+        int n = fetchstr(uarg, strs + used, PGSIZE - used);
+        if (n < 0) {
             cprintf("sys_exec: failed to fetch argument.\n");
-            return -1;
+            goto out;
         }
+        argv[i] = strs + used;
+        used += n + 1;
         cprintf("sys_exec: argv[%d] = '%s'\n", i, argv[i]);
     }
-    return execve(path, argv, NULL);
+    r = execve(path, argv, NULL);
+
+out:
+    kfree(strs);
+    return r;
 }
 
 int sys_yield() {
@@ -52,42 +67,117 @@ int sys_yield() {
     return 0;
 }
 
+/*
+ * Set the end of the heap to addr, as Linux's brk(2) does, and return
+ * the resulting end: the old one if addr is 0 or cannot be had.
+ */
 size_t sys_brk() {
-    uint64_t n;
-    if (argint(0, &n) < 0)
-        return -1;
-    uint64_t addr = thisproc()->sz;
-    if (growproc(n) < 0)
+    uint64_t addr;
+    if (argint(0, &addr) < 0)
         return -1;
-    return addr;
+    struct proc* p = thisproc();
+    if (addr)
+        growproc(addr - p->mm->sz);
+    return p->mm->sz;
 }
 
+/* clone(flags, stack, ptid, tls, ctid), in the order of aarch64 Linux. */
 int sys_clone() {
-    uint64_t flag, childstk;
-    if (argint(0, &flag) < 0 || argint(1, &childstk) < 0)
+    uint64_t flags, stack, ptid, tls, ctid;
+    if (argint(0, &flags) < 0 || argint(1, &stack) < 0 || argint(2, &ptid) < 0
+        || argint(3, &tls) < 0 || argint(4, &ctid) < 0)
         return -1;
-    if (flag != 17) {
-        cprintf("sys_clone: flags other than SIGCHLD are not supported.\n");
-        return -1;
-    }
-    return fork();
+    return clone(flags, stack, ptid, tls, ctid);
+}
+
+static void rusage_fill(struct rusage* r, struct pusage* u) {
+    memset(r, 0, sizeof(*r));
+    uint64_t ut = ticks2us(u->utime), st = ticks2us(u->stime);
+    r->ru_utime.tv_sec = ut / 1000000;
+    r->ru_utime.tv_usec = ut % 1000000;
+    r->ru_stime.tv_sec = st / 1000000;
+    r->ru_stime.tv_usec = st % 1000000;
+    r->ru_nvcsw = u->nvcsw;
+    r->ru_nivcsw = u->nivcsw;
 }
 
 int sys_wait4() {
     uint64_t pid, wstatus, opt, rusage;
+    char* ru = NULL;
 
     if (argint(0, &pid) < 0 || argint(1, &wstatus) < 0 || argint(2, &opt) < 0 || argint(3, &rusage) < 0)
         return -1;
+    if (rusage && argptr(3, &ru, sizeof(struct rusage)) < 0)
+        return -1;
 
-    if (pid != -1 || wstatus != 0 || opt != 0 || rusage != 0) {
-        cprintf("\tsys_wait4: unimplemented. pid %d, wstatus 0x%p, opt 0x%x, rusage 0x%p\n", pid, wstatus, opt, rusage);
+    if (pid != -1 || wstatus != 0 || opt != 0) {
+        cprintf("\tsys_wait4: unimplemented. pid %d, wstatus 0x%p, opt 0x%x\n", pid, wstatus, opt);
         return -1;
     }
 
-    return wait();
+    struct pusage u;
+    struct rusage r;
+    int child = wait(&u);
+    if (child >= 0 && ru) {
+        rusage_fill(&r, &u);
+        if (copy_user(ru, &r, sizeof(r)) < 0)
+            return -1;
+    }
+    return child;
+}
+
+int sys_getrusage() {
+    uint64_t who;
+    char* ru;
+    if (argint(0, &who) < 0 || argptr(1, &ru, sizeof(struct rusage)) < 0)
+        return -1;
+
+    struct proc* p = thisproc();
+    struct rusage r;
+    if ((int)who == RUSAGE_SELF) {
+        proc_charge(0);
+        rusage_fill(&r, &p->ru);
+    } else if ((int)who == RUSAGE_CHILDREN) {
+        rusage_fill(&r, &p->cru);
+    } else {
+        return -1;
+    }
+    return copy_user(ru, &r, sizeof(r));
 }
 
 int sys_exit() {
     exit(0);
     return 0;
 }
+
+int sys_exit_group() {
+    exit_group(0);
+    return 0;
+}
+
+/*
+ * Return 20 - nice, which is always positive, as Linux does;
+ * the C library turns it back into the nice value.
+ */
+int sys_getpriority() {
+    uint64_t which, who;
+    if (argint(0, &which) < 0 || argint(1, &who) < 0)
+        return -1;
+    if (which != PRIO_PROCESS) {
+        cprintf("sys_getpriority: only PRIO_PROCESS is supported.\n");
+        return -1;
+    }
+    int nice = proc_getnice(who);
+    return nice < NICE_MIN ? -1 : 20 - nice;
+}
+
+int sys_setpriority() {
+    uint64_t which, who, prio;
+    if (argint(0, &which) < 0 || argint(1, &who) < 0 || argint(2, &prio) < 0)
+        return -1;
+    if (which != PRIO_PROCESS) {
+        cprintf("sys_setpriority: only PRIO_PROCESS is supported.\n");
+        return -1;
+    }
+    return proc_setnice(who, (int)prio);
+}
@@ -2,24 +2,48 @@
 
 #include "arm.h"
 #include "peripherals/irq.h"
+#include "sysregs.h"
 
 #include "console.h"
 
-static int dt = 19200000;
+static uint64_t dt;
 
 void
 timer_init()
 {
+    dt = timerfreq() / HZ;
     asm volatile("msr cntp_ctl_el0, %[x]" : : [x] "r"(1));
     asm volatile("msr cntp_tval_el0, %[x]" : : [x] "r"(dt));
     put32(CORE_TIMER_CTRL(cpuid()), CORE_TIMER_ENABLE);
+    lcntkctl(rcntkctl() | CNTKCTL_EL0VCTEN);  // For the vDSO
     cprintf("timer_init: success at CPU %d.\n", cpuid());
 }
 
+/*
+ * Tick rate times a second from now on instead of HZ, for profiling.
+ * Each CPU switches over at its next tick.
+ */
+void
+timer_set_rate(uint32_t rate)
+{
+    dt = timerfreq() / rate;
+}
+
 void
 timer_reset()
 {
     asm volatile("msr cntp_tval_el0, %[x]" : : [x] "r"(dt));
+    asm volatile("msr cntp_ctl_el0, %[x]" : : [x] "r"(1));
+}
+
+/*
+ * Turn off this CPU's tick while it idles; timer_reset()
+ * turns it back on.
+ */
+void
+timer_stop()
+{
+    asm volatile("msr cntp_ctl_el0, %[x]" : : [x] "r"(0));
 }
 
 /*
@@ -0,0 +1,135 @@
+#include "trace.h"
+
+#include "arm.h"
+#include "console.h"
+#include "file.h"
+#include "kalloc.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "string.h"
+#include "types.h"
+
+/*
+ * One ring of events per CPU, overwriting the oldest when full. Only
+ * its own CPU writes a ring, with interrupts off, so recording takes
+ * no lock: trace_record() claims the next slot, fills it in, and
+ * publishes it by storing the index of the event in it. A reader on
+ * any CPU copies a slot and keeps the copy only if that index was
+ * there before and after; otherwise the event was overwritten while
+ * it lagged behind, and is only counted as lost.
+ */
+struct trace_slot {
+    volatile uint64_t seq;  // Index + 1 of the event in it, 0 while written
+    struct trace_event e;
+};
+
+#define TRACE_ORDER 5  // kalloc_pages() order of a ring
+#define NTRACE      ((PGSIZE << TRACE_ORDER) / sizeof(struct trace_slot))
+
+static struct {
+    struct trace_slot* slot;
+    uint64_t head;   // Events recorded, written by its CPU only
+    uint64_t tail;   // Events drained, under tracelock
+} ring[NCPU];
+
+static struct spinlock tracelock;  // Serializes readers
+
+uint32_t trace_mask;
+
+void
+trace_record(int type, uint64_t a, uint64_t b)
+{
+    int id = cpuid();
+    if (!ring[id].slot) return;
+
+    uint64_t i = ring[id].head;
+    struct trace_slot* s = &ring[id].slot[i % NTRACE];
+    __atomic_store_n(&s->seq, 0, __ATOMIC_RELAXED);
+    asm volatile("dmb ishst" ::: "memory");
+    s->e.ts = timestamp();
+    s->e.type = type;
+    s->e.cpu = id;
+    s->e.pid = thisproc() ? thisproc()->pid : 0;
+    s->e.a = a;
+    s->e.b = b;
+    __atomic_store_n(&s->seq, i + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring[id].head, i + 1, __ATOMIC_RELEASE);
+}
+
+/* Copy event i of CPU id to e. Returns 0, or -1 if it is gone. */
+static int
+trace_copy(int id, uint64_t i, struct trace_event* e)
+{
+    struct trace_slot* s = &ring[id].slot[i % NTRACE];
+    if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != i + 1) return -1;
+    *e = s->e;
+    asm volatile("dmb ishld" ::: "memory");
+    return __atomic_load_n(&s->seq, __ATOMIC_RELAXED) == i + 1 ? 0 : -1;
+}
+
+/*
+ * Drain up to n bytes of events into buf for trace_read(), counting
+ * the ones lost into clock->b. Called with tracelock held.
+ */
+static ssize_t
+trace_drain(char* buf, size_t n, void* arg)
+{
+    struct trace_event* clock = arg;
+    struct trace_event* out = (struct trace_event*)buf;
+    size_t max = n / sizeof(*out), k = 0;
+
+    for (int id = 0; id < NCPU; id++) {
+        if (!ring[id].slot) continue;
+        uint64_t head = __atomic_load_n(&ring[id].head, __ATOMIC_ACQUIRE);
+        if (head - ring[id].tail > NTRACE) {
+            clock->b += head - NTRACE - ring[id].tail;
+            ring[id].tail = head - NTRACE;
+        }
+        while (ring[id].tail < head && k < max) {
+            if (trace_copy(id, ring[id].tail, &out[k]) == 0)
+                k++;
+            else
+                clock->b++;
+            ring[id].tail++;
+        }
+    }
+    return k * sizeof(*out);
+}
+
+static ssize_t
+trace_read(struct inode* ip, char* dst, size_t off, ssize_t n)
+{
+    struct trace_event clock = {.ts = timestamp(), .type = TR_CLOCK, .cpu = cpuid(), .a = timerfreq()};
+    size_t max = n / sizeof(clock);
+    if (max < 1) return -1;
+
+    // The clock record goes first, once the events have been counted.
+    ssize_t r = dev_bounce(&tracelock, dst + sizeof(clock), (max - 1) * sizeof(clock), 0, trace_drain, &clock);
+    if (r < 0) return -1;
+    if (copy_user(dst, &clock, sizeof(clock)) < 0) return -1;
+    return r + sizeof(clock);
+}
+
+static ssize_t
+trace_write(struct inode* ip, char* src, size_t off, ssize_t n)
+{
+    uint32_t mask;
+    if (n != sizeof(mask) || copy_user(&mask, src, sizeof(mask)) < 0) return -1;
+    trace_mask = mask;
+    return n;
+}
+
+void
+trace_init()
+{
+    initlock(&tracelock, "trace");
+    for (int id = 0; id < NCPU; id++) {
+        if (!(ring[id].slot = (struct trace_slot*)kalloc_pages(TRACE_ORDER)))
+            panic("\ttrace_init: no memory for the ring of CPU %d.\n", id);
+        memset(ring[id].slot, 0, PGSIZE << TRACE_ORDER);
+    }
+    devsw[TRACE].read = trace_read;
+    devsw[TRACE].write = trace_write;
+    cprintf("trace_init: %d events per CPU, success.\n", (int)NTRACE);
+}
@@ -5,12 +5,18 @@
 #include "arm.h"
 #include "clock.h"
 #include "console.h"
+#include "ipi.h"
+#include "memlayout.h"
+#include "mm.h"
 #include "mmu.h"
+#include "pcache.h"
 #include "peripherals/irq.h"
 #include "proc.h"
+#include "prof.h"
 #include "sd.h"
 #include "syscall1.h"
 #include "sysregs.h"
+#include "vm.h"
 #include "timer.h"
 #include "uart.h"
 
@@ -19,7 +25,8 @@ void irq_init()
     clock_init();
     put32(ENABLE_IRQS_1, AUX_INT);
     put32(ENABLE_IRQS_2, VC_ARASANSDIO_INT);
-    put32(GPU_INT_ROUTE, GPU_IRQ2CORE(0));
+    // The clock interrupts CPU 0, devices the last CPU.
+    put32(GPU_INT_ROUTE, GPU_IRQ2CORE(NCPU - 1));
     cprintf("irq_init: success.\n");
 }
 
@@ -28,11 +35,19 @@ void interrupt(struct trapframe* tf)
     int src = get32(IRQ_SRC_CORE(cpuid()));
     if (src & IRQ_CNTPNSIRQ) {
         timer_reset();
-        // timer();
-        yield();
+        if (prof_on)
+            prof_sample(tf->elr_el1, (tf->spsr_el1 & SPSR_M) == SPSR_EL0t);
+        // The scheduler itself may be interrupted while it idles.
+        if (thisproc() && sched_tick()) yield();
+    } else if (src & IRQ_MAILBOX(0)) {
+        // IPI_WAKE only ends wfi in the scheduler, which rechecks its queue.
+        int msg = ipi_intr();
+        if (msg & IPI_STOP)
+            while (1) asm volatile("wfe");
+        if ((msg & IPI_RESCHED) && thisproc() && thiscpu->rq.n) yield();
     } else if (src & IRQ_TIMER) {
         clock_reset();
-        // clock();
+        pcache_clock();
     } else if (src & IRQ_GPU) {
         int p1 = get32(IRQ_PENDING_1);
         int p2 = get32(IRQ_PENDING_2);
@@ -48,14 +63,64 @@ void interrupt(struct trapframe* tf)
     }
 }
 
+extern char copy_user[], copy_user_fault[], copy_user_end[];
+
+/*
+ * An abort from user space, or from the kernel touching user memory
+ * on its behalf. Resolve it, or kill the process for a bad user
+ * access. A bad copy_user() returns -1 instead, since the kernel may
+ * hold locks there that only the system call can drop; any other bad
+ * kernel access is a bug. Threads of a process fault on the same mm
+ * one at a time.
+ */
+static void pgfault(struct trapframe* tf, int ec, int iss)
+{
+    uint64_t va = rfar();
+    struct proc* p = thisproc();
+    int write = (iss & ISS_WNR) != 0, fsc = ISS_FSC(iss);
+    int copy = ec == EC_DABORT_EL1 && tf->elr_el1 >= (uint64_t)copy_user && tf->elr_el1 < (uint64_t)copy_user_end;
+
+    if (p && p->mm && (fsc == FSC_TRANSLATION || fsc == FSC_PERMISSION)) {
+        acquiresleep(&p->mm->lock);
+        int r = uvm_fault(p, va, write);
+        releasesleep(&p->mm->lock);
+        if (!r) return;
+    }
+    if (ec == EC_DABORT_EL1) {
+        if (!copy || !p || !p->mm || va >= USERTOP)
+            panic("\tpgfault: kernel fault at 0x%llx, pc 0x%llx, iss 0x%x.\n", va, tf->elr_el1, iss);
+        tf->elr_el1 = (uint64_t)copy_user_fault;
+        return;
+    }
+
+    cprintf("pgfault: proc %d (%s) bad %s at 0x%llx, pc 0x%llx, iss 0x%x.\n", p->pid, p->name,
+            write ? "write" : "read", va, tf->elr_el1, iss);
+    exit(-1);
+}
+
 void trap(struct trapframe* tf)
 {
     int ec = resr() >> EC_SHIFT, iss = resr() & ISS_MASK;
+    int user = (tf->spsr_el1 & SPSR_M) == SPSR_EL0t;
     lesr(0); // Clear esr.
+    if (user)
+        proc_charge(1);
     switch (ec) {
+    case EC_DABORT:
+    case EC_DABORT_EL1:
+        pgfault(tf, ec, iss);
+        break;
+    case EC_IABORT:
+        pgfault(tf, ec, iss & ~ISS_WNR);
+        break;
     case EC_UNKNOWN:
         interrupt(tf);
         break;
+    case EC_FP:
+        if (!user)
+            panic("\ttrap: FP/SIMD access in the kernel.\n");
+        fpsimd_trap(thisproc());
+        break;
     case EC_SVC64:
         if (!iss) {
             /* Jump to syscall to handle the system call from user process */
@@ -67,6 +132,11 @@ void trap(struct trapframe* tf)
     default:
         panic("\ttrap: unexpected irq.\n");
     }
+    if (user)
+        proc_charge(0);
+    // Killed by exit_group() of another thread.
+    if (user && thisproc()->killed)
+        exit(-1);
 }
 
 void irq_error(uint64_t type) { panic("\tirq_error: irq of type %d unimplemented.\n", type); }
@@ -2,28 +2,125 @@
 
 #include "arm.h"
 #include "console.h"
+#include "file.h"
 #include "peripherals/gpio.h"
 #include "peripherals/mini_uart.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "string.h"
+#include "types.h"
 #include "uart.h"
 
+#define LSR_RX_READY (1 << 0)
+#define LSR_TX_ROOM  (1 << 5) /* The TX FIFO can take a byte */
+#define IER_RX       (3 << 2 | 1) /* Bits 3:2 must be set for RX interrupts */
+#define IER_TX       (1 << 1)     /* Interrupt while the TX FIFO is empty */
+
+/*
+ * Output goes through a ring that the TX interrupt drains into the
+ * FIFO, so that writers do not wait for the line. A full ring is
+ * drained by polling, except by uart_write(), which sleeps.
+ */
+#define UART_TXBUF 4096
+
+static struct {
+    struct spinlock lock;
+    char buf[UART_TXBUF];
+    uint32_t r;  // Next to go out
+    uint32_t w;  // Next free
+    int nwait;   // Writers sleeping for room, until woken
+} tx;
+
+/*
+ * Move what fits from the ring to the FIFO, and keep the TX interrupt
+ * on while there is more, or sleepers for it to wake up. Caller holds
+ * tx.lock.
+ */
+static void
+uart_kick()
+{
+    while (tx.r != tx.w && (get32(AUX_MU_LSR_REG) & LSR_TX_ROOM))
+        put32(AUX_MU_IO_REG, tx.buf[tx.r++ % UART_TXBUF]);
+    put32(AUX_MU_IER_REG, IER_RX | (tx.r != tx.w || tx.nwait ? IER_TX : 0));
+}
+
+/* Wait for room in the ring by feeding the FIFO. Caller holds tx.lock. */
+static void
+uart_poll()
+{
+    while (!(get32(AUX_MU_LSR_REG) & LSR_TX_ROOM)) {}
+    uart_kick();
+}
+
 void
 uart_putchar(int c)
 {
-    while (!(get32(AUX_MU_LSR_REG) & 0x20)) {}
-    put32(AUX_MU_IO_REG, c & 0xFF);
+    acquire(&tx.lock);
+    while (tx.w - tx.r == UART_TXBUF) uart_poll();
+    tx.buf[tx.w++ % UART_TXBUF] = c;
+    uart_kick();
+    release(&tx.lock);
+}
+
+/*
+ * Put the n bytes at buf in the ring for uart_write(), sleeping while
+ * it is full. Called with tx.lock held.
+ */
+static ssize_t
+uart_fill(char* buf, size_t n, void* arg)
+{
+    for (char* p = buf; p < buf + n;) {
+        while (tx.w - tx.r == UART_TXBUF) {
+            tx.nwait++;
+            uart_kick();
+            sleep(&tx, &tx.lock);
+        }
+        // As much as fits before the ring wraps or fills up.
+        uint32_t at = tx.w % UART_TXBUF;
+        size_t n1 = MIN(buf + n - p, MIN(UART_TXBUF - at, UART_TXBUF - (tx.w - tx.r)));
+        memmove(tx.buf + at, p, n1);
+        tx.w += n1;
+        p += n1;
+    }
+    uart_kick();
+    return n;
+}
+
+/* Output the n bytes of user memory at s. */
+ssize_t
+uart_write(char* s, size_t n)
+{
+    return dev_bounce(&tx.lock, s, n, 1, uart_fill, NULL);
+}
+
+/* Push everything out by polling, e.g. before halting. */
+void
+uart_flush()
+{
+    acquire(&tx.lock);
+    while (tx.r != tx.w) uart_poll();
+    release(&tx.lock);
 }
 
 int
 uart_getchar()
 {
-    int stat = get32(AUX_MU_IIR_REG);
-    if ((stat & 1) || (stat & 6) != 4) return -1;
+    if (!(get32(AUX_MU_LSR_REG) & LSR_RX_READY)) return -1;
     return get32(AUX_MU_IO_REG) & 0xFF;
 }
 
 void
 uart_intr()
 {
+    acquire(&tx.lock);
+    uart_kick();
+    if (tx.nwait && tx.w - tx.r < UART_TXBUF) {
+        tx.nwait = 0;  // They count themselves again if need be.
+        uart_kick();
+        wakeup(&tx);
+    }
+    release(&tx.lock);
+
     console_intr(uart_getchar);
 }
 
@@ -32,6 +129,8 @@ uart_init()
 {
     uint32_t selector, enables;
 
+    initlock(&tx.lock, "uart");
+
     /* initialize UART */
     enables = get32(AUX_ENABLES);
     enables |= 1;
@@ -39,7 +138,7 @@ uart_init()
     put32(AUX_MU_CNTL_REG, 0);
     put32(AUX_MU_LCR_REG, 3); /* 8 bits */
     put32(AUX_MU_MCR_REG, 0);
-    put32(AUX_MU_IER_REG, 3 << 2 | 1);
+    put32(AUX_MU_IER_REG, IER_RX);
     put32(AUX_MU_IIR_REG, 0xc6); /* disable interrupts */
     put32(AUX_MU_BAUD_REG, 270); /* 115200 baud */
     /* map UART1 to GPIO pins */
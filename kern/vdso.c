@@ -0,0 +1,111 @@
+#include "vdso.h"
+
+#include <time.h>
+
+#include "arm.h"
+#include "console.h"
+#include "kalloc.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "string.h"
+#include "syscall1.h"
+#include "types.h"
+#include "vm.h"
+
+/*
+ * The vDSO page: vdso.S, copied to a page of its own at boot with the
+ * data its code reads filled in, and mapped read-only at VDSOBASE into
+ * every address space. exec() hands its address to the C library as
+ * AT_SYSINFO_EHDR, which then calls __kernel_clock_gettime() instead
+ * of trapping. The system calls here are what the vDSO falls back to
+ * for the clocks it cannot read itself, and what programs call that
+ * do not know about it.
+ */
+
+extern char vdso_start[], vdso_end[], vdso_data[];
+
+static char* vdso_page;
+
+static struct vdso_data*
+vdso_vvar()
+{
+    return (struct vdso_data*)(vdso_page + (vdso_data - vdso_start));
+}
+
+void
+vdso_init()
+{
+    if (vdso_end - vdso_start > PGSIZE) panic("\tvdso_init: image too large.\n");
+    if (!(vdso_page = kalloc_zeroed())) panic("\tvdso_init: out of memory.\n");
+    memcpy(vdso_page, vdso_start, vdso_end - vdso_start);
+
+    struct vdso_data* d = vdso_vvar();
+    d->freq = timerfreq();
+    d->base = timestamp();
+    d->res = (1000000000 + d->freq - 1) / d->freq;
+    icache_sync(vdso_page, PGSIZE);
+    cprintf("vdso_init: success.\n");
+}
+
+/* Map the vDSO page into pgdir, which takes a reference to it. */
+int
+vdso_map(uint64_t* pgdir)
+{
+    if (map_region(pgdir, (void*)VDSOBASE, PGSIZE, (uint64_t)vdso_page, PTE_USER | PTE_RO | PTE_PAGE))
+        return -1;
+    kpage_get(vdso_page);
+    return 0;
+}
+
+/* Clocks that count from boot; there is no battery clock to set REALTIME. */
+static int
+vdso_clock(uint64_t id)
+{
+    return id == CLOCK_REALTIME || id == CLOCK_MONOTONIC
+           || (id >= CLOCK_MONOTONIC_RAW && id <= CLOCK_BOOTTIME);
+}
+
+static void
+ticks2ts(struct timespec* ts, uint64_t t, uint64_t freq)
+{
+    ts->tv_sec = t / freq;
+    ts->tv_nsec = t % freq * 1000000000 / freq;
+}
+
+int
+sys_clock_gettime()
+{
+    uint64_t id;
+    char* ts;
+    if (argint(0, &id) < 0 || argptr(1, &ts, sizeof(struct timespec)) < 0)
+        return -1;
+
+    struct proc* p = thisproc();
+    struct vdso_data* d = vdso_vvar();
+    struct timespec t;
+    if (vdso_clock(id)) {
+        ticks2ts(&t, timestamp() - d->base, d->freq);
+    } else if (id == CLOCK_PROCESS_CPUTIME_ID || id == CLOCK_THREAD_CPUTIME_ID) {
+        // Only what this thread ran: there is no sum over a process.
+        proc_charge(0);
+        ticks2ts(&t, p->ru.utime + p->ru.stime, d->freq);
+    } else {
+        return -1;
+    }
+    return copy_user(ts, &t, sizeof(t));
+}
+
+int
+sys_clock_getres()
+{
+    uint64_t id, ts;
+    if (argint(0, &id) < 0 || argint(1, &ts) < 0)
+        return -1;
+    if (!vdso_clock(id) && id != CLOCK_PROCESS_CPUTIME_ID && id != CLOCK_THREAD_CPUTIME_ID)
+        return -1;
+    if (ts && checkrange(ts, sizeof(struct timespec)) < 0)
+        return -1;
+    struct timespec t = {0, vdso_vvar()->res};
+    return ts ? copy_user((char*)ts, &t, sizeof(t)) : 0;
+}
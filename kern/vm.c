@@ -7,12 +7,105 @@
 #include "file.h"
 #include "kalloc.h"
 #include "memlayout.h"
+#include "mm.h"
+#include "mmap.h"
 #include "mmu.h"
+#include "pcache.h"
+#include "proc.h"
+#include "sleeplock.h"
 #include "string.h"
 #include "types.h"
 
 extern uint64_t* kpgdir;
 
+/*
+ * Address space IDs tag the TLB entries of user pages, which are all
+ * non-global, so switching ttbr0_el1 needs no flush. An address space
+ * is one struct mm, shared by all threads of a process, and mm->asid
+ * keeps a generation above ASID_BITS; asid.next hands ASIDs out in
+ * order, and running out of them starts a new generation: every CPU
+ * flushes its TLB before it next loads ttbr0_el1, and an mm from an
+ * older generation gets a new ASID as it is switched to. ASID 0 is
+ * never handed out, so a zero mm->asid is always stale.
+ */
+#define ASID_BITS 8
+#define ASID_MASK ((1UL << ASID_BITS) - 1)
+
+static struct {
+    struct spinlock lock;
+    uint64_t next;      // Generation and ASID
+    uint64_t rollover;  // New generations started
+    int flush[NCPU];    // Must flush before loading ttbr0_el1
+} asid = {
+    .next = (1UL << ASID_BITS) | 1,
+    .flush = {[0 ... NCPU - 1] = 1},  // Of the boot-time identity map
+};
+
+/* Number of ASID generations started since boot. */
+uint64_t
+asid_rollovers()
+{
+    return asid.rollover;
+}
+
+/*
+ * Page-table pages are recycled through a small cache. A table is
+ * all zeros again once everything under it has been unmapped, so it
+ * can be handed out again as it is, without a memset.
+ */
+#define NPTCACHE 128
+
+static struct {
+    struct spinlock lock;
+    uint64_t* page[NPTCACHE];
+    int n;
+} ptcache;
+
+/* Get a zeroed page-table page. */
+static uint64_t*
+pt_alloc()
+{
+    uint64_t* t = NULL;
+    acquire(&ptcache.lock);
+    if (ptcache.n) t = ptcache.page[--ptcache.n];
+    release(&ptcache.lock);
+    return t ? t : (uint64_t*)kalloc_zeroed();
+}
+
+/* Give back page-table page t, which must be all zeros. */
+static void
+pt_free(uint64_t* t)
+{
+    acquire(&ptcache.lock);
+    if (ptcache.n < NPTCACHE) {
+        ptcache.page[ptcache.n++] = t;
+        t = NULL;
+    }
+    release(&ptcache.lock);
+    if (t) kfree((char*)t);
+}
+
+static uint64_t
+pt_shrink(uint64_t npages)
+{
+    uint64_t freed = 0;
+    acquire(&ptcache.lock);
+    while (freed < npages && ptcache.n) {
+        kfree((char*)ptcache.page[--ptcache.n]);
+        freed++;
+    }
+    release(&ptcache.lock);
+    return freed;
+}
+
+void
+vm_init()
+{
+    initlock(&asid.lock, "asid");
+    initlock(&ptcache.lock, "ptcache");
+    kmem_register_shrinker(pt_shrink);
+}
+
 /*
  * If the page is invalid, then allocate a new one. Return NULL if failed.
  */
@@ -21,9 +114,8 @@ pde_validate(uint64_t* pde, int64_t alloc)
 {
     if (!(*pde & PTE_P)) {  // if the page is invalid
         if (!alloc) return NULL;
-        char* p = kalloc();
+        char* p = (char*)pt_alloc();
         if (!p) return NULL;  // allocation failed
-        memset(p, 0, PGSIZE);
         *pde = V2P(p) | PTE_P | PTE_PAGE | PTE_USER | PTE_RW;
     }
     return pde;
@@ -41,95 +133,209 @@ pde_validate(uint64_t* pde, int64_t alloc)
  *   - Otherwise, the new page is cleared, and pgdir_walk returns
  *     a pointer into the new page table page.
  */
+/* Is level-2 entry pde a 2 MiB block rather than a table? */
+static inline int
+pde_block(uint64_t pde)
+{
+    return (pde & (PTE_P | PTE_TABLE)) == PTE_P;
+}
+
+/*
+ * Turn the 2 MiB block *pde, which maps va, into a table of pages
+ * with the same attributes, so that part of it can change. Blocks
+ * are never shared, so the pages need no reference counting.
+ */
+static int
+block_split(uint64_t* pde, const void* va)
+{
+    uint64_t* t = (uint64_t*)kalloc();
+    if (!t) return -1;
+    uint64_t pa = PTE_ADDR(*pde), attr = *pde & ~PTE_ADDR_MASK;
+    for (int i = 0; i < ENTRYSZ; ++i) t[i] = (pa + i * PGSIZE) | attr | PTE_PAGE;
+    // Break before make: no TLB may hold the block and a page of it.
+    *pde = 0;
+    tlbi_va((uint64_t)va);
+    *pde = V2P(t) | PTE_P | PTE_TABLE;
+    return 0;
+}
+
+/*
+ * Return the entry for va at level leaf of pgdir, 3 for a page or 2
+ * for a block, going through (and if alloc is set, creating) the
+ * tables above it. A block on the way to a page is split.
+ */
 static uint64_t*
-pgdir_walk(uint64_t* pgdir, const void* va, int64_t alloc)
+pgdir_entry(uint64_t* pgdir, const void* va, int64_t alloc, int leaf)
 {
     uint64_t sign = ((uint64_t)va >> 48) & 0xFFFF;
     if (sign != 0 && sign != 0xFFFF) return NULL;
 
     uint64_t* pde = pgdir;
-    for (int level = 0; level < 3; ++level) {
+    for (int level = 0; level < leaf; ++level) {
         pde = &pde[PTX(level, va)];  // get pde at the next level
+        if (level == 2 && pde_block(*pde) && block_split(pde, va) < 0) return NULL;
         if (!(pde = pde_validate(pde, alloc))) return NULL;
         pde = (uint64_t*)P2V(PTE_ADDR(*pde));
     }
-    return &pde[PTX(3, va)];
+    return &pde[PTX(leaf, va)];
+}
+
+uint64_t*
+pgdir_walk(uint64_t* pgdir, const void* va, int64_t alloc)
+{
+    return pgdir_entry(pgdir, va, alloc, 3);
 }
 
 /*
- * Look up a virtual address, return the physical address,
- * or 0 if not mapped.
+ * Like pgdir_walk(), but leave blocks alone: return the entry that
+ * maps va, which is a block if *size is set to BKSIZE, or NULL.
+ */
+static uint64_t*
+leaf_walk(uint64_t* pgdir, const void* va, uint64_t* size)
+{
+    uint64_t* pde = pgdir_entry(pgdir, va, 0, 2);
+    if (!pde || !(*pde & PTE_P)) return NULL;
+    if (pde_block(*pde)) {
+        *size = BKSIZE;
+        return pde;
+    }
+    *size = PGSIZE;
+    return &((uint64_t*)P2V(PTE_ADDR(*pde)))[PTX(3, va)];
+}
+
+/*
+ * Look up a virtual address, return the physical address of its
+ * page, or 0 if not mapped.
  * Can only be used to look up user pages.
  */
 static uint64_t
 addr_walk(uint64_t* pgdir, const void* va)
 {
-    uint64_t* pte = pgdir_walk(pgdir, va, 0);
+    uint64_t size;
+    uint64_t* pte = leaf_walk(pgdir, va, &size);
     if (!pte) return 0;
     if (!(*pte & PTE_P)) return 0;
     if (!(*pte & PTE_USER)) return 0;
-    return (uint64_t)P2V(PTE_ADDR(*pte));
+    return (uint64_t)P2V(PTE_ADDR(*pte)) + ((uint64_t)va & (size - 1) & ~(PGSIZE - 1));
 }
 
 /*
  * Create PTEs for virtual addresses starting at va that refer to
  * physical addresses starting at pa. va and size might **NOT**
  * be page-aligned.
- * Use permission bits perm|PTE_P|PTE_TABLE|(MT_NORMAL << 2)|PTE_AF|PTE_SH for
- * the entries.
+ * Use permission bits perm|PTE_P|PTE_TABLE|(MT_NORMAL << 2)|PTE_AF|PTE_SH|PTE_NG
+ * for the entries. Where va, pa and what is left of size are 2 MiB
+ * aligned and nothing is mapped yet, one level-2 block replaces a
+ * table of pages; free it with kfree_pages(BKORDER).
  */
-static int
+int
 map_region(uint64_t* pgdir, void* va, uint64_t size, uint64_t pa, int64_t perm)
 {
     for (uint64_t i = 0; i < size; i += PGSIZE) {
+        if (!((uint64_t)(va + i) % BKSIZE) && !(V2P(pa + i) % BKSIZE) && size - i >= BKSIZE) {
+            uint64_t* pde = pgdir_entry(pgdir, (void*)va + i, 1, 2);
+            if (!pde) return 1;
+            if (!(*pde & PTE_P)) {
+                *pde = PTE_ADDR(V2P(pa + i)) | (perm & ~PTE_TABLE) | PTE_P
+                       | (MT_NORMAL << 2) | PTE_AF | PTE_SH | PTE_NG;
+                i += BKSIZE - PGSIZE;
+                continue;
+            }
+        }
         uint64_t* pte = pgdir_walk(pgdir, (void*)va + i, 1);
         if (!pte) return 1;
-        *pte = V2P(PTE_ADDR(pa + i)) | perm | PTE_P | PTE_TABLE
-               | (MT_NORMAL << 2) | PTE_AF | PTE_SH;
+        *pte = PTE_ADDR(V2P(pa + i)) | perm | PTE_P | PTE_TABLE
+               | (MT_NORMAL << 2) | PTE_AF | PTE_SH | PTE_NG;
+    }
+    return 0;
+}
+
+/*
+ * Map a zeroed 2 MiB block at block-aligned user address va, if
+ * nothing around it is mapped yet. Returns 0, or -1 to make do with
+ * pages.
+ */
+int
+uvm_alloc_block(uint64_t* pgdir, uint64_t va, int64_t perm)
+{
+    uint64_t* pde = pgdir_entry(pgdir, (void*)va, 1, 2);
+    if (!pde || (*pde & PTE_P)) return -1;
+    char* mem = kalloc_pages(BKORDER);
+    if (!mem) return -1;
+    memset(mem, 0, BKSIZE);
+    if (map_region(pgdir, (void*)va, BKSIZE, (uint64_t)mem, perm)) {
+        kfree_pages(mem, BKORDER);
+        return -1;
     }
     return 0;
 }
 
+/*
+ * Remove the mappings of [start, end) from table t at level (0 for
+ * the page directory), whose first entry maps va. Optionally free
+ * the physical memory. Subtrees not mapped are skipped, and tables
+ * left empty go back to the cache; the caller flushes the TLB before
+ * anything can use them again. Returns whether t is empty now.
+ */
+static int
+pt_unmap(uint64_t* t, int level, uint64_t va, uint64_t start, uint64_t end, int do_free)
+{
+    uint64_t span = 1UL << (39 - 9 * level);  // Covered by one entry
+    int used = 0;
+
+    for (int i = 0; i < ENTRYSZ; ++i, va += span) {
+        if (!(t[i] & PTE_P)) continue;
+        if (va + span <= start || end <= va) {
+            used = 1;
+            continue;
+        }
+        uint64_t* v = (uint64_t*)P2V(PTE_ADDR(t[i]));
+        if (level == 3) {
+            if (do_free) kpage_put((char*)v);
+            t[i] = 0;
+            continue;
+        }
+        if (level == 2 && pde_block(t[i])) {
+            if (start <= va && va + span <= end) {
+                if (do_free) kfree_pages((char*)v, BKORDER);
+                t[i] = 0;
+                continue;
+            }
+            if (block_split(&t[i], (void*)va) < 0) panic("\tpt_unmap: no memory to split a block.\n");
+            v = (uint64_t*)P2V(PTE_ADDR(t[i]));
+        }
+        if (pt_unmap(v, level + 1, va, start, end, do_free)) {
+            t[i] = 0;
+            pt_free(v);
+        } else {
+            used = 1;
+        }
+    }
+    return !used;
+}
+
 /*
  * Remove npages of mappings starting from va. va must be
- * page-aligned. The mappings must exist.
+ * page-aligned. Pages never mapped are skipped.
  * Optionally free the physical memory.
  */
-static void
+void
 uvm_unmap(uint64_t* pgdir, uint64_t va, uint64_t npages, int do_free)
 {
     if (va % PGSIZE) panic("\tuvm_unmap: not aligned.\n");
-
-    uint64_t size = npages * PGSIZE;
-    for (uint64_t i = 0; i < size; i += PGSIZE) {
-        uint64_t* pte = pgdir_walk(pgdir, (void*)va + i, 0);
-        if (!pte) panic("\tuvmunmap: pgdir_walk error.\n");
-        if (!(*pte & PTE_P)) panic("\tuvmunmap: not mapped.\n");
-        if (PTE_FLAGS(*pte) == PTE_P) panic("\tuvmunmap: not a leaf.\n");
-        if (do_free) kfree((char*)V2P(PTE_ADDR(*pte)));
-        *pte = 0;
-    }
+    pt_unmap(pgdir, 0, 0, va, va + npages * PGSIZE, do_free);
 }
 
 /*
- * Free a page table.
+ * Free a user page table and the memory it maps.
  */
 void
-vm_free(uint64_t* pgdir, int level)
+vm_free(uint64_t* pgdir)
 {
-    if (!pgdir || level < 0) return;
+    if (!pgdir) return;
     if (PTE_FLAGS(pgdir)) panic("\tvm_free: invalid pgdir.\n");
-    if (!level) {
-        kfree((char*)pgdir);
-        return;
-    }
-    for (uint64_t i = 0; i < ENTRYSZ; ++i) {
-        if (pgdir[i] & PTE_P) {
-            uint64_t* v = (uint64_t*)P2V(PTE_ADDR(pgdir[i]));
-            vm_free(v, level - 1);
-        }
-    }
-    kfree((char*)pgdir);
+    pt_unmap(pgdir, 0, 0, 0, USERTOP, 1);
+    pt_free(pgdir);
 }
 
 /*
@@ -138,10 +344,7 @@ vm_free(uint64_t* pgdir, int level)
 uint64_t*
 pgdir_init()
 {
-    uint64_t* pgdir;
-    if (!(pgdir = (uint64_t*)kalloc())) return NULL;
-    memset(pgdir, 0, PGSIZE);
-    return pgdir;
+    return pt_alloc();
 }
 
 /*
@@ -155,8 +358,7 @@ uvm_init(uint64_t* pgdir, char* binary, uint64_t sz)
 {
     char* mem;
     if (sz >= PGSIZE) panic("\tuvm_init: sz must be less than a page.\n");
-    if (!(mem = kalloc())) panic("\tuvm_init: not enough memory.\n");
-    memset(mem, 0, PGSIZE);
+    if (!(mem = kalloc_zeroed())) panic("\tuvm_init: not enough memory.\n");
     map_region(
         pgdir, (void*)0, PGSIZE, (uint64_t)mem, PTE_USER | PTE_RW | PTE_PAGE);
     memmove((void*)mem, (const void*)binary, sz);
@@ -185,6 +387,7 @@ uvm_load(
 /*
  * Allocate PTEs and physical memory to grow process from oldsz to
  * newsz, which need not be page aligned.  Returns new size or 0 on error.
+ * Only for memory needed right away: the rest is mapped by uvm_fault().
  */
 uint64_t
 uvm_alloc(uint64_t* pgdir, uint64_t oldsz, uint64_t newsz)
@@ -192,12 +395,11 @@ uvm_alloc(uint64_t* pgdir, uint64_t oldsz, uint64_t newsz)
     if (newsz < oldsz) return oldsz;
 
     for (uint64_t va = oldsz; va < newsz; va += PGSIZE) {
-        char* mem = kalloc();
+        char* mem = kalloc_zeroed();
         if (!mem) {
             uvm_dealloc(pgdir, va, oldsz);
             return 0;
         }
-        memset(mem, 0, PGSIZE);
         if (map_region(
                 pgdir, (void*)va, PGSIZE, (uint64_t)mem,
                 PTE_USER | PTE_RW | PTE_PAGE)) {
@@ -220,54 +422,208 @@ uvm_dealloc(uint64_t* pgdir, uint64_t oldsz, uint64_t newsz)
 {
     if (newsz >= oldsz) return oldsz;
 
-    int npages = (oldsz - newsz) / PGSIZE;
-    uvm_unmap(pgdir, newsz, npages, 1);
+    uint64_t start = ROUNDUP(newsz, PGSIZE), end = ROUNDUP(oldsz, PGSIZE);
+    if (start < end) uvm_unmap(pgdir, start, (end - start) / PGSIZE, 1);
 
     return newsz;
 }
 
 /*
- * Switch to the process's own page table for execution of it.
+ * Switch to the process's own page table for execution of it,
+ * under an ASID of the current generation. A new page table needs
+ * mm->asid cleared first.
  */
 void
 uvm_switch(struct proc* p)
 {
     if (!p) panic("\tuvm_switch: no process.\n");
     if (!p->kstack) panic("\tuvm_switch: no kstack.\n");
-    if (!p->pgdir) panic("\tuvm_switch: no pgdir.\n");
+    if (!p->mm || !p->mm->pgdir) panic("\tuvm_switch: no pgdir.\n");
 
-    lttbr0(V2P(p->pgdir));  // switch to process's address space
+    struct mm* mm = p->mm;
+    acquire(&asid.lock);
+    if ((mm->asid ^ asid.next) >> ASID_BITS) {
+        mm->asid = asid.next++;
+        if (!(mm->asid & ASID_MASK)) {
+            asid.rollover++;
+            for (int i = 0; i < NCPU; i++) asid.flush[i] = 1;
+            mm->asid = asid.next++;
+        }
+    }
+    int flush = asid.flush[cpuid()];
+    asid.flush[cpuid()] = 0;
+    release(&asid.lock);
+
+    // switch to process's address space
+    lttbr0(V2P(mm->pgdir) | (mm->asid & ASID_MASK) << TTBR_ASID_SHIFT);
+    if (flush) tlbi_local();
+    // IDs for __kernel_gettid() and __kernel_getpid() of the vDSO
+    ltpidrro((uint64_t)p->tgid << 32 | (uint32_t)p->pid);
 }
 
 /*
- * Given a parent process's page table, copy its memory into a child's page
- * table. Copies both the page table and the physical memory. Returns 0 on
- * success, -1 on failure. Frees any allocated pages on failure.
+ * Stop using any user page table on this CPU, so that the one it
+ * last loaded can be freed. What the TLB holds of it stays tagged
+ * with an ASID that is not handed out again before a flush.
+ */
+void
+uvm_detach()
+{
+    static __attribute__((aligned(PGSIZE))) uint64_t empty[PGSIZE / 8];
+    lttbr0(V2P(empty));
+}
+
+/*
+ * Given a parent process's page table, share its memory in [start, end)
+ * with a child's page table. Unless share is set, that is copy-on-write:
+ * writable pages become read-only and PTE_COW in both, and the first
+ * write to one makes a private copy (see uvm_fault()). Returns 0 on
+ * success, -1 on failure, in which case the child's mappings are undone.
  */
 int
-uvm_copy(uint64_t* old, uint64_t* new, uint64_t sz)
+uvm_copy(uint64_t* old, uint64_t* new, uint64_t start, uint64_t end, int share)
 {
-    for (uint64_t i = 0; i < sz; i += PGSIZE) {
+    for (uint64_t i = start; i < end; i += PGSIZE) {
+        uint64_t size, *leaf = leaf_walk(old, (void*)i, &size);
+        if (!leaf || !(*leaf & PTE_P)) continue;  // The child faults it in too
+        // Mapped, so only splitting a block can fail here.
         uint64_t* pte = pgdir_walk(old, (void*)i, 0);
-        if (!pte) panic("\tuvm_copy: pte should exist.\n");
-        if (!(*pte & PTE_P)) panic("\tuvm_copy: page not present.\n");
-        uint64_t pa = V2P(PTE_ADDR(*pte));
-        uint64_t flags = PTE_FLAGS(*pte);
-        char* mem = kalloc();
-        if (!mem) {
-            uvm_unmap(new, 0, i / PGSIZE, 1);
+        uint64_t* npte = pte ? pgdir_walk(new, (void*)i, 1) : NULL;
+        if (!npte) {
+            uvm_unmap(new, start, (i - start) / PGSIZE, 1);
+            tlbi_all();
             return -1;
         }
-        memmove(mem, (void*)pa, PGSIZE);
-        if (map_region(new, (void*)i, PGSIZE, (uint64_t)mem, flags) != 0) {
+        if (!share && (*pte & PTE_USER) && !(*pte & PTE_RO)) *pte |= PTE_RO | PTE_COW;
+        kpage_get((char*)P2V(PTE_ADDR(*pte)));
+        *npte = *pte;
+    }
+    // The parent may have the pages it can no longer write in its TLB.
+    tlbi_all();
+    return 0;
+}
+
+/*
+ * Read n bytes at off of ip into kernel memory for a page fault,
+ * which the kernel may take with ip locked, reading into the mapped
+ * file itself. Returns the bytes read, 0 past the end, or -1.
+ */
+ssize_t
+uvm_readi(struct inode* ip, char* mem, size_t off, size_t n)
+{
+    int locked = holdingsleep(&ip->lock);
+    if (!locked) ilock(ip);
+    ssize_t r = off < ip->size ? readi(ip, mem, off, n) : 0;
+    if (!locked) iunlock(ip);
+    return r;
+}
+
+/*
+ * Map page-aligned va of p on first touch: zeros, or the part of
+ * the program file it stands for. A page that is a whole page of the
+ * file comes from the page cache and is shared, read-only or
+ * copy-on-write. Big heaps get 2 MiB blocks. Only pages of a segment,
+ * the user stack below mm->heap and the heap are filled; the rest
+ * below mm->sz, such as page 0 and the gaps between segments, is not
+ * the program's.
+ */
+static int
+uvm_fill(struct proc* p, uint64_t va)
+{
+    // A heap with room for a whole block around va gets one.
+    uint64_t b = ROUNDDOWN(va, BKSIZE);
+    if (b >= p->mm->heap && b + BKSIZE <= p->mm->sz
+        && !uvm_alloc_block(p->mm->pgdir, b, PTE_USER | PTE_RW | PTE_PAGE))
+        return 0;
+
+    char* mem = NULL;
+    uint64_t perm = PTE_USER | PTE_RW | PTE_PAGE;
+    int ok = va >= p->mm->heap || (p->mm->exe && va + USTACKSIZE >= p->mm->heap);
+    for (struct seg* s = p->mm->seg; s < p->mm->seg + p->mm->nseg; ++s) {
+        if (va < s->va || va >= s->end) continue;
+        ok = 1;
+        uint64_t start = va - s->va;
+        if (start >= s->filesz) break;
+        if (start + PGSIZE <= s->filesz && !((s->off + start) % PGSIZE)) {
+            if (!(mem = pcache_get(p->mm->exe, (s->off + start) / PGSIZE))) return -1;
+            perm |= s->writable ? PTE_RO | PTE_COW : PTE_RO;
+            break;
+        }
+        uint64_t n = MIN(s->filesz - start, PGSIZE);
+        if (!(mem = kalloc_zeroed())) return -1;
+        if (uvm_readi(p->mm->exe, mem, s->off + start, n) != n) {
             kfree(mem);
-            uvm_unmap(new, 0, i / PGSIZE, 1);
             return -1;
         }
+        break;
+    }
+    if (!ok) return -1;
+    if (!mem && !(mem = kalloc_zeroed())) return -1;
+
+    uint64_t* pte = pgdir_walk(p->mm->pgdir, (void*)va, 0);
+    if (pte && (*pte & PTE_P)) {
+        kpage_put(mem);  // Mapped while we read
+        return 0;
+    }
+    if (map_region(p->mm->pgdir, (void*)va, PGSIZE, (uint64_t)mem, perm)) {
+        kpage_put(mem);
+        return -1;
     }
     return 0;
 }
 
+/*
+ * Handle a fault on user address va of p, a write if write is set.
+ * A page below p->mm->sz that was never touched is mapped now, and one
+ * above it is left to mmap_fault(). A write to a PTE_COW page gets
+ * the page to itself: a copy if it is still shared, or else the page
+ * itself, made writable again.
+ * Returns 0 if the access can be retried, -1 if it is invalid.
+ */
+int
+uvm_fault(struct proc* p, uint64_t va, int write)
+{
+    if (va >= USERTOP) return -1;
+    uint64_t size;
+    uint64_t* pte = leaf_walk(p->mm->pgdir, (void*)va, &size);
+    if (!pte || !(*pte & PTE_P))
+        return va < p->mm->sz ? uvm_fill(p, PTE_ADDR(va)) : mmap_fault(p->mm, va, write);
+    if (!(*pte & PTE_USER)) return -1;
+    if (!write || !(*pte & PTE_RO)) return 0;  // Raced with another fault
+    if (size == BKSIZE) return -1;  // Blocks are never copy-on-write
+    if (!(*pte & PTE_COW)) return va < p->mm->sz ? -1 : mmap_fault(p->mm, va, write);
+
+    char* page = (char*)P2V(PTE_ADDR(*pte));
+    if (kpage_shared(page)) {
+        char* mem = kalloc();
+        if (!mem) return -1;
+        memmove(mem, page, PGSIZE);
+        // Someone else may have dropped theirs while we copied.
+        if (!kpage_unshare(page)) kfree(page);
+        page = mem;
+    }
+    *pte = V2P(page) | (*pte & (PGSIZE - 1) & ~PTE_RO);
+    tlbi_va(va);
+    return 0;
+}
+
+/*
+ * Fault in [va, va + n) of p, for writing if write is set, as far as
+ * it can be. Called before taking an inode lock to copy to or from
+ * there: a fault takes mm->lock, and fills pages under it with inode
+ * locks, so one under an inode lock could deadlock with another
+ * thread. What cannot be had is left to fail the copy.
+ */
+void
+uvm_prefault(struct proc* p, uint64_t va, size_t n, int write)
+{
+    if (!n || !p->mm || va >= USERTOP) return;
+    acquiresleep(&p->mm->lock);
+    for (uint64_t a = PTE_ADDR(va); a < va + n && a < USERTOP; a += PGSIZE)
+        uvm_fault(p, a, write);
+    releasesleep(&p->mm->lock);
+}
+
 /*
  * Clear PTE_USER on a page. Used to create an inaccessible
  * page beneath the user stack.
@@ -300,12 +656,58 @@ copyout(uint64_t* pgdir, uint64_t dstva, char* src, uint64_t len)
     return 0;
 }
 
+/*
+ * Return the kernel address of user address va in pgdir, or 0 if it
+ * is not mapped writable: a write through the result must not bypass
+ * copy-on-write.
+ */
+char*
+uva2ka(uint64_t* pgdir, char* va)
+{
+    uint64_t size;
+    uint64_t* pte = leaf_walk(pgdir, va, &size);
+    if (!pte || !(*pte & PTE_P) || !(*pte & PTE_USER) || (*pte & PTE_RO))
+        return 0;
+    return (char*)P2V(PTE_ADDR(*pte)) + (uint64_t)va % size;
+}
+
+/*
+ * Like uva2ka(), but only for a page mapped on its own, not in a
+ * block, and with a reference to the page taken for the caller to
+ * kpage_put(), so that it outlives an munmap() meanwhile. Caller must
+ * hold the mm->lock of pgdir.
+ */
+char*
+uva2ka_get(uint64_t* pgdir, char* va)
+{
+    uint64_t size;
+    uint64_t* pte = leaf_walk(pgdir, va, &size);
+    if (!pte || !(*pte & PTE_P) || !(*pte & PTE_USER) || (*pte & PTE_RO) || size != PGSIZE)
+        return 0;
+    char* page = (char*)P2V(PTE_ADDR(*pte));
+    kpage_get(page);
+    return page + (uint64_t)va % PGSIZE;
+}
+
+/*
+ * Return the kernel address of user address va of p like uva2ka(),
+ * faulting the page in, or getting it to p from copy-on-write, first
+ * if need be. Caller must hold p->mm->lock.
+ */
+char*
+uva2ka_fault(struct proc* p, uint64_t va)
+{
+    char* ka = uva2ka(p->mm->pgdir, (char*)va);
+    if (!ka && !uvm_fault(p, va, 1))
+        ka = uva2ka(p->mm->pgdir, (char*)va);
+    return ka;
+}
+
 void
 check_map_region()
 {
     *((uint64_t*)P2V(0)) = 0xac;
-    char* p = kalloc();
-    memset(p, 0, PGSIZE);
+    char* p = kalloc_zeroed();
     map_region((uint64_t*)p, (void*)0x1000, PGSIZE, 0, 0);
     asm volatile("msr ttbr0_el1, %[x]" : : [x] "r"(V2P(p)));
 
@@ -315,6 +717,6 @@ check_map_region()
         panic("\tcheck_map_region: failed.\n");
     }
 
-    vm_free((uint64_t*)p, 4);
+    vm_free((uint64_t*)p);
     cprintf("check_vm_free: passed.\n");
 }
@@ -1,5 +1,8 @@
 SD_IMG ?=
 KERN_IMG ?=
+# Pass -H to make the root a hashed directory, -i and -l for the
+# number of inodes and log blocks. The file system fills its partition.
+MKFS_FLAGS ?=
 
 BOOT_IMG := $(BUILD_DIR)/boot.img
 FS_IMG := $(BUILD_DIR)/fs.img
@@ -27,7 +30,7 @@ $(BOOT_IMG): $(KERN_IMG) $(shell find boot/*)
 $(FS_IMG): $(shell find obj/user/bin -type f)
 	echo $^
 	cc $(shell find user/src/mkfs/ -name "*.c") -o obj/mkfs
-	./obj/mkfs $@ $^
+	./obj/mkfs -s $(FS_SECTORS) $(MKFS_FLAGS) $@ $^
 
 $(SD_IMG): $(BOOT_IMG) $(FS_IMG)
 	dd if=/dev/zero of=$@ seek=$(shell echo $$(($(SECTORS) - 1))) bs=$(SECTOR_SIZE) count=1
@@ -0,0 +1,87 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * Micro-benchmarks, one result per line:
+ *     name iterations ticks ns-per-iteration
+ * First those of the kernel, from the benchmark device (inc/bench.h),
+ * then those that take a user process, timed here with the counter
+ * that the kernel lets user code read. Lines starting with # are notes.
+ */
+
+static inline uint64_t
+ticks()
+{
+    uint64_t t;
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(t));
+    return t;
+}
+
+static inline uint64_t
+freq()
+{
+    uint64_t f;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(f));
+    return f;
+}
+
+void
+line(char* name, uint64_t iters, uint64_t t)
+{
+    printf("%s %lu %lu %lu\n", name, iters, t, iters ? t * 1000000000 / freq() / iters : 0);
+}
+
+void
+kernel()
+{
+    static char buf[4096];
+    int fd = open("bench", O_RDONLY), n;
+    if (fd < 0) {
+        fprintf(stderr, "bench: cannot open bench\n");
+        return;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0) fwrite(buf, 1, n, stdout);
+    close(fd);
+}
+
+int
+main(int argc, char* argv[])
+{
+    kernel();
+
+    int n = 10000;
+    uint64_t t = ticks();
+    for (int i = 0; i < n; i++) syscall(SYS_getpid);
+    line("syscall", n, ticks() - t);
+
+    n = 200;
+    t = ticks();
+    for (int i = 0; i < n; i++) {
+        int pid = fork();
+        if (pid == 0) _exit(0);
+        if (pid < 0) {
+            fprintf(stderr, "bench: fork failed\n");
+            break;
+        }
+        wait(NULL);
+    }
+    line("fork_wait", n, ticks() - t);
+
+    t = ticks();
+    for (int i = 0; i < n; i++) {
+        int pid = vfork();
+        if (pid == 0) _exit(0);
+        if (pid < 0) {
+            fprintf(stderr, "bench: vfork failed\n");
+            break;
+        }
+        wait(NULL);
+    }
+    line("vfork_wait", n, ticks() - t);
+    return 0;
+}
@@ -7,6 +7,16 @@
 
 char* argv[] = {"sh", 0};
 
+// Names of the statistics devices, by minor number starting at 1.
+char* kstat[] = {"logstat", "dcachestat", "icachestat", "schedstat", "syscallstat", "procstat", "pcachestat", "bootstat", 0};
+
+// Devices with one minor: trace buffers (inc/trace.h), profiler (inc/prof.h),
+// benchmarks (inc/bench.h).
+struct {
+    char* name;
+    int major;
+} dev[] = {{"trace", 3}, {"prof", 4}, {"bench", 5}, {0}};
+
 int
 main()
 {
@@ -19,6 +29,24 @@ main()
     dup(0);  // stdout
     dup(0);  // stderr
 
+    // Kernel statistics, see inc/kstat.h.
+    for (int i = 0; kstat[i]; i++) {
+        int fd;
+        if ((fd = open(kstat[i], O_RDONLY)) < 0)
+            mknod(kstat[i], 2, i + 1);
+        else
+            close(fd);
+    }
+
+    // Other devices, by major number.
+    for (int i = 0; dev[i].name; i++) {
+        int fd;
+        if ((fd = open(dev[i].name, O_RDONLY)) < 0)
+            mknod(dev[i].name, dev[i].major, 0);
+        else
+            close(fd);
+    }
+
     while (1) {
         printf("init: starting sh\n");
         pid = fork();
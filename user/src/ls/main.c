@@ -3,10 +3,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include "../../../inc/fs.h"
 
+// Directory entries are read, and lines written, this much at a time.
+#define BUFSZ (1 << 16)
+
+char dents[BUFSZ];
+char out[BUFSZ];
+
 char*
 fmtname(char* path)
 {
@@ -26,9 +33,8 @@ fmtname(char* path)
 void
 ls(char* path)
 {
-    char buf[512], *p;
     int fd;
-    struct dirent de;
+    long n;
     struct stat st;
 
     if ((fd = open(path, O_RDONLY)) < 0) {
@@ -47,25 +53,22 @@ ls(char* path)
             "%s %x %ld %ld\n", fmtname(path), st.st_mode, st.st_ino,
             st.st_size);
     } else if (S_ISDIR(st.st_mode)) {
-        if (strlen(path) + 1 + DIRSIZ + 1 > sizeof(buf)) {
-            fprintf(stderr, "ls: path too long\n");
-        } else {
-            strcpy(buf, path);
-            p = buf + strlen(buf);
-            *p++ = '/';
-            while (read(fd, &de, sizeof(de)) == sizeof(de)) {
-                if (de.inum == 0) continue;
-                memmove(p, de.name, DIRSIZ);
-                p[DIRSIZ] = 0;
-                if (stat(buf, &st) < 0) {
-                    fprintf(stderr, "ls: cannot stat %s\n", buf);
+        // Many entries per call, each stat()ed in the directory itself
+        // rather than by a path looked up from the top again.
+        while ((n = syscall(SYS_getdents64, fd, dents, sizeof(dents))) > 0) {
+            for (long off = 0; off < n;) {
+                struct linux_dirent64* d = (struct linux_dirent64*)(dents + off);
+                off += d->d_reclen;
+                if (fstatat(fd, d->d_name, &st, 0) < 0) {
+                    fprintf(stderr, "ls: cannot stat %s/%s\n", path, d->d_name);
                     continue;
                 }
                 printf(
-                    "%s %x %ld %ld\n", fmtname(buf), st.st_mode, st.st_ino,
-                    st.st_size);
+                    "%s %x %ld %ld\n", fmtname(d->d_name), st.st_mode,
+                    st.st_ino, st.st_size);
             }
         }
+        if (n < 0) fprintf(stderr, "ls: cannot read %s\n", path);
     }
     close(fd);
 }
@@ -73,6 +76,7 @@ ls(char* path)
 int
 main(int argc, char* argv[])
 {
+    setvbuf(stdout, out, _IOFBF, sizeof(out));
     if (argc < 2)
         ls(".");
     else
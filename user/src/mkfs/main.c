@@ -26,19 +26,25 @@ typedef uint32_t uint;
 #endif
 
 #define NINODES 200
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define WCHUNK  (1 << 20)  // Bytes per write() of the image
 
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
 
-int nbitmap = FSSIZE / (BSIZE * 8) + 1;
-int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+uint fssize = FSSIZE;
+uint ninodes = NINODES;
+int nbitmap;
+int ninodeblocks;
+int nlog = NLOG;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
+// The image is built in memory and written out at the end, up to the
+// last block in use; the rest is left to ftruncate() as zeros.
 int fsfd;
+char* img;
 struct superblock sb;
-char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
 
@@ -49,6 +55,13 @@ void rinode(uint inum, struct dinode* ip);
 void rsect(uint sec, void* buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void* p, int n);
+void ifile(uint inum, int fd);
+void mkdirh(uint inum, struct dirent* de, int n);
+void wimage(uint used);
+
+// Entries of the root directory, written once all files are in.
+struct dirent* rootde;
+int nrootde;
 
 // convert to little-endian byte order
 ushort
@@ -76,35 +89,64 @@ xint(uint x)
 int
 main(int argc, char* argv[])
 {
-    int i, cc, fd;
+    int i, fd, opt;
     uint rootino, inum, off;
-    struct dirent de;
+    struct dirent* de;
     char buf[BSIZE];
     struct dinode din;
+    int hashed = 0;
 
     static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+    while ((opt = getopt(argc, argv, "Hs:i:l:")) != -1) {
+        switch (opt) {
+        case 'H': hashed = 1; break;  // Make the root a hashed directory
+        case 's': fssize = strtoul(optarg, 0, 0); break;
+        case 'i': ninodes = strtoul(optarg, 0, 0); break;
+        case 'l': nlog = strtoul(optarg, 0, 0); break;
+        default: argc = 0;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
     if (argc < 2) {
-        fprintf(stderr, "Usage: mkfs fs.img files...\n");
+        fprintf(stderr, "Usage: mkfs [-H] [-s blocks] [-i inodes] [-l log blocks] fs.img files...\n");
         exit(1);
     }
 
     assert((BSIZE % sizeof(struct dinode)) == 0);
     assert((BSIZE % sizeof(struct dirent)) == 0);
 
+    // 1 fs block = 1 disk sector
+    nbitmap = fssize / BPB + 1;
+    ninodeblocks = ninodes / IPB + 1;
+    nmeta = 2 + nlog + ninodeblocks + nbitmap;
+    nblocks = fssize - nmeta;
+
+    // What the kernel can take: a log with room for a whole
+    // transaction, 16-bit inode numbers in directory entries, and
+    // the free counts of all bitmap blocks in a page.
+    if (nlog < LOGSIZE + 3 || ninodes < 2 || ninodes > 0xffff || nbitmap > 2048 || nblocks < 1) {
+        fprintf(stderr, "mkfs: bad geometry: %u blocks, %u inodes, %d log blocks\n", fssize,
+                ninodes, nlog);
+        exit(1);
+    }
+
     fsfd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0666);
     if (fsfd < 0) {
         perror(argv[1]);
         exit(1);
     }
+    img = calloc(fssize, BSIZE);
+    rootde = calloc(ninodes, sizeof(struct dirent));
+    if (!img || !rootde) {
+        perror("calloc");
+        exit(1);
+    }
 
-    // 1 fs block = 1 disk sector
-    nmeta = 2 + nlog + ninodeblocks + nbitmap;
-    nblocks = FSSIZE - nmeta;
-
-    sb.size = xint(FSSIZE);
+    sb.size = xint(fssize);
     sb.nblocks = xint(nblocks);
-    sb.ninodes = xint(NINODES);
+    sb.ninodes = xint(ninodes);
     sb.nlog = xint(nlog);
     sb.logstart = xint(2);
     sb.inodestart = xint(2 + nlog);
@@ -112,12 +154,10 @@ main(int argc, char* argv[])
 
     printf(
         "nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-        nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+        nmeta, nlog, ninodeblocks, nbitmap, nblocks, fssize);
 
     freeblock = nmeta;  // the first free block that we can allocate
 
-    for (i = 0; i < FSSIZE; i++) wsect(i, zeroes);
-
     memset(buf, 0, sizeof(buf));
     memmove(buf, &sb, sizeof(sb));
     wsect(1, buf);
@@ -125,15 +165,13 @@ main(int argc, char* argv[])
     rootino = ialloc(T_DIR);
     assert(rootino == ROOTINO);
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(rootino);
-    strcpy(de.name, ".");
-    iappend(rootino, &de, sizeof(de));
+    de = &rootde[nrootde++];
+    de->inum = xshort(rootino);
+    strcpy(de->name, ".");
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(rootino);
-    strcpy(de.name, "..");
-    iappend(rootino, &de, sizeof(de));
+    de = &rootde[nrootde++];
+    de->inum = xshort(rootino);
+    strcpy(de->name, "..");
 
     for (i = 2; i < argc; i++) {
         char* path = argv[i];
@@ -160,24 +198,31 @@ main(int argc, char* argv[])
 
         inum = ialloc(T_FILE);
 
-        bzero(&de, sizeof(de));
-        de.inum = xshort(inum);
-        strncpy(de.name, argv[i], DIRSIZ);
-        iappend(rootino, &de, sizeof(de));
-
-        while ((cc = read(fd, buf, sizeof(buf))) > 0) iappend(inum, buf, cc);
+        assert(nrootde < ninodes);
+        de = &rootde[nrootde++];
+        de->inum = xshort(inum);
+        strncpy(de->name, argv[i], DIRSIZ);
 
+        ifile(inum, fd);
         close(fd);
     }
 
+    if (hashed)
+        mkdirh(rootino, rootde, nrootde);
+    else
+        iappend(rootino, rootde, nrootde * sizeof(struct dirent));
+
     // fix size of root inode dir
-    rinode(rootino, &din);
-    off = xint(din.size);
-    off = ((off / BSIZE) + 1) * BSIZE;
-    din.size = xint(off);
-    winode(rootino, &din);
+    if (!hashed) {
+        rinode(rootino, &din);
+        off = xint(din.size);
+        off = ((off / BSIZE) + 1) * BSIZE;
+        din.size = xint(off);
+        winode(rootino, &din);
+    }
 
     balloc(freeblock);
+    wimage(freeblock);
 
     exit(0);
 }
@@ -185,13 +230,27 @@ main(int argc, char* argv[])
 void
 wsect(uint sec, void* buf)
 {
-    if (lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE) {
-        perror("lseek");
+    assert(sec < fssize);
+    memmove(img + (size_t)sec * BSIZE, buf, BSIZE);
+}
+
+// Write the first used blocks of the image to the file, in large
+// chunks, and size the file to the whole image.
+void
+wimage(uint used)
+{
+    size_t n = (size_t)used * BSIZE;
+    if (ftruncate(fsfd, (off_t)fssize * BSIZE) < 0) {
+        perror("ftruncate");
         exit(1);
     }
-    if (write(fsfd, buf, BSIZE) != BSIZE) {
-        perror("write");
-        exit(1);
+    for (size_t off = 0; off < n;) {
+        ssize_t cc = write(fsfd, img + off, min(n - off, WCHUNK));
+        if (cc <= 0) {
+            perror("write");
+            exit(1);
+        }
+        off += cc;
     }
 }
 
@@ -225,14 +284,8 @@ rinode(uint inum, struct dinode* ip)
 void
 rsect(uint sec, void* buf)
 {
-    if (lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE) {
-        perror("lseek");
-        exit(1);
-    }
-    if (read(fsfd, buf, BSIZE) != BSIZE) {
-        perror("read");
-        exit(1);
-    }
+    assert(sec < fssize);
+    memmove(buf, img + (size_t)sec * BSIZE, BSIZE);
 }
 
 uint
@@ -256,14 +309,55 @@ balloc(int used)
     int i;
 
     printf("balloc: first %d blocks have been allocated\n", used);
-    assert(used < BSIZE * 8);
-    bzero(buf, BSIZE);
-    for (i = 0; i < used; i++) { buf[i / 8] = buf[i / 8] | (0x1 << (i % 8)); }
-    printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-    wsect(sb.bmapstart, buf);
+    assert(used < fssize);
+    for (int b = 0; b < used; b += BPB) {
+        bzero(buf, BSIZE);
+        for (i = 0; i < BPB && b + i < used; i++) {
+            buf[i / 8] = buf[i / 8] | (0x1 << (i % 8));
+        }
+        printf("balloc: write bitmap block at sector %d\n", BBLOCK(b, sb));
+        wsect(BBLOCK(b, sb), buf);
+    }
 }
 
-#define min(a, b) ((a) < (b) ? (a) : (b))
+// Return the disk block of file block fbn, allocating any indirect
+// blocks on the way there, and the block itself if it is missing:
+// addr if that is set, the next free one otherwise.
+uint
+bmap(struct dinode* din, uint fbn, uint addr)
+{
+    uint indirect[NINDIRECT];
+    uint x, i, span;
+    int level = 0;
+
+    if (fbn < NDIRECT) {
+        if (xint(din->addrs[fbn]) == 0) {
+            din->addrs[fbn] = xint(addr ? addr : freeblock++);
+        }
+        return xint(din->addrs[fbn]);
+    }
+
+    fbn -= NDIRECT;
+    for (span = NINDIRECT; fbn >= span; span *= NINDIRECT) {
+        fbn -= span;
+        level++;
+    }
+    if (xint(din->addrs[NDIRECT + level]) == 0) {
+        din->addrs[NDIRECT + level] = xint(freeblock++);
+    }
+    x = xint(din->addrs[NDIRECT + level]);
+    for (span /= NINDIRECT; span > 0; span /= NINDIRECT) {
+        rsect(x, (char*)indirect);
+        i = fbn / span;
+        if (indirect[i] == 0) {
+            indirect[i] = xint(span == 1 && addr ? addr : freeblock++);
+            wsect(x, (char*)indirect);
+        }
+        x = xint(indirect[i]);
+        fbn %= span;
+    }
+    return x;
+}
 
 void
 iappend(uint inum, void* xp, int n)
@@ -272,7 +366,6 @@ iappend(uint inum, void* xp, int n)
     uint fbn, off, n1;
     struct dinode din;
     char buf[BSIZE];
-    uint indirect[NINDIRECT];
     uint x;
 
     rinode(inum, &din);
@@ -281,22 +374,7 @@ iappend(uint inum, void* xp, int n)
     while (n > 0) {
         fbn = off / BSIZE;
         assert(fbn < MAXFILE);
-        if (fbn < NDIRECT) {
-            if (xint(din.addrs[fbn]) == 0) {
-                din.addrs[fbn] = xint(freeblock++);
-            }
-            x = xint(din.addrs[fbn]);
-        } else {
-            if (xint(din.addrs[NDIRECT]) == 0) {
-                din.addrs[NDIRECT] = xint(freeblock++);
-            }
-            rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-            if (indirect[fbn - NDIRECT] == 0) {
-                indirect[fbn - NDIRECT] = xint(freeblock++);
-                wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-            }
-            x = xint(indirect[fbn - NDIRECT]);
-        }
+        x = bmap(&din, fbn, 0);
         n1 = min(n, (fbn + 1) * BSIZE - off);
         rsect(x, buf);
         bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -308,3 +386,79 @@ iappend(uint inum, void* xp, int n)
     din.size = xint(off);
     winode(inum, &din);
 }
+
+// Write the contents of fd as those of the empty file inum: all the
+// data blocks in one run, read straight into the image, and the
+// indirect blocks that map them behind it.
+void
+ifile(uint inum, int fd)
+{
+    struct dinode din;
+    off_t n = lseek(fd, 0, SEEK_END);
+    uint nb = (n + BSIZE - 1) / BSIZE, first = freeblock;
+
+    if (n < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+        perror("lseek");
+        exit(1);
+    }
+    assert(nb <= MAXFILE);
+    assert(first + nb <= fssize);
+    freeblock += nb;
+    for (off_t off = 0; off < n;) {
+        ssize_t cc = read(fd, img + (size_t)first * BSIZE + off, min(n - off, WCHUNK));
+        if (cc <= 0) {
+            perror("read");
+            exit(1);
+        }
+        off += cc;
+    }
+
+    rinode(inum, &din);
+    for (uint fbn = 0; fbn < nb; fbn++) bmap(&din, fbn, first + fbn);
+    assert(freeblock <= fssize);
+    din.size = xint(n);
+    winode(inum, &din);
+}
+
+// Write the n entries de as the contents of the empty hashed
+// directory inum, see inc/fs.h.
+void
+mkdirh(uint inum, struct dirent* de, int n)
+{
+    struct dirent blk[DIRH_NSLOT];
+    struct dirhslot* index = (struct dirhslot*)blk;
+    int count[DIRH_NBUCKET] = {0};
+    uint first[DIRH_NBUCKET];
+    uint b, fbn = 1, i, j;
+
+    for (i = 0; i < n; i++) count[dirhash(de[i].name) % DIRH_NBUCKET]++;
+
+    // Chain blocks follow the index, bucket by bucket.
+    bzero(blk, BSIZE);
+    index[0].v[0] = xshort(DIRH_MAGIC);
+    index[0].v[1] = xshort(DIRH_NBUCKET);
+    for (b = 0; b < DIRH_NBUCKET; b++) {
+        first[b] = count[b] ? fbn : 0;
+        index[1 + b / DIRH_NPTR].v[b % DIRH_NPTR] = xshort(first[b]);
+        fbn += (count[b] + DIRH_NSLOT - 2) / (DIRH_NSLOT - 1);
+    }
+    assert(fbn <= 0xffff);
+    iappend(inum, blk, BSIZE);
+
+    for (b = 0; b < DIRH_NBUCKET; b++) {
+        if (!count[b]) continue;
+        fbn = first[b];
+        bzero(blk, BSIZE);
+        for (i = 0, j = 1; i < n; i++) {
+            if (dirhash(de[i].name) % DIRH_NBUCKET != b) continue;
+            if (j == DIRH_NSLOT) {
+                ((struct dirhslot*)blk)->v[0] = xshort(++fbn);
+                iappend(inum, blk, BSIZE);
+                bzero(blk, BSIZE);
+                j = 1;
+            }
+            blk[j++] = de[i];
+        }
+        iappend(inum, blk, BSIZE);
+    }
+}
@@ -0,0 +1,210 @@
+#include <elf.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../../../inc/prof.h"
+
+/*
+ * Drive the kernel PC sampler:
+ *     prof -r RATE   start sampling RATE times a second on every CPU
+ *     prof -s        stop
+ *     prof           print the samples taken since the last drain,
+ *                    by function, for user code of programs still
+ *                    running; kernel PCs are printed as they are, for
+ *                    `addr2line -f -e obj/kernel8.elf' on the host.
+ */
+
+#define NPROG 16  // Programs whose symbols are loaded at once
+
+struct sym {
+    uint64_t addr;
+    char* name;
+};
+
+struct prog {
+    char name[16];
+    struct sym* sym;
+    int nsym;
+} prog[NPROG];
+int nprog;
+
+// One line of the report.
+struct hit {
+    char* what;   // Program, or "kernel"
+    char* func;   // Function, or NULL if only pc is known
+    uint64_t pc;
+    int n;
+} *hit;
+int nhit, maxhit;
+
+int
+symcmp(const void* a, const void* b)
+{
+    const struct sym *x = a, *y = b;
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+// Load the function symbols of program name, found in /.
+struct prog*
+load(char* name)
+{
+    for (int i = 0; i < nprog; i++)
+        if (!strcmp(prog[i].name, name)) return &prog[i];
+    if (nprog == NPROG) return 0;
+
+    struct prog* p = &prog[nprog++];
+    strncpy(p->name, name, sizeof(p->name) - 1);
+
+    char path[32];
+    struct stat st;
+    snprintf(path, sizeof(path), "/%s", name);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return p;
+    char* elf = 0;
+    if (fstat(fd, &st) < 0 || !(elf = malloc(st.st_size))) goto out;
+    for (off_t off = 0, n; off < st.st_size; off += n)
+        if ((n = read(fd, elf + off, st.st_size - off)) <= 0) goto out;
+
+    // Symbols point into elf, which is therefore kept.
+    Elf64_Ehdr* eh = (Elf64_Ehdr*)elf;
+    if (st.st_size < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG)
+        || eh->e_shoff + eh->e_shnum * sizeof(Elf64_Shdr) > st.st_size)
+        goto out;
+    Elf64_Shdr* sh = (Elf64_Shdr*)(elf + eh->e_shoff);
+    for (int i = 0; i < eh->e_shnum; i++) {
+        if (sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh->e_shnum) continue;
+        Elf64_Shdr* ss = &sh[sh[i].sh_link];
+        if (sh[i].sh_offset + sh[i].sh_size > st.st_size || ss->sh_offset + ss->sh_size > st.st_size) break;
+        Elf64_Sym* sym = (Elf64_Sym*)(elf + sh[i].sh_offset);
+        int n = sh[i].sh_size / sizeof(*sym);
+        p->sym = malloc(n * sizeof(*p->sym));
+        for (int k = 0; p->sym && k < n; k++)
+            if (ELF64_ST_TYPE(sym[k].st_info) == STT_FUNC && sym[k].st_name < ss->sh_size)
+                p->sym[p->nsym++] = (struct sym){sym[k].st_value, elf + ss->sh_offset + sym[k].st_name};
+        qsort(p->sym, p->nsym, sizeof(*p->sym), symcmp);
+        close(fd);
+        return p;
+    }
+out:
+    free(elf);
+    close(fd);
+    return p;
+}
+
+// The function of p that pc is in, or NULL.
+char*
+lookup(struct prog* p, uint64_t pc)
+{
+    int lo = 0, hi = p ? p->nsym : 0;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (p->sym[mid].addr <= pc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo ? p->sym[lo - 1].name : 0;
+}
+
+// Names of the running processes, by pid, from procstat.
+char* pname[4096];
+
+void
+readnames()
+{
+    static char buf[4096];
+    int fd = open("procstat", O_RDONLY), n;
+    if (fd < 0) return;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    buf[n > 0 ? n : 0] = 0;
+
+    for (char* l = strtok(buf, "\n"); l; l = strtok(0, "\n")) {
+        int pid;
+        char name[16];
+        if (sscanf(l, "%d %15s", &pid, name) == 2 && pid > 0 && pid < 4096) pname[pid] = strdup(name);
+    }
+}
+
+void
+count(char* what, char* func, uint64_t pc)
+{
+    for (int i = 0; i < nhit; i++)
+        if (!strcmp(hit[i].what, what) && (func ? hit[i].func == func : !hit[i].func && hit[i].pc == pc)) {
+            hit[i].n++;
+            return;
+        }
+    if (nhit == maxhit) {
+        maxhit = maxhit ? maxhit * 2 : 256;
+        hit = realloc(hit, maxhit * sizeof(*hit));
+    }
+    hit[nhit++] = (struct hit){what, func, pc, 1};
+}
+
+int
+hitcmp(const void* a, const void* b)
+{
+    return ((struct hit*)b)->n - ((struct hit*)a)->n;
+}
+
+int
+setrate(int fd, uint32_t rate)
+{
+    if (write(fd, &rate, sizeof(rate)) != sizeof(rate)) {
+        printf("prof: cannot set rate %u, at most %d.\n", rate, PROF_MAXRATE);
+        return -1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    int fd = open("prof", O_RDWR);
+    if (fd < 0) {
+        printf("prof: cannot open prof.\n");
+        _exit(-1);
+    }
+    if (argc == 3 && !strcmp(argv[1], "-r")) _exit(setrate(fd, atoi(argv[2])));
+    if (argc == 2 && !strcmp(argv[1], "-s")) _exit(setrate(fd, 0));
+    if (argc != 1) {
+        printf("usage: prof [-r rate | -s]\n");
+        _exit(-1);
+    }
+
+    readnames();
+    static struct prof_sample s[512];
+    int n, total = 0, idle = 0;
+    while ((n = read(fd, s, sizeof(s))) > 0) {
+        n /= sizeof(s[0]);
+        for (int i = 0; i < n; i++) {
+            total++;
+            if (!s[i].pid) {
+                idle++;
+                continue;
+            }
+            char* what = s[i].user ? (s[i].pid < 4096 ? pname[s[i].pid] : 0) : "kernel";
+            if (!what) what = "?";
+            char* func = s[i].user ? lookup(load(what), s[i].pc) : 0;
+            count(what, func, s[i].pc);
+        }
+        if (n < sizeof(s) / sizeof(s[0])) break;
+    }
+    close(fd);
+
+    qsort(hit, nhit, sizeof(*hit), hitcmp);
+    printf("%d samples, %d idle\n", total, idle);
+    for (int i = 0; i < nhit; i++) {
+        printf("%6d %5d%% %s ", hit[i].n, hit[i].n * 100 / total, hit[i].what);
+        if (hit[i].func)
+            printf("%s\n", hit[i].func);
+        else
+            printf("0x%lx\n", hit[i].pc);
+    }
+    _exit(0);
+}
@@ -1,10 +1,14 @@
 // Shell
 
 #include <fcntl.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 // Parsed command representation
@@ -15,6 +19,7 @@
 #define BACK  5
 
 #define MAXARGS 10
+#define NJOB    16  // Background jobs tracked at once
 
 struct cmd {
     int type;
@@ -52,21 +57,35 @@ struct backcmd {
     struct cmd* cmd;
 };
 
+// Background jobs, by pid; 0 is a free slot.
+struct job {
+    int pid;
+    char line[32];
+} jobs[NJOB];
+
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
+void runcmd(struct cmd*);
 struct cmd* parsecmd(char*);
+extern char whitespace[];
+
+// Commands are parsed by the shell itself: syntax errors come back here.
+jmp_buf parse_error;
+int parsing;
+
+// Memory for the commands of one line, freed as a whole.
+static size_t malloc1_used;
 
 void*
 malloc1(size_t sz)
 {
 #define MAXN 10000
     static char mem[MAXN];
-    static size_t i;
-    if ((i += sz) > MAXN) {
+    if ((malloc1_used += sz) > MAXN) {
         fprintf(stderr, "malloc1: memory used out\n");
         exit(1);
     }
-    return &mem[i - sz];
+    return &mem[malloc1_used - sz];
 #undef MAXN
 }
 
@@ -141,6 +160,212 @@ runcmd(struct cmd* cmd)
     exit(0);
 }
 
+// A simple command, maybe redirected, that can be exec()ed as it is.
+struct execcmd*
+simplecmd(struct cmd* cmd)
+{
+    while (cmd && cmd->type == REDIR) cmd = ((struct redircmd*)cmd)->cmd;
+    if (!cmd || cmd->type != EXEC || !((struct execcmd*)cmd)->argv[0]) return 0;
+    return (struct execcmd*)cmd;
+}
+
+/*
+ * Start cmd in a child with stdin in and stdout out, unless they are
+ * -1, closing unused there, and return its pid or -1. A simple
+ * command is vfork()ed: the child only redirects and execs, on the
+ * shell's memory, so nothing is copied. Anything else gets a fork()ed
+ * copy of the shell to run it.
+ */
+int
+spawn(struct cmd* cmd, int in, int out, int unused)
+{
+    struct execcmd* ecmd = simplecmd(cmd);
+    int pid = ecmd ? vfork() : fork();
+
+    if (pid < 0) fprintf(stderr, "fork failed\n");
+    if (pid != 0) return pid;
+    if (in >= 0) {
+        close(0);
+        dup(in);
+    }
+    if (out >= 0) {
+        close(1);
+        dup(out);
+    }
+    if (in >= 0) close(in);
+    if (out >= 0) close(out);
+    if (unused >= 0) close(unused);
+    if (!ecmd) runcmd(cmd);
+
+    // Touch nothing but the stack from here on: it is the shell's memory.
+    for (; cmd->type == REDIR; cmd = ((struct redircmd*)cmd)->cmd) {
+        struct redircmd* rcmd = (struct redircmd*)cmd;
+        close(rcmd->fd);
+        if (open(rcmd->file, rcmd->mode) < 0) {
+            dprintf(2, "open %s failed\n", rcmd->file);
+            _exit(1);
+        }
+    }
+    execv(ecmd->argv[0], ecmd->argv);
+    dprintf(2, "exec %s failed\n", ecmd->argv[0]);
+    _exit(1);
+}
+
+void
+job_done(int pid)
+{
+    for (struct job* j = jobs; j < jobs + NJOB; j++) {
+        if (j->pid == pid) {
+            fprintf(stderr, "[%d] Done\t%s\n", (int)(j - jobs) + 1, j->line);
+            j->pid = 0;
+        }
+    }
+}
+
+/*
+ * Wait for the n children in pid. Background jobs that end meanwhile
+ * are reported, there being no way to wait for one pid in particular.
+ */
+void
+waitpids(int* pid, int n)
+{
+    int left = 0;
+    for (int i = 0; i < n; i++) left += pid[i] > 0;
+    while (left > 0) {
+        int r = wait4(-1, NULL, 0, NULL);
+        if (r < 0) break;
+        int mine = 0;
+        for (int i = 0; i < n; i++) {
+            if (pid[i] > 0 && pid[i] == r) {
+                pid[i] = 0;
+                mine = 1;
+                left--;
+            }
+        }
+        if (!mine) job_done(r);
+    }
+}
+
+int
+job_start(struct cmd* cmd, char* line)
+{
+    struct job* j = jobs;
+    while (j < jobs + NJOB && j->pid) j++;
+    if (j == jobs + NJOB) {
+        fprintf(stderr, "too many jobs\n");
+        return -1;
+    }
+    if ((j->pid = spawn(cmd, -1, -1, -1)) < 0) {
+        j->pid = 0;
+        return -1;
+    }
+    strncpy(j->line, line, sizeof(j->line) - 1);
+    j->line[sizeof(j->line) - 1] = 0;
+    fprintf(stderr, "[%d] %d\n", (int)(j - jobs) + 1, j->pid);
+    return 0;
+}
+
+// Run ecmd in the shell itself if it is a built-in; returns 0 if not.
+int
+builtin(struct execcmd* ecmd)
+{
+    char* name = ecmd->argv[0];
+
+    if (!strcmp(name, "cd")) {
+        // Chdir must be called by the shell, not a child.
+        if (!ecmd->argv[1] || chdir(ecmd->argv[1]) < 0)
+            fprintf(stderr, "cannot cd %s\n", ecmd->argv[1] ? ecmd->argv[1] : "");
+    } else if (!strcmp(name, "exit")) {
+        exit(ecmd->argv[1] ? atoi(ecmd->argv[1]) : 0);
+    } else if (!strcmp(name, "jobs")) {
+        for (struct job* j = jobs; j < jobs + NJOB; j++)
+            if (j->pid) printf("[%d] %d Running\t%s\n", (int)(j - jobs) + 1, j->pid, j->line);
+        fflush(stdout);  // Or else every child flushes it again
+    } else if (!strcmp(name, "wait")) {
+        int r;
+        while ((r = wait4(-1, NULL, 0, NULL)) >= 0) job_done(r);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Run cmd, a line or part of one, from the shell: built-ins in the
+ * shell itself, lists one after the other, and background jobs and
+ * both sides of a pipe at the same time, each in a child of the shell.
+ */
+void
+runline(struct cmd* cmd, char* line)
+{
+    int p[2], pid[2];
+    struct listcmd* lcmd;
+    struct pipecmd* pcmd;
+
+    if (cmd == 0) return;
+
+    switch (cmd->type) {
+    case EXEC:
+        if (!((struct execcmd*)cmd)->argv[0] || builtin((struct execcmd*)cmd)) break;
+        // fall through
+    default:
+        pid[0] = spawn(cmd, -1, -1, -1);
+        waitpids(pid, 1);
+        break;
+
+    case LIST:
+        lcmd = (struct listcmd*)cmd;
+        runline(lcmd->left, line);
+        runline(lcmd->right, line);
+        break;
+
+    case PIPE:
+        pcmd = (struct pipecmd*)cmd;
+        if (pipe(p) < 0) {
+            fprintf(stderr, "pipe failed\n");
+            break;
+        }
+        pid[0] = spawn(pcmd->left, -1, p[1], p[0]);
+        pid[1] = spawn(pcmd->right, p[0], -1, p[1]);
+        close(p[0]);
+        close(p[1]);
+        waitpids(pid, 2);
+        break;
+
+    case BACK:
+        job_start(((struct backcmd*)cmd)->cmd, line);
+        break;
+    }
+}
+
+// Seconds and milliseconds of a timeval, for printf("%ld.%03ld").
+#define TV(tv) (long)(tv).tv_sec, (long)(tv).tv_usec / 1000
+
+/*
+ * Run line as the time keyword's command: the wall clock time it
+ * took, and the user and system time of the children it waited for.
+ */
+void
+timeline(struct cmd* cmd, char* line)
+{
+    struct timespec t0, t1;
+    struct rusage r0, r1;
+    struct timeval real, user, sys;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    getrusage(RUSAGE_CHILDREN, &r0);
+    runline(cmd, line);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    getrusage(RUSAGE_CHILDREN, &r1);
+
+    long ns = (t1.tv_sec - t0.tv_sec) * 1000000000L + t1.tv_nsec - t0.tv_nsec;
+    real.tv_sec = ns / 1000000000L;
+    real.tv_usec = ns % 1000000000L / 1000;
+    timersub(&r1.ru_utime, &r0.ru_utime, &user);
+    timersub(&r1.ru_stime, &r0.ru_stime, &sys);
+    fprintf(stderr, "real %ld.%03lds user %ld.%03lds sys %ld.%03lds\n", TV(real), TV(user), TV(sys));
+}
+
 int
 getcmd(char* buf, int nbuf)
 {
@@ -166,16 +391,31 @@ main()
         }
     }
 
-    // Read and run input commands.
+    // Read and run input commands, without a fork for the shell's own
+    // work: only what it starts runs in a child.
     while (getcmd(buf, sizeof(buf)) >= 0) {
-        if (buf[0] == 'c' && buf[1] == 'd' && buf[2] == ' ') {
-            // Chdir must be called by the parent, not the child.
-            buf[strlen(buf) - 1] = 0;  // chop \n
-            if (chdir(buf + 3) < 0) fprintf(stderr, "cannot cd %s\n", buf + 3);
-            continue;
+        static char line[sizeof(buf)];
+        char* s = buf;
+        int timed = 0;
+
+        strcpy(line, buf);
+        line[strcspn(line, "\n")] = 0;
+        s += strspn(s, whitespace);
+        if (!strncmp(s, "time", 4) && strchr(whitespace, s[4]) && s[4]) {
+            timed = 1;
+            s += 4;
         }
-        if (fork1() == 0) runcmd(parsecmd(buf));
-        wait(NULL);
+
+        malloc1_used = 0;
+        if (setjmp(parse_error)) continue;
+        parsing = 1;
+        struct cmd* cmd = parsecmd(s);
+        parsing = 0;
+
+        if (timed)
+            timeline(cmd, line);
+        else
+            runline(cmd, line);
     }
 }
 
@@ -183,6 +423,10 @@ void
 panic(char* s)
 {
     fprintf(stderr, "%s\n", s);
+    if (parsing) {
+        parsing = 0;
+        longjmp(parse_error, 1);
+    }
     exit(1);
 }
 
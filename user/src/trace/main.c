@@ -0,0 +1,105 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../../../inc/trace.h"
+
+/*
+ * Drain the kernel trace buffers and print the events in time order:
+ *     trace           print what was recorded since the last drain
+ *     trace -m MASK   record the event types in MASK, by bit; none
+ *                     are recorded until this is run
+ */
+
+// How to print a and b of each type.
+char* fmt[NTRACETYPE] = {
+    [TR_CLOCK] = "clock %lu Hz, %lu lost",
+    [TR_SWITCH] = "switch",
+    [TR_SLEEP] = "sleep chan 0x%lx",
+    [TR_WAKEUP] = "wakeup pid %lu chan 0x%lx",
+    [TR_FORK] = "fork child %lu",
+    [TR_EXIT] = "exit %ld",
+    [TR_EXEC] = "exec argc %lu entry 0x%lx",
+    [TR_SYSCALL] = "syscall %lu (0x%lx)",
+    [TR_SYSRET] = "sysret %lu = %ld",
+    [TR_BGET] = "bget %lu cached %lu",
+    [TR_COMMIT] = "commit %lu blocks in %lu us",
+    [TR_SDSTART] = "sd start %lu n 0x%lx",
+    [TR_SDDONE] = "sd done %lu n %lu",
+    [TR_SDERASE] = "sd erase %lu n %lu",
+};
+
+struct trace_event* ev;
+int nev, maxev;
+
+int
+cmp(const void* a, const void* b)
+{
+    const struct trace_event *x = a, *y = b;
+    return x->ts < y->ts ? -1 : x->ts > y->ts;
+}
+
+int
+main(int argc, char* argv[])
+{
+    int fd = open("trace", O_RDWR);
+    if (fd < 0) {
+        printf("trace: cannot open trace.\n");
+        _exit(-1);
+    }
+
+    if (argc == 3 && argv[1][0] == '-' && argv[1][1] == 'm') {
+        uint32_t mask = strtoul(argv[2], 0, 0);
+        if (write(fd, &mask, sizeof(mask)) != sizeof(mask)) {
+            printf("trace: cannot set mask.\n");
+            _exit(-1);
+        }
+        _exit(0);
+    } else if (argc != 1) {
+        printf("usage: trace [-m mask]\n");
+        _exit(-1);
+    }
+
+    // Every read() starts with a TR_CLOCK. Stop at the first one that
+    // does not fill the room given: the rest is our own reading.
+    uint64_t hz = 0, lost = 0;
+    for (;;) {
+        if (maxev - nev < 512) {
+            maxev = maxev ? maxev * 2 : 4096;
+            if (!(ev = realloc(ev, maxev * sizeof(*ev)))) {
+                printf("trace: out of memory.\n");
+                _exit(-1);
+            }
+        }
+        int room = maxev - nev;
+        int n = read(fd, ev + nev, room * sizeof(*ev));
+        if (n < (int)sizeof(*ev)) {
+            printf("trace: read error.\n");
+            _exit(-1);
+        }
+        n /= sizeof(*ev);
+        hz = ev[nev].a;
+        lost += ev[nev].b;
+        // Drop the TR_CLOCK.
+        for (int i = 1; i < n; i++) ev[nev + i - 1] = ev[nev + i];
+        nev += n - 1;
+        if (n < room) break;
+    }
+    close(fd);
+
+    qsort(ev, nev, sizeof(*ev), cmp);
+    for (int i = 0; i < nev; i++) {
+        struct trace_event* e = &ev[i];
+        uint64_t us = hz ? (e->ts - ev[0].ts) * 1000000 / hz : 0;
+        printf("%10lu us cpu%d pid %-3d ", us, e->cpu, e->pid);
+        if (e->type < NTRACETYPE && fmt[e->type])
+            printf(fmt[e->type], e->a, e->b);
+        else
+            printf("type %d 0x%lx 0x%lx", e->type, e->a, e->b);
+        printf("\n");
+    }
+    printf("trace: %d events, %lu lost.\n", nev, lost);
+    _exit(0);
+}